@@ -85,8 +85,9 @@ parse_mhia (DBParseContext *ctx, Itdb_PhotoAlbum *photo_album, GError *error)
 	}
 	dump_mhia (mhia);
 	image_id = get_gint32 (mhia->image_id, ctx->byte_order);
-	photo_album->members = g_list_append (photo_album->members,
-					      GUINT_TO_POINTER(image_id));
+	/* prepended for speed, parse_mhba() restores the order */
+	photo_album->members = g_list_prepend (photo_album->members,
+					       GUINT_TO_POINTER(image_id));
 	db_parse_context_set_total_len (ctx,
 					get_gint32_db (ctx->db, mhia->total_len));
 	return 0;
@@ -254,7 +255,9 @@ parse_mhii (DBParseContext *ctx, GError *error)
 	    photodb = db_get_photodb (ctx->db);
 	    g_return_val_if_fail (photodb, -1);
 	    artwork = g_new0 (Itdb_Artwork, 1);
-	    photodb->photos = g_list_append (photodb->photos, artwork);
+	    /* prepended for speed, ipod_parse_photo_db() restores
+	       the order */
+	    photodb->photos = g_list_prepend (photodb->photos, artwork);
 	    break;
 	case DB_TYPE_ITUNES:
 	    itunesdb = db_get_itunesdb (ctx->db);
@@ -379,6 +382,7 @@ parse_mhba (DBParseContext *ctx, GError *error)
 		g_free (mhia_ctx);
 		mhia_ctx = db_parse_context_get_sub_context (ctx, cur_offset);
 	}
+	album->members = g_list_reverse (album->members);
 	photodb = db_get_photodb (ctx->db);
 	g_return_val_if_fail (photodb, -1);
 	photodb->photoalbums = g_list_append (photodb->photoalbums,
@@ -545,6 +549,7 @@ ipod_db_get_artwork_db_path (const char *mount_point)
 		{
 		    gchar *dir = g_build_filename (control_dir, "Artwork", NULL);
 		    mkdir (dir, 0777);
+		    itdb_resolve_path_invalidate (dir);
 		    g_free (control_dir);
 		    g_free (dir);
 		    artwork_dir = itdb_get_artwork_dir (mount_point);
@@ -644,6 +649,7 @@ ipod_parse_artwork_db (Itdb_iTunesDB *itdb)
 	DBParseContext *ctx;
 	char *filename;
 	Itdb_DB db;
+	Itdb_Stats *stats;
 
 	db.db.itdb = itdb;
 	db.db_type = DB_TYPE_ITUNES;
@@ -670,6 +676,10 @@ ipod_parse_artwork_db (Itdb_iTunesDB *itdb)
 	}	
 
 	parse_mhfd (ctx, NULL);
+	stats = itdb_stats_get (itdb);
+	if (stats) {
+		stats->bytes_read += ctx->total_len;
+	}
 	db_parse_context_destroy (ctx, TRUE);
 	return 0;
 
@@ -702,6 +712,7 @@ ipod_db_get_photos_db_path (const char *mount_point)
 		/* attempt to create Photos dir */
 		gchar *dir = g_build_filename (mount_point, "Photos", NULL);
 		mkdir (dir, 0777);
+		itdb_resolve_path_invalidate (dir);
 		g_free (dir);
 		photos_dir = itdb_get_photos_dir (mount_point);
 	    }
@@ -744,6 +755,7 @@ ipod_parse_photo_db (Itdb_PhotoDB *photodb)
 	}
 	parse_mhfd (ctx, NULL);
 	db_parse_context_destroy (ctx, TRUE);
+	photodb->photos = g_list_reverse (photodb->photos);
 
 	/* Now we need to replace references to artwork_ids in the
 	 * photo albums with references to the actual artwork
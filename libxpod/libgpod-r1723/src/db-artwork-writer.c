@@ -26,9 +26,6 @@
 #include "itdb.h"
 #include "itdb_private.h"
 #include "db-artwork-parser.h"
-
-#if HAVE_GDKPIXBUF
-
 #include "db-artwork-debug.h"
 #include "db-itunes-parser.h"
 #include "db-image-parser.h"
@@ -38,26 +35,28 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <sys/types.h>
 
-/* FIXME: Writing aborts if a file exceeds the following size because
-   the mremap() further down will fail (at least most of the time on
-   most systems). As a workaround the size was increased from 2 MB to
-   16 MB. */
-#define IPOD_MMAP_SIZE 16 * 1024 * 1024
-
-struct iPodMmapBuffer {
-	int fd;
-	void *mmap_area;
+/* The database is assembled in memory and written to disk with a
+   single write() once it is complete. Headers are filled in after
+   their children have been written, so the memory block must not move
+   while the database is being assembled: it is allocated up front
+   from an estimate of the final size and, should the estimate turn
+   out to be too small, the database is assembled again in a block
+   twice as large (see ipod_write_db_file()). */
+#define IPOD_BUFFER_MIN_SIZE (64 * 1024)
+
+struct iPodMemBuffer {
+	guchar *data;
 	size_t size;
+	gboolean overflow;
 	int ref_count;
 };
 
 struct _iPodBuffer {
-	struct iPodMmapBuffer *mmap;
+	struct iPodMemBuffer *mem;
 	off_t offset;
 	guint byte_order;
 	DbType db_type;
@@ -66,19 +65,18 @@ struct _iPodBuffer {
 typedef struct _iPodBuffer iPodBuffer;
 
 static void
-ipod_mmap_buffer_destroy (struct iPodMmapBuffer *buf)
+ipod_mem_buffer_destroy (struct iPodMemBuffer *buf)
 {
-	munmap (buf->mmap_area, buf->size);
-	close (buf->fd);
+	g_free (buf->data);
 	g_free (buf);
 }
 
 static void
 ipod_buffer_destroy (iPodBuffer *buffer)
 {
-	buffer->mmap->ref_count--;
-	if (buffer->mmap->ref_count == 0) {
-		ipod_mmap_buffer_destroy (buffer->mmap);
+	buffer->mem->ref_count--;
+	if (buffer->mem->ref_count == 0) {
+		ipod_mem_buffer_destroy (buffer->mem);
 	}
 	g_free (buffer);
 }
@@ -87,79 +85,20 @@ ipod_buffer_destroy (iPodBuffer *buffer)
 static void *
 ipod_buffer_get_pointer (iPodBuffer *buffer)
 {
-	return &((unsigned char *)buffer->mmap->mmap_area)[buffer->offset];
-}
-
-static int
-ipod_buffer_grow_file (struct iPodMmapBuffer *mmap_buf, off_t new_size)
-{
-	int result;
-
-	result = lseek (mmap_buf->fd, new_size, SEEK_SET);
-	if (result == (off_t)-1) {
-		g_print ("Failed to grow file to %lu: %s\n",
-                        (unsigned long)new_size, strerror (errno));
-		return -1;
-	}
-	result = 0;
-	result = write (mmap_buf->fd, &result, 1);
-	if (result != 1) {
-		g_print ("Failed to write a byte at %lu: %s\n",
-                        (unsigned long)new_size, strerror (errno));
-		return -1;
-	}
-
-	return 0;
+	return &buffer->mem->data[buffer->offset];
 }
 
-
-static void *
-ipod_buffer_grow_mapping (iPodBuffer *buffer, size_t size)
-{
-	void *new_address;
-#ifdef HAVE_MREMAP
-
-	new_address = mremap (buffer->mmap->mmap_area, buffer->mmap->size,
-			      buffer->mmap->size + size, 0);
-#else
-	munmap (buffer->mmap->mmap_area, buffer->mmap->size);
-	new_address = mmap (buffer->mmap->mmap_area, buffer->mmap->size + size,
-			    PROT_READ | PROT_WRITE, MAP_SHARED,
-			    buffer->mmap->fd, 0);
-#endif
-	/* Don't allow libc to move the current mapping since this would
-	 * force us to be very careful wrt pointers in the rest of the code
-	 */
-	if (new_address != buffer->mmap->mmap_area) {
-		return MAP_FAILED;
-	}
-
-	return new_address;
-}
-
-
+/* Make sure @offset bytes are available at @buffer. Returns -1 and
+ * marks the buffer as overflowed otherwise.
+ */
 static int
-ipod_buffer_maybe_grow (iPodBuffer *buffer, off_t offset)
+ipod_buffer_reserve (iPodBuffer *buffer, off_t offset)
 {
-	void *new_address;
-
-	if (buffer->offset + offset <= buffer->mmap->size) {
+	if (buffer->offset + offset <= buffer->mem->size) {
 		return 0;
 	}
-
-	new_address = ipod_buffer_grow_mapping (buffer, IPOD_MMAP_SIZE);
-	if (new_address == MAP_FAILED) {
-		g_print ("Failed to mremap buffer\n");
-		return -1;
-	}
-
-	if (ipod_buffer_grow_file (buffer->mmap,
-				   buffer->mmap->size + IPOD_MMAP_SIZE) != 0) {
-		return -1;
-	}
-	buffer->mmap->size += IPOD_MMAP_SIZE;
-
-	return 0;
+	buffer->mem->overflow = TRUE;
+	return -1;
 }
 
 static iPodBuffer *
@@ -167,75 +106,68 @@ ipod_buffer_get_sub_buffer (iPodBuffer *buffer, off_t offset)
 {
 	iPodBuffer *sub_buffer;
 
-	if (ipod_buffer_maybe_grow (buffer, offset) != 0) {
+	if (ipod_buffer_reserve (buffer, offset) != 0) {
 		return NULL;
 	}
 	sub_buffer = g_new0 (iPodBuffer, 1);
 	if (sub_buffer == NULL) {
 		return NULL;
 	}
-	sub_buffer->mmap = buffer->mmap;
+	sub_buffer->mem = buffer->mem;
 	sub_buffer->offset = buffer->offset + offset;
 	sub_buffer->byte_order = buffer->byte_order;
 	sub_buffer->db_type = buffer->db_type;
 
-	buffer->mmap->ref_count++;
+	buffer->mem->ref_count++;
 
 	return sub_buffer;
 }
 
 static iPodBuffer *
-ipod_buffer_new (const char *filename, guint byte_order, DbType db_type)
+ipod_buffer_new (size_t size, guint byte_order, DbType db_type)
 {
-	int fd;
-	struct iPodMmapBuffer *mmap_buf;
+	struct iPodMemBuffer *mem_buf;
 	iPodBuffer *buffer;
-	void *mmap_area;
+	guchar *data;
 
-	fd = open (filename, O_RDWR | O_CREAT | O_TRUNC,
-		   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fd == -1) {
-		g_print ("Failed to open %s: %s\n",
-			 filename, strerror (errno));
+	/* zero-filled: padding is not written explicitly */
+	data = g_try_malloc0 (size);
+	if (data == NULL) {
+		g_print ("Failed to allocate %lu bytes\n", (unsigned long)size);
 		return NULL;
 	}
-
-	mmap_area = mmap (0, IPOD_MMAP_SIZE, PROT_READ | PROT_WRITE,
-			  MAP_SHARED, fd, 0);
-	if (mmap_area == MAP_FAILED) {
-		g_print ("Failed to mmap %s in memory: %s\n", filename,
-			 strerror (errno));
-		close (fd);
-		return NULL;
-	}
-	mmap_buf = g_new0 (struct iPodMmapBuffer, 1);
-	if (mmap_buf == NULL) {
-		munmap (mmap_area, IPOD_MMAP_SIZE);
-		close (fd);
-		return NULL;
-	}
-	mmap_buf->mmap_area = mmap_area;
-	mmap_buf->size = IPOD_MMAP_SIZE;
-	mmap_buf->ref_count = 1;
-	mmap_buf->fd = fd;
-
-	if (ipod_buffer_grow_file (mmap_buf, IPOD_MMAP_SIZE) != 0) {
-		ipod_mmap_buffer_destroy (mmap_buf);
-		return  NULL;
-	}
+	mem_buf = g_new0 (struct iPodMemBuffer, 1);
+	mem_buf->data = data;
+	mem_buf->size = size;
+	mem_buf->ref_count = 1;
 
 	buffer = g_new0 (iPodBuffer, 1);
-	if (buffer == NULL) {
-		ipod_mmap_buffer_destroy (mmap_buf);
-		return NULL;
-	}
-	buffer->mmap = mmap_buf;
+	buffer->mem = mem_buf;
 	buffer->byte_order = byte_order;
 	buffer->db_type = db_type;
 
 	return buffer;
 }
 
+/* Replaces @filename atomically, see itdb_file_replace() */
+static int
+ipod_buffer_write_file (iPodBuffer *buffer, const char *filename, size_t len,
+			gboolean backup)
+{
+	GError *error = NULL;
+
+	g_return_val_if_fail (len <= buffer->mem->size, -1);
+
+	if (!itdb_file_replace (filename, buffer->mem->data, len,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH,
+				backup, &error)) {
+		g_print ("Failed to write %s: %s\n", filename, error->message);
+		g_error_free (error);
+		return -1;
+	}
+	return 0;
+}
+
 enum MhsdType {
 	MHSD_TYPE_MHLI = 1,
 	MHSD_TYPE_MHLA = 2,
@@ -285,7 +217,7 @@ init_header (iPodBuffer *buffer, gchar _header_id[4], guint header_len)
 		header_len = padded_size;
 	}
 	g_assert (header_len > sizeof (MHeader));
-	if (ipod_buffer_maybe_grow (buffer, header_len) != 0) {
+	if (ipod_buffer_reserve (buffer, header_len) != 0) {
 		return NULL;
 	}
 	mh = (MHeader*)ipod_buffer_get_pointer (buffer);
@@ -335,7 +267,7 @@ write_mhod_type_1 (gchar *string, iPodBuffer *buffer)
 	mhod->type = get_gint16 (0x01, buffer->byte_order);
 
 	/* Make sure we have enough free space to write the string */
-	if (ipod_buffer_maybe_grow (buffer, total_bytes + len + padding ) != 0) {
+	if (ipod_buffer_reserve (buffer, total_bytes + len + padding ) != 0) {
 		return  -1;
 	}
 	memcpy (mhod->string, string, len);
@@ -396,7 +328,7 @@ write_mhod_type_3 (gchar *string, iPodBuffer *buffer)
 	    total_bytes += g2l*len + padding;
 
 	    /* Make sure we have enough free space to write the string */
-	    if (ipod_buffer_maybe_grow (buffer, total_bytes) != 0) {
+	    if (ipod_buffer_reserve (buffer, total_bytes) != 0) {
 		g_free (utf16);
 		return  -1;
 	    }
@@ -418,7 +350,7 @@ write_mhod_type_3 (gchar *string, iPodBuffer *buffer)
 		padding = 0;
 	    mhod->padding = padding;
 	    /* Make sure we have enough free space to write the string */
-	    if (ipod_buffer_maybe_grow (buffer, total_bytes + 2*len+padding) != 0) {
+	    if (ipod_buffer_reserve (buffer, total_bytes + 2*len+padding) != 0) {
 		return  -1;
 	    }
 	    memcpy (mhod->string, string, len);
@@ -804,7 +736,8 @@ write_mhif (Itdb_DB *db, iPodBuffer *buffer, enum iPodThumbnailType type)
 	}
 	mhif->total_len = mhif->header_len;
 
-	img_info = itdb_get_artwork_info_from_type (db_get_device(db), type);
+	img_info = itdb_get_artwork_info_from_type (db_get_device(db),
+						    (ItdbThumbType)type);
 	if (img_info == NULL) {
 		return -1;
 	}
@@ -995,6 +928,88 @@ write_mhfd (Itdb_DB *db, iPodBuffer *buffer, int id_max)
 	return total_bytes;
 }
 
+/* Rough estimate of the size of the database, used to size the buffer
+ * it is assembled in. Erring on the small side only costs another
+ * pass in ipod_write_db_file().
+ */
+static size_t
+ipod_db_estimate_size (Itdb_DB *db)
+{
+	size_t size = 4096; /* mhfd, mhsds, lists and mhifs */
+	GList *it;
+
+	switch (db->db_type) {
+	case DB_TYPE_ITUNES:
+		for (it = db_get_itunesdb (db)->tracks; it != NULL; it = it->next) {
+			Itdb_Track *track = it->data;
+			if (track->artwork == NULL) {
+				continue;
+			}
+			size += 0x98 + 0x100 * g_list_length (track->artwork->thumbnails);
+		}
+		break;
+	case DB_TYPE_PHOTO:
+		for (it = db_get_photodb (db)->photos; it != NULL; it = it->next) {
+			Itdb_Artwork *photo = it->data;
+			size += 0x98 + 0x100 * g_list_length (photo->thumbnails);
+		}
+		for (it = db_get_photodb (db)->photoalbums; it != NULL; it = it->next) {
+			Itdb_PhotoAlbum *album = it->data;
+			size += 0x200 + 0x40 * g_list_length (album->members);
+		}
+		break;
+	}
+	return size;
+}
+
+/* Assemble the database in memory and write it to @filename */
+static int
+ipod_write_db_file (Itdb_DB *db, const char *filename,
+		    guint byte_order, int id_max)
+{
+	size_t size;
+
+	size = MAX (ipod_db_estimate_size (db), IPOD_BUFFER_MIN_SIZE);
+	while (TRUE) {
+		iPodBuffer *buf;
+		int bytes_written;
+		gboolean overflow;
+		int result;
+
+		buf = ipod_buffer_new (size, byte_order, db->db_type);
+		if (buf == NULL) {
+			return -1;
+		}
+		bytes_written = write_mhfd (db, buf, id_max);
+		overflow = buf->mem->overflow;
+		if (!overflow) {
+			result = -1;
+			if (bytes_written != -1) {
+				result = ipod_buffer_write_file (
+					buf, filename, bytes_written,
+					(db->db_type == DB_TYPE_ITUNES) &&
+					itdb_get_backup (db_get_itunesdb (db)));
+			}
+			if ((result == 0) && (db->db_type == DB_TYPE_ITUNES)) {
+				Itdb_Stats *stats;
+
+				stats = itdb_stats_get (db_get_itunesdb (db));
+				if (stats) {
+					stats->bytes_written += bytes_written;
+				}
+			}
+			ipod_buffer_destroy (buf);
+			return result;
+		}
+		ipod_buffer_destroy (buf);
+		/* the estimate was too small, try again with more room */
+		if (size > G_MAXINT / 2) {
+			return -1;
+		}
+		size *= 2;
+	}
+}
+
 static unsigned int
 ipod_artwork_db_set_ids (Itdb_iTunesDB *db)
 {
@@ -1087,24 +1102,27 @@ itdb_filter_thumbnails (Itdb_iTunesDB *itdb)
 int
 ipod_write_artwork_db (Itdb_iTunesDB *itdb)
 {
-	iPodBuffer *buf;
-	int bytes_written;
 	int result;
 	char *filename;
 	int id_max;
 	Itdb_DB db;
+	Itdb_Stats *stats;
+	ItdbStatsTimer timer;
 
 	db.db_type = DB_TYPE_ITUNES;
 	db.db.itdb = itdb;
-
+	stats = itdb_stats_get (itdb);
 
         itdb_filter_thumbnails (itdb);
 
 	/* First, let's write the .ithmb files, this will create the
 	 * various thumbnails as well */
 
+	itdb_stats_begin (stats, &timer);
 	itdb_write_ithumb_files (&db);
+	itdb_stats_end (stats, ITDB_STATS_WRITE_THUMBNAILS, &timer);
 	/* Now we can update the ArtworkDB file */
+	itdb_stats_begin (stats, &timer);
 	id_max = ipod_artwork_db_set_ids (itdb);
 
 	filename = ipod_db_get_artwork_db_path (itdb_get_mountpoint (itdb));
@@ -1115,35 +1133,16 @@ ipod_write_artwork_db (Itdb_iTunesDB *itdb)
 		 */
 		return -1;
 	}
-	buf = ipod_buffer_new (filename, itdb->device->byte_order, DB_TYPE_ITUNES);
-	if (buf == NULL) {
-		g_print ("Couldn't create %s\n", filename);
-		g_free (filename);
-		return -1;
-	}
-	bytes_written = write_mhfd (&db, buf, id_max);
-
-	/* Refcount of the mmap buffer should drop to 0 and this should
-	 * sync buffered data to disk
-	 * FIXME: it's probably less error-prone to add a ipod_buffer_mmap_sync
-	 * call...
-	 */
-	ipod_buffer_destroy (buf);
-
-	if (bytes_written == -1) {
+	result = ipod_write_db_file (&db, filename,
+				     itdb->device->byte_order, id_max);
+	itdb_stats_end (stats, ITDB_STATS_WRITE_ARTWORK, &timer);
+	if (result != 0) {
 		g_print ("Failed to save %s\n", filename);
 		g_free (filename);
 		/* FIXME: maybe should unlink the file we may have created */
 		return -1;
 	}
-
-	result = truncate (filename, bytes_written);
-	if (result != 0) {
-		g_print ("Failed to truncate %s: %s\n",
-			 filename, strerror (errno));
-		g_free (filename);
-		return -1;
-	}
+	itdb_durability_add_file (itdb, filename);
 	g_free (filename);
 	return 0;
 }
@@ -1151,8 +1150,6 @@ ipod_write_artwork_db (Itdb_iTunesDB *itdb)
 int
 ipod_write_photo_db (Itdb_PhotoDB *photodb)
 {
-	iPodBuffer *buf;
-	int bytes_written;
 	int result;
 	char *filename;
 	int id_max;
@@ -1168,49 +1165,15 @@ ipod_write_photo_db (Itdb_PhotoDB *photodb)
 	if (filename == NULL) {
 		return -1;
 	}
-	buf = ipod_buffer_new (filename, photodb->device->byte_order, DB_TYPE_PHOTO);
-	if (buf == NULL) {
-		g_print ("Couldn't create %s\n", filename);
-		g_free (filename);
-		return -1;
-	}
 	id_max = itdb_get_free_photo_id( photodb );
-	bytes_written = write_mhfd (&db, buf, id_max);
-
-	/* Refcount of the mmap buffer should drop to 0 and this should
-	 * sync buffered data to disk
-	 * FIXME: it's probably less error-prone to add a ipod_buffer_mmap_sync
-	 * call...
-	 */
-	ipod_buffer_destroy (buf);
-
-	if (bytes_written == -1) {
+	result = ipod_write_db_file (&db, filename,
+				     photodb->device->byte_order, id_max);
+	if (result != 0) {
 		g_print ("Failed to save %s\n", filename);
 		g_free (filename);
 		/* FIXME: maybe should unlink the file we may have created */
 		return -1;
 	}
-
-	result = truncate (filename, bytes_written);
-	if (result != 0) {
-		g_print ("Failed to truncate %s: %s\n",
-			 filename, strerror (errno));
-		g_free (filename);
-		return -1;
-	}
 	g_free (filename);
 	return 0;
 }
-#else
-int
-ipod_write_artwork_db (Itdb_iTunesDB *itdb)
-{
-    return -1;
-}
-
-int
-ipod_write_photo_db (Itdb_PhotoDB *photodb)
-{
-    return -1;
-}
-#endif
@@ -66,6 +66,34 @@ typedef struct _Itdb_PhotoDB Itdb_PhotoDB;
 typedef struct _Itdb_Playlist Itdb_Playlist;
 typedef struct _Itdb_PhotoAlbum Itdb_PhotoAlbum;
 typedef struct _Itdb_Track Itdb_Track;
+typedef struct _Itdb_Image Itdb_Image;
+typedef struct _Itdb_ImageBackend Itdb_ImageBackend;
+typedef struct _Itdb_ThumbPrefetch Itdb_ThumbPrefetch;
+typedef struct _Itdb_Stats Itdb_Stats;
+typedef struct _Itdb_TrackTotals Itdb_TrackTotals;
+typedef struct _Itdb_Query Itdb_Query;
+typedef struct _Itdb_Batch Itdb_Batch;
+typedef struct _Itdb_Snapshot Itdb_Snapshot;
+typedef struct _Itdb_Diff Itdb_Diff;
+typedef struct _Itdb_DiffMember Itdb_DiffMember;
+
+/* called by itdb_thumb_prefetch_start() for each fetched thumbnail */
+typedef void (* ItdbThumbPrefetchFunc) (Itdb_Track *track,
+					Itdb_Image *image,
+					gpointer user_data);
+/* called by itdb_check_track_files() for each track */
+typedef void (* ItdbTrackFileFunc) (Itdb_Track *track,
+				    const gchar *filename,
+				    gint64 size,
+				    gpointer user_data);
+/* called by itdb_parse_async() and itdb_write_async() when done */
+typedef void (* ItdbAsyncFunc) (Itdb_iTunesDB *itdb,
+				GError *error,
+				gpointer user_data);
+/* returns a newly allocated key identifying @track across databases
+   for itdb_diff_new(), or NULL */
+typedef gchar *(* ItdbDiffKeyFunc) (Itdb_Track *track,
+				    gpointer user_data);
 
 
 /* ------------------------------------------------------------ *\
@@ -530,6 +558,156 @@ struct _Itdb_Artwork {
 };
 
 
+/* An uncompressed image with 8 bits per sample as used when creating
+   thumbnails. n_channels is 3 (RGB) or 4 (RGBA). */
+struct _Itdb_Image {
+    guchar *pixels;
+    gint    width;
+    gint    height;
+    gint    rowstride;
+    gint    n_channels;
+};
+
+/* An image backend is used to decode the image files, image data and
+   pixbufs handed to itdb_artwork_add_thumbnail...() when the
+   thumbnails are written to the iPod. libgpod comes with a built-in
+   backend (JPEG and PNG) and, if compiled with gdk-pixbuf support, a
+   gdk-pixbuf backend. Applications can provide their own.
+
+   load_file/load_data: decode the image. @width and @height are the
+   dimensions of the thumbnail to be created; a backend may use them
+   to decode at a reduced size as long as the result still fills
+   @width x @height (keeping the aspect ratio). libgpod scales the
+   result to the exact size. Return NULL on failure.
+
+   load_pixbuf: convert a backend specific image object as passed to
+   itdb_artwork_add_thumbnail_from_pixbuf(). May be NULL.
+
+   scale/rotate: may be NULL, in which case itdb_image_scale() and
+   itdb_image_rotate() are used. Rotation is counterclockwise by 90,
+   180 or 270 degrees. */
+struct _Itdb_ImageBackend {
+    const gchar *name;
+    Itdb_Image *(* load_file) (const gchar *filename,
+			       gint width, gint height);
+    Itdb_Image *(* load_data) (const guchar *data, gsize len,
+			       gint width, gint height);
+    Itdb_Image *(* load_pixbuf) (gpointer pixbuf);
+    Itdb_Image *(* scale) (const Itdb_Image *image,
+			   gint width, gint height);
+    Itdb_Image *(* rotate) (const Itdb_Image *image, gint rotation);
+    /* reserved for future use */
+    gpointer reserved1;
+    gpointer reserved2;
+};
+
+/* Phases timed by the statistics (see itdb_stats_set_enabled()) */
+typedef enum {
+    ITDB_STATS_READ_FILE,        /* reading iTunesDB into memory          */
+    ITDB_STATS_PLAYCOUNTS,       /* reading Play Counts / iTunesStats     */
+    ITDB_STATS_PARSE_TRACKS,     /* decoding the track list (mhit)        */
+    ITDB_STATS_PARSE_PLAYLISTS,  /* decoding the playlists (mhyp)         */
+    ITDB_STATS_READ_OTG,         /* reading the On-The-Go playlists       */
+    ITDB_STATS_PARSE_ARTWORK,    /* parsing the ArtworkDB                 */
+    ITDB_STATS_SPL_UPDATE,       /* itdb_spl_update_all()                 */
+    ITDB_STATS_PREPARE_WRITE,    /* assigning IDs, reordering the MPL     */
+    ITDB_STATS_WRITE_THUMBNAILS, /* writing the .ithmb files              */
+    ITDB_STATS_WRITE_ARTWORK,    /* writing the ArtworkDB                 */
+    ITDB_STATS_WRITE_TRACKS,     /* encoding the track list               */
+    ITDB_STATS_WRITE_PLAYLISTS,  /* encoding the playlists (incl. MHOD52) */
+    ITDB_STATS_COLLATE,          /* sorting for the MHOD52 indices        */
+    ITDB_STATS_CHECKSUM,         /* iTunesDB checksum                     */
+    ITDB_STATS_WRITE_FILE,       /* writing iTunesDB to disk              */
+    ITDB_STATS_SYNC,             /* flushing the files, see itdb_flush()  */
+    ITDB_STATS_N_PHASES
+} ItdbStatsPhase;
+
+/* How itdb_write() and friends make sure their files are on the
+   disk before returning, see itdb_set_durability() */
+typedef enum {
+    ITDB_DURABILITY_SYNC,   /* sync() all file systems (default)       */
+    ITDB_DURABILITY_FSYNC,  /* fsync() the files written and their
+			       directories                             */
+    ITDB_DURABILITY_SYNCFS, /* flush the iPod's file system only       */
+    ITDB_DURABILITY_NONE    /* don't flush, see itdb_flush()           */
+} ItdbDurability;
+
+/* Statistics collected while parsing and writing an Itdb_iTunesDB,
+   see itdb_get_stats(). Times are in seconds. Phases may nest
+   (ITDB_STATS_COLLATE is part of ITDB_STATS_WRITE_PLAYLISTS).
+   cpu_time is the CPU time of the thread running the phase (of the
+   whole process where per-thread times are not available); threads
+   helping to encode tracks (itdb_set_write_threads()) are not
+   included. tracks, playlists, members (playlist entries) and mhods
+   count the objects decoded while parsing; strings counts the
+   strings allocated for them. */
+struct _Itdb_Stats {
+    struct {
+	gdouble wall_time;
+	gdouble cpu_time;
+	guint32 calls;
+    } phases[ITDB_STATS_N_PHASES];
+    guint64 bytes_read;
+    guint64 bytes_written;
+    guint32 tracks;
+    guint32 playlists;
+    guint32 members;
+    guint32 mhods;
+    guint32 strings;
+};
+
+/* Sums over the tracks of an Itdb_iTunesDB, see
+   itdb_tracks_get_totals(). size is in bytes, tracklen in ms. */
+struct _Itdb_TrackTotals {
+    guint32 tracks;
+    guint64 size;
+    guint64 tracklen;
+    guint64 playcount;
+    guint64 skipcount;
+    guint32 unplayed;   /* tracks with a playcount of 0 */
+    guint32 rated;      /* tracks with a rating         */
+};
+
+/* Track fields that can be used in an Itdb_Query. String fields are
+   matched with itdb_query_add_equal(), the others with
+   itdb_query_add_range(). */
+typedef enum {
+    ITDB_QUERYFIELD_ARTIST,
+    ITDB_QUERYFIELD_ALBUM,
+    ITDB_QUERYFIELD_ALBUMARTIST,
+    ITDB_QUERYFIELD_GENRE,
+    ITDB_QUERYFIELD_COMPOSER,
+    ITDB_QUERYFIELD_FILETYPE,
+    ITDB_QUERYFIELD_MEDIATYPE,
+    ITDB_QUERYFIELD_YEAR,
+    ITDB_QUERYFIELD_RATING,
+    ITDB_QUERYFIELD_PLAYCOUNT,
+    ITDB_QUERYFIELD_SKIPCOUNT,
+    ITDB_QUERYFIELD_SIZE,
+    ITDB_QUERYFIELD_TRACKLEN,
+    ITDB_QUERYFIELD_TIME_ADDED,
+    ITDB_QUERYFIELD_TIME_PLAYED,
+    ITDB_QUERYFIELD_TIME_MODIFIED,
+    ITDB_QUERYFIELD_N
+} ItdbQueryField;
+
+/* Kinds of track changes in an Itdb_Diff */
+typedef enum {
+    ITDB_DIFF_ADDED,
+    ITDB_DIFF_REMOVED,
+    ITDB_DIFF_MODIFIED
+} ItdbDiffType;
+
+/* A track added to or removed from a playlist, see
+   itdb_diff_get_members() */
+struct _Itdb_DiffMember
+{
+    guint64 playlist_id;
+    gchar *playlist_name;
+    Itdb_Track *track;  /* copy owned by the Itdb_Diff      */
+    gboolean added;     /* TRUE: added, FALSE: removed      */
+};
+
 struct _Itdb_PhotoDB
 {
     GList *photos;      /* (Itdb_Artwork *)     */
@@ -1024,9 +1202,14 @@ Itdb_iTunesDB *itdb_parse_file (const gchar *filename, GError **error);
 gboolean itdb_write (Itdb_iTunesDB *itdb, GError **error);
 gboolean itdb_write_file (Itdb_iTunesDB *itdb, const gchar *filename,
 			  GError **error);
+gboolean itdb_otg_playlists_update (Itdb_iTunesDB *itdb, GError **error);
+void itdb_set_write_threads (Itdb_iTunesDB *itdb, guint n_threads);
+guint itdb_get_write_threads (Itdb_iTunesDB *itdb);
 gboolean itdb_shuffle_write (Itdb_iTunesDB *itdb, GError **error);
 gboolean itdb_shuffle_write_file (Itdb_iTunesDB *itdb,
 				  const gchar *filename, GError **error);
+void itdb_set_shuffle_in_place (Itdb_iTunesDB *itdb, gboolean in_place);
+gboolean itdb_get_shuffle_in_place (Itdb_iTunesDB *itdb);
 Itdb_iTunesDB *itdb_new (void);
 void itdb_free (Itdb_iTunesDB *itdb);
 Itdb_iTunesDB *itdb_duplicate (Itdb_iTunesDB *itdb); /* not implemented */
@@ -1034,10 +1217,39 @@ guint32 itdb_tracks_number (Itdb_iTunesDB *itdb);
 guint32 itdb_tracks_number_nontransferred (Itdb_iTunesDB *itdb);
 guint32 itdb_playlists_number (Itdb_iTunesDB *itdb);
 
+/* asynchronous parsing and writing (see itdb_async.c) */
+void itdb_parse_async (const gchar *mp, ItdbAsyncFunc func,
+		       gpointer user_data);
+void itdb_write_async (Itdb_iTunesDB *itdb, ItdbAsyncFunc func,
+		       gpointer user_data);
+void itdb_async_set_max_threads (gint max_threads);
+void itdb_async_wait (void);
+
+/* durability functions (see itdb_durability.c) */
+void itdb_set_durability (Itdb_iTunesDB *itdb, ItdbDurability durability);
+ItdbDurability itdb_get_durability (Itdb_iTunesDB *itdb);
+gboolean itdb_flush (Itdb_iTunesDB *itdb, ItdbDurability durability,
+		     GError **error);
+void itdb_set_backup (Itdb_iTunesDB *itdb, gboolean backup);
+gboolean itdb_get_backup (Itdb_iTunesDB *itdb);
+
+/* statistics functions (see itdb_stats.c) */
+void itdb_stats_set_enabled (gboolean enabled);
+gboolean itdb_stats_get_enabled (void);
+const Itdb_Stats *itdb_get_stats (Itdb_iTunesDB *itdb);
+void itdb_stats_reset (Itdb_iTunesDB *itdb);
+const gchar *itdb_stats_phase_name (ItdbStatsPhase phase);
+gchar *itdb_stats_to_string (const Itdb_Stats *stats);
+
+/* aggregate queries over all tracks (see itdb_columns.c) */
+void itdb_tracks_get_totals (Itdb_iTunesDB *itdb, guint32 mediatype,
+			     Itdb_TrackTotals *totals);
+
 /* general file functions */
 gint itdb_musicdirs_number (Itdb_iTunesDB *itdb);
 gchar *itdb_resolve_path (const gchar *root,
 			  const gchar * const * components);
+void itdb_resolve_path_invalidate (const gchar *path);
 gboolean itdb_rename_files (const gchar *mp, GError **error);
 gchar *itdb_cp_get_dest_filename (Itdb_Track *track,
                                   const gchar *mountpoint,
@@ -1054,6 +1266,8 @@ gboolean itdb_cp_track_to_ipod (Itdb_Track *track,
 void itdb_filename_fs2ipod (gchar *filename);
 void itdb_filename_ipod2fs (gchar *ipod_file);
 gchar *itdb_filename_on_ipod (Itdb_Track *track);
+void itdb_check_track_files (Itdb_iTunesDB *itdb, gboolean get_size,
+			     ItdbTrackFileFunc func, gpointer user_data);
 void itdb_set_mountpoint (Itdb_iTunesDB *itdb, const gchar *mp);
 const gchar *itdb_get_mountpoint (Itdb_iTunesDB *itdb);
 gchar *itdb_get_control_dir (const gchar *mountpoint);
@@ -1084,6 +1298,8 @@ gboolean itdb_device_supports_artwork (Itdb_Device *device);
 gboolean itdb_device_supports_photo (Itdb_Device *device);
 const gchar *itdb_info_get_ipod_model_name_string (Itdb_IpodModel model);
 const gchar *itdb_info_get_ipod_generation_string (Itdb_IpodGeneration generation);
+void itdb_device_profiles_set_enabled (gboolean enabled);
+void itdb_device_profiles_clear (void);
 
 /* track functions */
 Itdb_Track *itdb_track_new (void);
@@ -1096,6 +1312,45 @@ Itdb_Track *itdb_track_by_id (Itdb_iTunesDB *itdb, guint32 id);
 GTree *itdb_track_id_tree_create (Itdb_iTunesDB *itdb);
 void itdb_track_id_tree_destroy (GTree *idtree);
 Itdb_Track *itdb_track_id_tree_by_id (GTree *idtree, guint32 id);
+void itdb_track_changed (Itdb_Track *track);
+void itdb_track_prepare_change (Itdb_Track *track);
+
+/* track queries (see itdb_query.c) */
+Itdb_Query *itdb_query_new (void);
+void itdb_query_free (Itdb_Query *query);
+void itdb_query_add_equal (Itdb_Query *query, ItdbQueryField field,
+			   const gchar *value);
+void itdb_query_add_range (Itdb_Query *query, ItdbQueryField field,
+			   gint64 min, gint64 max);
+void itdb_query_add_mediatype (Itdb_Query *query, guint32 mediatype);
+GPtrArray *itdb_query_run (Itdb_iTunesDB *itdb, const Itdb_Query *query);
+
+/* batch functions (see itdb_batch.c) */
+Itdb_Batch *itdb_batch_begin (Itdb_iTunesDB *itdb);
+void itdb_batch_track_add (Itdb_Batch *batch, Itdb_Track *track);
+void itdb_batch_track_remove (Itdb_Batch *batch, Itdb_Track *track);
+void itdb_batch_playlist_add_track (Itdb_Batch *batch, Itdb_Playlist *pl,
+				    Itdb_Track *track);
+void itdb_batch_playlist_remove_track (Itdb_Batch *batch,
+				       Itdb_Playlist *pl,
+				       Itdb_Track *track);
+void itdb_batch_commit (Itdb_Batch *batch);
+void itdb_batch_cancel (Itdb_Batch *batch);
+
+/* snapshot functions (see itdb_snapshot.c) */
+Itdb_Snapshot *itdb_snapshot_new (Itdb_iTunesDB *itdb);
+Itdb_iTunesDB *itdb_snapshot_get_itdb (Itdb_Snapshot *snapshot);
+void itdb_snapshot_free (Itdb_Snapshot *snapshot);
+
+/* diff functions (see itdb_diff.c) */
+Itdb_Diff *itdb_diff_new (Itdb_iTunesDB *from, Itdb_iTunesDB *to,
+			  ItdbDiffKeyFunc key_func, gpointer user_data);
+void itdb_diff_free (Itdb_Diff *diff);
+gchar *itdb_diff_key_default (Itdb_Track *track, gpointer user_data);
+GPtrArray *itdb_diff_get_tracks (Itdb_Diff *diff, ItdbDiffType type);
+GArray *itdb_diff_get_members (Itdb_Diff *diff);
+gboolean itdb_diff_is_empty (Itdb_Diff *diff);
+guint itdb_diff_apply (Itdb_Diff *diff, Itdb_iTunesDB *itdb);
 
 /* playlist functions */
 Itdb_Playlist *itdb_playlist_new (const gchar *title, gboolean spl);
@@ -1225,6 +1480,25 @@ Itdb_Thumb *itdb_thumb_duplicate (Itdb_Thumb *thumb);
 void itdb_thumb_free (Itdb_Thumb *thumb);
 Itdb_Thumb *itdb_thumb_new (void);
 gchar *itdb_thumb_get_filename (Itdb_Device *device, Itdb_Thumb *thumb);
+Itdb_Image *itdb_thumb_get_image (Itdb_Device *device, Itdb_Thumb *thumb);
+Itdb_ThumbPrefetch *itdb_thumb_prefetch_start (Itdb_iTunesDB *itdb,
+					       GList *tracks,
+					       ItdbThumbType type,
+					       ItdbThumbPrefetchFunc func,
+					       gpointer user_data);
+void itdb_thumb_prefetch_cancel (Itdb_ThumbPrefetch *prefetch);
+void itdb_thumb_prefetch_free (Itdb_ThumbPrefetch *prefetch);
+
+/* image functions (see itdb_image.c) */
+Itdb_Image *itdb_image_new (gint width, gint height, gint n_channels);
+void itdb_image_free (Itdb_Image *image);
+Itdb_Image *itdb_image_scale (const Itdb_Image *image,
+			      gint width, gint height);
+Itdb_Image *itdb_image_rotate (const Itdb_Image *image, gint rotation);
+const Itdb_ImageBackend *itdb_image_backend_get (void);
+void itdb_image_backend_set (const Itdb_ImageBackend *backend);
+const Itdb_ImageBackend *itdb_image_backend_builtin (void);
+const Itdb_ImageBackend *itdb_image_backend_gdkpixbuf (void);
 
 #ifndef LIBGPOD_DISABLE_DEPRECATED
 /* time functions */
@@ -34,8 +34,10 @@
 #include "db-image-parser.h"
 #include "itdb_endianness.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #if HAVE_GDKPIXBUF
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #endif
@@ -186,8 +188,6 @@ itdb_artwork_add_thumbnail (Itdb_Artwork *artwork,
 			    gint rotation,
 			    GError **error)
 {
-#ifdef HAVE_GDKPIXBUF
-/* This operation doesn't make sense when we can't save thumbnail files */
     struct stat statbuf;
     Itdb_Thumb *thumb;
 
@@ -211,11 +211,6 @@ itdb_artwork_add_thumbnail (Itdb_Artwork *artwork,
     artwork->thumbnails = g_list_append (artwork->thumbnails, thumb);
 
     return TRUE;
-#else
-    g_set_error (error, 0, -1,
-		 _("Artwork support not compiled into libgpod."));
-    return FALSE;
-#endif
 }
 
 /**
@@ -309,8 +304,6 @@ itdb_artwork_add_thumbnail_from_data (Itdb_Artwork *artwork,
 				      gint rotation,
 				      GError **error)
 {
-#ifdef HAVE_GDKPIXBUF
-/* This operation doesn't make sense when we can't save thumbnail files */
     Itdb_Thumb *thumb;
     GTimeVal time;
 
@@ -332,11 +325,6 @@ itdb_artwork_add_thumbnail_from_data (Itdb_Artwork *artwork,
     artwork->thumbnails = g_list_append (artwork->thumbnails, thumb);
 
     return TRUE;
-#else
-    g_set_error (error, 0, -1,
-		 _("Artwork support not compiled into libgpod."));
-    return FALSE;
-#endif
 }
 
 
@@ -426,7 +414,6 @@ gchar *itdb_thumb_get_filename (Itdb_Device *device, Itdb_Thumb *thumb)
 }
 
 
-#if HAVE_GDKPIXBUF
 static guchar *
 unpack_RGB_565 (guint16 *pixels, guint bytes_len, guint byte_order)
 {
@@ -787,38 +774,13 @@ get_pixel_data (Itdb_Device *device, Itdb_Thumb *thumb)
 	return result;
 }
 
+/* Convert the raw thumbnail data @pixels_raw (@bytes_len bytes) in the
+   format described by @img_info to 24 bit RGB */
 static guchar *
-itdb_thumb_get_rgb_data (Itdb_Device *device, Itdb_Thumb *thumb)
+unpack_pixel_data (const Itdb_ArtworkFormat *img_info,
+		   void *pixels_raw, guint bytes_len)
 {
-#if 0
-    #include <unistd.h>
-    #include <fcntl.h>
-    static gint i=0;
-    int fd;
-    gchar *name;
-#endif
-	void *pixels_raw;
 	guchar *pixels=NULL;
-	const Itdb_ArtworkFormat *img_info;
-
-	g_return_val_if_fail (device, NULL);
-	g_return_val_if_fail (thumb, NULL);
-	g_return_val_if_fail (thumb->size != 0, NULL);
-	img_info = itdb_get_artwork_info_from_type (device, thumb->type);
-	g_return_val_if_fail (img_info, NULL);
-	
-	pixels_raw = get_pixel_data (device, thumb);
-
-#if 0
-    name = g_strdup_printf ("thumb_%03d.raw", i++);
-    fd = creat (name, S_IRWXU|S_IRWXG|S_IRWXO);
-    write (fd, pixels_raw, thumb->size);
-    close (fd);
-    g_free (name);
-#endif
-	if (pixels_raw == NULL) {
-		return NULL;
-	}
 
 	switch (img_info->format)
 	{
@@ -829,7 +791,7 @@ itdb_thumb_get_rgb_data (Itdb_Device *device, Itdb_Thumb *thumb)
 	       screen photo thumbnail) */
 	case THUMB_FORMAT_RGB565_LE:
 	case THUMB_FORMAT_RGB565_BE:
-	    pixels = unpack_RGB_565 (pixels_raw, thumb->size,
+	    pixels = unpack_RGB_565 (pixels_raw, bytes_len,
 				     itdb_thumb_get_byteorder (img_info->format));
 	    break;
 	case THUMB_FORMAT_RGB555_LE_90:
@@ -839,7 +801,7 @@ itdb_thumb_get_rgb_data (Itdb_Device *device, Itdb_Thumb *thumb)
 	       screen photo thumbnail) */
 	case THUMB_FORMAT_RGB555_LE:
 	case THUMB_FORMAT_RGB555_BE:
-	    pixels = unpack_RGB_555 (pixels_raw, thumb->size,
+	    pixels = unpack_RGB_555 (pixels_raw, bytes_len,
 				     itdb_thumb_get_byteorder (img_info->format));
 	    break;
 	case THUMB_FORMAT_REC_RGB555_LE_90:
@@ -849,32 +811,182 @@ itdb_thumb_get_rgb_data (Itdb_Device *device, Itdb_Thumb *thumb)
 	       screen photo thumbnail) */
 	case THUMB_FORMAT_REC_RGB555_LE:
 	case THUMB_FORMAT_REC_RGB555_BE:
-	    pixels = unpack_rec_RGB_555 (pixels_raw, thumb->size,
+	    pixels = unpack_rec_RGB_555 (pixels_raw, bytes_len,
 					 itdb_thumb_get_byteorder (img_info->format),
 					 img_info->width, img_info->height);
 	    break;
 	case THUMB_FORMAT_EXPERIMENTAL_LE:
 	case THUMB_FORMAT_EXPERIMENTAL_BE:
 #if DEBUG_ARTWORK
-	    pixels = unpack_experimental (pixels_raw, thumb->size,
+	    pixels = unpack_experimental (pixels_raw, bytes_len,
 					  itdb_thumb_get_byteorder (img_info->format),
 					  img_info->width, img_info->height);
 	    break;
 #endif
 	case THUMB_FORMAT_UYVY_LE:
 	case THUMB_FORMAT_UYVY_BE:
-	    pixels = unpack_UYVY (pixels_raw, thumb->size,
+	    pixels = unpack_UYVY (pixels_raw, bytes_len,
 				  itdb_thumb_get_byteorder (img_info->format),
 				  img_info->width, img_info->height);
 	    break;
 	}
+
+	return pixels;
+}
+
+static guchar *
+itdb_thumb_get_rgb_data (Itdb_Device *device, Itdb_Thumb *thumb)
+{
+#if 0
+    #include <unistd.h>
+    #include <fcntl.h>
+    static gint i=0;
+    int fd;
+    gchar *name;
+#endif
+	void *pixels_raw;
+	guchar *pixels=NULL;
+	const Itdb_ArtworkFormat *img_info;
+
+	g_return_val_if_fail (device, NULL);
+	g_return_val_if_fail (thumb, NULL);
+	g_return_val_if_fail (thumb->size != 0, NULL);
+	img_info = itdb_get_artwork_info_from_type (device, thumb->type);
+	g_return_val_if_fail (img_info, NULL);
+	
+	pixels_raw = get_pixel_data (device, thumb);
+
+#if 0
+    name = g_strdup_printf ("thumb_%03d.raw", i++);
+    fd = creat (name, S_IRWXU|S_IRWXG|S_IRWXO);
+    write (fd, pixels_raw, thumb->size);
+    close (fd);
+    g_free (name);
+#endif
+	if (pixels_raw == NULL) {
+		return NULL;
+	}
+
+	pixels = unpack_pixel_data (img_info, pixels_raw, thumb->size);
 	g_free (pixels_raw);
 
 	return pixels;
 
 }
+
+
+
+/* Dimensions to use for a thumbnail not yet transferred to the iPod:
+   the dimensions used on the iPod if known (@img_info != NULL),
+   default dimensions otherwise */
+static void thumb_get_size (Itdb_Thumb *thumb,
+			    const Itdb_ArtworkFormat *img_info,
+			    gint *width, gint *height)
+{
+    *width = 0;
+    *height = 0;
+
+    if (img_info != NULL)
+    {   /* use image dimensions from iPod */
+	*width = img_info->width;
+	*height = img_info->height;
+	return;
+    }
+
+    /* use default dimensions */
+    /* FIXME: better way to use the ipod_color dimensions? */
+    switch (thumb->type)
+    {
+    case ITDB_THUMB_COVER_SMALL:
+	*width =  56;  *height =  56;  break;
+    case ITDB_THUMB_COVER_LARGE:
+	*width = 140;  *height = 140;  break;
+    case ITDB_THUMB_PHOTO_SMALL:
+	*width =  42;  *height =  30;  break;
+    case ITDB_THUMB_PHOTO_LARGE:
+	*width = 130;  *height =  88;  break;
+    case ITDB_THUMB_PHOTO_FULL_SCREEN:
+	*width = 220;  *height = 176;  break;
+    case ITDB_THUMB_PHOTO_TV_SCREEN:
+	*width = 720;  *height = 480;  break;
+    case ITDB_THUMB_COVER_XLARGE:
+	*width = 320;  *height = 320;  break;
+    case ITDB_THUMB_COVER_MEDIUM:
+	*width = 128;  *height = 128;  break;
+    case ITDB_THUMB_COVER_SMEDIUM:
+	*width = 88;  *height = 88;  break;
+    case ITDB_THUMB_COVER_XSMALL:
+	*width = 56;  *height = 56;  break;
+    }
+    if (*width == 0)
+    {
+	*width = 140;
+	*height = 140;
+    }
+}
+
+/* Area of the thumbnail stored on the iPod actually covered by the
+   image, i.e. without padding */
+static void thumb_get_area (Itdb_Thumb *thumb,
+			    const Itdb_ArtworkFormat *img_info,
+			    gint *x, gint *y, gint *width, gint *height)
+{
+    gint pad_x = thumb->horizontal_padding;
+    gint pad_y = thumb->vertical_padding;
+
+    /* Negative offsets indicate that part of the image was cut
+       off at the left/top. thumb->width/height include that part
+       of the image. Positive offsets indicate that part of the
+       thumbnail are padded in black. thumb->width/height also
+       include that part of the image -> reduce width and height
+       by the absolute value of the padding */
+    *width = thumb->width - abs (pad_x);
+    *height = thumb->height - abs (pad_y);
+    /* And throw out "negative" padding */
+    if (pad_x < 0)		pad_x = 0;
+    if (pad_y < 0)		pad_y = 0;
+    /* Width/height might still be larger than
+       img_info->width/height, indicating that part of the image
+       was cut off at the right/bottom (similar to negative
+       padding above). Adjust width/height accordingly. */
+    if (pad_x + *width > img_info->width)
+	*width = img_info->width - pad_x;
+    if (pad_y + *height > img_info->height)
+	*height = img_info->height - pad_y;
+    *x = pad_x;
+    *y = pad_y;
+
+#if DEBUG_ARTWORK
+    printf ("px=%2d py=%2d x=%3d y=%3d\n", *x, *y, *width, *height);
 #endif
+}
+
 
+/* Copy the area @x, @y, @width, @height out of the full thumbnail
+   @pixels (24 bit RGB as returned by unpack_pixel_data()) */
+static Itdb_Image *image_from_rgb_data (const Itdb_ArtworkFormat *img_info,
+					const guchar *pixels,
+					gint x, gint y,
+					gint width, gint height)
+{
+    Itdb_Image *image = NULL;
+    gint row;
+
+    if ((width > 0) && (height > 0))
+    {
+	image = itdb_image_new (width, height, 3);
+    }
+    if (image)
+    {
+	for (row=0; row<height; ++row)
+	{
+	    memcpy (image->pixels + row*image->rowstride,
+		    pixels + ((y+row)*img_info->width + x)*3,
+		    width*3);
+	}
+    }
+    return image;
+}
 
 
 /**
@@ -915,45 +1027,9 @@ itdb_thumb_get_gdk_pixbuf (Itdb_Device *device, Itdb_Thumb *thumb)
 
     if (thumb->size == 0)
     {   /* thumbnail has not yet been transferred to the iPod */
-	gint width=0, height=0;
+	gint width, height;
 
-	if (img_info != NULL)
-	{   /* use image dimensions from iPod */
-	    width = img_info->width;
-	    height = img_info->height;
-	}
-	else
-	{   /* use default dimensions */
-	    /* FIXME: better way to use the ipod_color dimensions? */
-	    switch (thumb->type)
-	    {
-	    case ITDB_THUMB_COVER_SMALL:
-		width =  56;  height =  56;  break;
-	    case ITDB_THUMB_COVER_LARGE:
-		width = 140;  height = 140;  break;
-	    case ITDB_THUMB_PHOTO_SMALL:
-		width =  42;  height =  30;  break;
-	    case ITDB_THUMB_PHOTO_LARGE:
-		width = 130;  height =  88;  break;
-	    case ITDB_THUMB_PHOTO_FULL_SCREEN:
-		width = 220;  height = 176;  break;
-	    case ITDB_THUMB_PHOTO_TV_SCREEN:
-		width = 720;  height = 480;  break;
-	    case ITDB_THUMB_COVER_XLARGE:
-		width = 320;  height = 320;  break;
-	    case ITDB_THUMB_COVER_MEDIUM:
-		width = 128;  height = 128;  break;
-	    case ITDB_THUMB_COVER_SMEDIUM:
-		width = 88;  height = 88;  break;
-	    case ITDB_THUMB_COVER_XSMALL:
-		width = 56;  height = 56;  break;
-	    }
-	    if (width == 0)
-	    {
-		width = 140;
-		height = 140;
-	    }
-	}
+	thumb_get_size (thumb, img_info, &width, &height);
 
 	if (thumb->filename)
 	{   /* read data from filename */
@@ -1005,13 +1081,7 @@ itdb_thumb_get_gdk_pixbuf (Itdb_Device *device, Itdb_Thumb *thumb)
 	/* pixbuf is already on the iPod -> read from there */
 	GdkPixbuf *pixbuf_full;
 	GdkPixbuf *pixbuf_sub;
-	gint pad_x = thumb->horizontal_padding;
-	gint pad_y = thumb->vertical_padding;
-	gint width = thumb->width;
-	gint height = thumb->height;
-
-/*	printf ("hp%d vp%d w%d h%d\n",
-	       pad_x, pad_y, width, height);*/
+	gint pad_x, pad_y, width, height;
 
 	if (img_info == NULL)
 	{
@@ -1039,30 +1109,7 @@ itdb_thumb_get_gdk_pixbuf (Itdb_Device *device, Itdb_Thumb *thumb)
 
 	/* Remove padding from the pixmap and/or cut the pixmap to the
 	   right size. */
-
-	/* Negative offsets indicate that part of the image was cut
-	   off at the left/top. thumb->width/height include that part
-	   of the image. Positive offsets indicate that part of the
-	   thumbnail are padded in black. thumb->width/height also
-	   include that part of the image -> reduce width and height
-	   by the absolute value of the padding */
-	width = width - abs (pad_x);
-	height = height - abs (pad_y);
-	/* And throw out "negative" padding */
-	if (pad_x < 0)		pad_x = 0;
-	if (pad_y < 0)		pad_y = 0;
-	/* Width/height might still be larger than
-	   img_info->width/height, indicating that part of the image
-	   was cut off at the right/bottom (similar to negative
-	   padding above). Adjust width/height accordingly. */
-	if (pad_x + width > img_info->width)
-	    width = img_info->width - pad_x;
-	if (pad_y + height > img_info->height)
-	    height = img_info->height - pad_y;
-
-#if DEBUG_ARTWORK
- 	printf ("px=%2d py=%2d x=%3d y=%3d\n", pad_x, pad_y, width, height);
-#endif
+	thumb_get_area (thumb, img_info, &pad_x, &pad_y, &width, &height);
 
 	pixbuf_sub = gdk_pixbuf_new_subpixbuf (pixbuf_full,
 					       pad_x, pad_y,
@@ -1078,6 +1125,410 @@ itdb_thumb_get_gdk_pixbuf (Itdb_Device *device, Itdb_Thumb *thumb)
 #endif
 }
 
+/**
+ * itdb_thumb_get_image:
+ * @device: an #Itdb_Device
+ * @thumb: an #Itdb_Thumb
+ *
+ * Converts @thumb to an #Itdb_Image. Works like
+ * itdb_thumb_get_gdk_pixbuf() but does not need gdk-pixbuf: thumbnails
+ * not yet transferred to the iPod are decoded with the current image
+ * backend (see itdb_image_backend_get()).
+ *
+ * Return value: an #Itdb_Image that must be freed with
+ * itdb_image_free() after use, or NULL if the image could not be
+ * created.
+ **/
+Itdb_Image *
+itdb_thumb_get_image (Itdb_Device *device, Itdb_Thumb *thumb)
+{
+    Itdb_Image *image = NULL;
+    const Itdb_ArtworkFormat *img_info = NULL;
+
+    g_return_val_if_fail (thumb, NULL);
+
+    if (device != NULL)
+    {
+	img_info = itdb_get_artwork_info_from_type (device, thumb->type);
+    }
+
+    if (thumb->size == 0)
+    {   /* thumbnail has not yet been transferred to the iPod */
+	gint width, height;
+
+	thumb_get_size (thumb, img_info, &width, &height);
+
+	if (thumb->filename)
+	{   /* read data from filename */
+	    image = itdb_image_load_file_at_size (thumb->filename,
+						  width, height);
+	}
+	else if (thumb->image_data)
+	{   /* use data stored in image_data */
+	    image = itdb_image_load_data_at_size (thumb->image_data,
+						  thumb->image_data_len,
+						  width, height);
+	}
+	else if (thumb->pixbuf)
+	{   /* use pixbuf data */
+	    image = itdb_image_load_pixbuf_at_size (thumb->pixbuf,
+						    width, height);
+	}
+
+	if (!image)
+	{
+	    return NULL;
+	}
+
+	thumb->width = image->width;
+	thumb->height = image->height;
+    }
+    else
+    {
+	/* image is already on the iPod -> read from there */
+	guchar *pixels;
+	gint x, y, width, height;
+
+	if (img_info == NULL)
+	{
+	    g_print (_("Unable to retrieve thumbnail (appears to be on iPod, but no image info available): type: %d, filename: '%s'\n"),
+		     thumb->type, thumb->filename);
+	    return NULL;
+	}
+
+	pixels = itdb_thumb_get_rgb_data (device, thumb);
+	if (pixels == NULL)
+	{
+	    return NULL;
+	}
+
+	/* Remove padding from the image and/or cut the image to the
+	   right size. */
+	thumb_get_area (thumb, img_info, &x, &y, &width, &height);
+	image = image_from_rgb_data (img_info, pixels, x, y, width, height);
+	g_free (pixels);
+    }
+
+    return image;
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Thumbnail prefetching
+ *
+\* ------------------------------------------------------------ */
+
+/* Thumbnails less than this many bytes apart in the same .ithmb file
+   are fetched with a single read... */
+#define PREFETCH_MAX_GAP (64 * 1024)
+/* ...unless that read would grow beyond this size */
+#define PREFETCH_MAX_READ (4 * 1024 * 1024)
+
+typedef struct
+{
+    Itdb_Track *track;
+    const gchar *filename;     /* full path of the .ithmb file */
+    const Itdb_ArtworkFormat *img_info;
+    guint32 offset;
+    guint32 size;
+    gint x, y, width, height;  /* area covered by the image */
+} PrefetchRequest;
+
+struct _Itdb_ThumbPrefetch
+{
+    PrefetchRequest *requests; /* sorted by filename and offset */
+    guint n_requests;
+    GList *missing;            /* tracks without thumbnail on the iPod */
+    GHashTable *filenames;     /* thumb->filename -> full path */
+    ItdbThumbPrefetchFunc func;
+    gpointer user_data;
+    volatile gint cancelled;
+    GThread *thread;
+};
+
+static gint prefetch_request_compare (gconstpointer a, gconstpointer b)
+{
+    const PrefetchRequest *ra = a;
+    const PrefetchRequest *rb = b;
+    gint cmp;
+
+    cmp = strcmp (ra->filename, rb->filename);
+    if (cmp != 0)
+	return cmp;
+    if (ra->offset < rb->offset)
+	return -1;
+    if (ra->offset > rb->offset)
+	return 1;
+    return 0;
+}
+
+/* Read @len bytes at @offset from @fd. Returns NULL on error. */
+static guchar *prefetch_read (int fd, const gchar *filename,
+			      guint32 offset, guint32 len)
+{
+    guchar *buf;
+    guint32 done = 0;
+
+    buf = g_try_malloc (len);
+    if (buf == NULL)
+    {
+	g_print ("Failed to allocate %u bytes to read from %s\n",
+		 len, filename);
+	return NULL;
+    }
+    while (done < len)
+    {
+	ssize_t res = pread (fd, buf + done, len - done, offset + done);
+	if (res == -1 && errno == EINTR)
+	    continue;
+	if (res <= 0)
+	{
+	    g_print ("Failed to read %u bytes from %s: %s\n",
+		     len, filename,
+		     res == 0 ? "unexpected end of file" : strerror (errno));
+	    g_free (buf);
+	    return NULL;
+	}
+	done += res;
+    }
+    return buf;
+}
+
+static gpointer prefetch_run (gpointer data)
+{
+    Itdb_ThumbPrefetch *prefetch = data;
+    const gchar *fd_filename = NULL;
+    int fd = -1;
+    GList *gl;
+    guint first, last, i;
+
+    for (gl=prefetch->missing; gl; gl=gl->next)
+    {
+	if (g_atomic_int_get (&prefetch->cancelled))
+	    goto out;
+	prefetch->func (gl->data, NULL, prefetch->user_data);
+    }
+
+    first = 0;
+    while (first < prefetch->n_requests)
+    {
+	PrefetchRequest *req = &prefetch->requests[first];
+	guint32 start = req->offset;
+	guint32 end = req->offset + req->size;
+	guchar *buf = NULL;
+
+	if (g_atomic_int_get (&prefetch->cancelled))
+	    goto out;
+
+	/* merge the following thumbnails into the same read */
+	for (last=first+1; last<prefetch->n_requests; ++last)
+	{
+	    PrefetchRequest *next = &prefetch->requests[last];
+	    guint32 next_end = MAX (end, next->offset + next->size);
+
+	    if ((next->filename != req->filename) ||
+		(next->offset > end + PREFETCH_MAX_GAP) ||
+		(next_end - start > PREFETCH_MAX_READ))
+		break;
+	    end = next_end;
+	}
+
+	if (fd_filename != req->filename)
+	{
+	    if (fd != -1)
+		close (fd);
+	    fd_filename = req->filename;
+	    fd = open (req->filename, O_RDONLY);
+	    if (fd == -1)
+	    {
+		g_print ("Failed to open %s: %s\n",
+			 req->filename, strerror (errno));
+	    }
+	}
+	if (fd != -1)
+	{
+	    buf = prefetch_read (fd, req->filename, start, end - start);
+	}
+
+	for (i=first; i<last; ++i)
+	{
+	    PrefetchRequest *r = &prefetch->requests[i];
+	    Itdb_Image *image = NULL;
+
+	    if (g_atomic_int_get (&prefetch->cancelled))
+	    {
+		g_free (buf);
+		goto out;
+	    }
+	    if (buf)
+	    {
+		guchar *pixels = unpack_pixel_data (r->img_info,
+						    buf + (r->offset - start),
+						    r->size);
+		if (pixels)
+		{
+		    image = image_from_rgb_data (r->img_info, pixels,
+						 r->x, r->y,
+						 r->width, r->height);
+		    g_free (pixels);
+		}
+	    }
+	    prefetch->func (r->track, image, prefetch->user_data);
+	}
+	g_free (buf);
+	first = last;
+    }
+
+  out:
+    if (fd != -1)
+	close (fd);
+    return NULL;
+}
+
+/**
+ * itdb_thumb_prefetch_start:
+ * @itdb: an #Itdb_iTunesDB
+ * @tracks: list of #Itdb_Track about to be displayed
+ * @type: the thumbnail type to fetch
+ * @func: function called with each fetched thumbnail
+ * @user_data: data passed to @func
+ *
+ * Fetches the thumbnails of type @type of @tracks in the background.
+ * Instead of reading each thumbnail separately as
+ * itdb_thumb_get_image() does, the thumbnails are sorted by their
+ * position in the .ithmb files and neighbouring thumbnails are read
+ * with a single large read.
+ *
+ * @func is called once for every track in @tracks, in no particular
+ * order, with an #Itdb_Image of the thumbnail which must be freed with
+ * itdb_image_free(). The image is NULL if the track has no such
+ * thumbnail on the iPod (for instance because it has not been
+ * written yet -- use itdb_thumb_get_image() for those) or if it could
+ * not be read.
+ *
+ * If the GLib thread system has been initialised, the thumbnails are
+ * fetched in a separate thread and @func is called from that thread.
+ * Otherwise all thumbnails are fetched before this function returns.
+ * @tracks may be freed after this function returns, but the tracks
+ * themselves must not be freed until the prefetch is freed.
+ *
+ * Return value: a handle to be freed with itdb_thumb_prefetch_free()
+ **/
+Itdb_ThumbPrefetch *
+itdb_thumb_prefetch_start (Itdb_iTunesDB *itdb, GList *tracks,
+			   ItdbThumbType type,
+			   ItdbThumbPrefetchFunc func, gpointer user_data)
+{
+    Itdb_ThumbPrefetch *prefetch;
+    GList *gl;
+    guint n;
+
+    g_return_val_if_fail (itdb, NULL);
+    g_return_val_if_fail (func, NULL);
+
+    prefetch = g_new0 (Itdb_ThumbPrefetch, 1);
+    prefetch->func = func;
+    prefetch->user_data = user_data;
+    prefetch->filenames = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 g_free, g_free);
+    prefetch->requests = g_new0 (PrefetchRequest, g_list_length (tracks));
+
+    /* Resolve everything needed to locate and unpack the thumbnails
+       now, so the worker does not touch the database */
+    n = 0;
+    for (gl=tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	Itdb_Thumb *thumb = NULL;
+	const Itdb_ArtworkFormat *img_info;
+	PrefetchRequest *req;
+	gchar *filename = NULL;
+
+	img_info = itdb_get_artwork_info_from_type (itdb->device, type);
+	if (track && track->artwork)
+	    thumb = itdb_artwork_get_thumb_by_type (track->artwork, type);
+	if (thumb && thumb->filename && (thumb->size != 0) && img_info)
+	{
+	    if (!g_hash_table_lookup_extended (prefetch->filenames,
+					       thumb->filename,
+					       NULL, (gpointer *)&filename))
+	    {
+		filename = itdb_thumb_get_filename (itdb->device, thumb);
+		g_hash_table_insert (prefetch->filenames,
+				     g_strdup (thumb->filename), filename);
+	    }
+	}
+	if (!filename)
+	{
+	    prefetch->missing = g_list_prepend (prefetch->missing, track);
+	    continue;
+	}
+
+	req = &prefetch->requests[n++];
+	req->track = track;
+	req->filename = filename;
+	req->img_info = img_info;
+	req->offset = thumb->offset;
+	req->size = thumb->size;
+	thumb_get_area (thumb, img_info,
+			&req->x, &req->y, &req->width, &req->height);
+    }
+    prefetch->n_requests = n;
+    prefetch->missing = g_list_reverse (prefetch->missing);
+    qsort (prefetch->requests, n, sizeof (PrefetchRequest),
+	   prefetch_request_compare);
+
+    if (g_thread_supported ())
+    {
+	prefetch->thread = g_thread_create (prefetch_run, prefetch,
+					    TRUE, NULL);
+    }
+    if (!prefetch->thread)
+    {
+	prefetch_run (prefetch);
+    }
+
+    return prefetch;
+}
+
+/**
+ * itdb_thumb_prefetch_cancel:
+ * @prefetch: an #Itdb_ThumbPrefetch
+ *
+ * Stops fetching thumbnails. @func of itdb_thumb_prefetch_start()
+ * may still be called for the thumbnail currently being processed.
+ * Call itdb_thumb_prefetch_free() to wait for that.
+ **/
+void itdb_thumb_prefetch_cancel (Itdb_ThumbPrefetch *prefetch)
+{
+    g_return_if_fail (prefetch);
+
+    g_atomic_int_set (&prefetch->cancelled, TRUE);
+}
+
+/**
+ * itdb_thumb_prefetch_free:
+ * @prefetch: an #Itdb_ThumbPrefetch
+ *
+ * Waits until all thumbnails have been delivered (or, after
+ * itdb_thumb_prefetch_cancel(), until fetching has stopped) and frees
+ * @prefetch.
+ **/
+void itdb_thumb_prefetch_free (Itdb_ThumbPrefetch *prefetch)
+{
+    if (prefetch)
+    {
+	if (prefetch->thread)
+	    g_thread_join (prefetch->thread);
+	g_free (prefetch->requests);
+	g_list_free (prefetch->missing);
+	g_hash_table_destroy (prefetch->filenames);
+	g_free (prefetch);
+    }
+}
+
+
 /**
  * itdb_thumb_new:
  * 
@@ -0,0 +1,246 @@
+/*
+|  Parsing and writing iTunesDBs of several iPods at once on a shared
+|  pool of worker threads.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include <glib/gi18n-lib.h>
+
+/* All jobs run on one GThreadPool shared by the whole process, so
+   that handling many iPods at once doesn't start a thread per iPod.
+
+   Different databases may be parsed and written at the same time.
+   The state libgpod shares between databases is protected by locks
+   (the directory listings of itdb_resolve_path(), the device profiles
+   of itdb_device.c, this pool), initialized once with GOnce (the
+   fixed Huffman tables of the thumbnail decoder, the ITDB_FILE_ERROR
+   quark) or accessed atomically (the switch of
+   itdb_stats_set_enabled(), the backend of itdb_image_backend_set()).
+   g_random_int() and the quark table are locked by glib. A database
+   itself (and its tracks, playlists and device) must only be used by
+   one thread at a time. */
+
+#define ASYNC_MAX_THREADS_DEFAULT 4
+
+typedef enum
+{
+    ASYNC_PARSE,
+    ASYNC_WRITE
+} AsyncType;
+
+typedef struct
+{
+    AsyncType type;
+    gchar *mountpoint;   /* ASYNC_PARSE */
+    Itdb_iTunesDB *itdb; /* ASYNC_WRITE */
+    ItdbAsyncFunc func;
+    gpointer user_data;
+    gboolean queued;     /* counted in async_pending */
+} AsyncJob;
+
+G_LOCK_DEFINE_STATIC (async_pool);
+static GThreadPool *async_pool = NULL;
+static gint async_max_threads = ASYNC_MAX_THREADS_DEFAULT;
+
+/* Number of jobs queued whose callbacks haven't returned yet. A job
+   queued by a callback is counted before the job of the callback is
+   done, so itdb_async_wait() also waits for it. */
+static GMutex *async_pending_mutex = NULL;
+static GCond *async_pending_cond = NULL;
+static guint async_pending = 0;
+
+static void async_job_run (gpointer data, gpointer user_data)
+{
+    AsyncJob *job = data;
+    Itdb_iTunesDB *itdb = job->itdb;
+    GError *error = NULL;
+
+    switch (job->type)
+    {
+    case ASYNC_PARSE:
+	itdb = itdb_parse (job->mountpoint, &error);
+	break;
+    case ASYNC_WRITE:
+	if (!itdb_write (itdb, &error) && !error)
+	{
+	    g_set_error (&error,
+			 ITDB_FILE_ERROR,
+			 ITDB_FILE_ERROR_ITDB_CORRUPT,
+			 _("Could not write the iTunesDB."));
+	}
+	break;
+    }
+
+    if (job->func)
+	job->func (itdb, error, job->user_data);
+    if (error)
+	g_error_free (error);
+
+    if (job->queued)
+    {
+	g_mutex_lock (async_pending_mutex);
+	if (--async_pending == 0)
+	    g_cond_broadcast (async_pending_cond);
+	g_mutex_unlock (async_pending_mutex);
+    }
+    g_free (job->mountpoint);
+    g_free (job);
+}
+
+/* Queues @job on the shared pool, or runs it right away if threads
+   are not available */
+static void async_push (AsyncJob *job)
+{
+    gboolean queued = FALSE;
+
+    if (g_thread_supported ())
+    {
+	G_LOCK (async_pool);
+	if (!async_pool)
+	{
+	    async_pending_mutex = g_mutex_new ();
+	    async_pending_cond = g_cond_new ();
+	    async_pool = g_thread_pool_new (async_job_run, NULL,
+					    async_max_threads, FALSE, NULL);
+	}
+	if (async_pool)
+	{
+	    g_mutex_lock (async_pending_mutex);
+	    ++async_pending;
+	    g_mutex_unlock (async_pending_mutex);
+	    job->queued = TRUE;
+	    g_thread_pool_push (async_pool, job, NULL);
+	    queued = TRUE;
+	}
+	G_UNLOCK (async_pool);
+    }
+    if (!queued)
+	async_job_run (job, NULL);
+}
+
+/**
+ * itdb_parse_async:
+ * @mp: mount point of the iPod (e.g. "/mnt/ipod") in local encoding
+ * @func: called with the result, or NULL
+ * @user_data: user data passed to @func
+ *
+ * Parses the iTunesDB of the iPod mounted at @mp like itdb_parse() on
+ * a pool of worker threads shared by all asynchronous jobs (see
+ * itdb_async_set_max_threads()). @func is called from the worker
+ * thread with the new #Itdb_iTunesDB (to be freed by the caller), or
+ * with NULL and an error (owned by libgpod) if parsing failed.
+ *
+ * If g_thread_init() hasn't been called, the iTunesDB is parsed and
+ * @func is called before this function returns.
+ **/
+void itdb_parse_async (const gchar *mp, ItdbAsyncFunc func,
+		       gpointer user_data)
+{
+    AsyncJob *job;
+
+    g_return_if_fail (mp);
+
+    job = g_new0 (AsyncJob, 1);
+    job->type = ASYNC_PARSE;
+    job->mountpoint = g_strdup (mp);
+    job->func = func;
+    job->user_data = user_data;
+    async_push (job);
+}
+
+/**
+ * itdb_write_async:
+ * @itdb: the #Itdb_iTunesDB to write
+ * @func: called when done, or NULL
+ * @user_data: user data passed to @func
+ *
+ * Writes @itdb like itdb_write() on the pool of worker threads used
+ * by itdb_parse_async(). @func is called from the worker thread with
+ * @itdb and a NULL error on success, or with the error (owned by
+ * libgpod) that occurred. Don't use @itdb until @func has been called.
+ *
+ * If g_thread_init() hasn't been called, @itdb is written and @func is
+ * called before this function returns.
+ **/
+void itdb_write_async (Itdb_iTunesDB *itdb, ItdbAsyncFunc func,
+		       gpointer user_data)
+{
+    AsyncJob *job;
+
+    g_return_if_fail (itdb);
+
+    job = g_new0 (AsyncJob, 1);
+    job->type = ASYNC_WRITE;
+    job->itdb = itdb;
+    job->func = func;
+    job->user_data = user_data;
+    async_push (job);
+}
+
+/**
+ * itdb_async_set_max_threads:
+ * @max_threads: maximum number of worker threads, -1 for no limit
+ *
+ * Sets how many jobs of itdb_parse_async() and itdb_write_async() run
+ * at the same time. Further jobs wait in line. The default is 4: jobs
+ * mostly wait for the iPods, but too many of them at once make the
+ * disks seek more than they read.
+ **/
+void itdb_async_set_max_threads (gint max_threads)
+{
+    g_return_if_fail ((max_threads > 0) || (max_threads == -1));
+
+    G_LOCK (async_pool);
+    async_max_threads = max_threads;
+    if (async_pool)
+	g_thread_pool_set_max_threads (async_pool, max_threads, NULL);
+    G_UNLOCK (async_pool);
+}
+
+/**
+ * itdb_async_wait:
+ *
+ * Waits until all jobs queued with itdb_parse_async() and
+ * itdb_write_async() have finished and their callbacks have returned,
+ * including jobs queued by these callbacks (e.g. writing a database
+ * from the callback of its parse), for example before the application
+ * quits. Must not be called from such a callback.
+ **/
+void itdb_async_wait (void)
+{
+    gboolean started;
+
+    G_LOCK (async_pool);
+    started = (async_pool != NULL);
+    G_UNLOCK (async_pool);
+
+    if (!started)
+	return;
+
+    g_mutex_lock (async_pending_mutex);
+    while (async_pending > 0)
+	g_cond_wait (async_pending_cond, async_pending_mutex);
+    g_mutex_unlock (async_pending_mutex);
+}
@@ -0,0 +1,352 @@
+/*
+|  Batches of track and playlist changes applied in one go.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+
+/* Adding a track with itdb_track_add(..., -1) walks the whole track
+   list, and removing a track from the database and all its playlists
+   walks every playlist. For thousands of tracks both are
+   quadratic. An Itdb_Batch only records the changes; at commit time
+   the additions are appended as a whole and all removals are done
+   with one pass over the track list and over each playlist. */
+
+struct _Itdb_Batch
+{
+    Itdb_iTunesDB *itdb;
+    GList *tracks_added;      /* (Itdb_Track *) in reverse order     */
+    GHashTable *tracks_removed;   /* set of Itdb_Track               */
+    GHashTable *members_added;    /* Itdb_Playlist -> GList of tracks
+				     in reverse order                 */
+    GHashTable *members_removed;  /* Itdb_Playlist -> set of tracks   */
+};
+
+
+/**
+ * itdb_batch_begin:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Starts a batch of changes to @itdb. The changes recorded with
+ * itdb_batch_track_add(), itdb_batch_track_remove(),
+ * itdb_batch_playlist_add_track() and
+ * itdb_batch_playlist_remove_track() do not take effect until
+ * itdb_batch_commit() is called. Don't change @itdb by other means
+ * while a batch is open.
+ *
+ * Return value: a new #Itdb_Batch, freed by itdb_batch_commit() or
+ * itdb_batch_cancel()
+ **/
+Itdb_Batch *itdb_batch_begin (Itdb_iTunesDB *itdb)
+{
+    Itdb_Batch *batch;
+
+    g_return_val_if_fail (itdb, NULL);
+
+    batch = g_new0 (Itdb_Batch, 1);
+    batch->itdb = itdb;
+    batch->tracks_removed = g_hash_table_new (g_direct_hash,
+					      g_direct_equal);
+    batch->members_added = g_hash_table_new (g_direct_hash,
+					     g_direct_equal);
+    batch->members_removed = g_hash_table_new_full (
+	g_direct_hash, g_direct_equal,
+	NULL, (GDestroyNotify)g_hash_table_destroy);
+    return batch;
+}
+
+/**
+ * itdb_batch_track_add:
+ * @batch: an #Itdb_Batch
+ * @track: an #Itdb_Track not yet part of a database
+ *
+ * Adds @track to the end of the track list at commit, like
+ * itdb_track_add() with a position of -1. The database takes over
+ * @track at commit. Use itdb_batch_playlist_add_track() to also add
+ * it to the master playlist.
+ **/
+void itdb_batch_track_add (Itdb_Batch *batch, Itdb_Track *track)
+{
+    g_return_if_fail (batch);
+    g_return_if_fail (track);
+    g_return_if_fail (!track->userdata || track->userdata_duplicate);
+
+    batch->tracks_added = g_list_prepend (batch->tracks_added, track);
+}
+
+/**
+ * itdb_batch_track_remove:
+ * @batch: an #Itdb_Batch
+ * @track: an #Itdb_Track of the batch's database
+ *
+ * Removes @track from the database and from all its playlists at
+ * commit and frees it. Unlike itdb_track_remove() there's no need to
+ * remove @track from the playlists first. Tracks added and removed
+ * within the same batch end up removed.
+ **/
+void itdb_batch_track_remove (Itdb_Batch *batch, Itdb_Track *track)
+{
+    g_return_if_fail (batch);
+    g_return_if_fail (track);
+
+    g_hash_table_insert (batch->tracks_removed, track, track);
+}
+
+/**
+ * itdb_batch_playlist_add_track:
+ * @batch: an #Itdb_Batch
+ * @pl: an #Itdb_Playlist of the batch's database
+ * @track: an #Itdb_Track
+ *
+ * Adds @track to the end of @pl at commit, like
+ * itdb_playlist_add_track() with a position of -1.
+ **/
+void itdb_batch_playlist_add_track (Itdb_Batch *batch, Itdb_Playlist *pl,
+				    Itdb_Track *track)
+{
+    GList *members;
+
+    g_return_if_fail (batch);
+    g_return_if_fail (pl);
+    g_return_if_fail (pl->itdb == batch->itdb);
+    g_return_if_fail (track);
+
+    members = g_hash_table_lookup (batch->members_added, pl);
+    members = g_list_prepend (members, track);
+    g_hash_table_insert (batch->members_added, pl, members);
+}
+
+/**
+ * itdb_batch_playlist_remove_track:
+ * @batch: an #Itdb_Batch
+ * @pl: an #Itdb_Playlist of the batch's database
+ * @track: an #Itdb_Track
+ *
+ * Removes @track from @pl at commit. Unlike
+ * itdb_playlist_remove_track() all occurrences of @track in @pl are
+ * removed, including those added within the same batch.
+ **/
+void itdb_batch_playlist_remove_track (Itdb_Batch *batch,
+				       Itdb_Playlist *pl,
+				       Itdb_Track *track)
+{
+    GHashTable *tracks;
+
+    g_return_if_fail (batch);
+    g_return_if_fail (pl);
+    g_return_if_fail (pl->itdb == batch->itdb);
+    g_return_if_fail (track);
+
+    tracks = g_hash_table_lookup (batch->members_removed, pl);
+    if (!tracks)
+    {
+	tracks = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_insert (batch->members_removed, pl, tracks);
+    }
+    g_hash_table_insert (tracks, track, track);
+}
+
+/* Removes all elements of @list contained in @set1 or @set2 (either
+   may be NULL) in one pass and returns the new start of @list */
+static GList *list_remove_set (GList *list,
+			       GHashTable *set1, GHashTable *set2)
+{
+    GList *gl = list;
+
+    while (gl)
+    {
+	GList *next = gl->next;
+	if ((set1 && g_hash_table_lookup (set1, gl->data)) ||
+	    (set2 && g_hash_table_lookup (set2, gl->data)))
+	    list = g_list_delete_link (list, gl);
+	gl = next;
+    }
+    return list;
+}
+
+/* Set of the dbids of the tracks of @itdb and of @added, or NULL if
+   all tracks in @added have a dbid already */
+static GHashTable *batch_dbids (Itdb_iTunesDB *itdb, GList *added)
+{
+    GHashTable *dbids;
+    GList *gl;
+
+    for (gl=added; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	if (track->dbid == 0)
+	    break;
+    }
+    if (!gl)
+	return NULL;
+
+    dbids = g_hash_table_new (itdb_dbid_hash, itdb_dbid_equal);
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	g_hash_table_insert (dbids, &track->dbid, &track->dbid);
+    }
+    for (gl=added; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	if (track->dbid)
+	    g_hash_table_insert (dbids, &track->dbid, &track->dbid);
+    }
+    return dbids;
+}
+
+static void batch_add_members (Itdb_Playlist *pl, GList *members,
+			       gpointer user_data)
+{
+    GList *gl;
+
+    members = g_list_reverse (members);
+    for (gl=members; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	track->itdb = pl->itdb;
+    }
+    pl->members = g_list_concat (pl->members, members);
+}
+
+static void batch_free_members (Itdb_Playlist *pl, GList *members,
+				gpointer user_data)
+{
+    g_list_free (members);
+}
+
+static void batch_free (Itdb_Batch *batch)
+{
+    g_list_free (batch->tracks_added);
+    g_hash_table_destroy (batch->tracks_removed);
+    g_hash_table_foreach (batch->members_added,
+			  (GHFunc)batch_free_members, NULL);
+    g_hash_table_destroy (batch->members_added);
+    g_hash_table_destroy (batch->members_removed);
+    g_free (batch);
+}
+
+/**
+ * itdb_batch_commit:
+ * @batch: an #Itdb_Batch
+ *
+ * Applies the changes recorded in @batch and frees @batch. Tracks are
+ * added first, then the playlist members, then all removals are done
+ * with a single pass over the track list and each playlist.
+ **/
+void itdb_batch_commit (Itdb_Batch *batch)
+{
+    Itdb_iTunesDB *itdb;
+    gboolean removals, tracks_changed;
+    GList *gl;
+
+    g_return_if_fail (batch);
+
+    itdb = batch->itdb;
+    removals = (g_hash_table_size (batch->tracks_removed) != 0);
+    tracks_changed = removals || batch->tracks_added;
+
+    if (batch->tracks_added)
+    {
+	GList *added = g_list_reverse (batch->tracks_added);
+	GHashTable *dbids = batch_dbids (itdb, added);
+
+	batch->tracks_added = NULL;
+	for (gl=added; gl; gl=gl->next)
+	{
+	    Itdb_Track *track = gl->data;
+	    track->itdb = itdb;
+	    /* one set of the IDs in use instead of a walk over all
+	       tracks per track in itdb_track_set_defaults() */
+	    if (dbids && (track->dbid == 0))
+		itdb_track_set_unique_dbid (track, dbids);
+	    itdb_track_set_defaults (track);
+	}
+	if (dbids)
+	    g_hash_table_destroy (dbids);
+	itdb->tracks = g_list_concat (itdb->tracks, added);
+    }
+
+    g_hash_table_foreach (batch->members_added,
+			  (GHFunc)batch_add_members, NULL);
+    g_hash_table_steal_all (batch->members_added);
+
+    if (removals || (g_hash_table_size (batch->members_removed) != 0))
+    {
+	for (gl=itdb->playlists; gl; gl=gl->next)
+	{
+	    Itdb_Playlist *pl = gl->data;
+	    GHashTable *members = g_hash_table_lookup (batch->members_removed,
+						       pl);
+	    if (removals || members)
+		pl->members = list_remove_set (pl->members,
+					       removals ?
+					       batch->tracks_removed : NULL,
+					       members);
+	}
+    }
+
+    if (removals)
+    {
+	GList *removed = NULL;
+
+	gl = itdb->tracks;
+	while (gl)
+	{
+	    GList *next = gl->next;
+	    if (g_hash_table_lookup (batch->tracks_removed, gl->data))
+	    {
+		itdb->tracks = g_list_remove_link (itdb->tracks, gl);
+		removed = g_list_concat (gl, removed);
+	    }
+	    gl = next;
+	}
+	for (gl=removed; gl; gl=gl->next)
+	{
+	    if (!itdb_snapshots_track_release (gl->data))
+		itdb_track_free (gl->data);
+	}
+	g_list_free (removed);
+    }
+
+    /* cheaper than updating the indexes track by track */
+    if (tracks_changed)
+	itdb_query_invalidate (itdb);
+
+    batch_free (batch);
+}
+
+/**
+ * itdb_batch_cancel:
+ * @batch: an #Itdb_Batch
+ *
+ * Discards the changes recorded in @batch and frees @batch. Tracks
+ * passed to itdb_batch_track_add() remain owned by the caller.
+ **/
+void itdb_batch_cancel (Itdb_Batch *batch)
+{
+    g_return_if_fail (batch);
+
+    batch_free (batch);
+}
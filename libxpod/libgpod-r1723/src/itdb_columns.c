@@ -0,0 +1,189 @@
+/*
+|  Column-wise copy of the scalar track fields of an iTunesDB, used
+|  for scans over the whole library (smart playlists, totals).
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include <string.h>
+
+/* TRUE for the columns whose track field is signed */
+static const gboolean column_signed[ITDB_COLUMN_N] = {
+    FALSE, /* rating        */
+    FALSE, /* playcount     */
+    FALSE, /* skipcount     */
+    FALSE, /* time_added    */
+    FALSE, /* time_played   */
+    FALSE, /* time_modified */
+    FALSE, /* last_skipped  */
+    TRUE,  /* size          */
+    TRUE,  /* tracklen      */
+    FALSE, /* mediatype     */
+    TRUE,  /* bitrate       */
+    FALSE, /* samplerate    */
+    TRUE,  /* year          */
+    TRUE,  /* track_nr      */
+    TRUE,  /* cd_nr         */
+    TRUE,  /* BPM           */
+    FALSE, /* season_nr     */
+    FALSE, /* compilation   */
+    FALSE  /* checked       */
+};
+
+
+/* Copies the scalar fields of all tracks of @itdb into the columns
+ * kept in @itdb's private data, creating or growing them as
+ * needed. This is a single pass over itdb->tracks; the columns are
+ * reused between calls to avoid reallocation.
+ *
+ * Return value: the columns of @itdb (owned by @itdb) */
+ItdbColumns *itdb_columns_refresh (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+    ItdbColumns *cols;
+    guint32 *c[ITDB_COLUMN_N];
+    GList *gl;
+    guint n, i;
+
+    g_return_val_if_fail (itdb, NULL);
+
+    priv = itdb_get_private (itdb);
+    if (!priv->columns)
+	priv->columns = g_new0 (ItdbColumns, 1);
+    cols = priv->columns;
+
+    n = g_list_length (itdb->tracks);
+    if (n > cols->n_alloc)
+    {
+	g_free (cols->tracks);
+	g_free (cols->values);
+	cols->n_alloc = MAX (n, 2*cols->n_alloc);
+	cols->tracks = g_new (Itdb_Track *, cols->n_alloc);
+	cols->values = g_new (guint32, ITDB_COLUMN_N * cols->n_alloc);
+    }
+    for (i=0; i<ITDB_COLUMN_N; ++i)
+	c[i] = ITDB_COLUMN (cols, i);
+
+    cols->n_rows = 0;
+    for (gl=itdb->tracks, i=0; gl; gl=gl->next, ++i)
+    {
+	Itdb_Track *track = gl->data;
+	g_return_val_if_fail (track, NULL);
+
+	cols->tracks[i] = track;
+	c[ITDB_COLUMN_RATING][i] = track->rating;
+	c[ITDB_COLUMN_PLAYCOUNT][i] = track->playcount;
+	c[ITDB_COLUMN_SKIPCOUNT][i] = track->skipcount;
+	c[ITDB_COLUMN_TIME_ADDED][i] = track->time_added;
+	c[ITDB_COLUMN_TIME_PLAYED][i] = track->time_played;
+	c[ITDB_COLUMN_TIME_MODIFIED][i] = track->time_modified;
+	c[ITDB_COLUMN_LAST_SKIPPED][i] = track->last_skipped;
+	c[ITDB_COLUMN_SIZE][i] = track->size;
+	c[ITDB_COLUMN_TRACKLEN][i] = track->tracklen;
+	c[ITDB_COLUMN_MEDIATYPE][i] = track->mediatype;
+	c[ITDB_COLUMN_BITRATE][i] = track->bitrate;
+	c[ITDB_COLUMN_SAMPLERATE][i] = track->samplerate;
+	c[ITDB_COLUMN_YEAR][i] = track->year;
+	c[ITDB_COLUMN_TRACK_NR][i] = track->track_nr;
+	c[ITDB_COLUMN_CD_NR][i] = track->cd_nr;
+	c[ITDB_COLUMN_BPM][i] = track->BPM;
+	c[ITDB_COLUMN_SEASON_NR][i] = track->season_nr;
+	c[ITDB_COLUMN_COMPILATION][i] = track->compilation;
+	c[ITDB_COLUMN_CHECKED][i] = track->checked;
+    }
+    cols->n_rows = n;
+    return cols;
+}
+
+/* Returns the value of column @id in row @row, sign-extended if the
+   track field is signed */
+gint64 itdb_columns_value (const ItdbColumns *cols,
+			   ItdbColumnId id, guint row)
+{
+    guint32 val = ITDB_COLUMN (cols, id)[row];
+
+    if (column_signed[id])
+	return (gint32)val;
+    return val;
+}
+
+void itdb_columns_free (ItdbColumns *cols)
+{
+    if (cols)
+    {
+	g_free (cols->tracks);
+	g_free (cols->values);
+	g_free (cols);
+    }
+}
+
+
+/**
+ * itdb_tracks_get_totals:
+ * @itdb: an #Itdb_iTunesDB
+ * @mediatype: an or'ed combination of #ItdbMediatype or 0
+ * @totals: an #Itdb_TrackTotals to fill in
+ *
+ * Sums up size, length, play counts and skip counts of the tracks in
+ * @itdb. If @mediatype is not 0, only tracks whose mediatype has at
+ * least one of the bits of @mediatype set are counted.
+ **/
+void itdb_tracks_get_totals (Itdb_iTunesDB *itdb, guint32 mediatype,
+			     Itdb_TrackTotals *totals)
+{
+    ItdbColumns *cols;
+    const guint32 *mt, *rating, *playcount, *skipcount, *size, *tracklen;
+    guint i;
+
+    g_return_if_fail (itdb);
+    g_return_if_fail (totals);
+
+    memset (totals, 0, sizeof (Itdb_TrackTotals));
+
+    cols = itdb_columns_refresh (itdb);
+    g_return_if_fail (cols);
+
+    mt = ITDB_COLUMN (cols, ITDB_COLUMN_MEDIATYPE);
+    rating = ITDB_COLUMN (cols, ITDB_COLUMN_RATING);
+    playcount = ITDB_COLUMN (cols, ITDB_COLUMN_PLAYCOUNT);
+    skipcount = ITDB_COLUMN (cols, ITDB_COLUMN_SKIPCOUNT);
+    /* taken as unsigned: files between 2 and 4 GB */
+    size = ITDB_COLUMN (cols, ITDB_COLUMN_SIZE);
+    tracklen = ITDB_COLUMN (cols, ITDB_COLUMN_TRACKLEN);
+
+    for (i=0; i<cols->n_rows; ++i)
+    {
+	if (mediatype && !(mt[i] & mediatype))
+	    continue;
+	++totals->tracks;
+	totals->size += size[i];
+	totals->tracklen += tracklen[i];
+	totals->playcount += playcount[i];
+	totals->skipcount += skipcount[i];
+	if (playcount[i] == 0)
+	    ++totals->unplayed;
+	if (rating[i] != 0)
+	    ++totals->rated;
+    }
+}
@@ -330,6 +330,7 @@ static const Itdb_ArtworkFormat ipod_classic_1_artwork_info[] = {
 
 
 static void itdb_device_set_timezone_info (Itdb_Device *device);
+static const Itdb_IpodInfo *device_lookup_ipod_info (Itdb_Device *device);
 
 /* Reset or create the SysInfo hash table */
 static void itdb_device_reset_sysinfo (Itdb_Device *device)
@@ -339,6 +340,7 @@ static void itdb_device_reset_sysinfo (Itdb_Device *device)
     device->sysinfo = g_hash_table_new_full (g_str_hash, g_str_equal,
 					     g_free, g_free);
     device->sysinfo_changed = FALSE;
+    device->ipod_info = NULL;
 }
 
 
@@ -377,13 +379,228 @@ void itdb_device_free (Itdb_Device *device)
 }
 
 
+/* The SysInfo, SysInfoExtended and Preferences files of an iPod are
+   read whenever its mount point is set. What was read is kept as a
+   profile of the mount point, so that reconnecting the same iPod (or
+   parsing its databases again) doesn't parse these files again. A
+   profile is only used while size and modification time of all three
+   files are unchanged -- another iPod mounted at the same place has
+   different files. The firewire GUID and serial number are part of
+   what is cached, so the mount point is the key. Mount points
+   without any of the three files get no profile. */
+typedef struct
+{
+    gboolean exists;
+    off_t size;
+    time_t mtime;
+} DeviceFileStamp;
+
+#define DEVICE_PROFILE_FILES 3
+
+typedef struct
+{
+    DeviceFileStamp stamps[DEVICE_PROFILE_FILES];
+    GHashTable *sysinfo;   /* SysInfo and SysInfoExtended entries    */
+    gint timezone_shift;
+    guint byte_order;      /* 0 until detected from a database file  */
+} DeviceProfile;
+
+G_LOCK_DEFINE_STATIC (device_profiles);
+/* mount point -> DeviceProfile */
+static GHashTable *device_profiles = NULL;
+static gboolean device_profiles_enabled = TRUE;
+
+static void device_profile_free (DeviceProfile *profile)
+{
+    g_hash_table_destroy (profile->sysinfo);
+    g_free (profile);
+}
+
+static void device_sysinfo_copy_entry (const gchar *key, const gchar *value,
+				       GHashTable *copy)
+{
+    g_hash_table_insert (copy, g_strdup (key), g_strdup (value));
+}
+
+static GHashTable *device_sysinfo_copy (GHashTable *sysinfo)
+{
+    GHashTable *copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      g_free, g_free);
+    g_hash_table_foreach (sysinfo, (GHFunc)device_sysinfo_copy_entry, copy);
+    return copy;
+}
+
+/* Fills @stamps with size and modification time of the files a profile
+   of @mountpoint is made from. Returns FALSE if none of them exists:
+   there's nothing to tell one iPod from another then. */
+static gboolean device_profile_stamp (const gchar *mountpoint,
+				      DeviceFileStamp *stamps)
+{
+    const gchar *names[DEVICE_PROFILE_FILES] =
+	{"SysInfo", "SysInfoExtended", "Preferences"};
+    gchar *dev_path;
+    gboolean found = FALSE;
+    gint i;
+
+    memset (stamps, 0, sizeof (DeviceFileStamp) * DEVICE_PROFILE_FILES);
+    dev_path = itdb_get_device_dir (mountpoint);
+    if (!dev_path)
+	return FALSE;
+    for (i=0; i<DEVICE_PROFILE_FILES; ++i)
+    {
+	const gchar *components[] = {names[i], NULL};
+	gchar *path = itdb_resolve_path (dev_path, components);
+	struct stat statbuf;
+
+	if (path && (g_stat (path, &statbuf) == 0))
+	{
+	    stamps[i].exists = TRUE;
+	    stamps[i].size = statbuf.st_size;
+	    stamps[i].mtime = statbuf.st_mtime;
+	    found = TRUE;
+	}
+	g_free (path);
+    }
+    g_free (dev_path);
+    return found;
+}
+
+/* Sets the sysinfo and timezone of @device from the profile of its
+   mount point if there's one matching @stamps. */
+static gboolean device_profile_restore (Itdb_Device *device,
+					const DeviceFileStamp *stamps)
+{
+    DeviceProfile *profile = NULL;
+
+    G_LOCK (device_profiles);
+    if (device_profiles)
+	profile = g_hash_table_lookup (device_profiles, device->mountpoint);
+    if (profile &&
+	(memcmp (profile->stamps, stamps,
+		 sizeof (DeviceFileStamp) * DEVICE_PROFILE_FILES) == 0))
+    {
+	itdb_device_reset_sysinfo (device);
+	g_hash_table_foreach (profile->sysinfo,
+			      (GHFunc)device_sysinfo_copy_entry,
+			      device->sysinfo);
+	device->timezone_shift = profile->timezone_shift;
+	device->profile_byte_order = profile->byte_order;
+    }
+    else
+    {
+	profile = NULL;
+    }
+    G_UNLOCK (device_profiles);
+
+    return profile != NULL;
+}
+
+/* Keeps what was just read for @device as the profile of its mount
+   point */
+static void device_profile_store (Itdb_Device *device,
+				  const DeviceFileStamp *stamps)
+{
+    DeviceProfile *profile;
+
+    profile = g_new0 (DeviceProfile, 1);
+    memcpy (profile->stamps, stamps,
+	    sizeof (DeviceFileStamp) * DEVICE_PROFILE_FILES);
+    profile->sysinfo = device_sysinfo_copy (device->sysinfo);
+    profile->timezone_shift = device->timezone_shift;
+
+    G_LOCK (device_profiles);
+    if (!device_profiles)
+	device_profiles = g_hash_table_new_full (
+	    g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)device_profile_free);
+    g_hash_table_insert (device_profiles,
+			 g_strdup (device->mountpoint), profile);
+    G_UNLOCK (device_profiles);
+}
+
+/* Records @byte_order in the profile of @device's mount point */
+static void device_profile_set_byte_order (Itdb_Device *device,
+					   guint byte_order)
+{
+    DeviceProfile *profile = NULL;
+
+    G_LOCK (device_profiles);
+    if (device_profiles)
+	profile = g_hash_table_lookup (device_profiles, device->mountpoint);
+    if (profile)
+	profile->byte_order = byte_order;
+    G_UNLOCK (device_profiles);
+}
+
+/* Drops the profile of @mountpoint */
+static void device_profile_forget (const gchar *mountpoint)
+{
+    G_LOCK (device_profiles);
+    if (device_profiles)
+	g_hash_table_remove (device_profiles, mountpoint);
+    G_UNLOCK (device_profiles);
+}
+
+/**
+ * itdb_device_profiles_set_enabled:
+ * @enabled: TRUE to keep device profiles
+ *
+ * By default the information read from the SysInfo, SysInfoExtended
+ * and Preferences files of an iPod is kept for its mount point and
+ * used again by itdb_device_set_mountpoint() as long as these files
+ * keep their size and modification time. libgpod forgets the profile
+ * when it writes the SysInfo file itself. If these files are changed
+ * by other means within the timestamp resolution of the file system,
+ * call itdb_device_profiles_clear(). Disabling profiles also forgets
+ * all profiles kept so far.
+ **/
+void itdb_device_profiles_set_enabled (gboolean enabled)
+{
+    G_LOCK (device_profiles);
+    device_profiles_enabled = enabled;
+    G_UNLOCK (device_profiles);
+    if (!enabled)
+	itdb_device_profiles_clear ();
+}
+
+/**
+ * itdb_device_profiles_clear:
+ *
+ * Forgets all device profiles, see itdb_device_profiles_set_enabled().
+ * The files of each iPod will be read again the next time its mount
+ * point is set.
+ **/
+void itdb_device_profiles_clear (void)
+{
+    G_LOCK (device_profiles);
+    if (device_profiles)
+    {
+	g_hash_table_destroy (device_profiles);
+	device_profiles = NULL;
+    }
+    G_UNLOCK (device_profiles);
+}
+
+static gboolean device_profiles_get_enabled (void)
+{
+    gboolean enabled;
+
+    G_LOCK (device_profiles);
+    enabled = device_profiles_enabled;
+    G_UNLOCK (device_profiles);
+    return enabled;
+}
+
+
 /**
  * itdb_device_set_mountpoint:
  * @device: an #Itdb_Device
  * @mp: the new mount point
  *
  * Sets the mountpoint of @device to @mp and update the cached device 
- * information (in particular, re-read the SysInfo file)
+ * information (in particular, re-read the SysInfo file unless it is
+ * unchanged since it was last read for @mp, see
+ * itdb_device_profiles_set_enabled())
  **/
 void itdb_device_set_mountpoint (Itdb_Device *device, const gchar *mp)
 {
@@ -391,9 +608,26 @@ void itdb_device_set_mountpoint (Itdb_Device *device, const gchar *mp)
 
     g_free (device->mountpoint);
     device->mountpoint = g_strdup (mp);
+    device->profile_byte_order = 0;
     if (mp) {
+	DeviceFileStamp stamps[DEVICE_PROFILE_FILES];
+	gboolean enabled = device_profiles_get_enabled ();
+
+	/* whatever is mounted at @mp now may not be what was there
+	   when itdb_resolve_path() last looked */
+	itdb_resolve_path_forget_tree (mp);
+
+	if (enabled && !device_profile_stamp (mp, stamps))
+	{   /* no profile without files to check it against */
+	    device_profile_forget (mp);
+	    enabled = FALSE;
+	}
+	if (enabled && device_profile_restore (device, stamps))
+	    return;
 	itdb_device_read_sysinfo (device);
         itdb_device_set_timezone_info (device);
+	if (enabled)
+	    device_profile_store (device, stamps);
     }
 }
 
@@ -515,6 +749,7 @@ gboolean itdb_device_write_sysinfo (Itdb_Device *device, GError **error)
     {
 	gchar *sysfile = g_build_filename (devicedir, "SysInfo", NULL);
 	FILE *sysinfo = fopen (sysfile, "w");
+	itdb_resolve_path_invalidate (sysfile);
 	if (sysinfo)
 	{
 	    if (device->sysinfo)
@@ -543,6 +778,8 @@ gboolean itdb_device_write_sysinfo (Itdb_Device *device, GError **error)
 
     if (success)
 	device->sysinfo_changed = FALSE;
+    /* the SysInfo file has been rewritten in any case */
+    device_profile_forget (device->mountpoint);
 
     return success;
 }
@@ -594,6 +831,7 @@ void itdb_device_set_sysinfo (Itdb_Device *device,
 	g_hash_table_remove (device->sysinfo, field);
     }
     device->sysinfo_changed = TRUE;
+    device->ipod_info = NULL;
 }
 
 
@@ -607,6 +845,18 @@ void itdb_device_set_sysinfo (Itdb_Device *device,
  **/
 const Itdb_IpodInfo *
 itdb_device_get_ipod_info (Itdb_Device *device)
+{
+    g_return_val_if_fail (device, NULL);
+
+    /* looked up for each track with artwork */
+    if (!device->ipod_info)
+	device->ipod_info = device_lookup_ipod_info (device);
+    return device->ipod_info;
+}
+
+/* Looks up the #Itdb_IpodInfo entry of @device in ipod_info_table */
+static const Itdb_IpodInfo *
+device_lookup_ipod_info (Itdb_Device *device)
 {
     gint i;
     gchar *model_num, *p;
@@ -799,6 +1049,13 @@ itdb_device_autodetect_endianess (Itdb_Device *device)
 
     g_return_if_fail (device);
 
+    /* the byte order of an iPod doesn't change */
+    if (device->profile_byte_order != 0)
+    {
+	device->byte_order = device->profile_byte_order;
+	return;
+    }
+
     if (device->mountpoint)
     {
 	gchar *path;
@@ -841,6 +1098,12 @@ itdb_device_autodetect_endianess (Itdb_Device *device)
 	}
     }
 
+    if ((byte_order != 0) && device->mountpoint)
+    {
+	device->profile_byte_order = byte_order;
+	device_profile_set_byte_order (device, byte_order);
+    }
+
     /* default: non-reversed */
     if (byte_order == 0)
 	byte_order = G_LITTLE_ENDIAN;
@@ -84,6 +84,10 @@ struct _Itdb_Device
     gint timezone_shift;  /* difference in seconds between the current
                            * timezone and UTC
                            */
+    const Itdb_IpodInfo *ipod_info; /* NULL until looked up, see
+				     * itdb_device_get_ipod_info() */
+    guint profile_byte_order; /* byte order known for the mount point
+				 or 0, see itdb_device.c */
 
 };
 
@@ -0,0 +1,937 @@
+/*
+|  Differences between two iTunesDBs as a change set that can be
+|  applied to another database.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include <string.h>
+
+/* Tracks of the two databases are paired with hash joins: first by
+   dbid, then the remaining ones by the key returned by the
+   ItdbDiffKeyFunc. Each track taking part in a change is copied into
+   a DiffEntry together with the dbid and key of its old values, and
+   the position of the old track among the tracks of its database
+   with the same key, so that the change set doesn't refer to either
+   database and can be applied to a third one, where the tracks are
+   looked up the same way. Only the changes are copied: the size of an Itdb_Diff depends
+   on the number of changes, not on the size of the databases. */
+
+/* The track fields compared and copied. A size of 0 denotes a
+   string. There must not be more than 64 of them (one bit each in
+   DiffEntry.fields). Left out are the fields private to a database
+   (id, dbid, transferred, recent play/skip counts) and the
+   artwork. */
+typedef struct
+{
+    glong offset;
+    gsize size;
+} DiffField;
+
+#define DIFF_STRING(f) { G_STRUCT_OFFSET (Itdb_Track, f), 0 }
+#define DIFF_SCALAR(f) { G_STRUCT_OFFSET (Itdb_Track, f), \
+			 sizeof (((Itdb_Track *)NULL)->f) }
+
+static const DiffField diff_fields[] = {
+    DIFF_STRING (title),
+    DIFF_STRING (ipod_path),
+    DIFF_STRING (album),
+    DIFF_STRING (artist),
+    DIFF_STRING (genre),
+    DIFF_STRING (filetype),
+    DIFF_STRING (comment),
+    DIFF_STRING (category),
+    DIFF_STRING (composer),
+    DIFF_STRING (grouping),
+    DIFF_STRING (description),
+    DIFF_STRING (podcasturl),
+    DIFF_STRING (podcastrss),
+    DIFF_STRING (subtitle),
+    DIFF_STRING (tvshow),
+    DIFF_STRING (tvepisode),
+    DIFF_STRING (tvnetwork),
+    DIFF_STRING (albumartist),
+    DIFF_STRING (keywords),
+    DIFF_STRING (sort_artist),
+    DIFF_STRING (sort_title),
+    DIFF_STRING (sort_album),
+    DIFF_STRING (sort_albumartist),
+    DIFF_STRING (sort_composer),
+    DIFF_STRING (sort_tvshow),
+    DIFF_SCALAR (size),
+    DIFF_SCALAR (tracklen),
+    DIFF_SCALAR (cd_nr),
+    DIFF_SCALAR (cds),
+    DIFF_SCALAR (track_nr),
+    DIFF_SCALAR (tracks),
+    DIFF_SCALAR (bitrate),
+    DIFF_SCALAR (samplerate),
+    DIFF_SCALAR (year),
+    DIFF_SCALAR (volume),
+    DIFF_SCALAR (soundcheck),
+    DIFF_SCALAR (time_added),
+    DIFF_SCALAR (time_modified),
+    DIFF_SCALAR (time_played),
+    DIFF_SCALAR (time_released),
+    DIFF_SCALAR (bookmark_time),
+    DIFF_SCALAR (rating),
+    DIFF_SCALAR (playcount),
+    DIFF_SCALAR (skipcount),
+    DIFF_SCALAR (last_skipped),
+    DIFF_SCALAR (BPM),
+    DIFF_SCALAR (compilation),
+    DIFF_SCALAR (starttime),
+    DIFF_SCALAR (stoptime),
+    DIFF_SCALAR (checked),
+    DIFF_SCALAR (skip_when_shuffling),
+    DIFF_SCALAR (remember_playback_position),
+    DIFF_SCALAR (mark_unplayed),
+    DIFF_SCALAR (pregap),
+    DIFF_SCALAR (postgap),
+    DIFF_SCALAR (samplecount),
+    DIFF_SCALAR (gapless_data),
+    DIFF_SCALAR (mediatype),
+    DIFF_SCALAR (season_nr),
+    DIFF_SCALAR (episode_nr)
+};
+
+typedef struct
+{
+    Itdb_Track *track;  /* copy owned by the diff (new values)      */
+    guint64 dbid;       /* dbid and key of the old values, used to  */
+    gchar *key;         /* find the track in other databases        */
+    guint key_index;    /* tracks with @key before the old one      */
+    guint64 fields;     /* bits of diff_fields changed (modified)   */
+} DiffEntry;
+
+struct _Itdb_Diff
+{
+    ItdbDiffKeyFunc key_func;
+    gpointer user_data;
+    GPtrArray *added;        /* (DiffEntry *) only in @to               */
+    GPtrArray *removed;      /* (DiffEntry *) only in @from             */
+    GPtrArray *modified;     /* (DiffEntry *) fields changed            */
+    GArray *members;         /* (Itdb_DiffMember)                       */
+    GHashTable *entries;     /* copy -> DiffEntry, owns the entries     */
+    GPtrArray *tracks[3];    /* copies handed out by
+				itdb_diff_get_tracks(), NULL until
+				asked for                               */
+};
+
+
+/* Returns a table of the tracks of @itdb with a dbid, keyed by a
+   pointer to their dbid. The first track wins if dbids are not
+   unique. */
+static GHashTable *diff_dbid_index (Itdb_iTunesDB *itdb)
+{
+    GHashTable *index = g_hash_table_new (itdb_dbid_hash, itdb_dbid_equal);
+    GList *gl;
+
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	if (track->dbid && !g_hash_table_lookup (index, &track->dbid))
+	    g_hash_table_insert (index, &track->dbid, track);
+    }
+    return index;
+}
+
+static void diff_queue_free (gpointer queue)
+{
+    g_queue_free (queue);
+}
+
+static void diff_array_free (gpointer array)
+{
+    g_ptr_array_free (array, TRUE);
+}
+
+static gboolean diff_strings_equal (const gchar *str1, const gchar *str2)
+{
+    /* missing strings and empty strings are the same */
+    return strcmp (str1 ? str1 : "", str2 ? str2 : "") == 0;
+}
+
+/* Returns the bits of the fields differing between @tr1 and @tr2 */
+static guint64 diff_compare (const Itdb_Track *tr1, const Itdb_Track *tr2)
+{
+    guint64 fields = 0;
+    guint i;
+
+    for (i=0; i<G_N_ELEMENTS (diff_fields); ++i)
+    {
+	const guint8 *p1 = (const guint8 *)tr1 + diff_fields[i].offset;
+	const guint8 *p2 = (const guint8 *)tr2 + diff_fields[i].offset;
+	gboolean equal;
+
+	if (diff_fields[i].size == 0)
+	    equal = diff_strings_equal (*(gchar * const *)p1,
+					*(gchar * const *)p2);
+	else
+	    equal = (memcmp (p1, p2, diff_fields[i].size) == 0);
+	if (!equal)
+	    fields |= ((guint64)1) << i;
+    }
+    return fields;
+}
+
+/* Copies the fields selected by @fields from @src to @dest */
+static void diff_copy_fields (Itdb_Track *dest, const Itdb_Track *src,
+			      guint64 fields)
+{
+    guint i;
+
+    for (i=0; i<G_N_ELEMENTS (diff_fields); ++i)
+    {
+	guint8 *p1 = (guint8 *)dest + diff_fields[i].offset;
+	const guint8 *p2 = (const guint8 *)src + diff_fields[i].offset;
+
+	if (!(fields & (((guint64)1) << i)))
+	    continue;
+	if (diff_fields[i].size == 0)
+	{
+	    g_free (*(gchar **)p1);
+	    *(gchar **)p1 = g_strdup (*(gchar * const *)p2);
+	}
+	else
+	{
+	    memcpy (p1, p2, diff_fields[i].size);
+	}
+    }
+}
+
+/* Returns the entry for @track, creating it if necessary. @old is the
+   track @track was paired with in the old database (or @track itself
+   if it has none): it's looked for in other databases. */
+static DiffEntry *diff_entry (Itdb_Diff *diff, GHashTable *by_source,
+			      Itdb_Track *track, Itdb_Track *old)
+{
+    DiffEntry *entry = g_hash_table_lookup (by_source, track);
+
+    if (!entry)
+    {
+	entry = g_new0 (DiffEntry, 1);
+	entry->track = itdb_track_duplicate (track);
+	entry->dbid = old->dbid;
+	entry->key = diff->key_func (old, diff->user_data);
+	g_hash_table_insert (by_source, track, entry);
+	g_hash_table_insert (diff->entries, entry->track, entry);
+    }
+    return entry;
+}
+
+static void diff_entry_free (DiffEntry *entry)
+{
+    itdb_track_free (entry->track);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+/* Sets the key_index of the entries whose old values are tracks of
+   @itdb. @from is TRUE for the old database: the entries of its
+   tracks are found under their new partners, if they have one. In
+   the new database only the unpaired tracks (the ones added) are the
+   old values of an entry. */
+static void diff_index_keys (Itdb_Diff *diff, GHashTable *by_source,
+			     GHashTable *pairs, Itdb_iTunesDB *itdb,
+			     gboolean from)
+{
+    GHashTable *counts = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, NULL);
+    GList *gl;
+
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	Itdb_Track *partner = g_hash_table_lookup (pairs, track);
+	DiffEntry *entry = NULL;
+	guint count;
+	gchar *key;
+
+	if (from)
+	    entry = g_hash_table_lookup (by_source,
+					 partner ? partner : track);
+	else if (!partner)
+	    entry = g_hash_table_lookup (by_source, track);
+	key = diff->key_func (track, diff->user_data);
+	if (!key)
+	    continue;
+	count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, key));
+	if (entry)
+	    entry->key_index = count;
+	/* frees @key if it's already there */
+	g_hash_table_insert (counts, key, GUINT_TO_POINTER (count+1));
+    }
+    g_hash_table_destroy (counts);
+}
+
+/* Pairs the playlists of @from and @to with the same id or, failing
+   that, the same name. The master playlist and smart playlists are
+   left out: their members follow from the tracks or the rules. */
+static GList *diff_pair_playlists (Itdb_iTunesDB *from, Itdb_iTunesDB *to)
+{
+    GHashTable *by_id = g_hash_table_new (itdb_dbid_hash, itdb_dbid_equal);
+    GHashTable *by_name = g_hash_table_new (g_str_hash, g_str_equal);
+    GList *pairs = NULL;
+    GList *gl;
+
+    for (gl=from->playlists; gl; gl=gl->next)
+    {
+	Itdb_Playlist *pl = gl->data;
+	if (itdb_playlist_is_mpl (pl) || pl->is_spl)
+	    continue;
+	if (!g_hash_table_lookup (by_id, &pl->id))
+	    g_hash_table_insert (by_id, &pl->id, pl);
+	if (pl->name && !g_hash_table_lookup (by_name, pl->name))
+	    g_hash_table_insert (by_name, pl->name, pl);
+    }
+    for (gl=to->playlists; gl; gl=gl->next)
+    {
+	Itdb_Playlist *pl = gl->data;
+	Itdb_Playlist *old;
+
+	if (itdb_playlist_is_mpl (pl) || pl->is_spl)
+	    continue;
+	old = g_hash_table_lookup (by_id, &pl->id);
+	if (!old && pl->name)
+	    old = g_hash_table_lookup (by_name, pl->name);
+	if (!old)
+	    continue;
+	/* each playlist of @from is paired at most once */
+	g_hash_table_remove (by_id, &old->id);
+	if (old->name)
+	    g_hash_table_remove (by_name, old->name);
+	pairs = g_list_prepend (pairs, pl);
+	pairs = g_list_prepend (pairs, old);
+    }
+    g_hash_table_destroy (by_id);
+    g_hash_table_destroy (by_name);
+    return pairs;  /* old, new, old, new... */
+}
+
+static void diff_add_member (Itdb_Diff *diff, Itdb_Playlist *pl,
+			     DiffEntry *entry, gboolean added)
+{
+    Itdb_DiffMember member;
+
+    member.playlist_id = pl->id;
+    member.playlist_name = g_strdup (pl->name);
+    member.track = entry->track;
+    member.added = added;
+    g_array_append_val (diff->members, member);
+}
+
+/* Records the membership changes between @old and @pl. @pairs maps
+   the tracks of the old database to their partners in the new one. */
+static void diff_playlist (Itdb_Diff *diff, GHashTable *by_source,
+			   GHashTable *pairs, Itdb_Playlist *old,
+			   Itdb_Playlist *pl)
+{
+    GHashTable *old_members = g_hash_table_new (g_direct_hash,
+						g_direct_equal);
+    GHashTable *new_members = g_hash_table_new (g_direct_hash,
+						g_direct_equal);
+    GList *gl;
+
+    /* the old members under the name of their new partners */
+    for (gl=old->members; gl; gl=gl->next)
+    {
+	Itdb_Track *track = g_hash_table_lookup (pairs, gl->data);
+	if (track)
+	    g_hash_table_insert (old_members, track, gl->data);
+    }
+    for (gl=pl->members; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	Itdb_Track *old_track;
+
+	if (g_hash_table_lookup (new_members, track))
+	    continue;
+	g_hash_table_insert (new_members, track, track);
+	if (g_hash_table_lookup (old_members, track))
+	    continue;
+	/* pairs also maps the new tracks to their old partners */
+	old_track = g_hash_table_lookup (pairs, track);
+	if (!old_track)
+	    old_track = track;
+	diff_add_member (diff, pl,
+			 diff_entry (diff, by_source, track, old_track),
+			 TRUE);
+    }
+    for (gl=old->members; gl; gl=gl->next)
+    {
+	Itdb_Track *track = g_hash_table_lookup (pairs, gl->data);
+
+	/* members whose track was removed go with the track */
+	if (!track || g_hash_table_lookup (new_members, track))
+	    continue;
+	/* only report each removal once */
+	g_hash_table_insert (new_members, track, track);
+	diff_add_member (diff, pl,
+			 diff_entry (diff, by_source, track, gl->data),
+			 FALSE);
+    }
+    g_hash_table_destroy (old_members);
+    g_hash_table_destroy (new_members);
+}
+
+/**
+ * itdb_diff_key_default:
+ * @track: an #Itdb_Track
+ * @user_data: not used
+ *
+ * The #ItdbDiffKeyFunc used by itdb_diff_new() if none is given:
+ * tracks with the same title, artist, album, CD number and track
+ * number are considered the same.
+ *
+ * Return value: a newly allocated key, or NULL if @track has no title
+ **/
+gchar *itdb_diff_key_default (Itdb_Track *track, gpointer user_data)
+{
+    g_return_val_if_fail (track, NULL);
+
+    if (!track->title || !*track->title)
+	return NULL;
+    return g_strdup_printf ("%s\037%s\037%s\037%d\037%d",
+			    track->title,
+			    track->artist ? track->artist : "",
+			    track->album ? track->album : "",
+			    track->cd_nr, track->track_nr);
+}
+
+/**
+ * itdb_diff_new:
+ * @from: the old #Itdb_iTunesDB, e.g. a snapshot or the database last
+ * synced
+ * @to: the new #Itdb_iTunesDB
+ * @key_func: function returning the key of tracks to pair when they
+ * don't have the same dbid, or NULL for itdb_diff_key_default()
+ * @user_data: user data passed to @key_func
+ *
+ * Computes the changes turning @from into @to. Tracks are paired by
+ * their dbid and the tracks left over by the key returned by
+ * @key_func. Tracks of @to without a partner are added, tracks of
+ * @from without a partner are removed, and pairs differing in any of
+ * the metadata fields (title, artist, rating, playcount, ipod_path
+ * ...) are modified.
+ *
+ * Playlists other than the master playlist and smart playlists are
+ * paired by their id or name, and for each pair the tracks added to
+ * or removed from the playlist are recorded. Playlists only present
+ * in one of the databases and changes of the order of the members are
+ * not part of the change set.
+ *
+ * Both passes use hash tables, so the time needed grows linearly with
+ * the size of the databases. @from and @to are not changed and may be
+ * freed while the change set is still in use.
+ *
+ * Return value: a new #Itdb_Diff to be freed with itdb_diff_free()
+ **/
+Itdb_Diff *itdb_diff_new (Itdb_iTunesDB *from, Itdb_iTunesDB *to,
+			  ItdbDiffKeyFunc key_func, gpointer user_data)
+{
+    Itdb_Diff *diff;
+    GHashTable *by_dbid, *by_key, *pairs, *by_source;
+    GList *unpaired = NULL;
+    GList *gl, *playlists;
+
+    g_return_val_if_fail (from, NULL);
+    g_return_val_if_fail (to, NULL);
+
+    diff = g_new0 (Itdb_Diff, 1);
+    diff->key_func = key_func ? key_func : itdb_diff_key_default;
+    diff->user_data = user_data;
+    diff->added = g_ptr_array_new ();
+    diff->removed = g_ptr_array_new ();
+    diff->modified = g_ptr_array_new ();
+    diff->members = g_array_new (FALSE, FALSE, sizeof (Itdb_DiffMember));
+    diff->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					   NULL,
+					   (GDestroyNotify)diff_entry_free);
+
+    /* old -> new and new -> old, for the tracks of both databases */
+    pairs = g_hash_table_new (g_direct_hash, g_direct_equal);
+    /* track of @from or @to -> DiffEntry */
+    by_source = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    /* first pass: by dbid */
+    by_dbid = diff_dbid_index (from);
+    for (gl=to->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	Itdb_Track *old = NULL;
+
+	if (track->dbid)
+	    old = g_hash_table_lookup (by_dbid, &track->dbid);
+	if (old && !g_hash_table_lookup (pairs, old))
+	{
+	    g_hash_table_insert (pairs, old, track);
+	    g_hash_table_insert (pairs, track, old);
+	}
+	else
+	{
+	    unpaired = g_list_prepend (unpaired, track);
+	}
+    }
+    g_hash_table_destroy (by_dbid);
+
+    /* second pass: the tracks left over by key, paired in the order
+       they appear in their databases */
+    by_key = g_hash_table_new_full (g_str_hash, g_str_equal,
+				    g_free, diff_queue_free);
+    if (unpaired)
+    {
+	for (gl=from->tracks; gl; gl=gl->next)
+	{
+	    Itdb_Track *old = gl->data;
+	    GQueue *queue;
+	    gchar *key;
+
+	    if (g_hash_table_lookup (pairs, old))
+		continue;
+	    key = diff->key_func (old, diff->user_data);
+	    if (!key)
+		continue;
+	    queue = g_hash_table_lookup (by_key, key);
+	    if (queue)
+	    {
+		g_free (key);
+	    }
+	    else
+	    {
+		queue = g_queue_new ();
+		g_hash_table_insert (by_key, key, queue);
+	    }
+	    g_queue_push_tail (queue, old);
+	}
+    }
+    unpaired = g_list_reverse (unpaired);
+    for (gl=unpaired; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	gchar *key = diff->key_func (track, diff->user_data);
+	GQueue *queue = key ? g_hash_table_lookup (by_key, key) : NULL;
+	Itdb_Track *old = queue ? g_queue_pop_head (queue) : NULL;
+
+	g_free (key);
+	if (old)
+	{
+	    g_hash_table_insert (pairs, old, track);
+	    g_hash_table_insert (pairs, track, old);
+	}
+	else
+	{
+	    DiffEntry *entry = diff_entry (diff, by_source, track, track);
+	    g_ptr_array_add (diff->added, entry);
+	}
+    }
+    g_list_free (unpaired);
+    g_hash_table_destroy (by_key);
+
+    for (gl=from->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *old = gl->data;
+	Itdb_Track *track = g_hash_table_lookup (pairs, old);
+
+	if (!track)
+	{
+	    DiffEntry *entry = diff_entry (diff, by_source, old, old);
+	    g_ptr_array_add (diff->removed, entry);
+	}
+	else if (track != old)
+	{
+	    guint64 fields = diff_compare (old, track);
+	    if (fields)
+	    {
+		DiffEntry *entry = diff_entry (diff, by_source, track, old);
+		entry->fields = fields;
+		g_ptr_array_add (diff->modified, entry);
+	    }
+	}
+    }
+
+    playlists = diff_pair_playlists (from, to);
+    for (gl=playlists; gl; gl=gl->next->next)
+	diff_playlist (diff, by_source, pairs, gl->data, gl->next->data);
+    g_list_free (playlists);
+
+    /* all entries not added have their old values in @from */
+    if (g_hash_table_size (diff->entries) > diff->added->len)
+	diff_index_keys (diff, by_source, pairs, from, TRUE);
+    if (diff->added->len != 0)
+	diff_index_keys (diff, by_source, pairs, to, FALSE);
+
+    g_hash_table_destroy (pairs);
+    g_hash_table_destroy (by_source);
+    return diff;
+}
+
+/**
+ * itdb_diff_free:
+ * @diff: an #Itdb_Diff
+ *
+ * Frees @diff together with its copies of the tracks.
+ **/
+void itdb_diff_free (Itdb_Diff *diff)
+{
+    guint i;
+
+    g_return_if_fail (diff);
+
+    for (i=0; i<diff->members->len; ++i)
+	g_free (g_array_index (diff->members, Itdb_DiffMember, i).playlist_name);
+    g_array_free (diff->members, TRUE);
+    g_ptr_array_free (diff->added, TRUE);
+    g_ptr_array_free (diff->removed, TRUE);
+    g_ptr_array_free (diff->modified, TRUE);
+    for (i=0; i<G_N_ELEMENTS (diff->tracks); ++i)
+	if (diff->tracks[i])
+	    g_ptr_array_free (diff->tracks[i], TRUE);
+    g_hash_table_destroy (diff->entries);
+    g_free (diff);
+}
+
+/**
+ * itdb_diff_get_tracks:
+ * @diff: an #Itdb_Diff
+ * @type: the kind of change
+ *
+ * Retrieves the tracks added, removed or modified. The tracks are
+ * copies owned by @diff and not part of any database; modified tracks
+ * carry the new values.
+ *
+ * Return value: a #GPtrArray of #Itdb_Track owned by @diff
+ **/
+GPtrArray *itdb_diff_get_tracks (Itdb_Diff *diff, ItdbDiffType type)
+{
+    GPtrArray *entries;
+    guint i;
+
+    g_return_val_if_fail (diff, NULL);
+
+    switch (type)
+    {
+    case ITDB_DIFF_ADDED:
+	entries = diff->added;
+	break;
+    case ITDB_DIFF_REMOVED:
+	entries = diff->removed;
+	break;
+    case ITDB_DIFF_MODIFIED:
+	entries = diff->modified;
+	break;
+    default:
+	g_return_val_if_reached (NULL);
+    }
+
+    if (!diff->tracks[type])
+    {
+	diff->tracks[type] = g_ptr_array_sized_new (entries->len);
+	for (i=0; i<entries->len; ++i)
+	{
+	    DiffEntry *entry = g_ptr_array_index (entries, i);
+	    g_ptr_array_add (diff->tracks[type], entry->track);
+	}
+    }
+    return diff->tracks[type];
+}
+
+/**
+ * itdb_diff_get_members:
+ * @diff: an #Itdb_Diff
+ *
+ * Retrieves the tracks added to or removed from playlists, in the
+ * order of the playlists of the new database. The tracks are copies
+ * owned by @diff.
+ *
+ * Return value: a #GArray of #Itdb_DiffMember owned by @diff
+ **/
+GArray *itdb_diff_get_members (Itdb_Diff *diff)
+{
+    g_return_val_if_fail (diff, NULL);
+
+    return diff->members;
+}
+
+/**
+ * itdb_diff_is_empty:
+ * @diff: an #Itdb_Diff
+ *
+ * Return value: TRUE if the two databases compared had no differences
+ **/
+gboolean itdb_diff_is_empty (Itdb_Diff *diff)
+{
+    g_return_val_if_fail (diff, TRUE);
+
+    return diff->added->len == 0 && diff->removed->len == 0 &&
+	diff->modified->len == 0 && diff->members->len == 0;
+}
+
+
+/* Lookup of the tracks of the database a change set is applied to */
+typedef struct
+{
+    GHashTable *by_dbid;
+    GHashTable *by_key;   /* key -> (GPtrArray *) tracks in database
+			     order, NULL if all tracks are found by
+			     dbid                                    */
+    GHashTable *added;    /* DiffEntry -> track added              */
+    gboolean need_keys;
+} DiffTarget;
+
+static void diff_target_check (gpointer copy, DiffEntry *entry,
+			       DiffTarget *target)
+{
+    if (!entry->dbid ||
+	!g_hash_table_lookup (target->by_dbid, &entry->dbid))
+	target->need_keys = TRUE;
+}
+
+/* Indexes the tracks of @itdb by dbid and, if some tracks of the
+   change set can't be found that way, by key. Tracks with the same
+   key are kept in the order of @itdb, so that they are paired with
+   the entries in order as in itdb_diff_new(). This is done before
+   @itdb is changed so that the keys are those of the old values. */
+static void diff_target_init (DiffTarget *target, Itdb_Diff *diff,
+			      Itdb_iTunesDB *itdb)
+{
+    target->by_dbid = diff_dbid_index (itdb);
+    target->by_key = NULL;
+    target->added = g_hash_table_new (g_direct_hash, g_direct_equal);
+    target->need_keys = FALSE;
+    g_hash_table_foreach (diff->entries, (GHFunc)diff_target_check,
+			  target);
+    if (target->need_keys)
+    {
+	GList *gl;
+
+	target->by_key = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, diff_array_free);
+	for (gl=itdb->tracks; gl; gl=gl->next)
+	{
+	    gchar *key = diff->key_func (gl->data, diff->user_data);
+	    GPtrArray *tracks;
+
+	    if (!key)
+		continue;
+	    tracks = g_hash_table_lookup (target->by_key, key);
+	    if (tracks)
+	    {
+		g_free (key);
+	    }
+	    else
+	    {
+		tracks = g_ptr_array_new ();
+		g_hash_table_insert (target->by_key, key, tracks);
+	    }
+	    g_ptr_array_add (tracks, gl->data);
+	}
+    }
+}
+
+static void diff_target_free (DiffTarget *target)
+{
+    g_hash_table_destroy (target->added);
+    g_hash_table_destroy (target->by_dbid);
+    if (target->by_key)
+	g_hash_table_destroy (target->by_key);
+}
+
+static Itdb_Track *diff_target_lookup (DiffTarget *target, DiffEntry *entry)
+{
+    Itdb_Track *track = g_hash_table_lookup (target->added, entry);
+
+    if (!track && entry->dbid)
+	track = g_hash_table_lookup (target->by_dbid, &entry->dbid);
+    if (!track && entry->key && target->by_key)
+    {
+	GPtrArray *tracks = g_hash_table_lookup (target->by_key, entry->key);
+	if (tracks && (entry->key_index < tracks->len))
+	    track = g_ptr_array_index (tracks, entry->key_index);
+    }
+    return track;
+}
+
+/* Returns the members of @pl as a set, creating it if necessary */
+static GHashTable *diff_target_members (GHashTable *sets, Itdb_Playlist *pl)
+{
+    GHashTable *members = g_hash_table_lookup (sets, pl);
+
+    if (!members)
+    {
+	GList *gl;
+
+	members = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (gl=pl->members; gl; gl=gl->next)
+	    g_hash_table_insert (members, gl->data, gl->data);
+	g_hash_table_insert (sets, pl, members);
+    }
+    return members;
+}
+
+/**
+ * itdb_diff_apply:
+ * @diff: an #Itdb_Diff
+ * @itdb: the #Itdb_iTunesDB to change
+ *
+ * Applies the changes of @diff to @itdb, which may be one of the two
+ * databases compared or a third one (e.g. the database on the iPod
+ * after comparing two states of the host library). Tracks of @itdb
+ * are found by dbid or by the key of @diff, as for itdb_diff_new():
+ * the n-th track with a key in @itdb stands for the n-th track with
+ * that key in the database compared.
+ *
+ * Added tracks are copied and appended to @itdb and its master
+ * playlist, unless @itdb already contains them. Removed tracks are
+ * removed from @itdb and all its playlists and freed. For modified
+ * tracks only the fields that changed are copied, so that other
+ * changes made to the same tracks in @itdb are kept. Playlist
+ * members are added to or removed from the playlist of @itdb with the
+ * same id or, failing that, the same name.
+ *
+ * Tracks and playlists not found in @itdb are skipped. The changes
+ * are applied as one #Itdb_Batch, so no batch must be open on @itdb.
+ *
+ * Return value: the number of changes that were skipped
+ **/
+guint itdb_diff_apply (Itdb_Diff *diff, Itdb_iTunesDB *itdb)
+{
+    DiffTarget target;
+    Itdb_Batch *batch;
+    Itdb_Playlist *mpl;
+    GHashTable *pl_by_id, *pl_by_name, *pl_members;
+    gboolean modified = FALSE;
+    guint skipped = 0;
+    GList *gl;
+    guint i;
+
+    g_return_val_if_fail (diff, 0);
+    g_return_val_if_fail (itdb, 0);
+
+    diff_target_init (&target, diff, itdb);
+    batch = itdb_batch_begin (itdb);
+    mpl = itdb_playlist_mpl (itdb);
+
+    for (i=0; i<diff->modified->len; ++i)
+    {
+	DiffEntry *entry = g_ptr_array_index (diff->modified, i);
+	Itdb_Track *track = diff_target_lookup (&target, entry);
+
+	if (!track)
+	{
+	    ++skipped;
+	    continue;
+	}
+	itdb_track_prepare_change (track);
+	diff_copy_fields (track, entry->track, entry->fields);
+	modified = TRUE;
+    }
+
+    for (i=0; i<diff->removed->len; ++i)
+    {
+	DiffEntry *entry = g_ptr_array_index (diff->removed, i);
+	Itdb_Track *track = diff_target_lookup (&target, entry);
+
+	if (track)
+	    itdb_batch_track_remove (batch, track);
+	else
+	    ++skipped;
+    }
+
+    for (i=0; i<diff->added->len; ++i)
+    {
+	DiffEntry *entry = g_ptr_array_index (diff->added, i);
+	Itdb_Track *track = diff_target_lookup (&target, entry);
+
+	if (!track)
+	{
+	    track = itdb_track_duplicate (entry->track);
+	    itdb_batch_track_add (batch, track);
+	    if (mpl)
+		itdb_batch_playlist_add_track (batch, mpl, track);
+	}
+	g_hash_table_insert (target.added, entry, track);
+    }
+
+    pl_by_id = g_hash_table_new (itdb_dbid_hash, itdb_dbid_equal);
+    pl_by_name = g_hash_table_new (g_str_hash, g_str_equal);
+    pl_members = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					NULL,
+					(GDestroyNotify)g_hash_table_destroy);
+    if (diff->members->len != 0)
+    {
+	for (gl=itdb->playlists; gl; gl=gl->next)
+	{
+	    Itdb_Playlist *pl = gl->data;
+	    if (itdb_playlist_is_mpl (pl) || pl->is_spl)
+		continue;
+	    if (!g_hash_table_lookup (pl_by_id, &pl->id))
+		g_hash_table_insert (pl_by_id, &pl->id, pl);
+	    if (pl->name && !g_hash_table_lookup (pl_by_name, pl->name))
+		g_hash_table_insert (pl_by_name, pl->name, pl);
+	}
+    }
+    for (i=0; i<diff->members->len; ++i)
+    {
+	Itdb_DiffMember *member = &g_array_index (diff->members,
+						  Itdb_DiffMember, i);
+	DiffEntry *entry = g_hash_table_lookup (diff->entries,
+						member->track);
+	Itdb_Playlist *pl = g_hash_table_lookup (pl_by_id,
+						 &member->playlist_id);
+	Itdb_Track *track;
+	GHashTable *members;
+
+	if (!pl && member->playlist_name)
+	    pl = g_hash_table_lookup (pl_by_name, member->playlist_name);
+	track = diff_target_lookup (&target, entry);
+	if (!pl || !track)
+	{
+	    ++skipped;
+	    continue;
+	}
+	members = diff_target_members (pl_members, pl);
+	if (member->added && !g_hash_table_lookup (members, track))
+	{
+	    itdb_batch_playlist_add_track (batch, pl, track);
+	    g_hash_table_insert (members, track, track);
+	}
+	else if (!member->added && g_hash_table_lookup (members, track))
+	{
+	    itdb_batch_playlist_remove_track (batch, pl, track);
+	    g_hash_table_remove (members, track);
+	}
+    }
+    g_hash_table_destroy (pl_members);
+    g_hash_table_destroy (pl_by_name);
+    g_hash_table_destroy (pl_by_id);
+
+    itdb_batch_commit (batch);
+    /* cheaper than updating the indexes track by track */
+    if (modified)
+	itdb_query_invalidate (itdb);
+
+    diff_target_free (&target);
+    return skipped;
+}
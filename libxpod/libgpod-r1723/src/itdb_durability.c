@@ -0,0 +1,418 @@
+/*
+|  Making the files written by libgpod durable without flushing every
+|  mounted file system, and replacing them atomically.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include "itdb_device.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gi18n-lib.h>
+
+/* The writers of libgpod record the files they create, change or
+   remove with itdb_durability_add_file(). itdb_flush() flushes
+   exactly those files and their directories (or the whole file system
+   of the iPod) and forgets about them. */
+
+
+/**
+ * itdb_set_durability:
+ * @itdb: an #Itdb_iTunesDB
+ * @durability: an #ItdbDurability
+ *
+ * Sets how itdb_write(), itdb_write_file(), itdb_shuffle_write() and
+ * itdb_shuffle_write_file() make sure their files reach the disk
+ * before returning. The default is %ITDB_DURABILITY_SYNC which calls
+ * sync() and thereby also flushes track files copied to the iPod
+ * by the application. Use %ITDB_DURABILITY_FSYNC or
+ * %ITDB_DURABILITY_SYNCFS if the application flushes its own files,
+ * or %ITDB_DURABILITY_NONE together with itdb_flush() to flush once
+ * after several writes.
+ **/
+void itdb_set_durability (Itdb_iTunesDB *itdb, ItdbDurability durability)
+{
+    g_return_if_fail (itdb);
+    g_return_if_fail (durability <= ITDB_DURABILITY_NONE);
+
+    itdb_get_private (itdb)->durability = durability;
+}
+
+/**
+ * itdb_set_backup:
+ * @itdb: an #Itdb_iTunesDB
+ * @backup: TRUE to keep the previous files
+ *
+ * The iTunesDB, iTunesSD and ArtworkDB are never overwritten in place
+ * (unless itdb_set_shuffle_in_place() is used for the iTunesSD) but
+ * replaced atomically by a new file. If @backup is TRUE, the previous
+ * generation of each file is kept with ".bak" appended to its
+ * name. Off by default.
+ **/
+void itdb_set_backup (Itdb_iTunesDB *itdb, gboolean backup)
+{
+    g_return_if_fail (itdb);
+
+    itdb_get_private (itdb)->backup = backup;
+}
+
+/**
+ * itdb_get_backup:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Return value: TRUE if previous files are kept, see itdb_set_backup()
+ **/
+gboolean itdb_get_backup (Itdb_iTunesDB *itdb)
+{
+    g_return_val_if_fail (itdb, FALSE);
+
+    return itdb_get_private (itdb)->backup;
+}
+
+/**
+ * itdb_get_durability:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Return value: the #ItdbDurability set with itdb_set_durability()
+ **/
+ItdbDurability itdb_get_durability (Itdb_iTunesDB *itdb)
+{
+    g_return_val_if_fail (itdb, ITDB_DURABILITY_SYNC);
+
+    return itdb_get_private (itdb)->durability;
+}
+
+/* Remembers that @path (a file or a directory) was created, changed
+   or removed while writing @itdb so that itdb_flush() makes the
+   change durable. */
+void itdb_durability_add_file (Itdb_iTunesDB *itdb, const gchar *path)
+{
+    ItdbPrivate *priv;
+
+    g_return_if_fail (itdb);
+    g_return_if_fail (path);
+
+    priv = itdb_get_private (itdb);
+    if (!priv->unflushed)
+	priv->unflushed = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 g_free, NULL);
+    if (!g_hash_table_lookup (priv->unflushed, path))
+    {
+	gchar *key = g_strdup (path);
+	g_hash_table_insert (priv->unflushed, key, key);
+    }
+}
+
+/* fsync() that also flushes the drive's cache where needed */
+static int durability_fsync_fd (int fd)
+{
+#ifdef F_FULLFSYNC
+    /* fsync() doesn't flush the drive's cache on Mac OS X */
+    if (fcntl (fd, F_FULLFSYNC) != -1)
+	return 0;
+#endif
+    return fsync (fd);
+}
+
+/* Flushes @path to the disk. Files that no longer exist are fine:
+   their removal is made durable by flushing the directory. */
+static gboolean durability_fsync (const gchar *path, GError **error)
+{
+    int fd, result;
+
+    fd = open (path, O_RDONLY);
+    if (fd == -1)
+    {
+	if (errno == ENOENT)
+	    return TRUE;
+	g_set_error (error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Error opening '%s' for flushing (%s)."),
+		     path, g_strerror (errno));
+	return FALSE;
+    }
+    result = durability_fsync_fd (fd);
+    /* some file systems can't fsync directories */
+    if ((result == -1) && (errno != EINVAL) && (errno != ENOTSUP))
+    {
+	g_set_error (error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Error flushing '%s' (%s)."),
+		     path, g_strerror (errno));
+	close (fd);
+	return FALSE;
+    }
+    close (fd);
+    return TRUE;
+}
+
+typedef struct
+{
+    GHashTable *dirs;
+    gboolean result;
+    GError **error;
+} FlushFiles;
+
+static void flush_file (gchar *path, gpointer value, FlushFiles *ff)
+{
+    gchar *dir;
+
+    if (!ff->result)
+	return;
+    ff->result = durability_fsync (path, ff->error);
+
+    dir = g_path_get_dirname (path);
+    if (!g_hash_table_lookup (ff->dirs, dir))
+	g_hash_table_insert (ff->dirs, dir, dir);
+    else
+	g_free (dir);
+}
+
+static void flush_dir (gchar *dir, gpointer value, FlushFiles *ff)
+{
+    if (ff->result)
+	ff->result = durability_fsync (dir, ff->error);
+}
+
+static gboolean durability_fsync_files (GHashTable *files, GError **error)
+{
+    FlushFiles ff;
+
+    ff.dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+				     g_free, NULL);
+    ff.result = TRUE;
+    ff.error = error;
+    /* files first: their directory entries must point to flushed data */
+    g_hash_table_foreach (files, (GHFunc)flush_file, &ff);
+    g_hash_table_foreach (ff.dirs, (GHFunc)flush_dir, &ff);
+    g_hash_table_destroy (ff.dirs);
+    return ff.result;
+}
+
+#ifdef HAVE_SYNCFS
+static gboolean durability_syncfs (const gchar *mountpoint, GError **error)
+{
+    int fd = open (mountpoint, O_RDONLY);
+
+    if ((fd == -1) || (syncfs (fd) == -1))
+    {
+	g_set_error (error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Error flushing the file system at '%s' (%s)."),
+		     mountpoint, g_strerror (errno));
+	if (fd != -1)
+	    close (fd);
+	return FALSE;
+    }
+    close (fd);
+    return TRUE;
+}
+#endif
+
+/**
+ * itdb_flush:
+ * @itdb: an #Itdb_iTunesDB
+ * @durability: how to flush
+ * @error: return location for a #GError or NULL
+ *
+ * Makes sure the files written for @itdb since the last flush are on
+ * the disk. This is done automatically at the end of itdb_write() and
+ * friends according to itdb_set_durability(). Call it yourself after
+ * writing with %ITDB_DURABILITY_NONE.
+ *
+ * %ITDB_DURABILITY_FSYNC flushes the iTunesDB, iTunesSD, ArtworkDB,
+ * .ithmb and SysInfo files written as well as their directories.
+ * %ITDB_DURABILITY_SYNCFS flushes the file system of the iPod only
+ * where syncfs() is available and falls back to
+ * %ITDB_DURABILITY_FSYNC otherwise. %ITDB_DURABILITY_SYNC calls
+ * sync(). %ITDB_DURABILITY_NONE only forgets about the files written.
+ * If flushing fails, the files are remembered, so that calling
+ * itdb_flush() again retries all of them.
+ *
+ * Return value: TRUE on success, FALSE if a file couldn't be flushed
+ **/
+gboolean itdb_flush (Itdb_iTunesDB *itdb, ItdbDurability durability,
+		     GError **error)
+{
+    ItdbPrivate *priv;
+    gboolean result = TRUE;
+
+    g_return_val_if_fail (itdb, FALSE);
+
+    priv = itdb_get_private (itdb);
+    switch (durability)
+    {
+    case ITDB_DURABILITY_SYNC:
+	sync ();
+	break;
+    case ITDB_DURABILITY_SYNCFS:
+#ifdef HAVE_SYNCFS
+	if (itdb->device && itdb->device->mountpoint)
+	{
+	    result = durability_syncfs (itdb->device->mountpoint, error);
+	    break;
+	}
+#endif
+	/* fall through */
+    case ITDB_DURABILITY_FSYNC:
+	if (priv->unflushed)
+	    result = durability_fsync_files (priv->unflushed, error);
+	break;
+    case ITDB_DURABILITY_NONE:
+	break;
+    }
+    if (result && priv->unflushed)
+    {
+	g_hash_table_destroy (priv->unflushed);
+	priv->unflushed = NULL;
+    }
+    return result;
+}
+
+/* Called at the end of itdb_write() and friends: flushes according
+   to the durability set for @itdb, keeping the files for a later
+   itdb_flush() with ITDB_DURABILITY_NONE. */
+gboolean itdb_durability_flush (Itdb_iTunesDB *itdb, GError **error)
+{
+    ItdbDurability durability;
+
+    g_return_val_if_fail (itdb, FALSE);
+
+    durability = itdb_get_durability (itdb);
+    if (durability == ITDB_DURABILITY_NONE)
+	return TRUE;
+    return itdb_flush (itdb, durability, error);
+}
+
+/* Keeps the current contents of @filename as "@filename.bak". A hard
+   link is tried first, the file is copied on file systems without
+   links (FAT). */
+static gboolean replace_keep_backup (const gchar *filename, GError **error)
+{
+    gchar *bakname;
+    gboolean result = TRUE;
+
+    if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+	return TRUE;
+
+    bakname = g_strdup_printf ("%s.bak", filename);
+    unlink (bakname);
+    if (link (filename, bakname) == -1)
+	result = itdb_cp (filename, bakname, error);
+    itdb_resolve_path_invalidate (bakname);
+    g_free (bakname);
+    return result;
+}
+
+/* Replaces @filename with the @len bytes at @contents without ever
+   leaving a truncated or partially written @filename behind: the data
+   is written to "@filename.tmp" (created with @mode), flushed to the
+   disk and renamed over @filename. Processes reading the old file
+   keep reading the old contents. If @backup is TRUE the previous
+   contents are kept as "@filename.bak".
+
+   Return value: TRUE on success. On failure @filename is unchanged. */
+gboolean itdb_file_replace (const gchar *filename, const gchar *contents,
+			    gsize len, int mode, gboolean backup,
+			    GError **error)
+{
+    gchar *tmpname;
+    int fd;
+
+    g_return_val_if_fail (filename, FALSE);
+    g_return_val_if_fail (contents || (len == 0), FALSE);
+
+    tmpname = g_strdup_printf ("%s.tmp", filename);
+    fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    itdb_resolve_path_invalidate (tmpname);
+    if (fd == -1)
+    {
+	g_set_error (error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Opening of '%s' for writing failed (%s)."),
+		     tmpname, g_strerror (errno));
+	g_free (tmpname);
+	return FALSE;
+    }
+    while (len > 0)
+    {
+	ssize_t written = write (fd, contents, len);
+	if (written == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+	    goto write_error;
+	}
+	contents += written;
+	len -= written;
+    }
+    /* the data must be on the disk before the rename is */
+    if (durability_fsync_fd (fd) == -1 && (errno != EINVAL))
+	goto write_error;
+    if (close (fd) == -1)
+    {
+	fd = -1;
+	goto write_error;
+    }
+
+    if (backup && !replace_keep_backup (filename, error))
+    {
+	unlink (tmpname);
+	g_free (tmpname);
+	return FALSE;
+    }
+
+    if (rename (tmpname, filename) == -1)
+    {
+	g_set_error (error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Renaming '%s' to '%s' failed (%s)."),
+		     tmpname, filename, g_strerror (errno));
+	unlink (tmpname);
+	g_free (tmpname);
+	return FALSE;
+    }
+    itdb_resolve_path_invalidate (filename);
+    g_free (tmpname);
+    return TRUE;
+
+  write_error:
+    g_set_error (error,
+		 G_FILE_ERROR,
+		 g_file_error_from_errno (errno),
+		 _("Writing to '%s' failed (%s)."),
+		 tmpname, g_strerror (errno));
+    if (fd != -1)
+	close (fd);
+    unlink (tmpname);
+    g_free (tmpname);
+    return FALSE;
+}
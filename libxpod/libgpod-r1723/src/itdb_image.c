@@ -0,0 +1,755 @@
+/*
+|  Image handling for thumbnail creation: the Itdb_Image type,
+|  scaling/rotation and the image backends used to decode image files.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include "pixmaps.h"
+#include <string.h>
+#if HAVE_GDKPIXBUF
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#endif
+
+/* fixed point precision of the scaling filter weights */
+#define SCALE_SHIFT 14
+#define SCALE_ONE (1 << SCALE_SHIFT)
+
+/* backend set with itdb_image_backend_set(), NULL for the default.
+   Read by the threads of itdb_async.c, hence accessed atomically. */
+static volatile gpointer image_backend = NULL;
+
+
+/**
+ * itdb_image_new:
+ * @width: width of the image
+ * @height: height of the image
+ * @n_channels: 3 for RGB or 4 for RGBA
+ *
+ * Creates a new image with all pixels set to 0 (black, transparent).
+ *
+ * Return value: a new #Itdb_Image to be freed with itdb_image_free()
+ * after use.
+ **/
+Itdb_Image *itdb_image_new (gint width, gint height, gint n_channels)
+{
+    Itdb_Image *image;
+
+    g_return_val_if_fail (width > 0, NULL);
+    g_return_val_if_fail (height > 0, NULL);
+    g_return_val_if_fail ((n_channels == 3) || (n_channels == 4), NULL);
+    g_return_val_if_fail ((gint64)width * height * n_channels <= G_MAXINT, NULL);
+
+    image = g_new0 (Itdb_Image, 1);
+    image->width = width;
+    image->height = height;
+    image->n_channels = n_channels;
+    image->rowstride = width * n_channels;
+    image->pixels = g_malloc0 (image->rowstride * height);
+    return image;
+}
+
+/**
+ * itdb_image_free:
+ * @image: an #Itdb_Image
+ *
+ * Frees the memory used by @image.
+ **/
+void itdb_image_free (Itdb_Image *image)
+{
+    if (image)
+    {
+	g_free (image->pixels);
+	g_free (image);
+    }
+}
+
+static Itdb_Image *image_copy (const Itdb_Image *image)
+{
+    Itdb_Image *copy;
+    gint y;
+
+    copy = itdb_image_new (image->width, image->height, image->n_channels);
+    for (y=0; y<image->height; ++y)
+	memcpy (copy->pixels + y*copy->rowstride,
+		image->pixels + y*image->rowstride,
+		copy->rowstride);
+    return copy;
+}
+
+
+/* Filter taps for resampling @src samples to @dst samples along one
+   axis. When reducing, each destination sample is the area weighted
+   average of the source samples it covers, when enlarging it is
+   interpolated linearly from its two neighbours. */
+typedef struct
+{
+    gint taps;      /* maximum number of taps */
+    gint *first;    /* first source sample of each destination sample */
+    gint *n;        /* number of taps used for each destination sample */
+    gint *weights;  /* @taps weights per destination sample */
+} ScaleFilter;
+
+static void scale_filter_init (ScaleFilter *f, gint src, gint dst)
+{
+    gint i, t;
+
+    if (dst < src)
+	f->taps = (src + dst - 1) / dst + 1;
+    else
+	f->taps = 2;
+    f->first = g_new (gint, dst);
+    f->n = g_new (gint, dst);
+    f->weights = g_new0 (gint, dst * f->taps);
+
+    for (i=0; i<dst; ++i)
+    {
+	gint *w = f->weights + i*f->taps;
+	gint sum = 0, max = 0;
+
+	if (dst < src)
+	{
+	    gdouble scale = (gdouble)src / dst;
+	    gdouble a = i * scale;
+	    gdouble b = a + scale;
+	    f->first[i] = (gint)a;
+	    f->n[i] = 0;
+	    for (t=0; t<f->taps; ++t)
+	    {
+		gint j = f->first[i] + t;
+		gdouble lo = MAX (a, j);
+		gdouble hi = MIN (b, j+1);
+		if ((j >= src) || (hi <= lo))
+		    break;
+		w[t] = (gint)((hi - lo) / scale * SCALE_ONE + 0.5);
+		sum += w[t];
+		if (w[t] > w[max]) max = t;
+		f->n[i] = t+1;
+	    }
+	    /* make the weights add up to exactly 1 */
+	    w[max] += SCALE_ONE - sum;
+	}
+	else
+	{
+	    gdouble c = (i + 0.5) * src / dst - 0.5;
+	    gint j, frac;
+	    if (c < 0) c = 0;
+	    j = (gint)c;
+	    frac = (gint)((c - j) * SCALE_ONE + 0.5);
+	    f->first[i] = j;
+	    if ((j+1 < src) && (frac > 0))
+	    {
+		f->n[i] = 2;
+		w[0] = SCALE_ONE - frac;
+		w[1] = frac;
+	    }
+	    else
+	    {
+		f->n[i] = 1;
+		w[0] = SCALE_ONE;
+	    }
+	}
+    }
+}
+
+static void scale_filter_clear (ScaleFilter *f)
+{
+    g_free (f->first);
+    g_free (f->n);
+    g_free (f->weights);
+}
+
+/**
+ * itdb_image_scale:
+ * @image: an #Itdb_Image
+ * @width: new width
+ * @height: new height
+ *
+ * Scales @image to @width x @height without preserving the aspect
+ * ratio.
+ *
+ * Return value: a new #Itdb_Image to be freed with itdb_image_free()
+ * after use.
+ **/
+Itdb_Image *itdb_image_scale (const Itdb_Image *image,
+			      gint width, gint height)
+{
+    Itdb_Image *result;
+    ScaleFilter fx, fy;
+    guchar *tmp;
+    gint nc, tmp_stride, x, y, c, t;
+
+    g_return_val_if_fail (image, NULL);
+    g_return_val_if_fail (width > 0, NULL);
+    g_return_val_if_fail (height > 0, NULL);
+
+    if ((width == image->width) && (height == image->height))
+	return image_copy (image);
+
+    result = itdb_image_new (width, height, image->n_channels);
+    if (!result)
+	return NULL;
+
+    nc = image->n_channels;
+    scale_filter_init (&fx, image->width, width);
+    scale_filter_init (&fy, image->height, height);
+
+    /* horizontal pass: image->height rows of @width pixels */
+    tmp_stride = width * nc;
+    tmp = g_malloc (tmp_stride * image->height);
+    for (y=0; y<image->height; ++y)
+    {
+	const guchar *src = image->pixels + y*image->rowstride;
+	guchar *dst = tmp + y*tmp_stride;
+	for (x=0; x<width; ++x)
+	{
+	    const guchar *s = src + fx.first[x]*nc;
+	    const gint *w = fx.weights + x*fx.taps;
+	    for (c=0; c<nc; ++c)
+	    {
+		gint acc = 0;
+		for (t=0; t<fx.n[x]; ++t)
+		    acc += w[t] * s[t*nc + c];
+		*dst++ = (acc + SCALE_ONE/2) >> SCALE_SHIFT;
+	    }
+	}
+    }
+
+    /* vertical pass */
+    for (y=0; y<height; ++y)
+    {
+	const guchar *src = tmp + fy.first[y]*tmp_stride;
+	const gint *w = fy.weights + y*fy.taps;
+	guchar *dst = result->pixels + y*result->rowstride;
+	for (x=0; x<tmp_stride; ++x)
+	{
+	    gint acc = 0;
+	    for (t=0; t<fy.n[y]; ++t)
+		acc += w[t] * src[t*tmp_stride + x];
+	    dst[x] = (acc + SCALE_ONE/2) >> SCALE_SHIFT;
+	}
+    }
+
+    g_free (tmp);
+    scale_filter_clear (&fx);
+    scale_filter_clear (&fy);
+    return result;
+}
+
+/**
+ * itdb_image_rotate:
+ * @image: an #Itdb_Image
+ * @rotation: angle by which the image should be rotated
+ * counterclockwise. Valid values are 0, 90, 180 and 270.
+ *
+ * Rotates @image.
+ *
+ * Return value: a new #Itdb_Image to be freed with itdb_image_free()
+ * after use.
+ **/
+Itdb_Image *itdb_image_rotate (const Itdb_Image *image, gint rotation)
+{
+    Itdb_Image *result;
+    gint nc, x, y;
+
+    g_return_val_if_fail (image, NULL);
+
+    rotation = ((rotation % 360) + 360) % 360;
+    rotation = (rotation / 90) * 90;
+
+    if (rotation == 0)
+	return image_copy (image);
+
+    if (rotation == 180)
+	result = itdb_image_new (image->width, image->height, image->n_channels);
+    else
+	result = itdb_image_new (image->height, image->width, image->n_channels);
+
+    nc = image->n_channels;
+    for (y=0; y<image->height; ++y)
+    {
+	const guchar *s = image->pixels + y*image->rowstride;
+	for (x=0; x<image->width; ++x, s+=nc)
+	{
+	    gint dx, dy;
+	    switch (rotation)
+	    {
+	    case 90:
+		dx = y;
+		dy = image->width - 1 - x;
+		break;
+	    case 180:
+		dx = image->width - 1 - x;
+		dy = image->height - 1 - y;
+		break;
+	    default: /* 270 */
+		dx = image->height - 1 - y;
+		dy = x;
+		break;
+	    }
+	    memcpy (result->pixels + dy*result->rowstride + dx*nc, s, nc);
+	}
+    }
+    return result;
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Built-in backend
+ *
+\* ------------------------------------------------------------ */
+
+static Itdb_Image *builtin_load_data (const guchar *data, gsize len,
+				      gint width, gint height)
+{
+    g_return_val_if_fail (data, NULL);
+
+    if ((len >= 2) && (data[0] == 0xff) && (data[1] == 0xd8))
+	return itdb_image_decode_jpeg (data, len, width, height);
+    if ((len >= 8) && (memcmp (data, "\211PNG", 4) == 0))
+	return itdb_image_decode_png (data, len);
+    return NULL;
+}
+
+static Itdb_Image *builtin_load_file (const gchar *filename,
+				      gint width, gint height)
+{
+    GMappedFile *mapped;
+    Itdb_Image *image;
+
+    g_return_val_if_fail (filename, NULL);
+
+    mapped = g_mapped_file_new (filename, FALSE, NULL);
+    if (!mapped)
+	return NULL;
+    image = builtin_load_data ((const guchar *)g_mapped_file_get_contents (mapped),
+			       g_mapped_file_get_length (mapped),
+			       width, height);
+    g_mapped_file_free (mapped);
+    return image;
+}
+
+static const Itdb_ImageBackend builtin_backend = {
+    "builtin",
+    builtin_load_file,
+    builtin_load_data,
+    NULL,
+    NULL,
+    NULL,
+    NULL, NULL
+};
+
+/**
+ * itdb_image_backend_builtin:
+ *
+ * The built-in image backend can decode baseline JPEG and PNG images
+ * and does not need any external libraries.
+ *
+ * Return value: the built-in #Itdb_ImageBackend
+ **/
+const Itdb_ImageBackend *itdb_image_backend_builtin (void)
+{
+    return &builtin_backend;
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * gdk-pixbuf backend
+ *
+\* ------------------------------------------------------------ */
+
+#if HAVE_GDKPIXBUF
+static Itdb_Image *image_from_gdk_pixbuf (GdkPixbuf *pixbuf)
+{
+    Itdb_Image *image;
+    const guchar *pixels;
+    gint width, height, rowstride, channels, y;
+
+    if ((gdk_pixbuf_get_colorspace (pixbuf) != GDK_COLORSPACE_RGB) ||
+	(gdk_pixbuf_get_bits_per_sample (pixbuf) != 8))
+	return NULL;
+
+    width = gdk_pixbuf_get_width (pixbuf);
+    height = gdk_pixbuf_get_height (pixbuf);
+    rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+    channels = gdk_pixbuf_get_n_channels (pixbuf);
+    pixels = gdk_pixbuf_get_pixels (pixbuf);
+
+    image = itdb_image_new (width, height, channels);
+    if (!image)
+	return NULL;
+    for (y=0; y<height; ++y)
+	memcpy (image->pixels + y*image->rowstride,
+		pixels + y*rowstride, image->rowstride);
+    return image;
+}
+
+static Itdb_Image *gdkpixbuf_load_file (const gchar *filename,
+					gint width, gint height)
+{
+    GdkPixbuf *pixbuf;
+    Itdb_Image *image;
+
+    if ((width > 0) && (height > 0))
+	pixbuf = gdk_pixbuf_new_from_file_at_size (filename, width, height,
+						   NULL);
+    else
+	pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
+    if (!pixbuf)
+	return NULL;
+    image = image_from_gdk_pixbuf (pixbuf);
+    g_object_unref (pixbuf);
+    return image;
+}
+
+static void gdkpixbuf_size_prepared (GdkPixbufLoader *loader,
+				     gint width, gint height,
+				     gpointer user_data)
+{
+    const gint *size = user_data;
+    gint fit_width, fit_height;
+
+    itdb_image_fit_size (width, height, size[0], size[1],
+			 &fit_width, &fit_height);
+    gdk_pixbuf_loader_set_size (loader, fit_width, fit_height);
+}
+
+static Itdb_Image *gdkpixbuf_load_data (const guchar *data, gsize len,
+					gint width, gint height)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf;
+    Itdb_Image *image = NULL;
+    gint size[2];
+
+    loader = gdk_pixbuf_loader_new ();
+    g_return_val_if_fail (loader, NULL);
+    size[0] = width;
+    size[1] = height;
+    if ((width > 0) && (height > 0))
+	g_signal_connect (loader, "size-prepared",
+			  G_CALLBACK (gdkpixbuf_size_prepared), size);
+    gdk_pixbuf_loader_write (loader, data, len, NULL);
+    gdk_pixbuf_loader_close (loader, NULL);
+    pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+    if (pixbuf)
+	image = image_from_gdk_pixbuf (pixbuf);
+    g_object_unref (loader);
+    return image;
+}
+
+static Itdb_Image *gdkpixbuf_load_pixbuf (gpointer pixbuf)
+{
+    g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), NULL);
+
+    return image_from_gdk_pixbuf (GDK_PIXBUF (pixbuf));
+}
+
+static const Itdb_ImageBackend gdkpixbuf_backend = {
+    "gdk-pixbuf",
+    gdkpixbuf_load_file,
+    gdkpixbuf_load_data,
+    gdkpixbuf_load_pixbuf,
+    NULL,
+    NULL,
+    NULL, NULL
+};
+#endif
+
+/**
+ * itdb_image_backend_gdkpixbuf:
+ *
+ * The gdk-pixbuf image backend can decode all image formats supported
+ * by gdk-pixbuf.
+ *
+ * Return value: the gdk-pixbuf #Itdb_ImageBackend or NULL if libgpod
+ * was compiled without gdk-pixbuf support.
+ **/
+const Itdb_ImageBackend *itdb_image_backend_gdkpixbuf (void)
+{
+#if HAVE_GDKPIXBUF
+    return &gdkpixbuf_backend;
+#else
+    return NULL;
+#endif
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Backend selection
+ *
+\* ------------------------------------------------------------ */
+
+/**
+ * itdb_image_backend_get:
+ *
+ * Returns the image backend used to decode images when thumbnails are
+ * written to the iPod. Unless changed with itdb_image_backend_set()
+ * this is the gdk-pixbuf backend if libgpod was compiled with
+ * gdk-pixbuf support, the built-in backend otherwise.
+ *
+ * Return value: the current #Itdb_ImageBackend
+ **/
+const Itdb_ImageBackend *itdb_image_backend_get (void)
+{
+    const Itdb_ImageBackend *backend = g_atomic_pointer_get (&image_backend);
+
+    if (backend)
+	return backend;
+#if HAVE_GDKPIXBUF
+    return &gdkpixbuf_backend;
+#else
+    return &builtin_backend;
+#endif
+}
+
+/**
+ * itdb_image_backend_set:
+ * @backend: an #Itdb_ImageBackend or NULL to use the default backend
+ *
+ * Sets the image backend used to decode images. @backend must stay
+ * valid as long as it is in use. If @backend fails to decode an
+ * image, the built-in and gdk-pixbuf backends are tried before a
+ * question mark is used as the thumbnail.
+ **/
+void itdb_image_backend_set (const Itdb_ImageBackend *backend)
+{
+    g_atomic_pointer_set (&image_backend, (gpointer)backend);
+}
+
+/* Fill @list with the backends to try in order, return their number */
+static gint image_backend_list (const Itdb_ImageBackend **list)
+{
+    const Itdb_ImageBackend *backend = itdb_image_backend_get ();
+    gint n = 0;
+
+    list[n++] = backend;
+    if (backend != &builtin_backend)
+	list[n++] = &builtin_backend;
+#if HAVE_GDKPIXBUF
+    if (backend != &gdkpixbuf_backend)
+	list[n++] = &gdkpixbuf_backend;
+#endif
+    return n;
+}
+
+static Itdb_Image *image_scale_with_backend (Itdb_Image *image,
+					     gint width, gint height)
+{
+    const Itdb_ImageBackend *backend = itdb_image_backend_get ();
+    Itdb_Image *result = NULL;
+
+    if ((image->width == width) && (image->height == height))
+	return image;
+    if (backend->scale)
+	result = backend->scale (image, width, height);
+    if (!result)
+	result = itdb_image_scale (image, width, height);
+    itdb_image_free (image);
+    return result;
+}
+
+/* Compute the size of an image of @src_width x @src_height scaled to
+   fit into @width x @height keeping its aspect ratio (it will fill
+   the box in at least one dimension). */
+G_GNUC_INTERNAL void itdb_image_fit_size (gint src_width, gint src_height,
+					  gint width, gint height,
+					  gint *fit_width, gint *fit_height)
+{
+    g_return_if_fail (src_width > 0 && src_height > 0);
+    g_return_if_fail (fit_width && fit_height);
+
+    if ((gint64)src_width * height > (gint64)src_height * width)
+    {
+	*fit_width = width;
+	*fit_height = ((gint64)src_height * width + src_width/2) / src_width;
+    }
+    else
+    {
+	*fit_height = height;
+	*fit_width = ((gint64)src_width * height + src_height/2) / src_height;
+    }
+    if (*fit_width < 1)  *fit_width = 1;
+    if (*fit_height < 1) *fit_height = 1;
+}
+
+/* Decode @filename and scale it to fit into @width x @height. Returns
+   NULL if none of the backends could decode the file. */
+G_GNUC_INTERNAL Itdb_Image *itdb_image_load_file_at_size (const gchar *filename,
+							  gint width,
+							  gint height)
+{
+    const Itdb_ImageBackend *backends[3];
+    gint i, n;
+
+    g_return_val_if_fail (filename, NULL);
+    g_return_val_if_fail (width > 0 && height > 0, NULL);
+
+    n = image_backend_list (backends);
+    for (i=0; i<n; ++i)
+    {
+	Itdb_Image *image;
+	gint fit_width, fit_height;
+
+	if (!backends[i]->load_file)
+	    continue;
+	image = backends[i]->load_file (filename, width, height);
+	if (image)
+	{
+	    itdb_image_fit_size (image->width, image->height, width, height,
+				 &fit_width, &fit_height);
+	    return image_scale_with_backend (image, fit_width, fit_height);
+	}
+    }
+    return NULL;
+}
+
+/* Same as itdb_image_load_file_at_size() for an image file held in
+   memory */
+G_GNUC_INTERNAL Itdb_Image *itdb_image_load_data_at_size (const guchar *data,
+							  gsize len,
+							  gint width,
+							  gint height)
+{
+    const Itdb_ImageBackend *backends[3];
+    gint i, n;
+
+    g_return_val_if_fail (data, NULL);
+    g_return_val_if_fail (width > 0 && height > 0, NULL);
+
+    n = image_backend_list (backends);
+    for (i=0; i<n; ++i)
+    {
+	Itdb_Image *image;
+	gint fit_width, fit_height;
+
+	if (!backends[i]->load_data)
+	    continue;
+	image = backends[i]->load_data (data, len, width, height);
+	if (image)
+	{
+	    itdb_image_fit_size (image->width, image->height, width, height,
+				 &fit_width, &fit_height);
+	    return image_scale_with_backend (image, fit_width, fit_height);
+	}
+    }
+    return NULL;
+}
+
+/* Convert @pixbuf (as passed to
+   itdb_artwork_add_thumbnail_from_pixbuf()) and scale it to exactly
+   @width x @height */
+G_GNUC_INTERNAL Itdb_Image *itdb_image_load_pixbuf_at_size (gpointer pixbuf,
+							    gint width,
+							    gint height)
+{
+    const Itdb_ImageBackend *backends[3];
+    gint i, n;
+
+    g_return_val_if_fail (pixbuf, NULL);
+    g_return_val_if_fail (width > 0 && height > 0, NULL);
+
+    n = image_backend_list (backends);
+    for (i=0; i<n; ++i)
+    {
+	Itdb_Image *image;
+
+	if (!backends[i]->load_pixbuf)
+	    continue;
+	image = backends[i]->load_pixbuf (pixbuf);
+	if (image)
+	    return image_scale_with_backend (image, width, height);
+    }
+    return NULL;
+}
+
+/* Rotate @image using the current backend and free it */
+G_GNUC_INTERNAL Itdb_Image *itdb_image_rotate_with_backend (Itdb_Image *image,
+							    gint rotation)
+{
+    const Itdb_ImageBackend *backend = itdb_image_backend_get ();
+    Itdb_Image *result = NULL;
+
+    g_return_val_if_fail (image, NULL);
+
+    if (rotation % 360 == 0)
+	return image;
+    if (backend->rotate)
+	result = backend->rotate (image, rotation);
+    if (!result)
+	result = itdb_image_rotate (image, rotation);
+    itdb_image_free (image);
+    return result;
+}
+
+/* The question mark image used when an image cannot be decoded,
+   scaled to @width x @height */
+G_GNUC_INTERNAL Itdb_Image *itdb_image_new_questionmark (gint width,
+							 gint height)
+{
+    const ItdbPixdata *pixdata = &questionmark_pixdata;
+    const guint8 *p = pixdata->pixel_data;
+    Itdb_Image *image;
+    guchar *o, *end;
+
+    g_return_val_if_fail (width > 0 && height > 0, NULL);
+
+    image = itdb_image_new (pixdata->width, pixdata->height, 3);
+    o = image->pixels;
+    end = image->pixels + image->rowstride * image->height;
+
+    /* 1-byte-run-length-encoded: a count byte with the high bit set
+       repeats the following pixel, otherwise count literal pixels
+       follow */
+    while (o < end)
+    {
+	guint n = *p++;
+	if (n & 0x80)
+	{
+	    n = MIN (n & 0x7f, (end - o) / 3);
+	    if (n == 0) break;
+	    while (n--)
+	    {
+		o[0] = p[0];
+		o[1] = p[1];
+		o[2] = p[2];
+		o += 3;
+	    }
+	    p += 3;
+	}
+	else
+	{
+	    n = MIN (n, (end - o) / 3);
+	    if (n == 0) break;
+	    memcpy (o, p, 3*n);
+	    o += 3*n;
+	    p += 3*n;
+	}
+    }
+
+    return image_scale_with_backend (image, width, height);
+}
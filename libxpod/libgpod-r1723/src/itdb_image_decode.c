@@ -0,0 +1,1399 @@
+/*
+|  Small image decoders used by the built-in image backend
+|  (see itdb_image.c): baseline JPEG and PNG.
+|
+|  These are deliberately minimal. They decode what is commonly used
+|  for cover art and photos (baseline huffman JPEG with 1 or 3
+|  components, all PNG color types and bit depths, interlaced or
+|  not). Anything else (progressive or arithmetic coded JPEG, CMYK,
+|  ...) is rejected by returning NULL, so the caller can fall back to
+|  another backend or to the question mark thumbnail.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include <string.h>
+
+/* refuse images larger than this many pixels (corrupt headers would
+   otherwise make us allocate huge amounts of memory) */
+#define IMAGE_MAX_PIXELS (64*1024*1024)
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * JPEG (baseline, huffman coded)
+ *
+\* ------------------------------------------------------------ */
+
+/* number of bits resolved with a single table lookup */
+#define JPEG_LOOKAHEAD 9
+
+typedef struct
+{
+    guint8 bits[17];      /* number of codes of each length 1..16 */
+    guint8 vals[256];     /* symbols in order of increasing length */
+    gint32 mincode[17];
+    gint32 maxcode[18];
+    gint32 valptr[17];
+    guint8 look_nbits[1<<JPEG_LOOKAHEAD];
+    guint8 look_sym[1<<JPEG_LOOKAHEAD];
+    gboolean defined;
+} JpegHuffman;
+
+typedef struct
+{
+    gint id;
+    gint h, v;            /* sampling factors */
+    gint tq;              /* quantization table */
+    gint td, ta;          /* DC and AC huffman table */
+    gint bw, bh;          /* size of the plane in blocks */
+    gint pred;            /* DC predictor */
+    guchar *plane;
+    gint stride;
+} JpegComponent;
+
+typedef struct
+{
+    const guchar *data;
+    gsize len;
+    gsize pos;
+    guint32 bitbuf;       /* left aligned */
+    gint bitcnt;
+    gboolean marker_hit;
+    guint16 qt[4][64];    /* zigzag order */
+    JpegHuffman dc[4];
+    JpegHuffman ac[4];
+    JpegComponent comp[3];
+    gint ncomp;
+    gint width, height;
+    gint hmax, vmax;
+    gint mcux, mcuy;
+    gint restart_interval;
+    gint adobe_transform; /* -1 if no Adobe marker was found */
+    gint scale;           /* 1, or 8 to decode the DC coefficients only */
+    gboolean frame_seen;
+} JpegDecoder;
+
+static const guint8 jpeg_natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static inline guchar clamp8 (gint v)
+{
+    if (v < 0)   return 0;
+    if (v > 255) return 255;
+    return v;
+}
+
+static gboolean jpeg_build_huffman (JpegHuffman *h)
+{
+    gint l, i, p, code;
+
+    memset (h->look_nbits, 0, sizeof (h->look_nbits));
+    code = 0;
+    p = 0;
+    for (l=1; l<=16; ++l)
+    {
+	h->valptr[l] = p;
+	h->mincode[l] = code;
+	for (i=0; i<h->bits[l]; ++i, ++p, ++code)
+	{
+	    /* a code of length l must fit into l bits -- reject
+	       corrupt tables before touching the lookahead arrays */
+	    if (code >= (1<<l))
+		return FALSE;
+	    if (l <= JPEG_LOOKAHEAD)
+	    {
+		gint shift = JPEG_LOOKAHEAD - l;
+		gint base = code << shift;
+		gint j;
+		if (base + (1<<shift) > (1<<JPEG_LOOKAHEAD))
+		    return FALSE;
+		for (j=0; j<(1<<shift); ++j)
+		{
+		    h->look_nbits[base+j] = l;
+		    h->look_sym[base+j] = h->vals[p];
+		}
+	    }
+	}
+	h->maxcode[l] = h->bits[l] ? code-1 : -1;
+	code <<= 1;
+    }
+    h->maxcode[17] = G_MAXINT32;
+    h->defined = TRUE;
+    return TRUE;
+}
+
+static inline void jpeg_fill_bits (JpegDecoder *d)
+{
+    while (d->bitcnt <= 24)
+    {
+	guint32 b = 0;
+	if (!d->marker_hit && (d->pos < d->len))
+	{
+	    b = d->data[d->pos];
+	    if (b == 0xff)
+	    {
+		guint8 next = (d->pos+1 < d->len) ? d->data[d->pos+1] : 0xd9;
+		if (next == 0x00)
+		{   /* stuffed zero byte */
+		    d->pos += 2;
+		}
+		else
+		{   /* marker: stop reading, feed zeros */
+		    d->marker_hit = TRUE;
+		    b = 0;
+		}
+	    }
+	    else
+	    {
+		++d->pos;
+	    }
+	}
+	d->bitbuf |= b << (24 - d->bitcnt);
+	d->bitcnt += 8;
+    }
+}
+
+static inline gint jpeg_get_bits (JpegDecoder *d, gint n)
+{
+    gint v;
+    if (n == 0) return 0;
+    jpeg_fill_bits (d);
+    v = d->bitbuf >> (32 - n);
+    d->bitbuf <<= n;
+    d->bitcnt -= n;
+    return v;
+}
+
+static inline gint jpeg_extend (gint v, gint s)
+{
+    return (v < (1 << (s-1))) ? v - (1 << s) + 1 : v;
+}
+
+static inline gint jpeg_decode_huffman (JpegDecoder *d, const JpegHuffman *h)
+{
+    gint l, nb, code;
+
+    jpeg_fill_bits (d);
+    nb = h->look_nbits[d->bitbuf >> (32 - JPEG_LOOKAHEAD)];
+    if (nb)
+    {
+	gint sym = h->look_sym[d->bitbuf >> (32 - JPEG_LOOKAHEAD)];
+	d->bitbuf <<= nb;
+	d->bitcnt -= nb;
+	return sym;
+    }
+    for (l=JPEG_LOOKAHEAD+1; l<=16; ++l)
+    {
+	code = d->bitbuf >> (32 - l);
+	if (code <= h->maxcode[l])
+	{
+	    d->bitbuf <<= l;
+	    d->bitcnt -= l;
+	    return h->vals[h->valptr[l] + code - h->mincode[l]];
+	}
+    }
+    return -1;
+}
+
+/* Integer inverse DCT (the "islow" algorithm of the IJG library),
+   writing 8x8 clamped samples to @out */
+#define IDCT_CONST_BITS 13
+#define IDCT_PASS1_BITS 2
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+#define IDCT_DESCALE(x,n) (((x) + (1 << ((n)-1))) >> (n))
+
+static void jpeg_idct (const gint *in, guchar *out, gint stride)
+{
+    gint ws[64];
+    gint i;
+
+    /* columns */
+    for (i=0; i<8; ++i)
+    {
+	const gint *c = in + i;
+	gint *w = ws + i;
+	gint tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	gint z1, z2, z3, z4, z5;
+
+	if (!c[8] && !c[16] && !c[24] && !c[32] && !c[40] && !c[48] && !c[56])
+	{
+	    gint dc = c[0] << IDCT_PASS1_BITS;
+	    w[0] = w[8] = w[16] = w[24] = w[32] = w[40] = w[48] = w[56] = dc;
+	    continue;
+	}
+
+	z2 = c[16];
+	z3 = c[48];
+	z1 = (z2 + z3) * FIX_0_541196100;
+	tmp2 = z1 - z3 * FIX_1_847759065;
+	tmp3 = z1 + z2 * FIX_0_765366865;
+	tmp0 = (c[0] + c[32]) << IDCT_CONST_BITS;
+	tmp1 = (c[0] - c[32]) << IDCT_CONST_BITS;
+	tmp10 = tmp0 + tmp3;
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+
+	tmp0 = c[56];
+	tmp1 = c[40];
+	tmp2 = c[24];
+	tmp3 = c[8];
+	z1 = tmp0 + tmp3;
+	z2 = tmp1 + tmp2;
+	z3 = tmp0 + tmp2;
+	z4 = tmp1 + tmp3;
+	z5 = (z3 + z4) * FIX_1_175875602;
+	tmp0 *= FIX_0_298631336;
+	tmp1 *= FIX_2_053119869;
+	tmp2 *= FIX_3_072711026;
+	tmp3 *= FIX_1_501321110;
+	z1 *= -FIX_0_899976223;
+	z2 *= -FIX_2_562915447;
+	z3 = z3 * -FIX_1_961570560 + z5;
+	z4 = z4 * -FIX_0_390180644 + z5;
+	tmp0 += z1 + z3;
+	tmp1 += z2 + z4;
+	tmp2 += z2 + z3;
+	tmp3 += z1 + z4;
+
+	w[0]  = IDCT_DESCALE (tmp10 + tmp3, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[56] = IDCT_DESCALE (tmp10 - tmp3, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[8]  = IDCT_DESCALE (tmp11 + tmp2, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[48] = IDCT_DESCALE (tmp11 - tmp2, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[16] = IDCT_DESCALE (tmp12 + tmp1, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[40] = IDCT_DESCALE (tmp12 - tmp1, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[24] = IDCT_DESCALE (tmp13 + tmp0, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+	w[32] = IDCT_DESCALE (tmp13 - tmp0, IDCT_CONST_BITS-IDCT_PASS1_BITS);
+    }
+
+    /* rows */
+    for (i=0; i<8; ++i)
+    {
+	const gint *w = ws + 8*i;
+	guchar *o = out + i*stride;
+	gint tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	gint z1, z2, z3, z4, z5;
+	const gint shift = IDCT_CONST_BITS+IDCT_PASS1_BITS+3;
+
+	z2 = w[2];
+	z3 = w[6];
+	z1 = (z2 + z3) * FIX_0_541196100;
+	tmp2 = z1 - z3 * FIX_1_847759065;
+	tmp3 = z1 + z2 * FIX_0_765366865;
+	tmp0 = (w[0] + w[4]) << IDCT_CONST_BITS;
+	tmp1 = (w[0] - w[4]) << IDCT_CONST_BITS;
+	tmp10 = tmp0 + tmp3;
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+
+	tmp0 = w[7];
+	tmp1 = w[5];
+	tmp2 = w[3];
+	tmp3 = w[1];
+	z1 = tmp0 + tmp3;
+	z2 = tmp1 + tmp2;
+	z3 = tmp0 + tmp2;
+	z4 = tmp1 + tmp3;
+	z5 = (z3 + z4) * FIX_1_175875602;
+	tmp0 *= FIX_0_298631336;
+	tmp1 *= FIX_2_053119869;
+	tmp2 *= FIX_3_072711026;
+	tmp3 *= FIX_1_501321110;
+	z1 *= -FIX_0_899976223;
+	z2 *= -FIX_2_562915447;
+	z3 = z3 * -FIX_1_961570560 + z5;
+	z4 = z4 * -FIX_0_390180644 + z5;
+	tmp0 += z1 + z3;
+	tmp1 += z2 + z4;
+	tmp2 += z2 + z3;
+	tmp3 += z1 + z4;
+
+	o[0] = clamp8 (IDCT_DESCALE (tmp10 + tmp3, shift) + 128);
+	o[7] = clamp8 (IDCT_DESCALE (tmp10 - tmp3, shift) + 128);
+	o[1] = clamp8 (IDCT_DESCALE (tmp11 + tmp2, shift) + 128);
+	o[6] = clamp8 (IDCT_DESCALE (tmp11 - tmp2, shift) + 128);
+	o[2] = clamp8 (IDCT_DESCALE (tmp12 + tmp1, shift) + 128);
+	o[5] = clamp8 (IDCT_DESCALE (tmp12 - tmp1, shift) + 128);
+	o[3] = clamp8 (IDCT_DESCALE (tmp13 + tmp0, shift) + 128);
+	o[4] = clamp8 (IDCT_DESCALE (tmp13 - tmp0, shift) + 128);
+    }
+}
+
+/* decode one 8x8 block of component @c into its plane at block
+   position (@bx, @by) */
+static gboolean jpeg_decode_block (JpegDecoder *d, JpegComponent *c,
+				   gint bx, gint by)
+{
+    const guint16 *q = d->qt[c->tq];
+    gint coef[64];
+    gint k, t;
+    gboolean dc_only = (d->scale == 8);
+
+    t = jpeg_decode_huffman (d, &d->dc[c->td]);
+    if ((t < 0) || (t > 15))
+	return FALSE;
+    c->pred += t ? jpeg_extend (jpeg_get_bits (d, t), t) : 0;
+
+    if (!dc_only)
+    {
+	memset (coef, 0, sizeof (coef));
+	coef[0] = c->pred * q[0];
+    }
+
+    for (k=1; k<64; )
+    {
+	gint rs = jpeg_decode_huffman (d, &d->ac[c->ta]);
+	gint r, s;
+	if (rs < 0)
+	    return FALSE;
+	r = rs >> 4;
+	s = rs & 15;
+	if (s == 0)
+	{
+	    if (r != 15) break;    /* EOB */
+	    k += 16;
+	    continue;
+	}
+	k += r;
+	if (k > 63)
+	    return FALSE;
+	t = jpeg_extend (jpeg_get_bits (d, s), s);
+	if (!dc_only)
+	    coef[jpeg_natural_order[k]] = t * q[k];
+	++k;
+    }
+
+    if (dc_only)
+    {   /* the DC coefficient is 8 times the average of the block */
+	c->plane[by*c->stride + bx] =
+	    clamp8 (IDCT_DESCALE (c->pred * q[0], 3) + 128);
+    }
+    else
+    {
+	jpeg_idct (coef, c->plane + by*8*c->stride + bx*8, c->stride);
+    }
+    return TRUE;
+}
+
+static gboolean jpeg_restart (JpegDecoder *d)
+{
+    gint i;
+
+    d->bitbuf = 0;
+    d->bitcnt = 0;
+    d->marker_hit = FALSE;
+    for (i=0; i<d->ncomp; ++i)
+	d->comp[i].pred = 0;
+    /* skip to the RSTn marker */
+    while (d->pos+1 < d->len)
+    {
+	if ((d->data[d->pos] == 0xff) &&
+	    (d->data[d->pos+1] >= 0xd0) && (d->data[d->pos+1] <= 0xd7))
+	{
+	    d->pos += 2;
+	    return TRUE;
+	}
+	++d->pos;
+    }
+    return FALSE;
+}
+
+static gboolean jpeg_decode_scan (JpegDecoder *d, const guchar *seg, gint seglen)
+{
+    JpegComponent *scomp[3];
+    gint ns, i, x, y, mcus_x, mcus_y, mcu;
+
+    if (seglen < 1) return FALSE;
+    ns = seg[0];
+    if ((ns < 1) || (ns > d->ncomp) || (seglen < 1 + 2*ns + 3))
+	return FALSE;
+    for (i=0; i<ns; ++i)
+    {
+	gint id = seg[1+2*i], j;
+	scomp[i] = NULL;
+	for (j=0; j<d->ncomp; ++j)
+	    if (d->comp[j].id == id) scomp[i] = &d->comp[j];
+	if (!scomp[i])
+	    return FALSE;
+	scomp[i]->td = seg[2+2*i] >> 4;
+	scomp[i]->ta = seg[2+2*i] & 15;
+	if ((scomp[i]->td > 3) || (scomp[i]->ta > 3) ||
+	    !d->dc[scomp[i]->td].defined || !d->ac[scomp[i]->ta].defined)
+	    return FALSE;
+	scomp[i]->pred = 0;
+    }
+    d->bitbuf = 0;
+    d->bitcnt = 0;
+    d->marker_hit = FALSE;
+
+    if (ns == 1)
+    {   /* non-interleaved: blocks cover the component only */
+	JpegComponent *c = scomp[0];
+	mcus_x = ((d->width * c->h + d->hmax - 1) / d->hmax + 7) / 8;
+	mcus_y = ((d->height * c->v + d->vmax - 1) / d->vmax + 7) / 8;
+    }
+    else
+    {
+	mcus_x = d->mcux;
+	mcus_y = d->mcuy;
+    }
+
+    mcu = 0;
+    for (y=0; y<mcus_y; ++y)
+    {
+	for (x=0; x<mcus_x; ++x)
+	{
+	    if (d->restart_interval && mcu && (mcu % d->restart_interval == 0))
+	    {
+		if (!jpeg_restart (d))
+		    return FALSE;
+	    }
+	    ++mcu;
+	    if (ns == 1)
+	    {
+		if (!jpeg_decode_block (d, scomp[0], x, y))
+		    return FALSE;
+	    }
+	    else
+	    {
+		for (i=0; i<ns; ++i)
+		{
+		    JpegComponent *c = scomp[i];
+		    gint bx, by;
+		    for (by=0; by<c->v; ++by)
+			for (bx=0; bx<c->h; ++bx)
+			    if (!jpeg_decode_block (d, c,
+						    x*c->h + bx, y*c->v + by))
+				return FALSE;
+		}
+	    }
+	}
+    }
+    return TRUE;
+}
+
+static gboolean jpeg_read_frame (JpegDecoder *d, const guchar *seg, gint seglen)
+{
+    gint i, bs;
+
+    if (d->frame_seen || (seglen < 6))
+	return FALSE;
+    if (seg[0] != 8)
+	return FALSE;  /* only 8 bit precision */
+    d->height = (seg[1] << 8) | seg[2];
+    d->width = (seg[3] << 8) | seg[4];
+    d->ncomp = seg[5];
+    if ((d->ncomp != 1) && (d->ncomp != 3))
+	return FALSE;
+    if ((d->width == 0) || (d->height == 0) ||
+	((gint64)d->width * d->height > IMAGE_MAX_PIXELS))
+	return FALSE;
+    if (seglen < 6 + 3*d->ncomp)
+	return FALSE;
+    d->hmax = d->vmax = 1;
+    for (i=0; i<d->ncomp; ++i)
+    {
+	JpegComponent *c = &d->comp[i];
+	c->id = seg[6+3*i];
+	c->h = seg[7+3*i] >> 4;
+	c->v = seg[7+3*i] & 15;
+	c->tq = seg[8+3*i];
+	if ((c->h < 1) || (c->h > 4) || (c->v < 1) || (c->v > 4) || (c->tq > 3))
+	    return FALSE;
+	d->hmax = MAX (d->hmax, c->h);
+	d->vmax = MAX (d->vmax, c->v);
+    }
+    d->mcux = (d->width + 8*d->hmax - 1) / (8*d->hmax);
+    d->mcuy = (d->height + 8*d->vmax - 1) / (8*d->vmax);
+    bs = (d->scale == 8) ? 1 : 8;
+    for (i=0; i<d->ncomp; ++i)
+    {
+	JpegComponent *c = &d->comp[i];
+	c->bw = d->mcux * c->h;
+	c->bh = d->mcuy * c->v;
+	c->stride = c->bw * bs;
+	c->plane = g_malloc0 (c->stride * c->bh * bs);
+    }
+    d->frame_seen = TRUE;
+    return TRUE;
+}
+
+static Itdb_Image *jpeg_convert (JpegDecoder *d)
+{
+    Itdb_Image *image;
+    gint w, h, x, y;
+
+    w = (d->width + d->scale - 1) / d->scale;
+    h = (d->height + d->scale - 1) / d->scale;
+    image = itdb_image_new (w, h, 3);
+
+    for (y=0; y<h; ++y)
+    {
+	guchar *o = image->pixels + y*image->rowstride;
+	const guchar *row[3];
+	for (x=0; x<d->ncomp; ++x)
+	{
+	    JpegComponent *c = &d->comp[x];
+	    row[x] = c->plane + (y * c->v / d->vmax) * c->stride;
+	}
+	if (d->ncomp == 1)
+	{
+	    for (x=0; x<w; ++x, o+=3)
+		o[0] = o[1] = o[2] = row[0][x];
+	}
+	else if (d->adobe_transform == 0)
+	{   /* stored as RGB */
+	    const JpegComponent *c = d->comp;
+	    for (x=0; x<w; ++x, o+=3)
+	    {
+		o[0] = row[0][x * c[0].h / d->hmax];
+		o[1] = row[1][x * c[1].h / d->hmax];
+		o[2] = row[2][x * c[2].h / d->hmax];
+	    }
+	}
+	else
+	{   /* YCbCr -> RGB, 16 bit fixed point */
+	    const JpegComponent *c = d->comp;
+	    for (x=0; x<w; ++x, o+=3)
+	    {
+		gint yy = row[0][x * c[0].h / d->hmax] << 16;
+		gint cb = row[1][x * c[1].h / d->hmax] - 128;
+		gint cr = row[2][x * c[2].h / d->hmax] - 128;
+		o[0] = clamp8 ((yy + 91881*cr + 32768) >> 16);
+		o[1] = clamp8 ((yy - 22554*cb - 46802*cr + 32768) >> 16);
+		o[2] = clamp8 ((yy + 116130*cb + 32768) >> 16);
+	    }
+	}
+    }
+    return image;
+}
+
+/* Decode the baseline JPEG in @data. If the image is at least 8 times
+   as large as needed to fill @width x @height (keeping the aspect
+   ratio), only the DC coefficients are decoded, producing an image
+   scaled down by 8. @width/@height may be 0 to decode at full size. */
+G_GNUC_INTERNAL Itdb_Image *
+itdb_image_decode_jpeg (const guchar *data, gsize len,
+			gint width, gint height)
+{
+    JpegDecoder *d;
+    Itdb_Image *image = NULL;
+    gboolean ok = TRUE, scanned = FALSE;
+    gint i;
+
+    g_return_val_if_fail (data, NULL);
+
+    if ((len < 4) || (data[0] != 0xff) || (data[1] != 0xd8))
+	return NULL;
+
+    d = g_new0 (JpegDecoder, 1);
+    d->data = data;
+    d->len = len;
+    d->pos = 2;
+    d->adobe_transform = -1;
+    d->scale = 1;
+
+    while (ok)
+    {
+	gint marker, seglen;
+	const guchar *seg;
+
+	/* find next marker */
+	while ((d->pos < d->len) && (d->data[d->pos] != 0xff))
+	    ++d->pos;
+	while ((d->pos < d->len) && (d->data[d->pos] == 0xff))
+	    ++d->pos;
+	if (d->pos >= d->len)
+	    break;
+	marker = d->data[d->pos++];
+	if (marker == 0xd9)                            /* EOI */
+	    break;
+	if ((marker >= 0xd0) && (marker <= 0xd7))      /* stray RSTn */
+	    continue;
+	if (d->pos + 2 > d->len)
+	{
+	    ok = FALSE;
+	    break;
+	}
+	seglen = ((d->data[d->pos] << 8) | d->data[d->pos+1]) - 2;
+	seg = d->data + d->pos + 2;
+	if ((seglen < 0) || (d->pos + 2 + seglen > d->len))
+	{
+	    ok = FALSE;
+	    break;
+	}
+	d->pos += 2 + seglen;
+
+	switch (marker)
+	{
+	case 0xc0: /* SOF0 baseline */
+	case 0xc1: /* SOF1 extended sequential, huffman */
+	    if (!d->frame_seen && width > 0 && height > 0 && seglen >= 5)
+	    {   /* decide whether decoding the DC coefficients is enough */
+		gint iw = (seg[3] << 8) | seg[4];
+		gint ih = (seg[1] << 8) | seg[2];
+		gint fw, fh;
+		if ((iw == 0) || (ih == 0))
+		{
+		    ok = FALSE;
+		    break;
+		}
+		itdb_image_fit_size (iw, ih, width, height, &fw, &fh);
+		if ((iw / 8 >= fw) && (ih / 8 >= fh))
+		    d->scale = 8;
+	    }
+	    ok = jpeg_read_frame (d, seg, seglen);
+	    break;
+	case 0xc4: /* DHT */
+	    while (ok && (seglen > 0))
+	    {
+		gint tc, th, n = 0, k;
+		JpegHuffman *h;
+		if (seglen < 17) { ok = FALSE; break; }
+		tc = seg[0] >> 4;
+		th = seg[0] & 15;
+		if ((tc > 1) || (th > 3)) { ok = FALSE; break; }
+		h = tc ? &d->ac[th] : &d->dc[th];
+		for (k=1; k<=16; ++k)
+		{
+		    h->bits[k] = seg[k];
+		    n += seg[k];
+		}
+		if ((n > 256) || (seglen < 17 + n)) { ok = FALSE; break; }
+		memcpy (h->vals, seg+17, n);
+		ok = jpeg_build_huffman (h);
+		seg += 17 + n;
+		seglen -= 17 + n;
+	    }
+	    break;
+	case 0xdb: /* DQT */
+	    while (ok && (seglen > 0))
+	    {
+		gint pq = seg[0] >> 4, tq = seg[0] & 15, k;
+		if ((tq > 3) || (seglen < 1 + 64*(pq+1))) { ok = FALSE; break; }
+		for (k=0; k<64; ++k)
+		    d->qt[tq][k] = pq ? ((seg[1+2*k] << 8) | seg[2+2*k])
+			              : seg[1+k];
+		seg += 1 + 64*(pq+1);
+		seglen -= 1 + 64*(pq+1);
+	    }
+	    break;
+	case 0xdd: /* DRI */
+	    if (seglen < 2) { ok = FALSE; break; }
+	    d->restart_interval = (seg[0] << 8) | seg[1];
+	    break;
+	case 0xda: /* SOS */
+	    if (!d->frame_seen) { ok = FALSE; break; }
+	    ok = jpeg_decode_scan (d, seg, seglen);
+	    scanned = TRUE;
+	    break;
+	case 0xee: /* APP14: Adobe color transform */
+	    if ((seglen >= 12) && (memcmp (seg, "Adobe", 5) == 0))
+		d->adobe_transform = seg[11];
+	    break;
+	default:
+	    /* progressive, lossless, arithmetic coding, hierarchical:
+	       unsupported */
+	    if ((marker >= 0xc2) && (marker <= 0xcf) &&
+		(marker != 0xc4) && (marker != 0xc8) && (marker != 0xcc))
+		ok = FALSE;
+	    /* everything else (APPn, COM, ...) is skipped */
+	    break;
+	}
+    }
+
+    if (ok && scanned)
+	image = jpeg_convert (d);
+
+    for (i=0; i<d->ncomp && i<3; ++i)
+	g_free (d->comp[i].plane);
+    g_free (d);
+    return image;
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Inflate (RFC 1951), only what is needed for PNG
+ *
+\* ------------------------------------------------------------ */
+
+#define INFLATE_MAXBITS 15
+
+typedef struct
+{
+    const guchar *in;
+    gsize inlen;
+    gsize inpos;
+    guint32 bitbuf;
+    gint bitcnt;
+    guchar *out;
+    gsize outlen;
+    gsize outpos;
+} Inflate;
+
+typedef struct
+{
+    gshort count[INFLATE_MAXBITS+1];
+    gshort symbol[288];
+} InflateHuffman;
+
+static const gshort inflate_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const gshort inflate_lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const gshort inflate_dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+static const gshort inflate_dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+/* returns -1 when reading past the end of the input */
+static inline gint inflate_bits (Inflate *s, gint need)
+{
+    guint32 val;
+
+    while (s->bitcnt < need)
+    {
+	if (s->inpos >= s->inlen)
+	    return -1;
+	s->bitbuf |= (guint32)s->in[s->inpos++] << s->bitcnt;
+	s->bitcnt += 8;
+    }
+    val = s->bitbuf & ((1U << need) - 1);
+    s->bitbuf >>= need;
+    s->bitcnt -= need;
+    return val;
+}
+
+static gint inflate_decode (Inflate *s, const InflateHuffman *h)
+{
+    gint len, code = 0, first = 0, index = 0;
+
+    for (len=1; len<=INFLATE_MAXBITS; ++len)
+    {
+	gint count, bit = inflate_bits (s, 1);
+	if (bit < 0)
+	    return -1;
+	code |= bit;
+	count = h->count[len];
+	if (code - count < first)
+	    return h->symbol[index + (code - first)];
+	index += count;
+	first += count;
+	first <<= 1;
+	code <<= 1;
+    }
+    return -1;
+}
+
+/* returns FALSE if the code lengths are over-subscribed */
+static gboolean inflate_construct (InflateHuffman *h,
+				   const gshort *length, gint n)
+{
+    gshort offs[INFLATE_MAXBITS+1];
+    gint len, sym, left;
+
+    memset (h->count, 0, sizeof (h->count));
+    for (sym=0; sym<n; ++sym)
+	h->count[length[sym]]++;
+    if (h->count[0] == n)
+	return TRUE;
+    left = 1;
+    for (len=1; len<=INFLATE_MAXBITS; ++len)
+    {
+	left <<= 1;
+	left -= h->count[len];
+	if (left < 0)
+	    return FALSE;
+    }
+    offs[1] = 0;
+    for (len=1; len<INFLATE_MAXBITS; ++len)
+	offs[len+1] = offs[len] + h->count[len];
+    for (sym=0; sym<n; ++sym)
+	if (length[sym] != 0)
+	    h->symbol[offs[length[sym]]++] = sym;
+    return TRUE;
+}
+
+static gboolean inflate_codes (Inflate *s, const InflateHuffman *lencode,
+			       const InflateHuffman *distcode)
+{
+    for (;;)
+    {
+	gint sym = inflate_decode (s, lencode);
+	if (sym < 0)
+	    return FALSE;
+	if (sym < 256)
+	{
+	    if (s->outpos >= s->outlen)
+		return FALSE;
+	    s->out[s->outpos++] = sym;
+	}
+	else if (sym == 256)
+	{
+	    return TRUE;
+	}
+	else
+	{
+	    gint len, dist, e;
+	    sym -= 257;
+	    if (sym >= 29)
+		return FALSE;
+	    e = inflate_bits (s, inflate_lext[sym]);
+	    if (e < 0) return FALSE;
+	    len = inflate_lbase[sym] + e;
+	    sym = inflate_decode (s, distcode);
+	    if ((sym < 0) || (sym >= 30))
+		return FALSE;
+	    e = inflate_bits (s, inflate_dext[sym]);
+	    if (e < 0) return FALSE;
+	    dist = inflate_dbase[sym] + e;
+	    if ((dist > s->outpos) || (s->outpos + len > s->outlen))
+		return FALSE;
+	    while (len--)
+	    {
+		s->out[s->outpos] = s->out[s->outpos - dist];
+		++s->outpos;
+	    }
+	}
+    }
+}
+
+static gboolean inflate_dynamic (Inflate *s)
+{
+    static const gshort order[19] =
+	{16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    gshort lengths[320];
+    InflateHuffman lencode, distcode;
+    gint nlen, ndist, ncode, index;
+
+    nlen = inflate_bits (s, 5);
+    ndist = inflate_bits (s, 5);
+    ncode = inflate_bits (s, 4);
+    if ((nlen < 0) || (ndist < 0) || (ncode < 0))
+	return FALSE;
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if ((nlen > 286) || (ndist > 30))
+	return FALSE;
+
+    memset (lengths, 0, sizeof (lengths));
+    for (index=0; index<ncode; ++index)
+    {
+	gint l = inflate_bits (s, 3);
+	if (l < 0) return FALSE;
+	lengths[order[index]] = l;
+    }
+    if (!inflate_construct (&lencode, lengths, 19))
+	return FALSE;
+
+    index = 0;
+    while (index < nlen + ndist)
+    {
+	gint sym = inflate_decode (s, &lencode);
+	gint len = 0, rep;
+	if (sym < 0)
+	    return FALSE;
+	if (sym < 16)
+	{
+	    lengths[index++] = sym;
+	    continue;
+	}
+	if (sym == 16)
+	{
+	    if (index == 0) return FALSE;
+	    len = lengths[index-1];
+	    rep = inflate_bits (s, 2);
+	    if (rep < 0) return FALSE;
+	    rep += 3;
+	}
+	else if (sym == 17)
+	{
+	    rep = inflate_bits (s, 3);
+	    if (rep < 0) return FALSE;
+	    rep += 3;
+	}
+	else
+	{
+	    rep = inflate_bits (s, 7);
+	    if (rep < 0) return FALSE;
+	    rep += 11;
+	}
+	if (index + rep > nlen + ndist)
+	    return FALSE;
+	while (rep--)
+	    lengths[index++] = len;
+    }
+    if (lengths[256] == 0)
+	return FALSE;
+    if (!inflate_construct (&lencode, lengths, nlen))
+	return FALSE;
+    if (!inflate_construct (&distcode, lengths + nlen, ndist))
+	return FALSE;
+    return inflate_codes (s, &lencode, &distcode);
+}
+
+/* the fixed Huffman codes, shared by all threads */
+static InflateHuffman fixed_lencode, fixed_distcode;
+
+static gpointer inflate_fixed_init (gpointer data)
+{
+    gshort lengths[288];
+    gint sym;
+    for (sym=0; sym<144; ++sym) lengths[sym] = 8;
+    for (; sym<256; ++sym)      lengths[sym] = 9;
+    for (; sym<280; ++sym)      lengths[sym] = 7;
+    for (; sym<288; ++sym)      lengths[sym] = 8;
+    inflate_construct (&fixed_lencode, lengths, 288);
+    for (sym=0; sym<30; ++sym)  lengths[sym] = 5;
+    inflate_construct (&fixed_distcode, lengths, 30);
+    return NULL;
+}
+
+static gboolean inflate_fixed (Inflate *s)
+{
+    static GOnce fixed_once = G_ONCE_INIT;
+
+    g_once (&fixed_once, inflate_fixed_init, NULL);
+    return inflate_codes (s, &fixed_lencode, &fixed_distcode);
+}
+
+static gboolean inflate_stored (Inflate *s)
+{
+    guint len, nlen;
+
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    if (s->inpos + 4 > s->inlen)
+	return FALSE;
+    len = s->in[s->inpos] | (s->in[s->inpos+1] << 8);
+    nlen = s->in[s->inpos+2] | (s->in[s->inpos+3] << 8);
+    s->inpos += 4;
+    if (len != (~nlen & 0xffff))
+	return FALSE;
+    if ((s->inpos + len > s->inlen) || (s->outpos + len > s->outlen))
+	return FALSE;
+    memcpy (s->out + s->outpos, s->in + s->inpos, len);
+    s->inpos += len;
+    s->outpos += len;
+    return TRUE;
+}
+
+/* Inflate the zlib stream @in into @out, which must be exactly as
+   large as the uncompressed data */
+static gboolean zlib_uncompress (const guchar *in, gsize inlen,
+				 guchar *out, gsize outlen)
+{
+    Inflate s;
+    gint last, type;
+
+    if ((inlen < 2) || ((in[0] & 0x0f) != 8) ||
+	(((in[0] << 8) | in[1]) % 31 != 0) || (in[1] & 0x20))
+	return FALSE;
+
+    memset (&s, 0, sizeof (s));
+    s.in = in + 2;
+    s.inlen = inlen - 2;
+    s.out = out;
+    s.outlen = outlen;
+
+    do
+    {
+	gboolean ok;
+	last = inflate_bits (&s, 1);
+	type = inflate_bits (&s, 2);
+	switch (type)
+	{
+	case 0:  ok = inflate_stored (&s);  break;
+	case 1:  ok = inflate_fixed (&s);   break;
+	case 2:  ok = inflate_dynamic (&s); break;
+	default: ok = FALSE;                break;
+	}
+	if (!ok)
+	    return FALSE;
+    } while (last == 0);
+
+    return s.outpos == s.outlen;
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * PNG
+ *
+\* ------------------------------------------------------------ */
+
+typedef struct
+{
+    gint width, height;
+    gint depth;
+    gint color_type;
+    gint channels;        /* samples per pixel in the file */
+    gint bpp;             /* bytes per complete pixel, at least 1 */
+    guchar palette[256][4];
+    gint palette_len;
+    gboolean has_trns;
+    guint16 trns[3];      /* transparent gray or RGB value */
+} PngInfo;
+
+static inline guint32 png_get32 (const guchar *p)
+{
+    return ((guint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline gint png_paeth (gint a, gint b, gint c)
+{
+    gint p = a + b - c;
+    gint pa = ABS (p - a), pb = ABS (p - b), pc = ABS (p - c);
+    if ((pa <= pb) && (pa <= pc)) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static gsize png_rowbytes (const PngInfo *png, gint width)
+{
+    return ((gsize)width * png->channels * png->depth + 7) / 8;
+}
+
+/* read sample @i (counted in samples, not pixels) from @row */
+static inline guint png_sample (const PngInfo *png, const guchar *row, gint i)
+{
+    switch (png->depth)
+    {
+    case 16: return (row[2*i] << 8) | row[2*i+1];
+    case 8:  return row[i];
+    default:
+    {
+	gint bit = i * png->depth;
+	gint shift = 8 - png->depth - (bit & 7);
+	return (row[bit >> 3] >> shift) & ((1 << png->depth) - 1);
+    }
+    }
+}
+
+static inline guchar png_scale8 (const PngInfo *png, guint v)
+{
+    switch (png->depth)
+    {
+    case 16: return v >> 8;
+    case 8:  return v;
+    case 4:  return v * 0x11;
+    case 2:  return v * 0x55;
+    default: return v ? 0xff : 0;
+    }
+}
+
+/* unfilter a (sub)image of @pw x @ph pixels stored in @raw and copy
+   it into @image, pixel (x,y) going to (x0+x*dx, y0+y*dy) */
+static gboolean png_process_pass (const PngInfo *png, guchar *raw,
+				  gint pw, gint ph, Itdb_Image *image,
+				  gint x0, gint y0, gint dx, gint dy)
+{
+    gsize rb = png_rowbytes (png, pw);
+    guchar *prev = NULL;
+    gint x, y;
+
+    for (y=0; y<ph; ++y)
+    {
+	guchar *row = raw + y*(rb+1) + 1;
+	gint filter = row[-1];
+	gsize i;
+	guchar *o;
+
+	switch (filter)
+	{
+	case 0:
+	    break;
+	case 1:
+	    for (i=png->bpp; i<rb; ++i)
+		row[i] += row[i - png->bpp];
+	    break;
+	case 2:
+	    if (prev)
+		for (i=0; i<rb; ++i)
+		    row[i] += prev[i];
+	    break;
+	case 3:
+	    for (i=0; i<rb; ++i)
+	    {
+		gint a = (i >= png->bpp) ? row[i - png->bpp] : 0;
+		gint b = prev ? prev[i] : 0;
+		row[i] += (a + b) >> 1;
+	    }
+	    break;
+	case 4:
+	    for (i=0; i<rb; ++i)
+	    {
+		gint a = (i >= png->bpp) ? row[i - png->bpp] : 0;
+		gint b = prev ? prev[i] : 0;
+		gint c = (prev && (i >= png->bpp)) ? prev[i - png->bpp] : 0;
+		row[i] += png_paeth (a, b, c);
+	    }
+	    break;
+	default:
+	    return FALSE;
+	}
+	prev = row;
+
+	o = image->pixels + (y0 + y*dy)*image->rowstride + x0*image->n_channels;
+	for (x=0; x<pw; ++x, o += dx*image->n_channels)
+	{
+	    guint r, g, b, a = 0xff;
+	    switch (png->color_type)
+	    {
+	    case 0:
+		r = png_sample (png, row, x);
+		if (png->has_trns && (r == png->trns[0])) a = 0;
+		r = g = b = png_scale8 (png, r);
+		break;
+	    case 2:
+		r = png_sample (png, row, 3*x);
+		g = png_sample (png, row, 3*x+1);
+		b = png_sample (png, row, 3*x+2);
+		if (png->has_trns && (r == png->trns[0]) &&
+		    (g == png->trns[1]) && (b == png->trns[2])) a = 0;
+		r = png_scale8 (png, r);
+		g = png_scale8 (png, g);
+		b = png_scale8 (png, b);
+		break;
+	    case 3:
+	    {
+		guint idx = png_sample (png, row, x);
+		if (idx >= png->palette_len)
+		    return FALSE;
+		r = png->palette[idx][0];
+		g = png->palette[idx][1];
+		b = png->palette[idx][2];
+		a = png->palette[idx][3];
+		break;
+	    }
+	    case 4:
+		r = g = b = png_scale8 (png, png_sample (png, row, 2*x));
+		a = png_scale8 (png, png_sample (png, row, 2*x+1));
+		break;
+	    default: /* 6 */
+		r = png_scale8 (png, png_sample (png, row, 4*x));
+		g = png_scale8 (png, png_sample (png, row, 4*x+1));
+		b = png_scale8 (png, png_sample (png, row, 4*x+2));
+		a = png_scale8 (png, png_sample (png, row, 4*x+3));
+		break;
+	    }
+	    o[0] = r;
+	    o[1] = g;
+	    o[2] = b;
+	    if (image->n_channels == 4)
+		o[3] = a;
+	}
+    }
+    return TRUE;
+}
+
+/* Decode the PNG image in @data */
+G_GNUC_INTERNAL Itdb_Image *
+itdb_image_decode_png (const guchar *data, gsize len)
+{
+    static const gint adam7[7][4] = { /* x0, y0, dx, dy */
+	{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+	{0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2} };
+    PngInfo png;
+    GByteArray *idat;
+    Itdb_Image *image = NULL;
+    guchar *raw = NULL;
+    gsize pos, rawlen = 0;
+    gint interlace = 0, pass, npasses;
+    gboolean ok = TRUE, have_header = FALSE;
+
+    g_return_val_if_fail (data, NULL);
+
+    if ((len < 8) || (memcmp (data, "\211PNG\r\n\032\n", 8) != 0))
+	return NULL;
+
+    memset (&png, 0, sizeof (png));
+    idat = g_byte_array_new ();
+
+    for (pos=8; ok && (pos + 12 <= len); )
+    {
+	guint32 clen = png_get32 (data + pos);
+	const guchar *type = data + pos + 4;
+	const guchar *cdata = data + pos + 8;
+
+	if ((clen > len) || (pos + 12 + clen > len))
+	{
+	    ok = FALSE;
+	    break;
+	}
+	pos += 12 + clen;
+
+	if (memcmp (type, "IHDR", 4) == 0)
+	{
+	    if (clen < 13) { ok = FALSE; break; }
+	    png.width = png_get32 (cdata);
+	    png.height = png_get32 (cdata+4);
+	    png.depth = cdata[8];
+	    png.color_type = cdata[9];
+	    interlace = cdata[12];
+	    switch (png.color_type)
+	    {
+	    case 0: png.channels = 1; break;
+	    case 2: png.channels = 3; break;
+	    case 3: png.channels = 1; break;
+	    case 4: png.channels = 2; break;
+	    case 6: png.channels = 4; break;
+	    default: ok = FALSE; break;
+	    }
+	    if ((png.depth != 1) && (png.depth != 2) && (png.depth != 4) &&
+		(png.depth != 8) && (png.depth != 16))
+		ok = FALSE;
+	    if ((png.width <= 0) || (png.height <= 0) ||
+		((gint64)png.width * png.height > IMAGE_MAX_PIXELS) ||
+		(cdata[10] != 0) || (cdata[11] != 0) || (interlace > 1))
+		ok = FALSE;
+	    png.bpp = MAX (1, png.channels * png.depth / 8);
+	    have_header = TRUE;
+	}
+	else if (memcmp (type, "PLTE", 4) == 0)
+	{
+	    guint i;
+	    png.palette_len = MIN (clen / 3, 256);
+	    for (i=0; i<png.palette_len; ++i)
+	    {
+		png.palette[i][0] = cdata[3*i];
+		png.palette[i][1] = cdata[3*i+1];
+		png.palette[i][2] = cdata[3*i+2];
+		png.palette[i][3] = 0xff;
+	    }
+	}
+	else if (memcmp (type, "tRNS", 4) == 0)
+	{
+	    guint i;
+	    png.has_trns = TRUE;
+	    if (png.color_type == 3)
+	    {
+		for (i=0; (i<clen) && (i<256); ++i)
+		    png.palette[i][3] = cdata[i];
+	    }
+	    else if ((png.color_type == 0) && (clen >= 2))
+	    {
+		png.trns[0] = (cdata[0] << 8) | cdata[1];
+	    }
+	    else if ((png.color_type == 2) && (clen >= 6))
+	    {
+		for (i=0; i<3; ++i)
+		    png.trns[i] = (cdata[2*i] << 8) | cdata[2*i+1];
+	    }
+	    else
+	    {
+		png.has_trns = FALSE;
+	    }
+	}
+	else if (memcmp (type, "IDAT", 4) == 0)
+	{
+	    g_byte_array_append (idat, cdata, clen);
+	}
+	else if (memcmp (type, "IEND", 4) == 0)
+	{
+	    break;
+	}
+	else if (!(type[0] & 0x20))
+	{   /* unknown critical chunk */
+	    ok = FALSE;
+	}
+    }
+
+    if (!ok || !have_header || (idat->len == 0) ||
+	((png.color_type == 3) && (png.palette_len == 0)))
+	goto out;
+
+    /* size of the uncompressed data */
+    npasses = interlace ? 7 : 1;
+    for (pass=0; pass<npasses; ++pass)
+    {
+	gint x0 = interlace ? adam7[pass][0] : 0;
+	gint y0 = interlace ? adam7[pass][1] : 0;
+	gint dx = interlace ? adam7[pass][2] : 1;
+	gint dy = interlace ? adam7[pass][3] : 1;
+	gint pw = (png.width - x0 + dx - 1) / dx;
+	gint ph = (png.height - y0 + dy - 1) / dy;
+	if ((pw > 0) && (ph > 0))
+	    rawlen += (png_rowbytes (&png, pw) + 1) * ph;
+    }
+    raw = g_try_malloc (rawlen);
+    if (!raw || !zlib_uncompress (idat->data, idat->len, raw, rawlen))
+	goto out;
+
+    image = itdb_image_new (png.width, png.height,
+			    ((png.color_type == 4) || (png.color_type == 6) ||
+			     png.has_trns) ? 4 : 3);
+    pos = 0;
+    for (pass=0; pass<npasses; ++pass)
+    {
+	gint x0 = interlace ? adam7[pass][0] : 0;
+	gint y0 = interlace ? adam7[pass][1] : 0;
+	gint dx = interlace ? adam7[pass][2] : 1;
+	gint dy = interlace ? adam7[pass][3] : 1;
+	gint pw = (png.width - x0 + dx - 1) / dx;
+	gint ph = (png.height - y0 + dy - 1) / dy;
+	if ((pw <= 0) || (ph <= 0))
+	    continue;
+	if (!png_process_pass (&png, raw + pos, pw, ph, image, x0, y0, dx, dy))
+	{
+	    itdb_image_free (image);
+	    image = NULL;
+	    break;
+	}
+	pos += (png_rowbytes (&png, pw) + 1) * ph;
+    }
+
+  out:
+    g_free (raw);
+    g_byte_array_free (idat, TRUE);
+    return image;
+}
@@ -274,13 +274,20 @@ typedef struct _MHODData MHODData;
 /* Declarations */
 static gboolean itdb_create_directories (Itdb_Device *device, GError **error);
 
-/* ID for error domain */
+static gpointer itdb_file_error_quark_init (gpointer data)
+{
+    return GUINT_TO_POINTER (
+	g_quark_from_static_string ("itdb-file-error-quark"));
+}
+
+/* ID for error domain. Errors are set by parsers and writers running
+   on several threads at once, see itdb_async.c */
 GQuark itdb_file_error_quark (void)
 {
-    static GQuark q = 0;
-    if (q == 0)
-	q = g_quark_from_static_string ("itdb-file-error-quark");
-    return q;
+    static GOnce quark_once = G_ONCE_INIT;
+
+    g_once (&quark_once, itdb_file_error_quark_init, NULL);
+    return GPOINTER_TO_UINT (quark_once.retval);
 }
 
 
@@ -309,6 +316,30 @@ static FContents *fcontents_read (const gchar *fname, GError **error)
 }
 
 
+/* Like fcontents_read() but maps @fname into memory instead of
+   copying it. The contents must not be changed. Falls back to reading
+   @fname if it can't be mapped (e.g. empty files on some systems). */
+static FContents *fcontents_map (const gchar *fname, GError **error)
+{
+    GMappedFile *mapped;
+    FContents *cts;
+
+    g_return_val_if_fail (fname, NULL);
+
+    mapped = g_mapped_file_new (fname, FALSE, NULL);
+    if (!mapped)
+	return fcontents_read (fname, error);
+
+    cts = g_new0 (FContents, 1);
+    cts->reversed = FALSE;
+    cts->mapped = mapped;
+    cts->contents = g_mapped_file_get_contents (mapped);
+    cts->length = g_mapped_file_get_length (mapped);
+    cts->filename = g_strdup (fname);
+    return cts;
+}
+
+
 /* Frees the memory taken by a FContents structure. NULL pointer will
  * be ignored */
 static void fcontents_free (FContents *cts)
@@ -316,7 +347,10 @@ static void fcontents_free (FContents *cts)
     if (cts)
     {
 	g_free (cts->filename);
-	g_free (cts->contents);
+	if (cts->mapped)
+	    g_mapped_file_free (cts->mapped);
+	else
+	    g_free (cts->contents);
 	/* must not g_error_free (cts->error) because the error was
 	   propagated -> might free the error twice */
 	g_free (cts);
@@ -334,6 +368,317 @@ static void fcontents_free (FContents *cts)
    component of the filename.  If we can find such a match, we return
    it.  Otherwise, we return NULL.*/
      
+/* Directory listings used by itdb_resolve_path(). Maps a directory
+   (see resolve_cache_key()) to a ResolveDir. Listings are used without
+   looking at the directory again until they are dropped: by
+   itdb_resolve_path_invalidate() whenever libgpod creates, renames or
+   removes something in that directory, and all listings below a mount
+   point when it is (re)assigned to a device
+   (itdb_resolve_path_forget_tree()). */
+typedef struct
+{
+    GHashTable *names;   /* entries as found in the directory     */
+    GHashTable *folded;  /* collation key of casefolded UTF8 name
+			    -> first entry with that key          */
+} ResolveDir;
+
+G_LOCK_DEFINE_STATIC (resolve_cache);
+static GHashTable *resolve_cache = NULL;
+/* incremented whenever listings are dropped, so that a listing read
+   meanwhile without holding the lock isn't added */
+static guint resolve_cache_generation = 0;
+
+static void resolve_dir_free (ResolveDir *rdir)
+{
+    g_hash_table_destroy (rdir->names);
+    g_hash_table_destroy (rdir->folded);
+    g_free (rdir);
+}
+
+static gchar *resolve_fold (const gchar *name_utf8)
+{
+    gchar *stdcase = g_utf8_casefold (name_utf8, -1);
+    gchar *key = g_utf8_collate_key (stdcase, -1);
+    g_free (stdcase);
+    return key;
+}
+
+/* Key of @path in resolve_cache: casefolded, without duplicate or
+   trailing separators, so that different spellings of the same
+   directory share one listing */
+static gchar *resolve_cache_key (const gchar *path)
+{
+    gchar *path_utf8, *key;
+    GString *str;
+    const gchar *p;
+
+    str = g_string_sized_new (strlen (path));
+    for (p=path; *p; ++p)
+    {
+	if (G_IS_DIR_SEPARATOR (*p) &&
+	    (str->len > 0) && G_IS_DIR_SEPARATOR (str->str[str->len-1]))
+	    continue;
+	g_string_append_c (str, G_IS_DIR_SEPARATOR (*p) ? G_DIR_SEPARATOR : *p);
+    }
+    while ((str->len > 1) && G_IS_DIR_SEPARATOR (str->str[str->len-1]))
+	g_string_truncate (str, str->len-1);
+
+    path_utf8 = g_filename_to_utf8 (str->str, -1, NULL, NULL, NULL);
+    if (path_utf8)
+    {
+	key = g_utf8_casefold (path_utf8, -1);
+	g_free (path_utf8);
+	g_string_free (str, TRUE);
+    }
+    else
+    {
+	key = g_string_free (str, FALSE);
+    }
+    return key;
+}
+
+static ResolveDir *resolve_dir_read (const gchar *dir)
+{
+    ResolveDir *rdir;
+    GDir *cur_dir;
+    const gchar *dir_file;
+
+    cur_dir = g_dir_open (dir, 0, NULL);
+    if (!cur_dir)
+	return NULL;
+
+    rdir = g_new0 (ResolveDir, 1);
+    rdir->names = g_hash_table_new_full (g_str_hash, g_str_equal,
+					 g_free, NULL);
+    rdir->folded = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free, NULL);
+    while ((dir_file = g_dir_read_name (cur_dir)))
+    {
+	gchar *name = g_strdup (dir_file);
+	gchar *file_utf8 = g_filename_to_utf8 (dir_file, -1, NULL, NULL, NULL);
+
+	g_hash_table_insert (rdir->names, name, name);
+	if (file_utf8)
+	{
+	    gchar *key = resolve_fold (file_utf8);
+	    if (!g_hash_table_lookup (rdir->folded, key))
+		g_hash_table_insert (rdir->folded, key, name);
+	    else
+		g_free (key);
+	    g_free (file_utf8);
+	}
+    }
+    g_dir_close (cur_dir);
+    return rdir;
+}
+
+static gchar *resolve_dir_match (ResolveDir *rdir, const gchar *component,
+				 const gchar *component_as_filename)
+{
+    gchar *key, *result;
+
+    if (component_as_filename &&
+	g_hash_table_lookup (rdir->names, component_as_filename))
+	return g_strdup (component_as_filename);
+
+    key = resolve_fold (component);
+    result = g_strdup (g_hash_table_lookup (rdir->folded, key));
+    g_free (key);
+    return result;
+}
+
+/* Look up the entry of @dir matching @component (utf8) -- the entry
+   named exactly like @component if present, a case insensitive match
+   otherwise. Returns a newly allocated entry name or NULL if @dir does
+   not contain a match or cannot be read. */
+static gchar *resolve_dir_lookup (const gchar *dir, const gchar *component,
+				  const gchar *component_as_filename)
+{
+    ResolveDir *rdir;
+    gchar *dir_key, *result = NULL;
+    guint generation;
+
+    dir_key = resolve_cache_key (dir);
+
+    G_LOCK (resolve_cache);
+    if (!resolve_cache)
+	resolve_cache = g_hash_table_new_full (
+	    g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)resolve_dir_free);
+
+    rdir = g_hash_table_lookup (resolve_cache, dir_key);
+    if (rdir)
+	result = resolve_dir_match (rdir, component, component_as_filename);
+    generation = resolve_cache_generation;
+    G_UNLOCK (resolve_cache);
+
+    if (!rdir)
+    {
+	/* Read the directory without holding the lock: with several
+	   iPods parsed at once, a large music directory of one of them
+	   must not hold up the others. If another thread read it
+	   meanwhile, its listing is just as good. If listings were
+	   dropped meanwhile, this one may be outdated already. */
+	rdir = resolve_dir_read (dir);
+	if (rdir)
+	{
+	    result = resolve_dir_match (rdir, component,
+					component_as_filename);
+	    G_LOCK (resolve_cache);
+	    if (resolve_cache && (generation == resolve_cache_generation))
+	    {
+		g_hash_table_insert (resolve_cache, dir_key, rdir);
+		dir_key = NULL;
+		rdir = NULL;
+	    }
+	    G_UNLOCK (resolve_cache);
+	    if (rdir)
+		resolve_dir_free (rdir);
+	}
+    }
+
+    g_free (dir_key);
+    return result;
+}
+
+/* Drop the listing of @dir, if any */
+static void resolve_dir_forget (const gchar *dir)
+{
+    gchar *key = resolve_cache_key (dir);
+
+    G_LOCK (resolve_cache);
+    if (resolve_cache)
+	g_hash_table_remove (resolve_cache, key);
+    ++resolve_cache_generation;
+    G_UNLOCK (resolve_cache);
+    g_free (key);
+}
+
+static gboolean resolve_dir_below (gpointer key, gpointer value,
+				   gpointer user_data)
+{
+    const gchar *dir_key = key;
+    const gchar *root_key = user_data;
+    gsize len = strlen (root_key);
+
+    if (strncmp (dir_key, root_key, len) != 0)
+	return FALSE;
+    return (dir_key[len] == 0) || G_IS_DIR_SEPARATOR (dir_key[len]) ||
+	((len > 0) && G_IS_DIR_SEPARATOR (root_key[len-1]));
+}
+
+/* Drop the listings of @root and of all directories below it. Called
+   when @root is assigned to a device, since the file system mounted
+   there may not be the one that was read before. */
+void itdb_resolve_path_forget_tree (const gchar *root)
+{
+    gchar *root_key;
+
+    g_return_if_fail (root);
+
+    root_key = resolve_cache_key (root);
+    G_LOCK (resolve_cache);
+    if (resolve_cache)
+	g_hash_table_foreach_remove (resolve_cache,
+				     resolve_dir_below, root_key);
+    ++resolve_cache_generation;
+    G_UNLOCK (resolve_cache);
+    g_free (root_key);
+}
+
+/**
+ * itdb_resolve_path_invalidate:
+ * @path: a file or directory that was created, renamed or removed, or
+ * NULL
+ *
+ * itdb_resolve_path() remembers the contents of the directories it has
+ * looked at and doesn't look at them again until told so: libgpod
+ * calls this function for files and directories it creates, renames
+ * or removes itself, and forgets everything below a mount point when
+ * it is assigned to a device (itdb_parse(), itdb_device_set_mountpoint()).
+ *
+ * Call it with the path of a file (or NULL to forget about all
+ * directories) after adding, renaming or removing files on the iPod by
+ * other means while an #Itdb_iTunesDB is kept, or when the iPod itself
+ * may have changed them. Without it, files that are gone are still
+ * found (itdb_resolve_path() checks its result and looks again) and
+ * new files are found as long as no old file matches them case
+ * insensitively, but each such lookup costs more file system
+ * accesses than rereading the directory once.
+ **/
+void itdb_resolve_path_invalidate (const gchar *path)
+{
+    gchar *dir;
+
+    if (path)
+    {
+	resolve_dir_forget (path);
+	dir = g_path_get_dirname (path);
+	resolve_dir_forget (dir);
+	g_free (dir);
+    }
+    else
+    {
+	G_LOCK (resolve_cache);
+	if (resolve_cache)
+	{
+	    g_hash_table_destroy (resolve_cache);
+	    resolve_cache = NULL;
+	}
+	++resolve_cache_generation;
+	G_UNLOCK (resolve_cache);
+    }
+}
+
+/* itdb_resolve_path() through the directory listings: the path of
+   @components below @root (not checked for existence), or NULL if a
+   component can't be found */
+static gchar *resolve_path_listed (const gchar *root,
+				   const gchar * const * components)
+{
+  gchar *good_path;
+  guint32 i;
+
+  good_path = g_strdup(root);
+
+  for(i = 0 ; components[i] ; i++) {
+    gchar *component_as_filename;
+    gchar *entry;
+    gchar *new_good_path;
+
+    /* skip empty components */
+    if (strlen (components[i]) == 0) continue;
+    component_as_filename = 
+      g_filename_from_utf8(components[i],-1,NULL,NULL,NULL);
+    entry = resolve_dir_lookup (good_path, components[i],
+				component_as_filename);
+    if (!entry && component_as_filename)
+    {
+      /* Not (yet) in the listing of this directory. Fall back to
+	 the file system in case it was created behind our back. */
+      gchar *test_path = g_build_filename(good_path,
+					  component_as_filename,NULL);
+      if(g_file_test(test_path,G_FILE_TEST_EXISTS)) {
+	entry = g_strdup (component_as_filename);
+	itdb_resolve_path_invalidate (test_path);
+      }
+      g_free (test_path);
+    }
+    g_free(component_as_filename);
+    if (!entry) {
+      /* We couldn't fix this component, so don't try later ones */
+      g_free(good_path);
+      return NULL;
+    }
+    new_good_path = g_build_filename(good_path,entry,NULL);
+    g_free(entry);
+    g_free(good_path);
+    good_path = new_good_path;
+  }
+
+  return good_path;
+}
+
 /**
  * itdb_resolve_path:
  * @root: in local encoding
@@ -347,81 +692,39 @@ static void fcontents_free (FContents *cts)
  * append d to good_path and make the result the new good_path.
  * Otherwise, we quit and return NULL.
  *
+ * The contents of each directory are read only once and remembered
+ * for later calls (see itdb_resolve_path_invalidate()). The path
+ * found is checked for existence; if it doesn't exist because the
+ * remembered contents are outdated, the directories below @root are
+ * read again.
+ *
  * Return value: path to track on the iPod or NULL.
  **/
 gchar * itdb_resolve_path (const gchar *root,
 			   const gchar * const * components)
 {
-  gchar *good_path = g_strdup(root);
-  guint32 i;
+  gchar *path;
 
   if (!root) return NULL;
 
-  for(i = 0 ; components[i] ; i++) {
-    GDir *cur_dir;
-    gchar *component_as_filename;
-    gchar *test_path;
-    gchar *component_stdcase;
-    const gchar *dir_file=NULL;
-
-    /* skip empty components */
-    if (strlen (components[i]) == 0) continue;
-    component_as_filename = 
-      g_filename_from_utf8(components[i],-1,NULL,NULL,NULL);
-    test_path = g_build_filename(good_path,component_as_filename,NULL);
-    g_free(component_as_filename);
-    if(g_file_test(test_path,G_FILE_TEST_EXISTS)) {
-      /* This component does not require fixup */
-      g_free(good_path);
-      good_path = test_path;
-      continue;
-    }
-    g_free(test_path);
-    component_stdcase = g_utf8_casefold(components[i],-1);
-    /* Case insensitively compare the current component with each entry
-     * in the current directory. */
-
-    cur_dir = g_dir_open(good_path,0,NULL);
-    if (cur_dir) while ((dir_file = g_dir_read_name(cur_dir)))
-    {
-	gchar *file_utf8 = g_filename_to_utf8(dir_file,-1,NULL,NULL,NULL);
-	gchar *file_stdcase = g_utf8_casefold(file_utf8,-1);
-	gboolean found = !g_utf8_collate(file_stdcase,component_stdcase);
-	gchar *new_good_path;
-	g_free(file_stdcase);
-	if(!found)
-	{
-	    /* This is not the matching entry */
-	    g_free(file_utf8);
-	    continue;
-	}
-      
-	new_good_path = dir_file ? g_build_filename(good_path,dir_file,NULL) : NULL;
-	g_free(good_path);
-	good_path= new_good_path;
-	/* This is the matching entry, so we can stop searching */
-	break;
-    }
-    
-    if(!dir_file) {
-      /* We never found a matching entry */
-      g_free(good_path);
-      good_path = NULL;
+  path = resolve_path_listed (root, components);
+  if (path && !g_file_test (path, G_FILE_TEST_EXISTS))
+  {
+    /* removed or renamed behind our back */
+    g_free (path);
+    itdb_resolve_path_forget_tree (root);
+    path = resolve_path_listed (root, components);
+    if (path && !g_file_test (path, G_FILE_TEST_EXISTS))
+    {
+      g_free (path);
+      path = NULL;
     }
-
-    g_free(component_stdcase);
-    if (cur_dir) g_dir_close(cur_dir);
-    if(!good_path || !g_file_test(good_path,G_FILE_TEST_EXISTS))
-      break; /* We couldn't fix this component, so don't try later ones */
   }
-    
-  if(good_path && g_file_test(good_path,G_FILE_TEST_EXISTS))
-    return good_path;
-          
-  return NULL;
+  return path;
 }
 
 
+
 /* Check if the @seek with length @len is legal or out of
  * range. Returns TRUE if legal and FALSE when it is out of range, in
  * which case cts->error is set as well. */
@@ -430,7 +733,7 @@ static gboolean check_seek (FContents *cts, glong seek, glong len)
     g_return_val_if_fail (cts, FALSE);
     g_return_val_if_fail (cts->contents, FALSE);
 
-    if ((seek+len <= cts->length) && (seek >=0))
+    if ((seek >= 0) && (len >= 0) && (seek+len <= cts->length))
     {
 	return TRUE;
     }
@@ -531,21 +834,6 @@ static guint8 get8int (FContents *cts, glong seek)
    Little Endian
    ------------------------------------------------------------ */
 
-/* Get the 2-byte-number stored at position "seek" in little endian
-   encoding. On error the GError in @cts is set. */
-static guint16 raw_get16lint (FContents *cts, glong seek)
-{
-    guint16 n=0;
-
-    if (check_seek (cts, seek, 2))
-    {
-	g_return_val_if_fail (cts->contents, 0);
-	memcpy (&n, &cts->contents[seek], 2);
-	n = GUINT16_FROM_LE (n);
-    }
-    return n;
-}
-
 /* Get the 3-byte-number stored at position "seek" in little endian
    encoding. On error the GError in @cts is set. */
 static guint32 raw_get24lint (FContents *cts, glong seek)
@@ -577,22 +865,6 @@ static guint32 raw_get32lint (FContents *cts, glong seek)
     return n;
 }
 
-/* Get 4 byte floating number */
-static float raw_get32lfloat (FContents *cts, glong seek)
-{
-    union
-    {
-	guint32 i;
-	float   f;
-    } flt;
-
-    g_return_val_if_fail (sizeof (float) == 4, 0);
-
-    flt.i = raw_get32lint (cts, seek);
-
-    return flt.f;
-}
-
 
 /* Get the 8-byte-number stored at position "seek" in little endian
    encoding. On error the GError in @cts is set. */
@@ -614,21 +886,6 @@ static guint64 raw_get64lint (FContents *cts, glong seek)
    Big Endian
    ------------------------------------------------------------ */
 
-/* Get the 2-byte-number stored at position "seek" in little endian
-   encoding. On error the GError in @cts is set. */
-static guint16 raw_get16bint (FContents *cts, glong seek)
-{
-    guint16 n=0;
-
-    if (check_seek (cts, seek, 2))
-    {
-	g_return_val_if_fail (cts->contents, 0);
-	memcpy (&n, &cts->contents[seek], 2);
-	n = GUINT16_FROM_BE (n);
-    }
-    return n;
-}
-
 /* Get the 3-byte-number stored at position "seek" in big endian
    encoding. On error the GError in @cts is set. */
 static guint32 raw_get24bint (FContents *cts, glong seek)
@@ -660,22 +917,6 @@ static guint32 raw_get32bint (FContents *cts, glong seek)
     return n;
 }
 
-/* Get 4 byte floating number */
-static float raw_get32bfloat (FContents *cts, glong seek)
-{
-    union
-    {
-	guint32 i;
-	float   f;
-    } flt;
-
-    g_return_val_if_fail (sizeof (float) == 4, 0);
-
-    flt.i = raw_get32bint (cts, seek);
-
-    return flt.f;
-}
-
 /* Get the 8-byte-number stored at position "seek" in big endian
    encoding. On error the GError in @cts is set. */
 static guint64 raw_get64bint (FContents *cts, glong seek)
@@ -698,14 +939,6 @@ static guint64 raw_get64bint (FContents *cts, glong seek)
 
 /* The following functions take into consideration the state of
  * cts->reversed and call either raw_getnnlint or raw_getnnbint */
-static guint16 get16lint (FContents *cts, glong seek)
-{
-    g_return_val_if_fail (cts, 0);
-    if (!cts->reversed)
-	return raw_get16lint (cts, seek);
-    else
-	return raw_get16bint (cts, seek);
-}
 
 static guint32 get24lint (FContents *cts, glong seek)
 {
@@ -715,16 +948,6 @@ static guint32 get24lint (FContents *cts, glong seek)
     else
 	return raw_get24bint (cts, seek);
 }
-#if 0
-static guint32 get24bint (FContents *cts, glong seek)
-{
-    g_return_val_if_fail (cts, 0);
-    if (!cts->reversed)
-	return raw_get24bint (cts, seek);
-    else
-	return raw_get24lint (cts, seek);
-}
-#endif
 static guint32 get32lint (FContents *cts, glong seek)
 {
     g_return_val_if_fail (cts, 0);
@@ -734,15 +957,6 @@ static guint32 get32lint (FContents *cts, glong seek)
 	return raw_get32bint (cts, seek);
 }
 
-static float get32lfloat (FContents *cts, glong seek)
-{
-    g_return_val_if_fail (cts, 0);
-    if (!cts->reversed)
-	return raw_get32lfloat (cts, seek);
-    else
-	return raw_get32bfloat (cts, seek);
-}
-
 static guint64 get64lint (FContents *cts, glong seek)
 {
     g_return_val_if_fail (cts, 0);
@@ -758,16 +972,6 @@ static guint64 get64lint (FContents *cts, glong seek)
    Reversed Endian Sensitive (big endian)
    ------------------------------------------------------------ */
 
-#if 0
-static guint16 get16bint (FContents *cts, glong seek)
-{
-    g_return_val_if_fail (cts, 0);
-    if (!cts->reversed)
-	return raw_get16bint (cts, seek);
-    else
-	return raw_get16lint (cts, seek);
-}
-#endif
 static guint32 get32bint (FContents *cts, glong seek)
 {
     g_return_val_if_fail (cts, 0);
@@ -777,27 +981,101 @@ static guint32 get32bint (FContents *cts, glong seek)
 	return raw_get32lint (cts, seek);
 }
 
-#if 0
-static float get32bfloat (FContents *cts, glong seek)
+static guint64 get64bint (FContents *cts, glong seek)
 {
     g_return_val_if_fail (cts, 0);
     if (!cts->reversed)
-	return raw_get32bfloat (cts, seek);
+	return raw_get64bint (cts, seek);
     else
-	return raw_get32lfloat (cts, seek);
+	return raw_get64lint (cts, seek);
 }
+
+
+
+
+/* ------------------------------------------------------------
+   Validated views
+   ------------------------------------------------------------ */
+
+/* A range of cts->contents that is checked once with check_seek() by
+   fview_init(). The fields inside the range are then read without
+   any further checks -- the caller must make sure that every offset
+   read lies inside the range, usually by checking the header length
+   found in the file against the fields used, as get_mhit() does. */
+typedef struct
+{
+    const guchar *data;
+    glong len;
+    gboolean reversed;
+} FView;
+
+/* Sets up @view for @len bytes at @seek. Returns FALSE and sets
+ * cts->error if the range is out of bounds. */
+static gboolean fview_init (FView *view, FContents *cts,
+			    glong seek, glong len)
+{
+    if (!check_seek (cts, seek, len))
+	return FALSE;
+    view->data = (const guchar *)&cts->contents[seek];
+    view->len = len;
+    view->reversed = cts->reversed;
+    return TRUE;
+}
+
+#if ITUNESDB_DEBUG
+#  define FVIEW_CHECK(view, offset, n) \
+    g_assert (((offset) >= 0) && ((offset)+(n) <= (view)->len))
+#else
+#  define FVIEW_CHECK(view, offset, n)
 #endif
 
-static guint64 get64bint (FContents *cts, glong seek)
+/* The following functions read a field at @offset inside @view,
+ * taking into consideration the state of cts->reversed when the view
+ * was set up (little endian unless reversed) */
+static inline guint8 fview_get8 (const FView *view, glong offset)
 {
-    g_return_val_if_fail (cts, 0);
-    if (!cts->reversed)
-	return raw_get64bint (cts, seek);
-    else
-	return raw_get64lint (cts, seek);
+    FVIEW_CHECK (view, offset, 1);
+    return view->data[offset];
 }
 
+static inline guint16 fview_get16l (const FView *view, glong offset)
+{
+    guint16 n;
 
+    FVIEW_CHECK (view, offset, 2);
+    memcpy (&n, view->data+offset, 2);
+    return view->reversed ? GUINT16_FROM_BE (n) : GUINT16_FROM_LE (n);
+}
+
+static inline guint32 fview_get32l (const FView *view, glong offset)
+{
+    guint32 n;
+
+    FVIEW_CHECK (view, offset, 4);
+    memcpy (&n, view->data+offset, 4);
+    return view->reversed ? GUINT32_FROM_BE (n) : GUINT32_FROM_LE (n);
+}
+
+static inline float fview_get32lfloat (const FView *view, glong offset)
+{
+    union
+    {
+	guint32 i;
+	float   f;
+    } flt;
+
+    flt.i = fview_get32l (view, offset);
+    return flt.f;
+}
+
+static inline guint64 fview_get64l (const FView *view, glong offset)
+{
+    guint64 n;
+
+    FVIEW_CHECK (view, offset, 8);
+    memcpy (&n, view->data+offset, 8);
+    return view->reversed ? GUINT64_FROM_BE (n) : GUINT64_FROM_LE (n);
+}
 
 
 /* Fix little endian UTF16 String to correct byteorder if necessary
@@ -839,29 +1117,27 @@ static gunichar2 *fixup_big_utf16 (gunichar2 *utf16_string)
 #define CHECK_ERROR(imp, val) if (cts->error) { g_propagate_error (&imp->error, cts->error); return (val); }
 
 
-/* get next playcount, that is the first entry of GList
- * playcounts. This entry is removed from the list. You must free the
- * return value after use */
+/* get next playcount, that is the entry following the one returned
+ * by the previous call. The return value points into
+ * fimp->playcounts and must not be freed. */
 static struct playcount *playcount_get_next (FImport *fimp)
 {
-    struct playcount *playcount;
     g_return_val_if_fail (fimp, NULL);
 
-    playcount = g_list_nth_data (fimp->playcounts, 0);
-
-    if (playcount)
-	fimp->playcounts = g_list_remove (fimp->playcounts, playcount);
-    return playcount;
+    if (fimp->playcounts_next >= fimp->playcounts_num)
+	return NULL;
+    return &fimp->playcounts[fimp->playcounts_next++];
 }
 
-/* delete all entries of GList *playcounts */
+/* delete all entries of the playcounts array */
 static void playcounts_free (FImport *fimp)
 {
-    struct playcount *playcount;
-
     g_return_if_fail (fimp);
 
-    while ((playcount=playcount_get_next (fimp))) g_free (playcount);
+    g_free (fimp->playcounts);
+    fimp->playcounts = NULL;
+    fimp->playcounts_num = 0;
+    fimp->playcounts_next = 0;
 }
 
 
@@ -869,6 +1145,7 @@ static void playcounts_free (FImport *fimp)
 static gboolean playcounts_read (FImport *fimp, FContents *cts)
 {
     guint32 header_length, entry_length, entry_num, i=0;
+    FView view;
 
     g_return_val_if_fail (fimp, FALSE);
     g_return_val_if_fail (cts, FALSE);
@@ -930,25 +1207,42 @@ static gboolean playcounts_read (FImport *fimp, FContents *cts)
     /* number of entries */
     entry_num = get32lint (cts, 12);
     CHECK_ERROR (fimp, FALSE);
+    /* all entries must be inside the file -- check before allocating
+       the array and read them without further checks */
+    if ((guint64)header_length + (guint64)entry_num * entry_length >
+	cts->length)
+    {
+	g_set_error (&fimp->error,
+		     ITDB_FILE_ERROR,
+		     ITDB_FILE_ERROR_CORRUPT,
+		     _("Play Counts file ('%s'): file too short for %d entries."),
+		     cts->filename, entry_num);
+	return FALSE;
+    }
+    if (!fview_init (&view, cts, header_length,
+		     (glong)entry_num * entry_length))
+    {
+	CHECK_ERROR (fimp, FALSE);
+	return FALSE;
+    }
+
+    fimp->playcounts = g_new0 (struct playcount, entry_num);
+    fimp->playcounts_num = entry_num;
     for (i=0; i<entry_num; ++i)
     {
 	guint32 mac_time;
-	struct playcount *playcount = g_new0 (struct playcount, 1);
-	glong seek = header_length + i*entry_length;
+	struct playcount *playcount = &fimp->playcounts[i];
+	glong seek = (glong)i * entry_length;
 
-	check_seek (cts, seek, entry_length);
-	CHECK_ERROR (fimp, FALSE);	
-
-	fimp->playcounts = g_list_append (fimp->playcounts, playcount);
-	playcount->playcount = get32lint (cts, seek);	
-	mac_time = get32lint (cts, seek+4);
+	playcount->playcount = fview_get32l (&view, seek);
+	mac_time = fview_get32l (&view, seek+4);
 	playcount->time_played = device_time_mac_to_time_t (fimp->itdb->device, mac_time);
-	playcount->bookmark_time = get32lint (cts, seek+8);
+	playcount->bookmark_time = fview_get32l (&view, seek+8);
 	
 	/* rating only exists if the entry length is at least 0x10 */
 	if (entry_length >= 0x10)
 	{
-	    playcount->rating = get32lint (cts, seek+12);
+	    playcount->rating = fview_get32l (&view, seek+12);
 	}
 	else
 	{
@@ -957,14 +1251,14 @@ static gboolean playcounts_read (FImport *fimp, FContents *cts)
 	/* unk16 only exists if the entry length is at least 0x14 */
 	if (entry_length >= 0x14)
 	{
-	    playcount->pc_unk16 = get32lint (cts, seek+16);
+	    playcount->pc_unk16 = fview_get32l (&view, seek+16);
 	}
 	/* skip_count and last_skipped only exists if the entry length
 	   is at least 0x1c */
 	if (entry_length >= 0x1c)
 	{
-	    playcount->skipcount = get32lint (cts, seek+20);
-	    mac_time = get32lint (cts, seek+24);
+	    playcount->skipcount = fview_get32l (&view, seek+20);
+	    mac_time = fview_get32l (&view, seek+24);
 	    playcount->last_skipped = device_time_mac_to_time_t (fimp->itdb->device,
 							       mac_time);
 
@@ -986,11 +1280,23 @@ static gboolean itunesstats_read (FImport *fimp, FContents *cts)
     /* number of entries */
     entry_num = get32lint (cts, 0);
     CHECK_ERROR (fimp, FALSE);
+    /* entries are at least 18 bytes long */
+    if (6 + (guint64)entry_num * 18 > cts->length)
+    {
+	g_set_error (&fimp->error,
+		     ITDB_FILE_ERROR,
+		     ITDB_FILE_ERROR_CORRUPT,
+		     _("iTunesStats file ('%s'): file too short for %d entries."),
+		     cts->filename, entry_num);
+	return FALSE;
+    }
 
+    fimp->playcounts = g_new0 (struct playcount, entry_num);
+    fimp->playcounts_num = entry_num;
     seek = 6;
     for (i=0; i<entry_num; ++i)
     {
-	struct playcount *playcount = g_new0 (struct playcount, 1);
+	struct playcount *playcount = &fimp->playcounts[i];
 	guint32 entry_length = get24lint (cts, seek+0);
 	CHECK_ERROR (fimp, FALSE);
 	if (entry_length < 18)
@@ -1003,7 +1309,6 @@ static gboolean itunesstats_read (FImport *fimp, FContents *cts)
 	    return FALSE;
 	}
 
-	fimp->playcounts = g_list_append (fimp->playcounts, playcount);
 	/* NOTE:
 	 *
 	 * The iPod (firmware 1.3, 2.0, ...?) doesn't seem to use the
@@ -1068,13 +1373,14 @@ gboolean playcounts_init (FImport *fimp)
   if (plcname)
   {
       /* skip if playcounts file has zero-length (often happens after
-       * dosfsck) */
-      stat (plcname, &filestat);
-      if (filestat.st_size >= 0x60)
+       * dosfsck) or has disappeared since it was found */
+      if ((g_stat (plcname, &filestat) == 0) &&
+	  (filestat.st_size >= 0x60))
       {
 	  cts = fcontents_read (plcname, &fimp->error);
 	  if (cts)
 	  {
+	      if (fimp->stats) fimp->stats->bytes_read += cts->length;
 	      result = playcounts_read (fimp, cts);
 	      fcontents_free (cts);
 	  }
@@ -1087,13 +1393,14 @@ gboolean playcounts_init (FImport *fimp)
   else if (istname)
   {
       /* skip if iTunesStats file has zero-length (often happens after
-       * dosfsck) */
-      stat (istname, &filestat);
-      if (filestat.st_size >= 0x06)
+       * dosfsck) or has disappeared since it was found */
+      if ((g_stat (istname, &filestat) == 0) &&
+	  (filestat.st_size >= 0x06))
       {
 	  cts = fcontents_read (istname, &fimp->error);
 	  if (cts)
 	  {
+	      if (fimp->stats) fimp->stats->bytes_read += cts->length;
 	      result = itunesstats_read (fimp, cts);
 	      fcontents_free (cts);
 	  }
@@ -1132,22 +1439,64 @@ void itdb_free_fimp (FImport *fimp)
  **/
 void itdb_free (Itdb_iTunesDB *itdb)
 {
+    GList *gl;
+
     if (itdb)
     {
 	g_list_foreach (itdb->playlists,
 			(GFunc)(itdb_playlist_free), NULL);
 	g_list_free (itdb->playlists);
-	g_list_foreach (itdb->tracks,
-			(GFunc)(itdb_track_free), NULL);
+	for (gl=itdb->tracks; gl; gl=gl->next)
+	{   /* snapshots may take over tracks they still share */
+	    if (!itdb_snapshots_track_release (gl->data))
+		itdb_track_free (gl->data);
+	}
 	g_list_free (itdb->tracks);
 	g_free (itdb->filename);
 	itdb_device_free (itdb->device);
 	if (itdb->userdata && itdb->userdata_destroy)
 	    (*itdb->userdata_destroy) (itdb->userdata);
+	itdb_free_private (itdb);
 	g_free (itdb);
     }
 }
 
+/* Returns the private data of @itdb, creating it if needed */
+ItdbPrivate *itdb_get_private (Itdb_iTunesDB *itdb)
+{
+    g_return_val_if_fail (itdb, NULL);
+
+    if (!itdb->reserved1)
+	itdb->reserved1 = g_new0 (ItdbPrivate, 1);
+    return itdb->reserved1;
+}
+
+static void shuffle_cache_free (ItdbShuffleCache *cache);
+static void otg_state_free (ItdbOtgState *otg);
+
+/* Frees the private data of @itdb */
+void itdb_free_private (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+
+    g_return_if_fail (itdb);
+
+    priv = itdb->reserved1;
+    if (priv)
+    {
+	g_free (priv->stats);
+	itdb_columns_free (priv->columns);
+	itdb_query_indexes_free (priv->indexes);
+	itdb_snapshots_detach (itdb);
+	if (priv->unflushed)
+	    g_hash_table_destroy (priv->unflushed);
+	shuffle_cache_free (priv->shuffle);
+	otg_state_free (priv->otg);
+	g_free (priv);
+	itdb->reserved1 = NULL;
+    }
+}
+
 /**
  * itdb_duplicate:
  * @itdb: an #Itdb_iTunesDB
@@ -1262,11 +1611,10 @@ static gint32 get_mhod_type (FContents *cts, glong seek, guint32 *ml)
 
     if (check_header_seek (cts, "mhod", seek))
     {
-	guint32 len = get32lint (cts, seek+8);    /* total length */
-	if (cts->error) return -1;
-	if (ml) *ml = len;
-	type = get32lint (cts, seek+12);          /* mhod_id      */
-	if (cts->error) return -1;
+	FView view;
+	if (!fview_init (&view, cts, seek, 16)) return -1;
+	if (ml) *ml = fview_get32l (&view, 8);    /* total length */
+	type = fview_get32l (&view, 12);          /* mhod_id      */
     }
     return type;
 }
@@ -1296,6 +1644,7 @@ static MHODData get_mhod (FImport *fimp, glong mhod_seek, guint32 *ml)
   guint32 string_type;
   gulong seek;
   FContents *cts;
+  FView view;
   
   cts = fimp->fcontents;
     
@@ -1369,19 +1718,28 @@ static MHODData get_mhod (FImport *fimp, glong mhod_seek, guint32 *ml)
   case MHOD_ID_SORT_ALBUMARTIST:
   case MHOD_ID_SORT_COMPOSER:
   case MHOD_ID_SORT_TVSHOW:
+      /* 16 byte string header followed by the string */
+      if (!fview_init (&view, cts, seek, 16))
+	  return result;  /* *ml==-1, result.valid==FALSE */
       /* type of string: 0x02: UTF8, 0x01 or 0x00: UTF16 LE */
-      string_type = get32lint (cts, seek);
-      xl = get32lint (cts, seek+4);   /* length of string */
+      string_type = fview_get32l (&view, 0);
+      xl = fview_get32l (&view, 4);   /* length of string */
       g_return_val_if_fail (xl < G_MAXUINT - 2, result);
+      /* make sure the string is there before allocating memory for
+	 it */
+      if (!check_seek (cts, seek+16, xl))
+	  return result;  /* *ml==-1, result.valid==FALSE */
       if (string_type != 0x02)
       {
-	  entry_utf16 = g_new0 (gunichar2, (xl+2)/2);
+	  /* room for a terminating 0 even if xl is odd */
+	  entry_utf16 = g_new0 (gunichar2, (xl+3)/2);
 	  if (seek_get_n_bytes (cts, (gchar *)entry_utf16, seek+16, xl))
 	  {
 	      fixup_little_utf16 (entry_utf16);
 	      result.data.string = g_utf16_to_utf8 (entry_utf16, -1,
 						    NULL, NULL, NULL);
 	      g_free (entry_utf16);
+	      if (fimp->stats) ++fimp->stats->strings;
 	  }
 	  else
 	  {   /* error */
@@ -1397,6 +1755,7 @@ static MHODData get_mhod (FImport *fimp, glong mhod_seek, guint32 *ml)
 	      g_free (entry_utf16);
 	      return result;  /* *ml==-1, result.valid==FALSE */
 	  }
+	  if (fimp->stats) ++fimp->stats->strings;
       }
       break;
   case MHOD_ID_PODCASTURL:
@@ -1404,16 +1763,21 @@ static MHODData get_mhod (FImport *fimp, glong mhod_seek, guint32 *ml)
       /* length of string */
       xl = mhod_len - header_length;
       g_return_val_if_fail (xl < G_MAXUINT - 1, result);
+      if (!check_seek (cts, seek, xl))
+	  return result;  /* *ml==-1, result.valid==FALSE */
       result.data.string = g_new0 (gchar, xl+1);
       if (!seek_get_n_bytes (cts, result.data.string, seek, xl))
       {
 	  g_free (result.data.string);
 	  return result;  /* *ml==-1, result.valid==FALSE */
       }
+      if (fimp->stats) ++fimp->stats->strings;
       break;
   case MHOD_ID_CHAPTERDATA: 
       /* we'll just copy the entire data section */
       xl = mhod_len - header_length;
+      if (!check_seek (cts, seek, xl))
+	  return result;  /* *ml==-1, result.valid==FALSE */
       result.data.chapterdata_raw = g_new0 (gchar, xl);
       if (!seek_get_n_bytes (cts, result.data.chapterdata_raw, seek, xl))
       {
@@ -1562,6 +1926,7 @@ static MHODData get_mhod (FImport *fimp, glong mhod_seek, guint32 *ml)
 
   *ml = mhod_len;
   result.valid = TRUE;
+  if (fimp->stats) ++fimp->stats->mhods;
   return result;
 }
 
@@ -1817,6 +2182,7 @@ static glong get_mhip (FImport *fimp, Itdb_Playlist *plitem,
 {
     gboolean first_entry = TRUE;
     FContents *cts;
+    FView view;
     guint32 mhip_hlen, mhip_len, mhod_num, mhod_seek;
     Itdb_Track *tr;
     gint32 i, pos=-1;
@@ -1851,12 +2217,15 @@ static glong get_mhip (FImport *fimp, Itdb_Playlist *plitem,
        have to check for read errors every time we access a single
        byte */
 
-    check_seek (cts, mhip_seek, mhip_hlen);
-    CHECK_ERROR (fimp, -1);
+    if (!fview_init (&view, cts, mhip_seek, mhip_hlen))
+    {
+	CHECK_ERROR (fimp, -1);
+	return -1;
+    }
 
-    mhip_len = get32lint (cts, mhip_seek+8);
-    mhod_num = get32lint (cts, mhip_seek+12);
-    trackid = get32lint(cts, mhip_seek+24);
+    mhip_len = fview_get32l (&view, 8);
+    mhod_num = fview_get32l (&view, 12);
+    trackid = fview_get32l (&view, 24);
 
     mhod_seek = mhip_seek + mhip_hlen;
  
@@ -1914,6 +2283,7 @@ static glong get_mhip (FImport *fimp, Itdb_Playlist *plitem,
     {
 	itdb_playlist_add_track (plitem, tr, pos);
 	++fimp->pos_len;
+	if (fimp->stats) ++fimp->stats->members;
     }
     else
     {
@@ -1947,6 +2317,7 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
   guint32 header_len;
   Itdb_Playlist *plitem = NULL;
   FContents *cts;
+  FView view;
 
 #if ITUNESDB_DEBUG
   fprintf(stderr, "mhyp seek: %x\n", (int)mhyp_seek);
@@ -1979,28 +2350,31 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
   /* Check if entire mhyp can be read -- that way we won't have to
    * check for read errors every time we access a single byte */
 
-  check_seek (cts, mhyp_seek, header_len);
-  CHECK_ERROR (fimp, -1);
+  if (!fview_init (&view, cts, mhyp_seek, header_len))
+  {
+      CHECK_ERROR (fimp, -1);
+      return -1;
+  }
 
-  nextseek = mhyp_seek + get32lint (cts, mhyp_seek+8);/* possible begin of next PL */  mhod_num = get32lint (cts, mhyp_seek+12); /* number of MHODs we expect */
-  mhipnum = get32lint (cts, mhyp_seek+16); /* number of tracks
+  nextseek = mhyp_seek + fview_get32l (&view, 8);/* possible begin of next PL */  mhod_num = fview_get32l (&view, 12); /* number of MHODs we expect */
+  mhipnum = fview_get32l (&view, 16); /* number of tracks
 					       (mhips) in playlist */
 
   plitem = itdb_playlist_new (NULL, FALSE);
 
   /* Some Playlists have added 256 to their type -- I don't know what
      it's for, so we just ignore it for now -> & 0xff */
-  plitem->type = get8int (cts, mhyp_seek+20);
-  plitem->flag1 = get8int (cts, mhyp_seek+21);
-  plitem->flag2 = get8int (cts, mhyp_seek+22);
-  plitem->flag3 = get8int (cts, mhyp_seek+23);
-  plitem->timestamp = get32lint (cts, mhyp_seek+24);
+  plitem->type = fview_get8 (&view, 20);
+  plitem->flag1 = fview_get8 (&view, 21);
+  plitem->flag2 = fview_get8 (&view, 22);
+  plitem->flag3 = fview_get8 (&view, 23);
+  plitem->timestamp = fview_get32l (&view, 24);
   plitem->timestamp = device_time_mac_to_time_t (fimp->itdb->device, plitem->timestamp);
-  plitem->id = get64lint (cts, mhyp_seek+28);
+  plitem->id = fview_get64l (&view, 28);
 /*  plitem->mhodcount = get32lint (cts, mhyp_seek+36);   */
 /*  plitem->libmhodcount = get16lint (cts, mhyp_seek+40);*/
-  plitem->podcastflag = get16lint (cts, mhyp_seek+42);
-  plitem->sortorder = get32lint (cts, mhyp_seek+44);
+  plitem->podcastflag = fview_get16l (&view, 42);
+  plitem->sortorder = fview_get32l (&view, 44);
 
   mhod_seek = mhyp_seek + header_len;
 
@@ -2010,7 +2384,7 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
       MHODData mhod;
 
       type = get_mhod_type (cts, mhod_seek, &header_len);
-      CHECK_ERROR (fimp, -1);
+      if (cts->error) goto mhod_error;
       if (header_len != -1)
       {
 	  switch ((enum MHOD_ID)type)
@@ -2020,7 +2394,7 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
 	      break;
 	  case MHOD_ID_TITLE:
 	      mhod = get_mhod (fimp, mhod_seek, &header_len);
-	      CHECK_ERROR (fimp, -1);
+	      if (cts->error) goto mhod_error;
 	      if (mhod.valid && mhod.data.string)
 	      {
 		  /* sometimes there seem to be two mhod TITLE headers */
@@ -2031,7 +2405,7 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
 	      break;
 	  case MHOD_ID_SPLPREF:
 	      mhod = get_mhod (fimp, mhod_seek, &header_len);
-	      CHECK_ERROR (fimp, -1);
+	      if (cts->error) goto mhod_error;
 	      if (mhod.valid && mhod.data.splpref)
 	      {
 		  plitem->is_spl = TRUE;
@@ -2043,7 +2417,7 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
 	      break;
 	  case MHOD_ID_SPLRULES:
 	      mhod = get_mhod (fimp, mhod_seek, &header_len);
-	      CHECK_ERROR (fimp, -1);
+	      if (cts->error) goto mhod_error;
 	      if (mhod.valid && mhod.data.splrules)
 	      {
 		  plitem->is_spl = TRUE;
@@ -2137,6 +2511,12 @@ static glong get_playlist (FImport *fimp, glong mhyp_seek)
   fimp->pos_glist = NULL;
   fimp->pos_len = 0;
   return nextseek;
+
+ mhod_error:
+  /* plitem isn't part of the database yet */
+  itdb_playlist_free (plitem);
+  CHECK_ERROR (fimp, -1);
+  return -1;
 }
 
 
@@ -2153,6 +2533,7 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
   struct playcount *playcount;
   guint32 i, mhod_nums;
   FContents *cts;
+  FView view;
   glong seek = mhit_seek;
 
 #if ITUNESDB_DEBUG
@@ -2185,13 +2566,17 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
       return -1;
   }
 
-  /* Check if entire mhit can be read -- that way we won't have to
-   * check for read errors every time we access a single byte */
-
-  check_seek (cts, seek, header_len);
+  /* Check if entire mhit header can be read -- that way we won't
+   * have to check for read errors every time we access a single
+   * field. All fields read below lie within the first header_len
+   * bytes. */
+  if (!fview_init (&view, cts, seek, header_len))
+  {
+      CHECK_ERROR (fimp, -1);
+      return -1;
+  }
 
-  mhod_nums = get32lint (cts, seek+12);
-  CHECK_ERROR (fimp, -1);
+  mhod_nums = fview_get32l (&view, 12);
 
 
   track = itdb_track_new ();
@@ -2199,198 +2584,212 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
   if (header_len >= 0x9c)
   {
       guint32 val32;
-      track->id = get32lint(cts, seek+16);         /* iPod ID          */
-      track->visible = get32lint (cts, seek+20);
-      track->filetype_marker = get32lint (cts, seek+24);
-      track->type1 = get8int (cts, seek+28);
-      track->type2 = get8int (cts, seek+29);
-      track->compilation = get8int (cts, seek+30);
-      track->rating = get8int (cts, seek+31);
-      track->time_modified = get32lint(cts, seek+32); /* time added       */
+      track->id = fview_get32l (&view, 16);         /* iPod ID          */
+      track->visible = fview_get32l (&view, 20);
+      track->filetype_marker = fview_get32l (&view, 24);
+      track->type1 = fview_get8 (&view, 28);
+      track->type2 = fview_get8 (&view, 29);
+      track->compilation = fview_get8 (&view, 30);
+      track->rating = fview_get8 (&view, 31);
+      track->time_modified = fview_get32l (&view, 32); /* time added       */
       track->time_modified = device_time_mac_to_time_t (fimp->itdb->device, 
 						      track->time_modified);
-      track->size = get32lint(cts, seek+36);       /* file size        */
-      track->tracklen = get32lint(cts, seek+40);   /* time             */
-      track->track_nr = get32lint(cts, seek+44);   /* track number     */
-      track->tracks = get32lint(cts, seek+48);     /* nr of tracks     */
-      track->year = get32lint(cts, seek+52);       /* year             */
-      track->bitrate = get32lint(cts, seek+56);    /* bitrate          */
-      val32 = get32lint (cts, seek+60);
+      track->size = fview_get32l (&view, 36);       /* file size        */
+      track->tracklen = fview_get32l (&view, 40);   /* time             */
+      track->track_nr = fview_get32l (&view, 44);   /* track number     */
+      track->tracks = fview_get32l (&view, 48);     /* nr of tracks     */
+      track->year = fview_get32l (&view, 52);       /* year             */
+      track->bitrate = fview_get32l (&view, 56);    /* bitrate          */
+      val32 = fview_get32l (&view, 60);
       track->samplerate = val32 >> 16;             /* sample rate      */
       track->samplerate_low = val32 & 0xffff;      /* remaining bits   */
-      track->volume = get32lint(cts, seek+64);     /* volume adjust    */
-      track->starttime = get32lint (cts, seek+68);
-      track->stoptime = get32lint (cts, seek+72);
-      track->soundcheck = get32lint (cts, seek+76);/* soundcheck       */
-      track->playcount = get32lint (cts, seek+80); /* playcount        */
-      track->playcount2 = get32lint (cts, seek+84);
-      track->time_played = get32lint(cts, seek+88);/* last time played */
+      track->volume = fview_get32l (&view, 64);     /* volume adjust    */
+      track->starttime = fview_get32l (&view, 68);
+      track->stoptime = fview_get32l (&view, 72);
+      track->soundcheck = fview_get32l (&view, 76);/* soundcheck       */
+      track->playcount = fview_get32l (&view, 80); /* playcount        */
+      track->playcount2 = fview_get32l (&view, 84);
+      track->time_played = fview_get32l (&view, 88);/* last time played */
       track->time_played = device_time_mac_to_time_t (fimp->itdb->device, 
 						    track->time_played);
-      track->cd_nr = get32lint(cts, seek+92);      /* CD nr            */
-      track->cds = get32lint(cts, seek+96);        /* CD nr of..       */
+      track->cd_nr = fview_get32l (&view, 92);      /* CD nr            */
+      track->cds = fview_get32l (&view, 96);        /* CD nr of..       */
       /* Apple Store/Audible User ID (for DRM'ed files only, set to 0
 	 otherwise). */
-      track->drm_userid = get32lint (cts, seek+100);
-      track->time_added = get32lint(cts, seek+104);/* last mod. time */
+      track->drm_userid = fview_get32l (&view, 100);
+      track->time_added = fview_get32l (&view, 104);/* last mod. time */
       track->time_added = device_time_mac_to_time_t (fimp->itdb->device, 
 						   track->time_added);
-      track->bookmark_time = get32lint (cts, seek+108);/*time bookmarked*/
-      track->dbid = get64lint (cts, seek+112);
-      track->checked = get8int (cts, seek+120); /*Checked/Unchecked: 0/1*/
+      track->bookmark_time = fview_get32l (&view, 108);/*time bookmarked*/
+      track->dbid = fview_get64l (&view, 112);
+      track->checked = fview_get8 (&view, 120); /*Checked/Unchecked: 0/1*/
       /* The rating set by the application, as opposed to the rating
 	 set on the iPod itself */
-      track->app_rating = get8int (cts, seek+121);
-      track->BPM = get16lint (cts, seek+122);
-      track->artwork_count = get16lint (cts, seek+124);
-      track->unk126 = get16lint (cts, seek+126);
-      track->artwork_size = get32lint (cts, seek+128);
-      track->unk132 = get32lint (cts, seek+132);
-      track->samplerate2 = get32lfloat (cts, seek+136);
-      track->time_released = get32lint (cts, seek+140);
+      track->app_rating = fview_get8 (&view, 121);
+      track->BPM = fview_get16l (&view, 122);
+      track->artwork_count = fview_get16l (&view, 124);
+      track->unk126 = fview_get16l (&view, 126);
+      track->artwork_size = fview_get32l (&view, 128);
+      track->unk132 = fview_get32l (&view, 132);
+      track->samplerate2 = fview_get32lfloat (&view, 136);
+      track->time_released = fview_get32l (&view, 140);
       track->time_released = device_time_mac_to_time_t (fimp->itdb->device,
 						      track->time_released);
-      track->unk144 = get16lint (cts, seek+144);
-      track->unk146 = get16lint (cts, seek+146);
-      track->unk148 = get32lint (cts, seek+148);
-      track->unk152 = get32lint (cts, seek+152);
+      track->unk144 = fview_get16l (&view, 144);
+      track->unk146 = fview_get16l (&view, 146);
+      track->unk148 = fview_get32l (&view, 148);
+      track->unk152 = fview_get32l (&view, 152);
   }
   if (header_len >= 0xf4)
   {
-      track->skipcount = get32lint (cts, seek+156);
-      track->last_skipped = get32lint (cts, seek+160);
+      track->skipcount = fview_get32l (&view, 156);
+      track->last_skipped = fview_get32l (&view, 160);
       track->last_skipped = device_time_mac_to_time_t (fimp->itdb->device, 
 						     track->last_skipped);
-      track->has_artwork = get8int (cts, seek+164);
-      track->skip_when_shuffling = get8int (cts, seek+165);
-      track->remember_playback_position = get8int (cts, seek+166);
-      track->flag4 = get8int (cts, seek+167);
-      track->dbid2 = get64lint (cts, seek+168);
-      track->lyrics_flag = get8int (cts, seek+176);
-      track->movie_flag = get8int (cts, seek+177);
-      track->mark_unplayed = get8int (cts, seek+178);
-      track->unk179 = get8int (cts, seek+179);
-      track->unk180 = get32lint (cts, seek+180);
-      track->pregap = get32lint (cts, seek+184);
-      track->samplecount = get64lint (cts, seek+188);
-      track->unk196 = get32lint (cts, seek+196);
-      track->postgap = get32lint (cts, seek+200);
-      track->unk204 = get32lint (cts, seek+204);
-      track->mediatype = get32lint (cts, seek+208);
-      track->season_nr = get32lint (cts, seek+212);
-      track->episode_nr = get32lint (cts, seek+216);
-      track->unk220 = get32lint (cts, seek+220);
-      track->unk224 = get32lint (cts, seek+224);
-      track->unk228 = get32lint (cts, seek+228);
-      track->unk232 = get32lint (cts, seek+232);
-      track->unk236 = get32lint (cts, seek+236);
-      track->unk240 = get32lint (cts, seek+240);
+      track->has_artwork = fview_get8 (&view, 164);
+      track->skip_when_shuffling = fview_get8 (&view, 165);
+      track->remember_playback_position = fview_get8 (&view, 166);
+      track->flag4 = fview_get8 (&view, 167);
+      track->dbid2 = fview_get64l (&view, 168);
+      track->lyrics_flag = fview_get8 (&view, 176);
+      track->movie_flag = fview_get8 (&view, 177);
+      track->mark_unplayed = fview_get8 (&view, 178);
+      track->unk179 = fview_get8 (&view, 179);
+      track->unk180 = fview_get32l (&view, 180);
+      track->pregap = fview_get32l (&view, 184);
+      track->samplecount = fview_get64l (&view, 188);
+      track->unk196 = fview_get32l (&view, 196);
+      track->postgap = fview_get32l (&view, 200);
+      track->unk204 = fview_get32l (&view, 204);
+      track->mediatype = fview_get32l (&view, 208);
+      track->season_nr = fview_get32l (&view, 212);
+      track->episode_nr = fview_get32l (&view, 216);
+      track->unk220 = fview_get32l (&view, 220);
+      track->unk224 = fview_get32l (&view, 224);
+      track->unk228 = fview_get32l (&view, 228);
+      track->unk232 = fview_get32l (&view, 232);
+      track->unk236 = fview_get32l (&view, 236);
+      track->unk240 = fview_get32l (&view, 240);
   }
   if (header_len >= 0x148)
   {
-      track->unk244 = get32lint (cts, seek+244);
-      track->gapless_data = get32lint (cts, seek+248);
-      track->unk252 = get32lint (cts, seek+252);
-      track->gapless_track_flag = get16lint (cts, seek+256);
-      track->gapless_album_flag = get16lint (cts, seek+258);
+      track->unk244 = fview_get32l (&view, 244);
+      track->gapless_data = fview_get32l (&view, 248);
+      track->unk252 = fview_get32l (&view, 252);
+      track->gapless_track_flag = fview_get16l (&view, 256);
+      track->gapless_album_flag = fview_get16l (&view, 258);
   }
 
   track->transferred = TRUE;                   /* track is on iPod! */
 
-  seek += get32lint (cts, seek+4);             /* 1st mhod starts here! */
-  CHECK_ERROR (fimp, -1);
+  seek += header_len;                          /* 1st mhod starts here! */
 
   for (i=0; i<mhod_nums; ++i)
   {
       entry_utf8 = get_mhod_string (fimp, seek, &zip, &type);
-      CHECK_ERROR (fimp, -1);
+      if (cts->error)
+      {
+	  g_propagate_error (&fimp->error, cts->error);
+	  itdb_track_free (track);
+	  return -1;
+      }
       if (entry_utf8 != NULL)
       {
+	  gchar **field = NULL;
+
 	  switch ((enum MHOD_ID)type)
 	  {
 	  case MHOD_ID_TITLE:
-	      track->title = entry_utf8;
+	      field = &track->title;
 	      break;
 	  case MHOD_ID_PATH:
-	      track->ipod_path = entry_utf8;
+	      field = &track->ipod_path;
 	      break;
 	  case MHOD_ID_ALBUM:
-	      track->album = entry_utf8;
+	      field = &track->album;
 	      break;
 	  case MHOD_ID_ARTIST:
-	      track->artist = entry_utf8;
+	      field = &track->artist;
 	      break;
 	  case MHOD_ID_GENRE:
-	      track->genre = entry_utf8;
+	      field = &track->genre;
 	      break;
 	  case MHOD_ID_FILETYPE:
-	      track->filetype = entry_utf8;
+	      field = &track->filetype;
 	      break;
 	  case MHOD_ID_COMMENT:
-	      track->comment = entry_utf8;
+	      field = &track->comment;
 	      break;
 	  case MHOD_ID_CATEGORY:
-	      track->category = entry_utf8;
+	      field = &track->category;
 	      break;
 	  case MHOD_ID_COMPOSER:
-	      track->composer = entry_utf8;
+	      field = &track->composer;
 	      break;
 	  case MHOD_ID_GROUPING:
-	      track->grouping = entry_utf8;
+	      field = &track->grouping;
 	      break;
 	  case MHOD_ID_DESCRIPTION:
-	      track->description = entry_utf8;
+	      field = &track->description;
 	      break;
 	  case MHOD_ID_PODCASTURL:
-	      track->podcasturl = entry_utf8;
+	      field = &track->podcasturl;
 	      break;
 	  case MHOD_ID_PODCASTRSS:
-	      track->podcastrss = entry_utf8;
+	      field = &track->podcastrss;
 	      break;
 	  case MHOD_ID_SUBTITLE:
-	      track->subtitle = entry_utf8;
+	      field = &track->subtitle;
 	      break;
 	  case MHOD_ID_TVSHOW:
-	      track->tvshow = entry_utf8;
+	      field = &track->tvshow;
 	      break;
 	  case MHOD_ID_TVEPISODE:
-	      track->tvepisode = entry_utf8;
+	      field = &track->tvepisode;
 	      break;
 	  case MHOD_ID_TVNETWORK:
-	      track->tvnetwork = entry_utf8;
+	      field = &track->tvnetwork;
 	      break;
 	  case MHOD_ID_ALBUMARTIST:
-	      track->albumartist = entry_utf8;
+	      field = &track->albumartist;
 	      break;
 	  case MHOD_ID_KEYWORDS:
-	      track->keywords = entry_utf8;
+	      field = &track->keywords;
 	      break;
 	  case MHOD_ID_SORT_ARTIST:
-	      track->sort_artist = entry_utf8;
+	      field = &track->sort_artist;
 	      break;
 	  case MHOD_ID_SORT_TITLE:
-	      track->sort_title = entry_utf8;
+	      field = &track->sort_title;
 	      break;
 	  case MHOD_ID_SORT_ALBUM:
-	      track->sort_album = entry_utf8;
+	      field = &track->sort_album;
 	      break;
 	  case MHOD_ID_SORT_ALBUMARTIST:
-	      track->sort_albumartist = entry_utf8;
+	      field = &track->sort_albumartist;
 	      break;
 	  case MHOD_ID_SORT_COMPOSER:
-	      track->sort_composer = entry_utf8;
+	      field = &track->sort_composer;
 	      break;
 	  case MHOD_ID_SORT_TVSHOW:
-	      track->sort_tvshow = entry_utf8;
+	      field = &track->sort_tvshow;
 	      break;
 	  case MHOD_ID_SPLPREF:
 	  case MHOD_ID_SPLRULES:
 	  case MHOD_ID_LIBPLAYLISTINDEX:
 	  case MHOD_ID_PLAYLIST:
 	  case MHOD_ID_CHAPTERDATA:
-	      g_free (entry_utf8);
 	      break;
 	  }
+	  if (field)
+	  {   /* a corrupt file may repeat a string type */
+	      g_free (*field);
+	      *field = entry_utf8;
+	  }
+	  else
+	  {
+	      g_free (entry_utf8);
+	  }
       }
       else
       {
@@ -2446,25 +2845,150 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
 
       track->skipcount += playcount->skipcount;
       track->recent_skipcount = playcount->skipcount;
-
-      g_free (playcount);
   }
   itdb_track_add (fimp->itdb, track, -1);
   return seek;
 }
 
 
-/* Called by read_OTG_playlists(): OTG playlist stored in @cts by
- * adding a new playlist (named @plname) with the tracks specified in
- * @cts. If @plname is NULL, a standard name will be substituted */
+/* An OTGPlaylistInfo_<n> file as last read */
+typedef struct
+{
+    off_t size;           /* size and mtime of the file when read,  */
+    time_t mtime;         /* mtime is 0 if it wasn't read yet       */
+    guint64 playlist_id;  /* playlist created from the file or 0    */
+    GArray *entries;      /* (guint32) entries of the file added to
+			     that playlist, NULL if none            */
+} OtgFile;
+
+/* Kept between itdb_parse() and itdb_otg_playlists_update(): the OTG
+   files refer to tracks by their position in the iTunesDB on disk,
+   which the track list of the database doesn't reflect once it's
+   changed. The positions are kept as dbids so that tracks freed in
+   the meantime are simply skipped. */
+struct _ItdbOtgState
+{
+    GArray *dbids;        /* (guint64) dbid of the track at each
+			     position of the iTunesDB on disk       */
+    GArray *files;        /* (OtgFile) OTGPlaylistInfo_1, _2, ...   */
+};
+
+static ItdbOtgState *otg_state_get (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv = itdb_get_private (itdb);
+
+    if (!priv->otg)
+    {
+	priv->otg = g_new0 (ItdbOtgState, 1);
+	priv->otg->dbids = g_array_new (FALSE, FALSE, sizeof (guint64));
+	priv->otg->files = g_array_new (FALSE, TRUE, sizeof (OtgFile));
+    }
+    return priv->otg;
+}
+
+static void otg_file_forget_entries (OtgFile *file)
+{
+    if (file->entries)
+	g_array_free (file->entries, TRUE);
+    file->entries = NULL;
+}
+
+static void otg_state_free (ItdbOtgState *otg)
+{
+    if (otg)
+    {
+	guint i;
+
+	for (i=0; i<otg->files->len; ++i)
+	    otg_file_forget_entries (&g_array_index (otg->files, OtgFile, i));
+	g_array_free (otg->dbids, TRUE);
+	g_array_free (otg->files, TRUE);
+	g_free (otg);
+    }
+}
+
+/* Remembers the order of itdb->tracks as the order of the iTunesDB
+   on disk. Called after parsing and after writing @itdb. */
+static void otg_state_set_positions (Itdb_iTunesDB *itdb)
+{
+    ItdbOtgState *otg = otg_state_get (itdb);
+    GList *gl;
+
+    g_array_set_size (otg->dbids, 0);
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	g_array_append_val (otg->dbids, track->dbid);
+    }
+}
+
+/* Called after @itdb was written: the OTG playlists on the iPod refer
+   to the old iTunesDB and are removed by itdb_write() (the remaining
+   files by the iPod). Files still present are not read again, files
+   written by the iPod later make new playlists. */
+static void otg_state_written (Itdb_iTunesDB *itdb)
+{
+    ItdbOtgState *otg = otg_state_get (itdb);
+    guint i;
+
+    otg_state_set_positions (itdb);
+    for (i=0; i<otg->files->len; ++i)
+    {
+	OtgFile *file = &g_array_index (otg->files, OtgFile, i);
+	file->playlist_id = 0;
+	otg_file_forget_entries (file);
+    }
+}
+
+/* Sets fimp->otg_tracks to the tracks of the positions kept in the
+   OTG state of fimp->itdb, NULL for tracks no longer in the
+   database. Tracks without a dbid can't be told apart and resolve to
+   NULL; if several tracks share a dbid, the first one is used. */
+static void otg_tracks_from_state (FImport *fimp)
+{
+    ItdbOtgState *otg = otg_state_get (fimp->itdb);
+    GHashTable *by_dbid;
+    GList *gl;
+    guint32 i;
+
+    by_dbid = g_hash_table_new (itdb_dbid_hash, itdb_dbid_equal);
+    for (gl=fimp->itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	if (track->dbid &&
+	    !g_hash_table_lookup (by_dbid, &track->dbid))
+	    g_hash_table_insert (by_dbid, &track->dbid, track);
+    }
+    fimp->otg_tracks_num = otg->dbids->len;
+    fimp->otg_tracks = g_new0 (Itdb_Track *, otg->dbids->len);
+    for (i=0; i<otg->dbids->len; ++i)
+    {
+	guint64 *dbid = &g_array_index (otg->dbids, guint64, i);
+	if (*dbid)
+	    fimp->otg_tracks[i] = g_hash_table_lookup (by_dbid, dbid);
+    }
+    g_hash_table_destroy (by_dbid);
+}
+
+/* Called by read_OTG_files(): OTG playlist stored in @cts by adding a
+ * new playlist (named @plname) with the tracks specified in @cts. If
+ * @file refers to a playlist already created from the same file and
+ * the file still starts with the entries read then, the entries added
+ * since are appended to it; if it doesn't, the members of the
+ * playlist are replaced. The entries are
+ * resolved through fimp->otg_tracks. If @plname is NULL, a standard
+ * name will be substituted */
 /* Returns FALSE on error, TRUE on success. On error @fimp->error will
  * be set apropriately. */
 static gboolean process_OTG_file (FImport *fimp, FContents *cts,
-				  const gchar *plname)
+				  const gchar *plname, OtgFile *file)
 {
-    guint32 header_length, entry_length, entry_num;
+    guint32 header_length, entry_length, entry_num, first, i;
+    Itdb_Playlist *pl = NULL;
+    GList *members = NULL;
+    GArray *entries;
 
-    g_return_val_if_fail (fimp && cts, FALSE);
+    g_return_val_if_fail (fimp && cts && file, FALSE);
     g_return_val_if_fail (fimp->itdb, FALSE);
 
     if (!plname) plname = _("OTG Playlist");
@@ -2519,92 +3043,229 @@ static gboolean process_OTG_file (FImport *fimp, FContents *cts,
     entry_num = get32lint (cts, 12);
     CHECK_ERROR (fimp, FALSE);
 
-    if (entry_num > 0)
+    /* don't trust entry_num before allocating for it */
+    if (!check_seek (cts, header_length,
+		     (glong)entry_length * entry_num))
     {
-	gint i;
-	Itdb_Playlist *pl;
+	CHECK_ERROR (fimp, FALSE);
+    }
+    entries = g_array_sized_new (FALSE, FALSE, sizeof (guint32), entry_num);
+    for (i=0; i<entry_num; ++i)
+    {
+	guint32 num = get32lint (cts, header_length + entry_length *i);
+	if (cts->error)
+	{
+	    g_array_free (entries, TRUE);
+	    CHECK_ERROR (fimp, FALSE);
+	}
+	if (num >= fimp->otg_tracks_num)
+	{
+	    g_set_error (&fimp->error,
+			 ITDB_FILE_ERROR,
+			 ITDB_FILE_ERROR_CORRUPT,
+			 _("OTG playlist file '%s': reference to non-existent track (%d)."),
+			 cts->filename, num);
+	    g_array_free (entries, TRUE);
+	    return FALSE;
+	}
+	g_array_append_val (entries, num);
+    }
 
+    if (file->playlist_id)
+	pl = itdb_playlist_by_id (fimp->itdb, file->playlist_id);
+    /* the iPod appends to the file while the playlist is extended --
+       anything else means the file was written anew */
+    first = 0;
+    if (pl && file->entries && (entry_num >= file->entries->len) &&
+	(memcmp (entries->data, file->entries->data,
+		 file->entries->len * sizeof (guint32)) == 0))
+	first = file->entries->len;
+
+    for (i=first; i<entry_num; ++i)
+    {
+	guint32 num = g_array_index (entries, guint32, i);
+	/* NULL if the track was removed since the iTunesDB was read */
+	if (fimp->otg_tracks[num])
+	    members = g_list_prepend (members, fimp->otg_tracks[num]);
+    }
+    members = g_list_reverse (members);
+
+    if (pl && first == 0)
+    {   /* the file was written anew: replace the members */
+	g_list_free (pl->members);
+	pl->members = NULL;
+    }
+    else if (!pl && entry_num > 0)
+    {
 	pl = itdb_playlist_new (plname, FALSE);
 	/* Add new playlist */
 	itdb_playlist_add (fimp->itdb, pl, -1);
+	file->playlist_id = pl->id;
+    }
+    if (pl)
+	pl->members = g_list_concat (pl->members, members);
+    otg_file_forget_entries (file);
+    file->entries = entries;
+    return TRUE;
+}
+
+
+/* Reads the files OTGPlaylistInfo_1, _2... in @dirname that changed
+   since they were last read. On error fimp->error is set. */
+static void read_OTG_files (FImport *fimp, const gchar *dirname)
+{
+    ItdbOtgState *otg = otg_state_get (fimp->itdb);
+    gchar *filename;
+    guint i = 1;
 
-	/* Add items */
-	for (i=0; i<entry_num; ++i)
+    do
+    {
+	gchar *db[] = {NULL, NULL};
+
+	db[0] = g_strdup_printf ("OTGPlaylistInfo_%d", i);
+	filename = itdb_resolve_path (dirname, (const gchar **)db);
+	g_free (db[0]);
+	if (filename)
 	{
-	    Itdb_Track *track;
-	    guint32 num = get32lint (cts,
-				     header_length + entry_length *i);
-	    CHECK_ERROR (fimp, FALSE);
+	    OtgFile *file;
+	    struct stat st;
 
-	    track = g_list_nth_data (fimp->itdb->tracks, num);
-	    if (track)
-	    {
-		itdb_playlist_add_track (pl, track, -1);
+	    if (g_stat (filename, &st) != 0)
+	    {   /* removed by the iPod just now */
+		g_free (filename);
+		break;
 	    }
-	    else
+	    if (otg->files->len < i)
+		g_array_set_size (otg->files, i);
+	    file = &g_array_index (otg->files, OtgFile, i-1);
+	    if (file->mtime == 0 ||
+		file->size != st.st_size || file->mtime != st.st_mtime)
 	    {
-		g_set_error (&fimp->error,
-			     ITDB_FILE_ERROR,
-			     ITDB_FILE_ERROR_CORRUPT,
-			     _("OTG playlist file '%s': reference to non-existent track (%d)."),
-			     cts->filename, num);
-		return FALSE;
+		FContents *cts = fcontents_map (filename, &fimp->error);
+		if (cts)
+		{
+		    gchar *plname = g_strdup_printf (_("OTG Playlist %d"), i);
+		    if (fimp->stats) fimp->stats->bytes_read += cts->length;
+		    process_OTG_file (fimp, cts, plname, file);
+		    g_free (plname);
+		    fcontents_free (cts);
+		}
+		if (!fimp->error)
+		{
+		    file->size = st.st_size;
+		    file->mtime = st.st_mtime;
+		}
 	    }
+	    g_free (filename);
 	}
-    }
-    return TRUE;
+	if (fimp->error) break;
+	++i;
+    } while (filename);
 }
 
 
-
-
 /* Add the On-The-Go Playlist(s) to the database */
 /* The OTG-Files are located in the directory given by
-   fimp->itdb->itdb_filename.
+   fimp->itdb->itdb_filename. The entries are resolved through an
+   array of the tracks built once. The order of the tracks is kept for
+   itdb_otg_playlists_update().
    On error FALSE is returned and fimp->error is set accordingly. */
 gboolean read_OTG_playlists (FImport *fimp)
 {
     gchar *db[] = {"OTGPlaylistInfo", NULL};
     gchar *dirname, *otgname;
 
-    g_return_val_if_fail (fimp, FALSE);
-    g_return_val_if_fail (fimp->itdb, FALSE);
-    g_return_val_if_fail (fimp->itdb->filename, FALSE);
-
-    dirname = g_path_get_dirname (fimp->itdb->filename);
-
+    g_return_val_if_fail (fimp, FALSE);
+    g_return_val_if_fail (fimp->itdb, FALSE);
+    g_return_val_if_fail (fimp->itdb->filename, FALSE);
+
+    otg_state_set_positions (fimp->itdb);
+
+    dirname = g_path_get_dirname (fimp->itdb->filename);
+
+    otgname = itdb_resolve_path (dirname, (const gchar **)db);
+
+
+    /* only parse if "OTGPlaylistInfo" exists */
+    if (otgname)
+    {
+	GList *gl;
+	guint32 i = 0;
+
+	fimp->otg_tracks_num = g_list_length (fimp->itdb->tracks);
+	fimp->otg_tracks = g_new (Itdb_Track *, fimp->otg_tracks_num);
+	for (gl=fimp->itdb->tracks; gl; gl=gl->next)
+	    fimp->otg_tracks[i++] = gl->data;
+
+	read_OTG_files (fimp, dirname);
+
+	g_free (fimp->otg_tracks);
+	fimp->otg_tracks = NULL;
+	g_free (otgname);
+    }
+    g_free (dirname);
+    return TRUE;
+}
+
+
+/**
+ * itdb_otg_playlists_update:
+ * @itdb: an #Itdb_iTunesDB read with itdb_parse() or written with
+ * itdb_write() since
+ * @error: return location for a #GError or NULL
+ *
+ * Adds the On-The-Go playlists created on the iPod since @itdb was
+ * read or written, without parsing the iTunesDB again. This is meant
+ * for applications keeping @itdb while the iPod is connected, during
+ * which the user may create OTG playlists on the iPod.
+ *
+ * Only the OTGPlaylistInfo files changed since they were last read
+ * are read. Tracks added to the playlist of a file read before are
+ * appended to the playlist created from it; if the file was written
+ * anew, the members of that playlist are replaced. Entries referring
+ * to tracks removed from @itdb in the meantime are skipped.
+ *
+ * Return value: TRUE on success, FALSE on error, in which case
+ * @error is set accordingly.
+ **/
+gboolean itdb_otg_playlists_update (Itdb_iTunesDB *itdb, GError **error)
+{
+    gchar *db[] = {"OTGPlaylistInfo", NULL};
+    gchar *dirname, *otgname;
+    FImport *fimp;
+    gboolean result = TRUE;
+
+    g_return_val_if_fail (itdb, FALSE);
+    g_return_val_if_fail (itdb->filename, FALSE);
+    /* the positions of the tracks in the iTunesDB are not known */
+    g_return_val_if_fail (itdb_get_private (itdb)->otg, FALSE);
+
+    dirname = g_path_get_dirname (itdb->filename);
+    /* the iPod creates and removes OTG files behind our back */
+    otgname = g_build_filename (dirname, db[0], NULL);
+    itdb_resolve_path_invalidate (otgname);
+    g_free (otgname);
     otgname = itdb_resolve_path (dirname, (const gchar **)db);
-
-
-    /* only parse if "OTGPlaylistInfo" exists */
     if (otgname)
     {
-	gchar *filename;
-	gint i=1;
-	do
+	fimp = g_new0 (FImport, 1);
+	fimp->itdb = itdb;
+	fimp->stats = itdb_stats_get (itdb);
+	otg_tracks_from_state (fimp);
+
+	read_OTG_files (fimp, dirname);
+
+	if (fimp->error)
 	{
-	    db[0] = g_strdup_printf ("OTGPlaylistInfo_%d", i);
-	    filename = itdb_resolve_path (dirname, (const gchar **)db);
-	    g_free (db[0]);
-	    if (filename)
-	    {
-		FContents *cts = fcontents_read (filename, &fimp->error);
-		if (cts)
-		{
-		    gchar *plname = g_strdup_printf (_("OTG Playlist %d"), i);
-		    process_OTG_file (fimp, cts, plname);
-		    g_free (plname);
-		    fcontents_free (cts);
-		}
-		g_free (filename);
-	    }
-	    if (fimp->error) break;
-	    ++i;
-	} while (filename);
+	    g_propagate_error (error, fimp->error);
+	    result = FALSE;
+	}
+	g_free (fimp->otg_tracks);
+	g_free (fimp);
 	g_free (otgname);
     }
     g_free (dirname);
-    return TRUE;
+    return result;
 }
 
 
@@ -2648,6 +3309,17 @@ static gboolean parse_tracks (FImport *fimp, glong mhsd_seek)
     nr_tracks = get32lint (cts, mhlt_seek+8);
     CHECK_ERROR (fimp, FALSE);
 
+    /* The Play Counts file has one entry per track in the order of
+       the iTunesDB. If the numbers differ the file doesn't belong to
+       this iTunesDB and merging would assign the counts to the wrong
+       tracks. */
+    if (fimp->playcounts && (fimp->playcounts_num != nr_tracks))
+    {
+	g_warning (_("Number of entries in Play Counts file (%d) does not match number of tracks (%d). Play counts are ignored.\n"),
+		   fimp->playcounts_num, nr_tracks);
+	playcounts_free (fimp);
+    }
+
     seek = find_next_a_in_b (cts, "mhit", mhsd_seek, mhlt_seek);
     CHECK_ERROR (fimp, FALSE);
     /* seek should now point to the first mhit */
@@ -2662,6 +3334,7 @@ static gboolean parse_tracks (FImport *fimp, glong mhsd_seek)
 	    g_warning (_("iTunesDB corrupt: number of tracks (mhit hunks) inconsistent. Trying to continue.\n"));
 	    break;
 	}
+	if (fimp->stats) ++fimp->stats->tracks;
     }
     return TRUE;
 }
@@ -2725,6 +3398,7 @@ static gboolean parse_playlists (FImport *fimp, glong mhsd_seek)
 	    g_warning (_("iTunesDB possibly corrupt: number of playlists (mhyp hunks) inconsistent. Trying to continue.\n"));
 	    break;
 	}
+	if (fimp->stats) ++fimp->stats->playlists;
     }
 
     itdb_track_id_tree_destroy (fimp->idtree);
@@ -2738,6 +3412,7 @@ gboolean parse_fimp (FImport *fimp)
     glong seek=0;
     FContents *cts;
     glong mhsd_1, mhsd_2, mhsd_3;
+    ItdbStatsTimer timer;
 
     g_return_val_if_fail (fimp, FALSE);
     g_return_val_if_fail (fimp->itdb, FALSE);
@@ -2785,14 +3460,18 @@ gboolean parse_fimp (FImport *fimp)
     fimp->itdb->device->endianess_reversed = cts->reversed;
 #endif
 
+    itdb_stats_begin (fimp->stats, &timer);
     parse_tracks (fimp, mhsd_1);
+    itdb_stats_end (fimp->stats, ITDB_STATS_PARSE_TRACKS, &timer);
     if (fimp->error) return FALSE;
 
+    itdb_stats_begin (fimp->stats, &timer);
     if (mhsd_3 != -1)
 	parse_playlists (fimp, mhsd_3);
     else if (mhsd_2 != -1)
 	parse_playlists (fimp, mhsd_2);
-    else
+    itdb_stats_end (fimp->stats, ITDB_STATS_PARSE_PLAYLISTS, &timer);
+    if ((mhsd_3 == -1) && (mhsd_2 == -1))
     {  /* Very bad: no type 2 or type 3 mhsd which should hold the
 	  playlists */
 	g_set_error (&fimp->error,
@@ -2867,21 +3546,36 @@ itdb_parse_internal (Itdb_iTunesDB *itdb, GError **error)
 {
     FImport *fimp;
     gboolean success = FALSE;
+    ItdbStatsTimer timer;
 
     g_return_val_if_fail (itdb->filename != NULL, FALSE);
     
     fimp = g_new0 (FImport, 1);
     fimp->itdb = itdb;
+    fimp->stats = itdb_stats_get (itdb);
 
+    itdb_stats_begin (fimp->stats, &timer);
     fimp->fcontents = fcontents_read (itdb->filename, error);
+    itdb_stats_end (fimp->stats, ITDB_STATS_READ_FILE, &timer);
 
     if (fimp->fcontents)
     {
-	if (playcounts_init (fimp))
+	gboolean result;
+
+	if (fimp->stats)
+	    fimp->stats->bytes_read += fimp->fcontents->length;
+
+	itdb_stats_begin (fimp->stats, &timer);
+	result = playcounts_init (fimp);
+	itdb_stats_end (fimp->stats, ITDB_STATS_PLAYCOUNTS, &timer);
+	if (result)
 	{
 	    if (parse_fimp (fimp))
 	    {
-		if (read_OTG_playlists (fimp))
+		itdb_stats_begin (fimp->stats, &timer);
+		result = read_OTG_playlists (fimp);
+		itdb_stats_end (fimp->stats, ITDB_STATS_READ_OTG, &timer);
+		if (result)
 		{
 		    success = TRUE;
 		}
@@ -2961,7 +3655,12 @@ Itdb_iTunesDB *itdb_parse (const gchar *mp, GError **error)
 		 * repositories may exist in the same directory, the names
 		 * should be modified by the repository name.
 		 */
+		Itdb_Stats *stats = itdb_stats_get (itdb);
+		ItdbStatsTimer timer;
+
+		itdb_stats_begin (stats, &timer);
 		ipod_parse_artwork_db (itdb);
+		itdb_stats_end (stats, ITDB_STATS_PARSE_ARTWORK, &timer);
 	    }
 	    else
 	    {
@@ -4214,6 +4913,299 @@ static void mk_mhip (FExport *fexp,
 }
 
 
+/* Write the mhit of @track together with its mhods to the end of
+ * fexp->wcontents. Only touches fexp->wcontents and @track, so
+ * different tracks may be written to different WContents in
+ * parallel. */
+static void write_mhit (FExport *fexp, Itdb_Track *track)
+{
+    WContents *cts = fexp->wcontents;
+    guint32 mhod_num = 0;
+    gulong mhit_seek = cts->pos;
+    MHODData mhod;
+
+    mhod.valid = TRUE;
+
+    mk_mhit (cts, track);
+    if (track->title && *track->title)
+    {
+	mhod.type = MHOD_ID_TITLE;
+	mhod.data.string = track->title;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->ipod_path && *track->ipod_path)
+    {
+	mhod.type = MHOD_ID_PATH;
+	mhod.data.string = track->ipod_path;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->album && *track->album)
+    {
+	mhod.type = MHOD_ID_ALBUM;
+	mhod.data.string = track->album;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->artist && *track->artist)
+    {
+	mhod.type = MHOD_ID_ARTIST;
+	mhod.data.string = track->artist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->genre && *track->genre)
+    {
+	mhod.type = MHOD_ID_GENRE;
+	mhod.data.string = track->genre;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->filetype && *track->filetype)
+    {
+	mhod.type = MHOD_ID_FILETYPE;
+	mhod.data.string = track->filetype;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->comment && *track->comment)
+    {
+	mhod.type = MHOD_ID_COMMENT;
+	mhod.data.string = track->comment;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->category && *track->category)
+    {
+	mhod.type = MHOD_ID_CATEGORY;
+	mhod.data.string = track->category;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->composer && *track->composer)
+    {
+	mhod.type = MHOD_ID_COMPOSER;
+	mhod.data.string = track->composer;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->grouping && *track->grouping)
+    {
+	mhod.type = MHOD_ID_GROUPING;
+	mhod.data.string = track->grouping;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->description && *track->description)
+    {
+	mhod.type = MHOD_ID_DESCRIPTION;
+	mhod.data.string = track->description;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->subtitle && *track->subtitle)
+    {
+	mhod.type = MHOD_ID_SUBTITLE;
+	mhod.data.string = track->subtitle;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->tvshow && *track->tvshow)
+    {
+	mhod.type = MHOD_ID_TVSHOW;
+	mhod.data.string = track->tvshow;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->tvepisode && *track->tvepisode)
+    {
+	mhod.type = MHOD_ID_TVEPISODE;
+	mhod.data.string = track->tvepisode;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->tvnetwork && *track->tvnetwork)
+    {
+	mhod.type = MHOD_ID_TVNETWORK;
+	mhod.data.string = track->tvnetwork;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->albumartist && *track->albumartist)
+    {
+	mhod.type = MHOD_ID_ALBUMARTIST;
+	mhod.data.string = track->albumartist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->keywords && *track->keywords)
+    {
+	mhod.type = MHOD_ID_KEYWORDS;
+	mhod.data.string = track->keywords;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->podcasturl && *track->podcasturl)
+    {
+	mhod.type = MHOD_ID_PODCASTURL;
+	mhod.data.string = track->podcasturl;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->podcastrss && *track->podcastrss)
+    {
+	mhod.type = MHOD_ID_PODCASTRSS;
+	mhod.data.string = track->podcastrss;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_artist && *track->sort_artist)
+    {
+	mhod.type = MHOD_ID_SORT_ARTIST;
+	mhod.data.string = track->sort_artist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_title && *track->sort_title)
+    {
+	mhod.type = MHOD_ID_SORT_TITLE;
+	mhod.data.string = track->sort_title;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_album && *track->sort_album)
+    {
+	mhod.type = MHOD_ID_SORT_ALBUM;
+	mhod.data.string = track->sort_album;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_albumartist && *track->sort_albumartist)
+    {
+	mhod.type = MHOD_ID_SORT_ALBUMARTIST;
+	mhod.data.string = track->sort_albumartist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_composer && *track->sort_composer)
+    {
+	mhod.type = MHOD_ID_SORT_COMPOSER;
+	mhod.data.string = track->sort_composer;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_tvshow && *track->sort_tvshow)
+    {
+	mhod.type = MHOD_ID_SORT_TVSHOW;
+	mhod.data.string = track->sort_tvshow;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->chapterdata_raw && track->chapterdata_raw_length)
+    {
+	mhod.type = MHOD_ID_CHAPTERDATA;
+	mhod.data.chapterdata_track = track;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    /* Fill in the missing items of the mhit header */
+    fix_mhit (cts, mhit_seek, mhod_num);
+}
+
+/* Tracks are only written in parallel if each thread gets at least
+   that many of them: below, starting the threads costs more than it
+   saves. */
+#define MHIT_RANGE_MIN 2000
+/* upper limit for the number of threads chosen automatically, and
+   number of threads of the pool shared by all writes */
+#define MHIT_THREADS_MAX 8
+
+/* a contiguous range of tracks written into its own WContents */
+typedef struct
+{
+    FExport fexp;
+    WContents cts;
+    GList *first;        /* first track of the range                */
+    guint n;             /* number of tracks in the range           */
+    gboolean queued;     /* FALSE if written by the calling thread  */
+    gboolean done;       /* set by the pool, protected by mhit_done */
+} MhitRange;
+
+/* The ranges of all writes share one pool of MHIT_THREADS_MAX
+   threads, so that writing several iTunesDBs at once (e.g. with
+   itdb_write_async()) doesn't start that many threads per write. */
+G_LOCK_DEFINE_STATIC (mhit_pool);
+static GThreadPool *mhit_pool = NULL;
+static GMutex *mhit_done_mutex = NULL;
+static GCond *mhit_done_cond = NULL;
+
+static void write_mhit_range (MhitRange *range)
+{
+    GList *gl;
+    guint i;
+
+    for (gl=range->first, i=0; i<range->n; gl=gl->next, ++i)
+    {
+	write_mhit (&range->fexp, gl->data);
+    }
+}
+
+static void write_mhit_range_job (gpointer data, gpointer user_data)
+{
+    MhitRange *range = data;
+
+    write_mhit_range (range);
+
+    g_mutex_lock (mhit_done_mutex);
+    range->done = TRUE;
+    g_cond_broadcast (mhit_done_cond);
+    g_mutex_unlock (mhit_done_mutex);
+}
+
+/* Returns the shared pool, creating it on first use. Returns NULL if
+   it couldn't be created. */
+static GThreadPool *mhit_pool_get (void)
+{
+    GThreadPool *pool;
+
+    G_LOCK (mhit_pool);
+    if (!mhit_pool)
+    {
+	if (!mhit_done_mutex)
+	{
+	    mhit_done_mutex = g_mutex_new ();
+	    mhit_done_cond = g_cond_new ();
+	}
+	mhit_pool = g_thread_pool_new (write_mhit_range_job, NULL,
+				       MHIT_THREADS_MAX, FALSE, NULL);
+    }
+    pool = mhit_pool;
+    G_UNLOCK (mhit_pool);
+    return pool;
+}
+
+/* Returns the number of threads to write @n_tracks tracks with */
+static guint write_mhit_threads (Itdb_iTunesDB *itdb, guint n_tracks)
+{
+    guint n_threads = itdb_get_write_threads (itdb);
+
+    if (!g_thread_supported ())
+	return 1;
+    if (n_threads == 0)
+    {
+	n_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	{
+	    glong n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	    if (n_cpus > 1)
+		n_threads = MIN (n_cpus, MHIT_THREADS_MAX);
+	}
+#endif
+    }
+    return MAX (1, MIN (n_threads, n_tracks / MHIT_RANGE_MIN));
+}
+
 /* Write first mhsd hunk. Return FALSE in case of error and set
  * fexp->error */
 static gboolean write_mhsd_tracks (FExport *fexp)
@@ -4221,213 +5213,80 @@ static gboolean write_mhsd_tracks (FExport *fexp)
     GList *gl;
     gulong mhsd_seek;
     WContents *cts;
+    guint n_tracks, n_ranges;
 
     g_return_val_if_fail (fexp, FALSE);
     g_return_val_if_fail (fexp->itdb, FALSE);
     g_return_val_if_fail (fexp->wcontents, FALSE);
 
     cts = fexp->wcontents;
-    
+    n_tracks = g_list_length (fexp->itdb->tracks);
+    for (gl=fexp->itdb->tracks; gl; gl=gl->next)
+    {
+	g_return_val_if_fail (gl->data, FALSE);
+    }
+
     mhsd_seek = cts->pos;      /* get position of mhsd header  */
     mk_mhsd (fexp, 1);         /* write header: type 1: tracks */
     /* write header with nr. of tracks */
-    mk_mhlt (fexp, g_list_length (fexp->itdb->tracks));
-    for (gl=fexp->itdb->tracks; gl; gl=gl->next)  /* Write each track */
-    {
-	Itdb_Track *track = gl->data;
-	guint32 mhod_num = 0;
-	gulong mhit_seek = cts->pos;
-	MHODData mhod;
-
-	g_return_val_if_fail (track, FALSE);
-
-	mhod.valid = TRUE;
+    mk_mhlt (fexp, n_tracks);
 
-	mk_mhit (cts, track);
-	if (track->title && *track->title)
-	{
-	    mhod.type = MHOD_ID_TITLE;
-	    mhod.data.string = track->title;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->ipod_path && *track->ipod_path)
-	{
-	    mhod.type = MHOD_ID_PATH;
-	    mhod.data.string = track->ipod_path;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->album && *track->album)
-	{
-	    mhod.type = MHOD_ID_ALBUM;
-	    mhod.data.string = track->album;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->artist && *track->artist)
-	{
-	    mhod.type = MHOD_ID_ARTIST;
-	    mhod.data.string = track->artist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->genre && *track->genre)
-	{
-	    mhod.type = MHOD_ID_GENRE;
-	    mhod.data.string = track->genre;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->filetype && *track->filetype)
-	{
-	    mhod.type = MHOD_ID_FILETYPE;
-	    mhod.data.string = track->filetype;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->comment && *track->comment)
-	{
-	    mhod.type = MHOD_ID_COMMENT;
-	    mhod.data.string = track->comment;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->category && *track->category)
-	{
-	    mhod.type = MHOD_ID_CATEGORY;
-	    mhod.data.string = track->category;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->composer && *track->composer)
-	{
-	    mhod.type = MHOD_ID_COMPOSER;
-	    mhod.data.string = track->composer;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->grouping && *track->grouping)
-	{
-	    mhod.type = MHOD_ID_GROUPING;
-	    mhod.data.string = track->grouping;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->description && *track->description)
-	{
-	    mhod.type = MHOD_ID_DESCRIPTION;
-	    mhod.data.string = track->description;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->subtitle && *track->subtitle)
-	{
-	    mhod.type = MHOD_ID_SUBTITLE;
-	    mhod.data.string = track->subtitle;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->tvshow && *track->tvshow)
-	{
-	    mhod.type = MHOD_ID_TVSHOW;
-	    mhod.data.string = track->tvshow;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->tvepisode && *track->tvepisode)
-	{
-	    mhod.type = MHOD_ID_TVEPISODE;
-	    mhod.data.string = track->tvepisode;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->tvnetwork && *track->tvnetwork)
-	{
-	    mhod.type = MHOD_ID_TVNETWORK;
-	    mhod.data.string = track->tvnetwork;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->albumartist && *track->albumartist)
-	{
-	    mhod.type = MHOD_ID_ALBUMARTIST;
-	    mhod.data.string = track->albumartist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->keywords && *track->keywords)
-	{
-	    mhod.type = MHOD_ID_KEYWORDS;
-	    mhod.data.string = track->keywords;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->podcasturl && *track->podcasturl)
-	{
-	    mhod.type = MHOD_ID_PODCASTURL;
-	    mhod.data.string = track->podcasturl;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->podcastrss && *track->podcastrss)
-	{
-	    mhod.type = MHOD_ID_PODCASTRSS;
-	    mhod.data.string = track->podcastrss;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_artist && *track->sort_artist)
-	{
-	    mhod.type = MHOD_ID_SORT_ARTIST;
-	    mhod.data.string = track->sort_artist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_title && *track->sort_title)
-	{
-	    mhod.type = MHOD_ID_SORT_TITLE;
-	    mhod.data.string = track->sort_title;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_album && *track->sort_album)
-	{
-	    mhod.type = MHOD_ID_SORT_ALBUM;
-	    mhod.data.string = track->sort_album;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_albumartist && *track->sort_albumartist)
-	{
-	    mhod.type = MHOD_ID_SORT_ALBUMARTIST;
-	    mhod.data.string = track->sort_albumartist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_composer && *track->sort_composer)
+    n_ranges = write_mhit_threads (fexp->itdb, n_tracks);
+    if (n_ranges == 1)
+    {
+	for (gl=fexp->itdb->tracks; gl; gl=gl->next)  /* Write each track */
 	{
-	    mhod.type = MHOD_ID_SORT_COMPOSER;
-	    mhod.data.string = track->sort_composer;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
+	    write_mhit (fexp, gl->data);
 	}
-	if (track->sort_tvshow && *track->sort_tvshow)
+    }
+    else
+    {
+	/* Each range is written into a buffer of its own starting at
+	   offset 0. As fix_mhit() only uses offsets relative to the
+	   mhit, appending the buffers in order gives exactly the bytes
+	   the loop above would have written. */
+	MhitRange *ranges = g_new0 (MhitRange, n_ranges);
+	GThreadPool *pool = mhit_pool_get ();
+	guint i, j;
+
+	gl = fexp->itdb->tracks;
+	for (i=0; i<n_ranges; ++i)
 	{
-	    mhod.type = MHOD_ID_SORT_TVSHOW;
-	    mhod.data.string = track->sort_tvshow;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
+	    MhitRange *range = &ranges[i];
+
+	    range->n = n_tracks / n_ranges + (i < n_tracks % n_ranges);
+	    range->first = gl;
+	    for (j=0; j<range->n; ++j)
+		gl = gl->next;
+	    range->cts.reversed = cts->reversed;
+	    range->fexp = *fexp;
+	    range->fexp.wcontents = &range->cts;
+	    /* the first range is written by the calling thread */
+	    if ((i != 0) && pool)
+	    {
+		range->queued = TRUE;
+		g_thread_pool_push (pool, range, NULL);
+	    }
 	}
-	if (track->chapterdata_raw && track->chapterdata_raw_length)
+	for (i=0; i<n_ranges; ++i)
 	{
-	    mhod.type = MHOD_ID_CHAPTERDATA;
-	    mhod.data.chapterdata_track = track;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
+	    MhitRange *range = &ranges[i];
+
+	    if (range->queued)
+	    {
+		g_mutex_lock (mhit_done_mutex);
+		while (!range->done)
+		    g_cond_wait (mhit_done_cond, mhit_done_mutex);
+		g_mutex_unlock (mhit_done_mutex);
+	    }
+	    else
+	    {
+		write_mhit_range (range);
+	    }
+	    put_data (cts, range->cts.contents, range->cts.pos);
+	    g_free (range->cts.contents);
 	}
-        /* Fill in the missing items of the mhit header */
-	fix_mhit (cts, mhit_seek, mhod_num);
+	g_free (ranges);
     }
     fix_header (cts, mhsd_seek);
     return TRUE;
@@ -4480,38 +5339,26 @@ static gboolean write_playlist_mhips (FExport *fexp,
 }
 
 
-void free_memberlist (gpointer data);
-void write_one_podcast_group (gpointer key, gpointer value, gpointer userdata);
-void free_memberlist (gpointer data)
+/* a group of podcast episodes with the same album */
+typedef struct
 {
-    GList **memberlist = data;
-    if (memberlist)
-    {
-	g_list_free (*memberlist);
-	g_free (memberlist);
-    }
-}
-void write_one_podcast_group (gpointer key, gpointer value,
-			      gpointer userdata)
+    const gchar *album;
+    guint start;         /* index of the first episode in the array
+			    of all episodes sorted by group          */
+    guint n;             /* number of episodes                       */
+} PodcastGroup;
+
+/* write out the group mhip for @group followed by the mhip/mhod pairs
+   of its episodes, @tracks[group->start] ... */
+static void write_podcast_group (FExport *fexp, PodcastGroup *group,
+				 Itdb_Track **tracks)
 {
-    gchar *album = key;
-    GList **memberlist = value;
-    FExport *fexp = userdata;
-    GList *gl;
-    WContents *cts;
+    WContents *cts = fexp->wcontents;
     glong mhip_seek;
     guint32 groupid;
-    Itdb_iTunesDB *itdb;
     MHODData mhod;
+    guint i;
 
-    g_return_if_fail (album);
-    g_return_if_fail (memberlist);
-    g_return_if_fail (fexp);
-    g_return_if_fail (fexp->itdb);
-    g_return_if_fail (fexp->wcontents);
-
-    cts = fexp->wcontents;
-    itdb = fexp->itdb;
     mhip_seek = cts->pos;
 
     groupid = fexp->next_id++;
@@ -4519,18 +5366,16 @@ void write_one_podcast_group (gpointer key, gpointer value,
 
     mhod.valid = TRUE;
     mhod.type = MHOD_ID_TITLE;
-    mhod.data.string = album;
+    mhod.data.string = (gchar *)group->album;
     mk_mhod (fexp, &mhod);
     fix_header (cts, mhip_seek);
 
     /* write members */
-    for (gl=*memberlist; gl; gl=gl->next)
+    for (i=group->start; i<group->start+group->n; ++i)
     {
-	Itdb_Track *track = gl->data;
+	Itdb_Track *track = tracks[i];
 	guint32 mhip_id;
 
-	g_return_if_fail (track);
-
 	mhip_seek = cts->pos;
 	mhip_id = fexp->next_id++;
 	mk_mhip (fexp, 1, 0, mhip_id, track->id, 0, groupid);
@@ -4554,6 +5399,10 @@ static gboolean write_podcast_mhips (FExport *fexp,
     WContents *cts;
     guint32 mhip_num;
     GHashTable *album_hash;
+    GArray *groups;
+    guint *group_of;
+    Itdb_Track **tracks;
+    guint n_tracks, i;
 
     g_return_val_if_fail (fexp, FALSE);
     g_return_val_if_fail (fexp->itdb, FALSE);
@@ -4561,41 +5410,70 @@ static gboolean write_podcast_mhips (FExport *fexp,
     g_return_val_if_fail (pl, FALSE);
 
     cts = fexp->wcontents;
-
-    /* Create a list wit all available album names because we have to
-       group the podcasts according to albums */
-
-    album_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-					NULL, free_memberlist);
+    n_tracks = 0;
     for (gl=pl->members; gl; gl=gl->next)
     {
-	GList **memberlist;
-	gchar *album;
-	Itdb_Track *track = gl->data;
-	g_return_val_if_fail (track, FALSE);
-
-	if (track->album)
-	    album = track->album;
-	else
-	    album = "";
+	g_return_val_if_fail (gl->data, FALSE);
+	++n_tracks;
+    }
 
-	memberlist = g_hash_table_lookup (album_hash, album);
+    /* The podcasts have to be grouped according to albums. The groups
+       are numbered in the order their album first appears in @pl
+       (album_hash maps the album to its number + 1), so identical
+       playlists always give the same iTunesDB. */
+    album_hash = g_hash_table_new (g_str_hash, g_str_equal);
+    groups = g_array_new (FALSE, TRUE, sizeof (PodcastGroup));
+    group_of = g_new (guint, n_tracks);
+    for (gl=pl->members, i=0; gl; gl=gl->next, ++i)
+    {
+	Itdb_Track *track = gl->data;
+	const gchar *album;
+	guint group;
 
-	if (!memberlist)
+	album = track->album ? track->album : "";
+	group = GPOINTER_TO_UINT (g_hash_table_lookup (album_hash, album));
+	if (group == 0)
 	{
-	    memberlist = g_new0 (GList *, 1);
-	    g_hash_table_insert (album_hash, album, memberlist);
+	    PodcastGroup new_group = { album, 0, 0 };
+	    g_array_append_val (groups, new_group);
+	    group = groups->len;
+	    g_hash_table_insert (album_hash, (gpointer)album,
+				 GUINT_TO_POINTER (group));
 	}
-	*memberlist = g_list_append (*memberlist, track);
+	group_of[i] = group - 1;
+	++g_array_index (groups, PodcastGroup, group - 1).n;
+    }
+
+    /* sort the episodes by group, keeping their order within a group */
+    for (i=1; i<groups->len; ++i)
+    {
+	PodcastGroup *prev = &g_array_index (groups, PodcastGroup, i - 1);
+	g_array_index (groups, PodcastGroup, i).start = prev->start + prev->n;
+    }
+    tracks = g_new (Itdb_Track *, n_tracks);
+    for (gl=pl->members, i=0; gl; gl=gl->next, ++i)
+    {
+	PodcastGroup *group = &g_array_index (groups, PodcastGroup,
+					      group_of[i]);
+	tracks[group->start++] = gl->data;
     }
 
-    g_hash_table_foreach (album_hash, write_one_podcast_group, fexp);
+    for (i=0; i<groups->len; ++i)
+    {
+	PodcastGroup *group = &g_array_index (groups, PodcastGroup, i);
+	/* the loop above advanced start to the end of the group */
+	group->start -= group->n;
+	write_podcast_group (fexp, group, tracks);
+    }
 
     /* set number of mhips */
-    mhip_num = g_list_length (pl->members)+g_hash_table_size (album_hash);
+    mhip_num = n_tracks + groups->len;
     put32lint_seek (cts, mhip_num, mhyp_seek+16);
 
     g_hash_table_destroy (album_hash);
+    g_array_free (groups, TRUE);
+    g_free (group_of);
+    g_free (tracks);
 
     return TRUE;
 }
@@ -4666,11 +5544,14 @@ static gboolean write_playlist (FExport *fexp,
 
     if ((pl->type == ITDB_PL_TYPE_MPL) && pl->members)
     {   /* write out the MHOD 52 lists */
+	ItdbStatsTimer timer;
+
 	/* We have to sort all tracks five times. To speed this up,
 	   translate the utf8 keys into collate_keys and use the
 	   faster strcmp() for comparison */
 	mhod.valid = TRUE;
 	mhod.type = MHOD_ID_LIBPLAYLISTINDEX;
+	itdb_stats_begin (fexp->stats, &timer);
 	mhod.data.mhod52coltracks = mhod52_make_collate_keys (pl->members);
 	mhod.data2.mhod52sorttype = MHOD52_SORTTYPE_TITLE;
 	mk_mhod (fexp, &mhod);
@@ -4683,6 +5564,7 @@ static gboolean write_playlist (FExport *fexp,
 	mhod.data2.mhod52sorttype = MHOD52_SORTTYPE_COMPOSER;
 	mk_mhod (fexp, &mhod);
 	mhod52_free_collate_keys (mhod.data.mhod52coltracks);
+	itdb_stats_end (fexp->stats, ITDB_STATS_COLLATE, &timer);
     }
     else  if (pl->is_spl)
     {  /* write the smart rules */
@@ -4758,44 +5640,14 @@ static WContents *wcontents_new (const gchar *filename)
  * cts->error accordingly. */
 static gboolean wcontents_write (WContents *cts)
 {
-    int fd;
-
     g_return_val_if_fail (cts, FALSE);
     g_return_val_if_fail (cts->filename, FALSE);
 
-    fd = creat (cts->filename, S_IRWXU|S_IRWXG|S_IRWXO);
-
-    if (fd == -1)
-    {
-	cts->error = g_error_new (G_FILE_ERROR,
-				  g_file_error_from_errno (errno),
-				  _("Opening of '%s' for writing failed (%s)."),
-				  cts->filename, g_strerror (errno));
-	return FALSE;
-    }
-    if (cts->contents && cts->pos)
-    {
-	ssize_t written = write (fd, cts->contents, cts->pos);
-	if (written == -1)
-	{
-	    cts->error = g_error_new (G_FILE_ERROR,
-				      g_file_error_from_errno (errno),
-				      _("Writing to '%s' failed (%s)."),
-				      cts->filename, g_strerror (errno));
-	    close (fd);
-	    return FALSE;
-	}
-    }
-    fd = close (fd);
-    if (fd == -1)
-    {
-	cts->error = g_error_new (G_FILE_ERROR,
-				  g_file_error_from_errno (errno),
-				  _("Writing to '%s' failed (%s)."),
-				  cts->filename, g_strerror (errno));
-	return FALSE;
-    }
-    return TRUE;
+    /* never truncate the live file: a crash or an unplugged iPod
+       would leave an unusable database behind */
+    return itdb_file_replace (cts->filename, cts->contents, cts->pos,
+			      S_IRWXU|S_IRWXG|S_IRWXO, cts->backup,
+			      &cts->error);
 }
 
 
@@ -4818,7 +5670,8 @@ static void wcontents_free (WContents *cts)
 */
 static void prepare_itdb_for_write (FExport *fexp)
 {
-    GList *gl;
+    GList *gl, *ordered = NULL, *tail = NULL;
+    GHashTable *links;
     Itdb_iTunesDB *itdb;
     Itdb_Playlist *mpl;
 
@@ -4834,17 +5687,51 @@ static void prepare_itdb_for_write (FExport *fexp)
     mpl = itdb_playlist_mpl (itdb);
     g_return_if_fail (mpl);
 
-    for (gl=g_list_last(mpl->members); gl; gl=gl->prev)
+    /* Move the links of itdb->tracks found through a hash table to
+       a new list in MPL order, then append the remaining tracks in
+       their previous order. Unlike searching itdb->tracks for each
+       member this is linear in the number of tracks. */
+    links = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (gl=itdb->tracks; gl; gl=gl->next)
     {
-	GList *link;
-	Itdb_Track *track = gl->data;
-	g_return_if_fail (track);
-	link = g_list_find (itdb->tracks, track);
-	g_return_if_fail (link);
+	if (!g_hash_table_lookup (links, gl->data))
+	    g_hash_table_insert (links, gl->data, gl);
+    }
+    for (gl=mpl->members; gl; gl=gl->next)
+    {
+	if (!g_hash_table_lookup (links, gl->data))
+	    break;
+    }
+    if (gl)
+    {   /* a member of the MPL is missing in itdb->tracks */
+	g_hash_table_destroy (links);
+	g_return_if_reached ();
+    }
+    for (gl=mpl->members; gl; gl=gl->next)
+    {
+	GList *link = g_hash_table_lookup (links, gl->data);
 
-	/* move this track to the beginning of itdb_tracks */
-	itdb->tracks = g_list_delete_link (itdb->tracks, link);
-	itdb->tracks = g_list_prepend (itdb->tracks, track);
+	/* NULL: moved already because the track is listed twice */
+	if (!link)
+	    continue;
+	g_hash_table_insert (links, gl->data, NULL);
+	itdb->tracks = g_list_remove_link (itdb->tracks, link);
+	if (tail)
+	{
+	    tail->next = link;
+	    link->prev = tail;
+	}
+	else
+	    ordered = link;
+	tail = link;
+    }
+    g_hash_table_destroy (links);
+    if (tail)
+    {
+	tail->next = itdb->tracks;
+	if (itdb->tracks)
+	    itdb->tracks->prev = tail;
+	itdb->tracks = ordered;
     }
 
     fexp->next_id = FIRST_IPOD_ID;
@@ -4854,6 +5741,8 @@ static void prepare_itdb_for_write (FExport *fexp)
     {
 	Itdb_Track *track = gl->data;
 	g_return_if_fail (track);
+	if (track->id != fexp->next_id)
+	    itdb_snapshots_track_write (track);
 	track->id = fexp->next_id++;
     }
 }
@@ -4902,6 +5791,41 @@ static gboolean write_db_checksum (FExport *fexp, GError **error)
     return TRUE;
 }
 
+/**
+ * itdb_set_write_threads:
+ * @itdb: an #Itdb_iTunesDB
+ * @n_threads: number of threads, 0 for automatic
+ *
+ * Sets the number of threads itdb_write_file() uses to encode the
+ * tracks of @itdb. With 0 (the default) one thread per processor is
+ * used, 1 writes all tracks in the calling thread. The calling thread
+ * writes one part of the tracks, the others are written on a pool of
+ * at most 8 threads shared by all databases being written. Small
+ * databases are always written by the calling thread, and so is
+ * everything if g_thread_init() hasn't been called. The iTunesDB
+ * written is the same in every case.
+ **/
+void itdb_set_write_threads (Itdb_iTunesDB *itdb, guint n_threads)
+{
+    g_return_if_fail (itdb);
+
+    itdb_get_private (itdb)->write_threads = n_threads;
+}
+
+/**
+ * itdb_get_write_threads:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Return value: the number of threads set with
+ * itdb_set_write_threads()
+ **/
+guint itdb_get_write_threads (Itdb_iTunesDB *itdb)
+{
+    g_return_val_if_fail (itdb, 1);
+
+    return itdb_get_private (itdb)->write_threads;
+}
+
 /**
  * itdb_write_file:
  * @itdb: the #Itdb_iTunesDB to save
@@ -4920,6 +5844,9 @@ gboolean itdb_write_file (Itdb_iTunesDB *itdb, const gchar *filename,
     gulong mhbd_seek = 0;
     WContents *cts;
     gboolean result = TRUE;;
+    gboolean success;
+    Itdb_Stats *stats;
+    ItdbStatsTimer timer;
 
     g_return_val_if_fail (itdb, FALSE);
     g_return_val_if_fail (itdb->device, FALSE);
@@ -4933,14 +5860,18 @@ gboolean itdb_write_file (Itdb_iTunesDB *itdb, const gchar *filename,
 
     fexp = g_new0 (FExport, 1);
     fexp->itdb = itdb;
+    stats = itdb_stats_get (itdb);
+    fexp->stats = stats;
     fexp->wcontents = wcontents_new (filename);
     cts = fexp->wcontents;
+    cts->backup = itdb_get_backup (itdb);
 
     cts->reversed = (itdb->device->byte_order == G_BIG_ENDIAN);
 
+    itdb_stats_begin (stats, &timer);
     prepare_itdb_for_write (fexp);
+    itdb_stats_end (stats, ITDB_STATS_PREPARE_WRITE, &timer);
 
-#if HAVE_GDKPIXBUF
     /* only write ArtworkDB if we deal with an iPod
        FIXME: figure out a way to store the artwork data when storing
        to local directories. At the moment it's the application's task
@@ -4952,29 +5883,40 @@ gboolean itdb_write_file (Itdb_iTunesDB *itdb, const gchar *filename,
     if (itdb_device_supports_artwork (itdb->device)) {
 		ipod_write_artwork_db (itdb);
     }
-#endif
 
     mk_mhbd (fexp, 3);   /* three mhsds */
     /* write tracklist */
-    if (write_mhsd_tracks (fexp))
-    {   /* write special podcast version mhsd */
-	if (write_mhsd_playlists (fexp, 3))
-	{   /* write standard playlist mhsd */
-	    if (write_mhsd_playlists (fexp, 2))
-	    {
-		fix_header (cts, mhbd_seek);
-
-		/* Set checksum (ipods require it starting from iPod Classic 
-		 * and fat Nanos)
-		 */
-		write_db_checksum (fexp, &fexp->error);
-	    }
-	}
+    itdb_stats_begin (stats, &timer);
+    success = write_mhsd_tracks (fexp);
+    itdb_stats_end (stats, ITDB_STATS_WRITE_TRACKS, &timer);
+    if (success)
+    {   /* write special podcast version mhsd, then standard playlist
+	   mhsd */
+	itdb_stats_begin (stats, &timer);
+	success = write_mhsd_playlists (fexp, 3) &&
+	    write_mhsd_playlists (fexp, 2);
+	itdb_stats_end (stats, ITDB_STATS_WRITE_PLAYLISTS, &timer);
+    }
+    if (success)
+    {
+	fix_header (cts, mhbd_seek);
+
+	/* Set checksum (ipods require it starting from iPod Classic 
+	 * and fat Nanos)
+	 */
+	itdb_stats_begin (stats, &timer);
+	write_db_checksum (fexp, &fexp->error);
+	itdb_stats_end (stats, ITDB_STATS_CHECKSUM, &timer);
     }
     if (!fexp->error)
     {
+	itdb_stats_begin (stats, &timer);
 	if (!wcontents_write (cts))
 	    g_propagate_error (&fexp->error, cts->error);
+	else if (stats)
+	    stats->bytes_written += cts->pos;
+	itdb_durability_add_file (itdb, filename);
+	itdb_stats_end (stats, ITDB_STATS_WRITE_FILE, &timer);
     }
     if (fexp->error)
     {
@@ -4988,15 +5930,48 @@ gboolean itdb_write_file (Itdb_iTunesDB *itdb, const gchar *filename,
 	gchar *fn = g_strdup (filename);
 	g_free (itdb->filename);
 	itdb->filename = fn;
+	otg_state_written (itdb);
     }
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    sync ();
+    itdb_stats_begin (stats, &timer);
+    if (!itdb_durability_flush (itdb, result ? error : NULL))
+	result = FALSE;
+    itdb_stats_end (stats, ITDB_STATS_SYNC, &timer);
 
     return result;
 }
 
+/* Registers the file @name in the Device directory of @itdb's iPod
+   for itdb_flush() */
+static void durability_add_device_file (Itdb_iTunesDB *itdb,
+					const gchar *name)
+{
+    gchar *dir = itdb_get_device_dir (itdb_get_mountpoint (itdb));
+
+    if (dir)
+    {
+	gchar *path = g_build_filename (dir, name, NULL);
+	itdb_durability_add_file (itdb, path);
+	g_free (path);
+	g_free (dir);
+    }
+}
+
+/* Registers the iTunes directory of @itdb's iPod for itdb_flush()
+   after itdb_rename_files() renamed or removed files in it */
+static void durability_add_itunes_dir (Itdb_iTunesDB *itdb)
+{
+    gchar *dir = itdb_get_itunes_dir (itdb_get_mountpoint (itdb));
+
+    if (dir)
+    {
+	itdb_durability_add_file (itdb, dir);
+	g_free (dir);
+    }
+}
+
 /**
  * itdb_write:
  * @itdb: the #Itdb_iTunesDB to write to disk
@@ -5015,6 +5990,8 @@ gboolean itdb_write (Itdb_iTunesDB *itdb, GError **error)
 {
     gchar *itunes_filename, *itunes_path;
     gboolean result = FALSE;
+    Itdb_Stats *stats;
+    ItdbStatsTimer timer;
 
     g_return_val_if_fail (itdb, FALSE);
     g_return_val_if_fail (itdb_get_mountpoint (itdb), FALSE);
@@ -5047,14 +6024,20 @@ gboolean itdb_write (Itdb_iTunesDB *itdb, GError **error)
 	/* Write SysInfo file if it has changed */
 	if (itdb->device->sysinfo_changed)
 	{
-	    itdb_device_write_sysinfo (itdb->device, error);
+	    if (itdb_device_write_sysinfo (itdb->device, error))
+		durability_add_device_file (itdb, "SysInfo");
 	}
 	result = itdb_rename_files (itdb_get_mountpoint (itdb), error);
+	durability_add_itunes_dir (itdb);
     }
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    sync ();
+    stats = itdb_stats_get (itdb);
+    itdb_stats_begin (stats, &timer);
+    if (!itdb_durability_flush (itdb, result ? error : NULL))
+	result = FALSE;
+    itdb_stats_end (stats, ITDB_STATS_SYNC, &timer);
 
     return result;
 }
@@ -5211,29 +6194,129 @@ gboolean itdb_shuffle_write (Itdb_iTunesDB *itdb, GError **error)
     g_free(itunes_path);
 
     if (result == TRUE)
+    {
 	result = itdb_rename_files (itdb_get_mountpoint (itdb), error);
+	durability_add_itunes_dir (itdb);
+    }
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    sync ();
+    if (!itdb_durability_flush (itdb, result ? error : NULL))
+	result = FALSE;
 
     return result;
 }
 
 
-/**
- * itdb_shuffle_write_file:
- * @itdb: the #Itdb_iTunesDB to write to disk
- * @filename: file to write to, cannot be NULL
- * @error: return location for a #GError or NULL
- *
- * Do the actual writing to the iTunesSD 
- *
- * Return value: TRUE on success, FALSE on error, in which case @error is
- * set accordingly.
- **/
-gboolean itdb_shuffle_write_file (Itdb_iTunesDB *itdb,
-				  const gchar *filename, GError **error)
+/* size of the iTunesSD header and of each track record */
+#define SHUFFLE_HEADER_SIZE 0x12
+#define SHUFFLE_RECORD_SIZE 0x22e
+
+/* The encoded iTunesSD record of a track together with copies of the
+   fields of the track it was made from. As long as these fields don't
+   change, the record can be written again as it is. */
+typedef struct
+{
+    gchar *ipod_path;
+    gchar *filetype;
+    guint32 starttime;
+    guint32 stoptime;
+    gint32 volume;
+    guint index;         /* position in the iTunesSD last written */
+    gchar record[SHUFFLE_RECORD_SIZE];
+} ShuffleRecord;
+
+struct _ItdbShuffleCache
+{
+    GHashTable *records; /* Itdb_Track -> ShuffleRecord             */
+    /* identifies the iTunesSD last written; filename is NULL if the
+       file may not contain the records at their index            */
+    gchar *filename;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+static void shuffle_record_free (ShuffleRecord *rec)
+{
+    g_free (rec->ipod_path);
+    g_free (rec->filetype);
+    g_free (rec);
+}
+
+static void shuffle_cache_forget_file (ItdbShuffleCache *cache)
+{
+    g_free (cache->filename);
+    cache->filename = NULL;
+}
+
+static void shuffle_cache_free (ItdbShuffleCache *cache)
+{
+    if (cache)
+    {
+	if (cache->records)
+	    g_hash_table_destroy (cache->records);
+	shuffle_cache_forget_file (cache);
+	g_free (cache);
+    }
+}
+
+/* remember @filename as the iTunesSD just written */
+static void shuffle_cache_set_file (ItdbShuffleCache *cache,
+				    const gchar *filename)
+{
+    struct stat statbuf;
+
+    shuffle_cache_forget_file (cache);
+    if (g_stat (filename, &statbuf) == 0)
+    {
+	cache->filename = g_strdup (filename);
+	cache->dev = statbuf.st_dev;
+	cache->ino = statbuf.st_ino;
+	cache->size = statbuf.st_size;
+	cache->mtime = statbuf.st_mtime;
+    }
+}
+
+/* TRUE if @filename is still the iTunesSD written last and has @size
+   bytes */
+static gboolean shuffle_cache_is_file (ItdbShuffleCache *cache,
+				       const gchar *filename, off_t size)
+{
+    struct stat statbuf;
+
+    if (!cache->filename || (strcmp (cache->filename, filename) != 0))
+	return FALSE;
+    if (g_stat (filename, &statbuf) != 0)
+	return FALSE;
+    return (statbuf.st_dev == cache->dev) &&
+	(statbuf.st_ino == cache->ino) &&
+	(statbuf.st_size == cache->size) &&
+	(statbuf.st_mtime == cache->mtime) &&
+	(statbuf.st_size == size);
+}
+
+static gboolean shuffle_str_equal (const gchar *a, const gchar *b)
+{
+    if (!a || !b)
+	return a == b;
+    return strcmp (a, b) == 0;
+}
+
+/* TRUE if @rec was made from the current fields of @tr */
+static gboolean shuffle_record_matches (ShuffleRecord *rec, Itdb_Track *tr)
+{
+    return (rec->starttime == tr->starttime) &&
+	(rec->stoptime == tr->stoptime) &&
+	(rec->volume == tr->volume) &&
+	shuffle_str_equal (rec->ipod_path, tr->ipod_path) &&
+	shuffle_str_equal (rec->filetype, tr->filetype);
+}
+
+/* Returns the file type code of the iTunesSD for @filetype. The
+   result for each distinct string is kept in @filetypes. */
+static guint32 shuffle_filetype (GHashTable *filetypes, gchar *filetype)
 {
     auto gboolean haystack (gchar *filetype, gchar **desclist);
     gboolean haystack (gchar *filetype, gchar **desclist)
@@ -5246,106 +6329,288 @@ gboolean itdb_shuffle_write_file (Itdb_iTunesDB *itdb,
 	}
 	return FALSE;
     }
+    gchar *mp3_desc[] = {"MPEG", "MP3", "mpeg", "mp3", NULL};
+    gchar *mp4_desc[] = {"AAC", "MP4", "aac", "mp4", NULL};
+    gchar *wav_desc[] = {"WAV", "wav", NULL};
+    guint32 type;
+
+    if (!filetype)
+	return 0x01;  /* default to mp3 */
+    type = GPOINTER_TO_UINT (g_hash_table_lookup (filetypes, filetype));
+    if (type != 0)
+	return type;
+
+    /* The next one should be 0x01 for MP3,
+    ** 0x02 for AAC, and 0x04 for WAV, but I can't find
+    ** a suitable indicator within the track structure? */
+    /* JCS: let's do heuristic on tr->filetype which would contain
+       "MPEG audio file", "AAC audio file", "Protected AAC audio
+       file", "AAC audio book file", "WAV audio file" (or similar
+       if not written by gtkpod) */
+    if (haystack (filetype, mp3_desc))
+	type = 0x01;
+    else if (haystack (filetype, mp4_desc))
+	type = 0x02;
+    else if (haystack (filetype, wav_desc))
+	type = 0x04;
+    else
+	type = 0x01;  /* default to mp3 */
+
+    g_hash_table_insert (filetypes, filetype, GUINT_TO_POINTER (type));
+    return type;
+}
+
+/* Encodes the iTunesSD record of @tr. @cts is used as scratch
+   space. */
+static ShuffleRecord *shuffle_record_new (Itdb_Track *tr, WContents *cts,
+					  GHashTable *filetypes)
+{
+    ShuffleRecord *rec;
+    gchar *path;
+    gunichar2 *path_utf16;
+    glong pathlen;
+
+    cts->pos = 0;
+
+    put24bint (cts, 0x00022e);
+    put24bint (cts, 0x5aa501);
+    /* starttime is in 256 ms incr. for shuffle */
+    put24bint (cts, tr->starttime / 256);
+    put24bint (cts, 0);
+    put24bint (cts, 0);
+    put24bint (cts, tr->stoptime / 256);
+    put24bint (cts, 0);
+    put24bint (cts, 0);
+    /* track->volume ranges from -255 to +255 */
+    /* we want 0 - 200 */
+    put24bint (cts, ((tr->volume + 255) * 201) / 511);
+
+    put24bint (cts, shuffle_filetype (filetypes, tr->filetype));
+
+    put24bint (cts, 0x200);
+
+    /* shuffle uses forward slash separator, not colon */
+    path = g_strdup (tr->ipod_path);
+    itdb_filename_ipod2fs (path);
+    path_utf16 = g_utf8_to_utf16 (path, -1, NULL, &pathlen, NULL);
+    /* the record has a fixed size */
+    if (!path_utf16) pathlen = 0;
+    if (pathlen > 261) pathlen = 261;
+    fixup_little_utf16 (path_utf16);
+    put_data (cts, (gchar *)path_utf16, sizeof (gunichar2)*pathlen);
+    /* pad to 522 bytes */
+    put16_n0 (cts, 261-pathlen);
+    g_free(path);
+    g_free(path_utf16);
+
+    /* XXX FIXME: should depend on something, not hardcoded */
+    put8int (cts, 0x1); /* song used in shuffle mode */
+    put8int (cts, 0);   /* song will not be bookmarkable */
+    put8int (cts, 0);
+
+    rec = g_new (ShuffleRecord, 1);
+    rec->ipod_path = g_strdup (tr->ipod_path);
+    rec->filetype = g_strdup (tr->filetype);
+    rec->starttime = tr->starttime;
+    rec->stoptime = tr->stoptime;
+    rec->volume = tr->volume;
+    rec->index = G_MAXUINT;
+    memcpy (rec->record, cts->contents, SHUFFLE_RECORD_SIZE);
+    return rec;
+}
+
+/**
+ * itdb_set_shuffle_in_place:
+ * @itdb: an #Itdb_iTunesDB
+ * @in_place: TRUE to update the iTunesSD in place
+ *
+ * Normally itdb_shuffle_write_file() replaces the iTunesSD atomically
+ * by a new file. With @in_place set and if the iTunesSD is still the
+ * one written last through @itdb with the same number of tracks, only
+ * the records of tracks that changed or moved are overwritten in the
+ * existing file. This makes small edits on slow flash almost free, but
+ * if writing is interrupted the iTunesSD may be left with a mix of old
+ * and new (or partly written) records. Ignored if itdb_set_backup()
+ * is on. Off by default.
+ **/
+void itdb_set_shuffle_in_place (Itdb_iTunesDB *itdb, gboolean in_place)
+{
+    g_return_if_fail (itdb);
+
+    itdb_get_private (itdb)->shuffle_in_place = in_place;
+}
+
+/**
+ * itdb_get_shuffle_in_place:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Return value: TRUE if the iTunesSD is updated in place, see
+ * itdb_set_shuffle_in_place()
+ **/
+gboolean itdb_get_shuffle_in_place (Itdb_iTunesDB *itdb)
+{
+    g_return_val_if_fail (itdb, FALSE);
+
+    return itdb_get_private (itdb)->shuffle_in_place;
+}
 
+/**
+ * itdb_shuffle_write_file:
+ * @itdb: the #Itdb_iTunesDB to write to disk
+ * @filename: file to write to, cannot be NULL
+ * @error: return location for a #GError or NULL
+ *
+ * Do the actual writing to the iTunesSD. The records of the tracks are
+ * kept with @itdb and only encoded again for tracks whose path,
+ * filetype, start/stop time or volume changed since the last write.
+ *
+ * Return value: TRUE on success, FALSE on error, in which case @error is
+ * set accordingly.
+ **/
+gboolean itdb_shuffle_write_file (Itdb_iTunesDB *itdb,
+				  const gchar *filename, GError **error)
+{
     FExport *fexp;
     GList *gl;
-    WContents *cts;
+    WContents *cts, *scratch;
+    ItdbPrivate *priv;
+    ItdbShuffleCache *cache;
+    GHashTable *records, *filetypes;
+    guint n_tracks, i;
+    int fd = -1;
     gboolean result = TRUE;;
 
     g_return_val_if_fail (itdb, FALSE);
     g_return_val_if_fail (filename, FALSE);
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	g_return_val_if_fail (gl->data, FALSE);
+    }
 
     fexp = g_new0 (FExport, 1);
     fexp->itdb = itdb;
     fexp->wcontents = wcontents_new (filename);
     cts = fexp->wcontents;
+    cts->backup = itdb_get_backup (itdb);
 
     prepare_itdb_for_write (fexp);
 
-    put24bint (cts, itdb_tracks_number (itdb));
-    put24bint (cts, 0x010600);
-    put24bint (cts, 0x12);	/* size of header */
-    put24bint (cts, 0x0);	/* padding? */
-    put24bint (cts, 0x0);
-    put24bint (cts, 0x0);
+    priv = itdb_get_private (itdb);
+    if (!priv->shuffle)
+	priv->shuffle = g_new0 (ItdbShuffleCache, 1);
+    cache = priv->shuffle;
+    n_tracks = itdb_tracks_number (itdb);
 
-    for (gl=itdb->tracks; gl; gl=gl->next)
+    if (priv->shuffle_in_place && !cts->backup &&
+	shuffle_cache_is_file (cache, filename,
+			       SHUFFLE_HEADER_SIZE +
+			       (off_t)n_tracks * SHUFFLE_RECORD_SIZE))
+    {
+	/* the header only depends on the number of tracks */
+	fd = open (filename, O_WRONLY);
+    }
+    /* the file is about to change whatever happens */
+    shuffle_cache_forget_file (cache);
+
+    if (fd == -1)
+    {
+	put24bint (cts, n_tracks);
+	put24bint (cts, 0x010600);
+	put24bint (cts, SHUFFLE_HEADER_SIZE);	/* size of header */
+	put24bint (cts, 0x0);	/* padding? */
+	put24bint (cts, 0x0);
+	put24bint (cts, 0x0);
+    }
+
+    records = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+				     (GDestroyNotify)shuffle_record_free);
+    filetypes = g_hash_table_new (g_str_hash, g_str_equal);
+    scratch = g_new0 (WContents, 1);
+    for (gl=itdb->tracks, i=0; gl && !fexp->error; gl=gl->next, ++i)
     {
 	Itdb_Track *tr = gl->data;
-	gchar *path;
-	gunichar2 *path_utf16;
-	glong pathlen;
-	gchar *mp3_desc[] = {"MPEG", "MP3", "mpeg", "mp3", NULL};
-	gchar *mp4_desc[] = {"AAC", "MP4", "aac", "mp4", NULL};
-	gchar *wav_desc[] = {"WAV", "wav", NULL};
-
-	g_return_val_if_fail (tr, FALSE);
-
-	put24bint (cts, 0x00022e);
-	put24bint (cts, 0x5aa501);
-	/* starttime is in 256 ms incr. for shuffle */
-	put24bint (cts, tr->starttime / 256);
-	put24bint (cts, 0);
-	put24bint (cts, 0);
-	put24bint (cts, tr->stoptime / 256);
-	put24bint (cts, 0);
-	put24bint (cts, 0);
-	/* track->volume ranges from -255 to +255 */
-	/* we want 0 - 200 */
-	put24bint (cts, ((tr->volume + 255) * 201) / 511);
-
-	/* The next one should be 0x01 for MP3,
-	** 0x02 for AAC, and 0x04 for WAV, but I can't find
-	** a suitable indicator within the track structure? */
-	/* JCS: let's do heuristic on tr->filetype which would contain
-	   "MPEG audio file", "AAC audio file", "Protected AAC audio
-	   file", "AAC audio book file", "WAV audio file" (or similar
-	   if not written by gtkpod) */
-
-	if (haystack (tr->filetype, mp3_desc))
-	    put24bint (cts, 0x01);
-	else if (haystack (tr->filetype, mp4_desc))
-	    put24bint (cts, 0x02);
-	else if (haystack (tr->filetype, wav_desc))
-	    put24bint (cts, 0x04);
-	else
-	    put24bint (cts, 0x01);  /* default to mp3 */
-
-	put24bint (cts, 0x200);
-		
-	/* shuffle uses forward slash separator, not colon */
-	path = g_strdup (tr->ipod_path);
-	itdb_filename_ipod2fs (path);
-	path_utf16 = g_utf8_to_utf16 (path, -1, NULL, &pathlen, NULL);
-	if (pathlen > 261) pathlen = 261;
-	fixup_little_utf16 (path_utf16);
-	put_data (cts, (gchar *)path_utf16, sizeof (gunichar2)*pathlen);
-	/* pad to 522 bytes */
-	put16_n0 (cts, 261-pathlen);
-	g_free(path);
-	g_free(path_utf16);
-
-	/* XXX FIXME: should depend on something, not hardcoded */
-	put8int (cts, 0x1); /* song used in shuffle mode */
-	put8int (cts, 0);   /* song will not be bookmarkable */
-	put8int (cts, 0);
+	ShuffleRecord *rec = NULL;
+	gboolean unchanged = FALSE;
+
+	if (cache->records)
+	{
+	    rec = g_hash_table_lookup (cache->records, tr);
+	    if (rec)
+	    {
+		g_hash_table_steal (cache->records, tr);
+		if (shuffle_record_matches (rec, tr))
+		{
+		    unchanged = (rec->index == i);
+		}
+		else
+		{
+		    shuffle_record_free (rec);
+		    rec = NULL;
+		}
+	    }
+	}
+	if (!rec)
+	    rec = shuffle_record_new (tr, scratch, filetypes);
+	rec->index = i;
+	g_hash_table_insert (records, tr, rec);
+
+	if (fd == -1)
+	{
+	    put_data (cts, rec->record, SHUFFLE_RECORD_SIZE);
+	}
+	else if (!unchanged &&
+		 (pwrite (fd, rec->record, SHUFFLE_RECORD_SIZE,
+			  SHUFFLE_HEADER_SIZE +
+			  (off_t)i * SHUFFLE_RECORD_SIZE) !=
+		  SHUFFLE_RECORD_SIZE))
+	{
+	    g_set_error (&fexp->error,
+			 G_FILE_ERROR,
+			 g_file_error_from_errno (errno),
+			 _("Error writing to '%s' (%s)."),
+			 filename, g_strerror (errno));
+	}
     }
-    if (!fexp->error)
+    g_hash_table_destroy (filetypes);
+    wcontents_free (scratch);
+    if (cache->records)
+	g_hash_table_destroy (cache->records);
+    cache->records = records;
+
+    if (fd != -1)
+    {
+	if ((close (fd) != 0) && !fexp->error)
+	{
+	    g_set_error (&fexp->error,
+			 G_FILE_ERROR,
+			 g_file_error_from_errno (errno),
+			 _("Error writing to '%s' (%s)."),
+			 filename, g_strerror (errno));
+	}
+	itdb_durability_add_file (itdb, filename);
+    }
+    else if (!fexp->error)
     {
 	if (!wcontents_write (cts))
 	    g_propagate_error (&fexp->error, cts->error);
+	itdb_durability_add_file (itdb, filename);
     }
     if (fexp->error)
     {
 	g_propagate_error (error, fexp->error);
 	result = FALSE;
     }
+    else
+    {
+	shuffle_cache_set_file (cache, filename);
+    }
     wcontents_free (cts);
     g_free (fexp);
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    sync ();
+    if (!itdb_durability_flush (itdb, result ? error : NULL))
+	result = FALSE;
 
     return result;
 }
@@ -5410,6 +6675,7 @@ gboolean itdb_rename_files (const gchar *mp, GError **error)
     /* rename "Play Counts" to "Play Counts.bak" */
     if (plcname_o)
     {
+	itdb_resolve_path_invalidate (plcname_o);
 	if (rename (plcname_o, plcname_n) == -1)
 	{   /* an error occured */
 	    g_set_error (error,
@@ -5425,6 +6691,7 @@ gboolean itdb_rename_files (const gchar *mp, GError **error)
      * files */
     if (otgname)
     {
+	itdb_resolve_path_invalidate (otgname);
 	if (unlink (otgname) == -1)
 	{
 	    if (error && !*error)
@@ -5442,6 +6709,7 @@ gboolean itdb_rename_files (const gchar *mp, GError **error)
     /* remove some Shuffle files */
     if (shuname)
     {
+	itdb_resolve_path_invalidate (shuname);
 	if (unlink (shuname) == -1)
 	{
 	    if (error && !*error)
@@ -5797,6 +7065,7 @@ Itdb_Track *itdb_cp_finalize (Itdb_Track *track,
     else
     {
 	use_track = track;
+	itdb_snapshots_track_write (track);
     }
 
     use_track->transferred = TRUE;
@@ -5955,6 +7224,113 @@ gchar *itdb_filename_on_ipod (Itdb_Track *track)
 }
 
 
+/**
+ * itdb_check_track_files:
+ * @itdb: an #Itdb_iTunesDB
+ * @get_size: TRUE to also determine the size of the files
+ * @func: function called for every track of @itdb
+ * @user_data: data passed to @func
+ *
+ * Checks for all tracks of @itdb at once whether their file exists on
+ * the iPod. This gives the same result as calling
+ * itdb_filename_on_ipod() for every track, but each directory
+ * containing tracks (e.g. iPod_Control/Music/F00) is located once and
+ * read with a single directory scan instead of testing the files one
+ * by one.
+ *
+ * @func is called for every track in the order of @itdb->tracks with
+ * the full filename of the track, or NULL if the file does not exist
+ * or no filename is set in the track. The size of the file is passed
+ * if @get_size is TRUE (this requires a stat() of each file), -1
+ * otherwise.
+ **/
+void itdb_check_track_files (Itdb_iTunesDB *itdb, gboolean get_size,
+			     ItdbTrackFileFunc func, gpointer user_data)
+{
+    GHashTable *dirs;
+    const gchar *mp;
+    GList *gl;
+
+    g_return_if_fail (itdb);
+    g_return_if_fail (func);
+
+    mp = itdb_get_mountpoint (itdb);
+
+    /* ipod_path of directory -> resolved directory ("" if it could
+       not be found) */
+    dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	gchar *filename = NULL;
+	gint64 size = -1;
+
+	if (!track)
+	{   /* don't return here, @dirs would be leaked */
+	    g_warning ("itdb_check_track_files: NULL track in itdb->tracks");
+	    continue;
+	}
+
+	if (mp && track->ipod_path && *track->ipod_path)
+	{
+	    gchar **components = g_strsplit (track->ipod_path, ":", 10);
+	    guint n = g_strv_length (components);
+	    gchar *last = components[n-1];
+	    gchar *dir_path, *dir, *entry = NULL;
+
+	    components[n-1] = NULL;
+	    dir_path = g_strjoinv (":", components);
+	    dir = g_hash_table_lookup (dirs, dir_path);
+	    if (!dir)
+	    {
+		dir = itdb_resolve_path (mp, (const gchar **)components);
+		if (dir)
+		{   /* make sure the directory is read again */
+		    resolve_dir_forget (dir);
+		}
+		else
+		{
+		    dir = g_strdup ("");
+		}
+		g_hash_table_insert (dirs, dir_path, dir);
+		dir_path = NULL;
+	    }
+	    if (*dir && *last)
+	    {
+		gchar *last_as_filename =
+		    g_filename_from_utf8 (last, -1, NULL, NULL, NULL);
+		entry = resolve_dir_lookup (dir, last, last_as_filename);
+		g_free (last_as_filename);
+	    }
+	    if (entry)
+	    {
+		filename = g_build_filename (dir, entry, NULL);
+		g_free (entry);
+	    }
+	    else if (*dir && !*last)
+	    {   /* ipod_path ends with ':' */
+		filename = g_strdup (dir);
+	    }
+	    if (filename && get_size)
+	    {
+		struct stat statbuf;
+		if (g_stat (filename, &statbuf) == 0)
+		    size = statbuf.st_size;
+	    }
+	    components[n-1] = last;
+	    g_strfreev (components);
+	    g_free (dir_path);
+	}
+
+	func (track, filename, size, user_data);
+	g_free (filename);
+    }
+
+    g_hash_table_destroy (dirs);
+}
+
+
 /**
  * itdb_cp:
  * @from_file: source file
@@ -5995,6 +7371,7 @@ gboolean itdb_cp (const gchar *from_file, const gchar *to_file,
     }
 
     file_out = fopen (to_file, "w");
+    itdb_resolve_path_invalidate (to_file);
     if (file_out == NULL)
     {
 	g_set_error (error,
@@ -6067,6 +7444,7 @@ gboolean itdb_cp (const gchar *from_file, const gchar *to_file,
     if (file_in)  fclose (file_in);
     if (file_out) fclose (file_out);
     remove (to_file);
+    itdb_resolve_path_invalidate (to_file);
     g_free (data);
     return FALSE;
 }
@@ -6577,6 +7955,7 @@ mkdir_with_parents (const gchar *pathname,
       
       if (!g_file_test (fn, G_FILE_TEST_EXISTS))
 	{
+	  itdb_resolve_path_invalidate (fn);
 	  if (g_mkdir (fn, mode) == -1)
 	    {
 	      int errno_save = errno;
@@ -87,12 +87,268 @@
    
    This information will be written to the iPod when the PhotoDB is
    saved (itdb_device_write_sysinfo() is called).
+
+   The functions above keep an index of the PhotoDB (next free photo
+   id, album names, and the album links of each photo) so that adding,
+   looking up and removing photos does not have to walk all photos and
+   albums. db->photos, db->photoalbums and album->members should
+   therefore only be changed through these functions.
 */
 
 
 static Itdb_PhotoDB *itdb_photodb_new (void);
 static void itdb_photodb_photoalbum_free (Itdb_PhotoAlbum *pa);
 
+/* Lookup index kept in photodb->reserved1. It is built from the lists
+   the first time it is needed (e.g. after the PhotoDB was parsed) and
+   updated by all functions adding or removing photos and albums. */
+typedef struct
+{
+    guint32 next_id;          /* one more than the highest photo id  */
+    GList *photos_tail;       /* last link of db->photos             */
+    GHashTable *album_names;  /* album name -> first album with name */
+    GHashTable *album_tails;  /* album -> last link of album->members */
+    GHashTable *photo_links;  /* photo -> GSList of PhotoLink        */
+} PhotoDBIndex;
+
+/* A link holding @photo, either in db->photos (@album is NULL) or in
+   album->members */
+typedef struct
+{
+    Itdb_PhotoAlbum *album;
+    GList *link;
+} PhotoLink;
+
+#define PHOTODB_INDEX(db) ((PhotoDBIndex *)(db)->reserved1)
+
+static void photo_links_free (gpointer key, gpointer value, gpointer data)
+{
+    GSList *gl;
+
+    for (gl=value; gl; gl=gl->next)
+    {
+	g_free (gl->data);
+    }
+    g_slist_free (value);
+}
+
+static void photodb_index_free (Itdb_PhotoDB *db)
+{
+    PhotoDBIndex *index = PHOTODB_INDEX (db);
+
+    if (index)
+    {
+	g_hash_table_destroy (index->album_names);
+	g_hash_table_destroy (index->album_tails);
+	g_hash_table_foreach (index->photo_links, photo_links_free, NULL);
+	g_hash_table_destroy (index->photo_links);
+	g_free (index);
+	db->reserved1 = NULL;
+    }
+}
+
+/* Remember that @link of @album (or of db->photos if @album is NULL)
+   holds @photo */
+static void photodb_index_add_link (PhotoDBIndex *index,
+				    Itdb_Artwork *photo,
+				    Itdb_PhotoAlbum *album,
+				    GList *link)
+{
+    PhotoLink *pl = g_new (PhotoLink, 1);
+    GSList *links;
+
+    pl->album = album;
+    pl->link = link;
+    links = g_hash_table_lookup (index->photo_links, photo);
+    links = g_slist_prepend (links, pl);
+    g_hash_table_insert (index->photo_links, photo, links);
+}
+
+/* Enter @album under its name unless an album further up in
+   db->photoalbums already has the same name */
+static void photodb_index_add_album_name (Itdb_PhotoDB *db,
+					  Itdb_PhotoAlbum *album)
+{
+    PhotoDBIndex *index = PHOTODB_INDEX (db);
+    Itdb_PhotoAlbum *first;
+
+    if (!album->name)
+	return;
+
+    first = g_hash_table_lookup (index->album_names, album->name);
+    if (first && (first != album) &&
+	(g_list_index (db->photoalbums, first) <
+	 g_list_index (db->photoalbums, album)))
+	return;
+
+    g_hash_table_insert (index->album_names, g_strdup (album->name), album);
+}
+
+static gboolean album_name_steal (gpointer key, gpointer value,
+				  gpointer user_data)
+{
+    gpointer *data = user_data;
+
+    if (value != data[0])
+	return FALSE;
+    data[1] = g_slist_prepend (data[1], key);
+    return TRUE;
+}
+
+/* Drop @album from the name table. If another album carries the same
+   name it takes its place. The table is searched by value since the
+   application may have renamed @album in the meantime. */
+static void photodb_index_remove_album_name (Itdb_PhotoDB *db,
+					     Itdb_PhotoAlbum *album)
+{
+    PhotoDBIndex *index = PHOTODB_INDEX (db);
+    gpointer data[2] = {album, NULL};
+    GSList *gsl;
+    GList *gl;
+
+    g_hash_table_foreach_steal (index->album_names,
+				album_name_steal, data);
+    for (gsl=data[1]; gsl; gsl=gsl->next)
+    {
+	gchar *name = gsl->data;
+	for (gl=db->photoalbums; gl; gl=gl->next)
+	{
+	    Itdb_PhotoAlbum *pa = gl->data;
+	    if ((pa != album) && pa->name && (strcmp (pa->name, name) == 0))
+	    {
+		g_hash_table_insert (index->album_names, g_strdup (name), pa);
+		break;
+	    }
+	}
+	g_free (name);
+    }
+    g_slist_free (data[1]);
+}
+
+/* Return the index of @db, building it from the lists if necessary */
+static PhotoDBIndex *photodb_index_get (Itdb_PhotoDB *db)
+{
+    PhotoDBIndex *index = PHOTODB_INDEX (db);
+    GList *gl;
+
+    if (index)
+	return index;
+
+    index = g_new0 (PhotoDBIndex, 1);
+    index->album_names = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, NULL);
+    index->album_tails = g_hash_table_new (g_direct_hash, g_direct_equal);
+    index->photo_links = g_hash_table_new (g_direct_hash, g_direct_equal);
+    db->reserved1 = index;
+
+    for (gl=db->photos; gl; gl=gl->next)
+    {
+	Itdb_Artwork *photo = gl->data;
+	if (photo->id >= index->next_id)
+	    index->next_id = photo->id + 1;
+	photodb_index_add_link (index, photo, NULL, gl);
+	index->photos_tail = gl;
+    }
+    /* walk the albums backwards so the first album of a given name
+       ends up in the name table without repeated position lookups */
+    for (gl=g_list_last (db->photoalbums); gl; gl=gl->prev)
+    {
+	Itdb_PhotoAlbum *album = gl->data;
+	GList *glm, *last = NULL;
+
+	for (glm=album->members; glm; glm=glm->next)
+	{
+	    photodb_index_add_link (index, glm->data, album, glm);
+	    last = glm;
+	}
+	g_hash_table_insert (index->album_tails, album, last);
+	if (album->name)
+	    g_hash_table_insert (index->album_names,
+				 g_strdup (album->name), album);
+    }
+
+    return index;
+}
+
+/* Insert @data into *@list at @position (-1 or past the end: append)
+   and return the new link. *@tail is the last link of *@list and is
+   used to append in constant time. */
+static GList *photodb_list_insert (GList **list, GList **tail,
+				   gpointer data, gint position)
+{
+    GList *sibling = NULL;
+    GList *link;
+
+    if (position >= 0)
+	sibling = g_list_nth (*list, position);
+
+    if (sibling)
+    {
+	*list = g_list_insert_before (*list, sibling, data);
+	return sibling->prev;
+    }
+
+    link = g_list_alloc ();
+    link->data = data;
+    link->prev = *tail;
+    if (*tail)
+	(*tail)->next = link;
+    else
+	*list = link;
+    *tail = link;
+    return link;
+}
+
+/* Unlink @link from *@list, keeping *@tail up to date */
+static void photodb_list_delete_link (GList **list, GList **tail,
+				      GList *link)
+{
+    if (*tail == link)
+	*tail = link->prev;
+    *list = g_list_delete_link (*list, link);
+}
+
+/* Remove the links of @photo in @album, or in all albums and
+   db->photos if @album is NULL */
+static void photodb_index_unlink_photo (Itdb_PhotoDB *db,
+					Itdb_PhotoAlbum *album,
+					Itdb_Artwork *photo)
+{
+    PhotoDBIndex *index = photodb_index_get (db);
+    GSList *links, *gl, *keep = NULL;
+
+    links = g_hash_table_lookup (index->photo_links, photo);
+    for (gl=links; gl; gl=gl->next)
+    {
+	PhotoLink *pl = gl->data;
+
+	if (album && (pl->album != album))
+	{
+	    keep = g_slist_prepend (keep, pl);
+	    continue;
+	}
+	if (pl->album)
+	{
+	    GList *tail = g_hash_table_lookup (index->album_tails, pl->album);
+	    photodb_list_delete_link (&pl->album->members, &tail, pl->link);
+	    g_hash_table_insert (index->album_tails, pl->album, tail);
+	}
+	else
+	{
+	    photodb_list_delete_link (&db->photos,
+				      &index->photos_tail, pl->link);
+	}
+	g_free (pl);
+    }
+    g_slist_free (links);
+
+    if (keep)
+	g_hash_table_insert (index->photo_links, photo, keep);
+    else
+	g_hash_table_remove (index->photo_links, photo);
+}
+
+
 /* Set @error with standard error message */
 static void error_no_photos_dir (const gchar *mp, GError **error)
 {
@@ -294,6 +550,7 @@ void itdb_photodb_free (Itdb_PhotoDB *photodb)
 		g_list_foreach (photodb->photos,
 				(GFunc)(itdb_artwork_free), NULL);
 		g_list_free (photodb->photos);
+		photodb_index_free (photodb);
 		itdb_device_free (photodb->device);
 
 		if (photodb->userdata && photodb->userdata_destroy)
@@ -308,17 +565,9 @@ void itdb_photodb_free (Itdb_PhotoDB *photodb)
 
 G_GNUC_INTERNAL gint itdb_get_free_photo_id ( Itdb_PhotoDB *db ) 
 {
-	gint photo_id = 0;
-	GList *it;
+	PhotoDBIndex *index = photodb_index_get (db);
 
-	for (it = db->photos; it != NULL; it = it->next) {
-		Itdb_Artwork *artwork;
-
-		artwork = (Itdb_Artwork *)it->data;
-		if( artwork->id > photo_id )
-			photo_id = artwork->id;
-	}
-	return photo_id + 1;
+	return MAX (index->next_id, 1);
 }
 
 static void itdb_photodb_photoalbum_free (Itdb_PhotoAlbum *album)
@@ -347,17 +596,20 @@ static Itdb_Artwork *itdb_photodb_add_photo_internal (Itdb_PhotoDB *db,
 						      gint rotation,
 						      GError **error)
 {
-#ifdef HAVE_GDKPIXBUF
     gboolean result;
     Itdb_Artwork *artwork;
     Itdb_PhotoAlbum *album;
     const Itdb_ArtworkFormat *format;
+    PhotoDBIndex *index;
+    GList *link;
 
     g_return_val_if_fail (db, NULL);
     g_return_val_if_fail (db->device, NULL);
     g_return_val_if_fail (filename || image_data, NULL);
     g_return_val_if_fail (!(image_data && (image_data_len == 0)), NULL);
+#ifdef HAVE_GDKPIXBUF
     g_return_val_if_fail (!(pixbuf && (!GDK_IS_PIXBUF (pixbuf))), NULL);
+#endif
 
     if (!ipod_supports_photos (db->device))
     {
@@ -453,8 +705,10 @@ static Itdb_Artwork *itdb_photodb_add_photo_internal (Itdb_PhotoDB *db,
     }
 
     /* Add artwork to the list of photos */
-    /* (it would be sufficient to append to the end) */
-    db->photos = g_list_insert (db->photos, artwork, position);
+    index = photodb_index_get (db);
+    link = photodb_list_insert (&db->photos, &index->photos_tail,
+				artwork, position);
+    photodb_index_add_link (index, artwork, NULL, link);
 
     /* Add artwork to the first album */
     album = itdb_photodb_photoalbum_by_name (db, NULL);
@@ -466,11 +720,6 @@ static Itdb_Artwork *itdb_photodb_add_photo_internal (Itdb_PhotoDB *db,
     itdb_photodb_photoalbum_add_photo (db, album, artwork, position);
 
     return artwork;
-#else
-    g_set_error (error, 0, -1,
-		 _("Library compiled without gdk-pixbuf support. Picture support is disabled."));
-    return NULL;
-#endif
 }
 
 
@@ -600,32 +849,22 @@ void itdb_photodb_remove_photo (Itdb_PhotoDB *db,
 				Itdb_PhotoAlbum *album,
 				Itdb_Artwork *photo)
 {
-    GList *it;
-
     g_return_if_fail (db);
 
     /* If album==NULL, or album is the master album, remove from all
      * albums */
-    if ((album == NULL) || (album == g_list_nth_data (db->photoalbums, 0)))
+    if ((album == NULL) || (db->photoalbums && (album == db->photoalbums->data)))
     {
-        /* Remove the photo from any albums containing it */
-        for (it = db->photoalbums; it != NULL; it = it->next)
-	{
-            Itdb_PhotoAlbum *_album = it->data;
-	    while (g_list_find (_album->members, photo))
-	    {
-		_album->members = g_list_remove (_album->members, photo);
-	    }
-        }
-        /* Remove the photo from the image list */
-	db->photos = g_list_remove (db->photos, photo);
+        /* Remove the photo from any albums containing it and from
+	 * the image list */
+	photodb_index_unlink_photo (db, NULL, photo);
 	/* Free the photo */
 	itdb_artwork_free (photo);
     }
     /* If album is specified, only remove it from that album */
     else
     {
-        album->members = g_list_remove (album->members, photo);
+	photodb_index_unlink_photo (db, album, photo);
     }
 }
 
@@ -643,17 +882,29 @@ void itdb_photodb_remove_photo (Itdb_PhotoDB *db,
  */
 Itdb_PhotoAlbum *itdb_photodb_photoalbum_by_name (Itdb_PhotoDB *db, const gchar *albumname)
 {
+	PhotoDBIndex *index;
+	Itdb_PhotoAlbum *album;
 	GList *it;
 
+	g_return_val_if_fail (db, NULL);
+
 	if( albumname == NULL )
 	    return g_list_nth_data (db->photoalbums, 0);
 
-	for (it = db->photoalbums; it != NULL; it = it->next) {
-		Itdb_PhotoAlbum *album;
+	index = photodb_index_get (db);
+	album = g_hash_table_lookup (index->album_names, albumname);
+	if (album && album->name && (strcmp (album->name, albumname) == 0))
+		return album;
 
+	/* Not indexed under this name: the album may have been
+	 * renamed by the application since it was added. */
+	for (it = db->photoalbums; it != NULL; it = it->next) {
 		album = (Itdb_PhotoAlbum *)it->data;
-		if( strcmp(album->name, albumname) == 0 )
+		if( album->name && strcmp(album->name, albumname) == 0 ) {
+			g_hash_table_insert (index->album_names,
+					     g_strdup (albumname), album);
 			return album;
+		}
 	}
 	return NULL;
 }
@@ -675,21 +926,36 @@ void itdb_photodb_photoalbum_remove (Itdb_PhotoDB *db,
 				     Itdb_PhotoAlbum *album,
 				     gboolean remove_pics)
 {
+        PhotoDBIndex *index;
         GList *it;
 
         g_return_if_fail (db);
         g_return_if_fail (album);
 
+        index = photodb_index_get (db);
+
         /* if remove_pics, iterate over the photos within that album
-	 * and remove them from the database */
+	 * and remove them from the database. Removing a photo unlinks
+	 * it from album->members, so iterate over a copy and skip
+	 * photos listed more than once. */
         if (remove_pics)
 	{
-            for (it = album->members; it != NULL; it = it->next )
+	    GList *photos = g_list_copy (album->members);
+            for (it = photos; it != NULL; it = it->next )
 	    {
                 Itdb_Artwork *photo = it->data;
-                itdb_photodb_remove_photo (db, NULL, photo);
+		if (g_hash_table_lookup (index->photo_links, photo))
+		    itdb_photodb_remove_photo (db, NULL, photo);
             }
+	    g_list_free (photos);
         }
+	/* unlink the remaining members of this album */
+	while (album->members)
+	{
+	    photodb_index_unlink_photo (db, album, album->members->data);
+	}
+	photodb_index_remove_album_name (db, album);
+	g_hash_table_remove (index->album_tails, album);
         db->photoalbums = g_list_remove (db->photoalbums, album);
 	itdb_photodb_photoalbum_free (album);
 }
@@ -715,11 +981,20 @@ void itdb_photodb_photoalbum_add_photo (Itdb_PhotoDB *db,
 					Itdb_Artwork *photo,
 					gint position)
 {
+    PhotoDBIndex *index;
+    GList *tail, *link;
+
     g_return_if_fail (db);
     g_return_if_fail (album);
     g_return_if_fail (photo);
 
-    album->members = g_list_insert (album->members, photo, position);
+    index = photodb_index_get (db);
+    if (!g_hash_table_lookup_extended (index->album_tails, album,
+				       NULL, (gpointer *)&tail))
+	tail = g_list_last (album->members);
+    link = photodb_list_insert (&album->members, &tail, photo, position);
+    g_hash_table_insert (index->album_tails, album, tail);
+    photodb_index_add_link (index, photo, album, link);
 }
 
 
@@ -739,6 +1014,7 @@ Itdb_PhotoAlbum *itdb_photodb_photoalbum_create (Itdb_PhotoDB *db,
 						 gint pos)
 {
 	Itdb_PhotoAlbum *album;
+	PhotoDBIndex *index;
 
 	g_return_val_if_fail (db, NULL);
 	g_return_val_if_fail (albumname, NULL);
@@ -746,7 +1022,10 @@ Itdb_PhotoAlbum *itdb_photodb_photoalbum_create (Itdb_PhotoDB *db,
 	album = g_new0 (Itdb_PhotoAlbum, 1);
 	album->album_type = 2; /* normal album, set to 1 for Photo Library */
 	album->name = g_strdup(albumname);
+	index = photodb_index_get (db);
 	db->photoalbums = g_list_insert (db->photoalbums, album, pos);
+	g_hash_table_insert (index->album_tails, album, NULL);
+	photodb_index_add_album_name (db, album);
 
 	return album;
 }
@@ -784,6 +1063,7 @@ gboolean itdb_photodb_write (Itdb_PhotoDB *photodb, GError **error)
 	photo->id = id;
 	++id;
     }
+    photodb_index_get (photodb)->next_id = id;
     /* set up album_ids -- this is how my iPod Nano does it... */
     prev_id = 0x64;
     id = prev_id + g_list_length (photodb->photos);
@@ -321,6 +321,102 @@ ItdbSPLActionType itdb_splr_get_action_type (const Itdb_SPLRule *splr)
  */
 
 
+/* Compares the integer, boolean or date value @intcomp taken from a
+ * track against @splr. Used by itdb_splr_eval() and by the column
+ * scans of itdb_spl_update(). */
+static gboolean splr_eval_int (Itdb_SPLRule *splr, ItdbSPLFieldType ft,
+			       gint64 intcomp)
+{
+    gboolean boolcomp = (intcomp != 0);
+    guint32 datecomp = intcomp;
+    time_t t;
+    guint64 mactime;
+
+    switch (ft)
+    {
+    case ITDB_SPLFT_INT:
+	switch(splr->action)
+	{
+	case ITDB_SPLACTION_IS_INT:
+	    return (intcomp == splr->fromvalue);
+	case ITDB_SPLACTION_IS_NOT_INT:
+	    return (intcomp != splr->fromvalue);
+	case ITDB_SPLACTION_IS_GREATER_THAN:
+	    return (intcomp > splr->fromvalue);
+	case ITDB_SPLACTION_IS_LESS_THAN:
+	    return (intcomp < splr->fromvalue);
+	case ITDB_SPLACTION_IS_IN_THE_RANGE:
+	    return ((intcomp <= splr->fromvalue &&
+		     intcomp >= splr->tovalue) ||
+		    (intcomp >= splr->fromvalue &&
+		     intcomp <= splr->tovalue));
+	case ITDB_SPLACTION_IS_NOT_IN_THE_RANGE:
+	    return ((intcomp < splr->fromvalue &&
+		     intcomp < splr->tovalue) ||
+		    (intcomp > splr->fromvalue &&
+		     intcomp > splr->tovalue));
+	}
+	return FALSE;
+    case ITDB_SPLFT_BINARY_AND:
+	switch(splr->action)
+	{
+	case ITDB_SPLACTION_BINARY_AND:
+	    return (intcomp & splr->fromvalue)? TRUE:FALSE;
+	}
+	return FALSE;
+    case ITDB_SPLFT_BOOLEAN:
+	switch (splr->action)
+	{
+	case ITDB_SPLACTION_IS_INT:	    /* aka "is set" */
+	    return (boolcomp != 0);
+	case ITDB_SPLACTION_IS_NOT_INT:  /* aka "is not set" */
+	    return (boolcomp == 0);
+	}
+	return FALSE;
+    case ITDB_SPLFT_DATE:
+	switch (splr->action)
+	{
+	case ITDB_SPLACTION_IS_INT:
+	    return (datecomp == splr->fromvalue);
+	case ITDB_SPLACTION_IS_NOT_INT:
+	    return (datecomp != splr->fromvalue);
+	case ITDB_SPLACTION_IS_GREATER_THAN:
+	    return (datecomp > splr->fromvalue);
+	case ITDB_SPLACTION_IS_LESS_THAN:
+	    return (datecomp < splr->fromvalue);
+	case ITDB_SPLACTION_IS_NOT_GREATER_THAN:
+	    return (datecomp <= splr->fromvalue);
+	case ITDB_SPLACTION_IS_NOT_LESS_THAN:
+	    return (datecomp >= splr->fromvalue);
+	case ITDB_SPLACTION_IS_IN_THE_LAST:
+	    time (&t);
+	    t += (splr->fromdate * splr->fromunits);
+	    mactime = itdb_time_host_to_mac (t);
+	    return (datecomp > mactime);
+	case ITDB_SPLACTION_IS_NOT_IN_THE_LAST:
+	    time (&t);
+	    t += (splr->fromdate * splr->fromunits);
+	    mactime = itdb_time_host_to_mac (t);
+	    return (datecomp <= mactime);
+	case ITDB_SPLACTION_IS_IN_THE_RANGE:
+	    return ((datecomp <= splr->fromvalue &&
+		     datecomp >= splr->tovalue) ||
+		    (datecomp >= splr->fromvalue &&
+		     datecomp <= splr->tovalue));
+	case ITDB_SPLACTION_IS_NOT_IN_THE_RANGE:
+	    return ((datecomp < splr->fromvalue &&
+		     datecomp < splr->tovalue) ||
+		    (datecomp > splr->fromvalue &&
+		     datecomp > splr->tovalue));
+	}
+	return FALSE;
+    default:
+	break;
+    }
+    return FALSE;
+}
+
+
 /**
  * itdb_splr_eval:
  * @splr: an #Itdb_SPLRule
@@ -340,8 +436,6 @@ gboolean itdb_splr_eval (Itdb_SPLRule *splr, Itdb_Track *track)
     gboolean handled = FALSE;
     guint32 datecomp = 0;
     Itdb_Playlist *playcomp = NULL;
-    time_t t;
-    guint64 mactime;
 
     g_return_val_if_fail (splr, FALSE);
     g_return_val_if_fail (track, FALSE);
@@ -512,81 +606,12 @@ gboolean itdb_splr_eval (Itdb_SPLRule *splr, Itdb_Track *track)
 	}
 	return FALSE;
     case ITDB_SPLFT_INT:
-	switch(splr->action)
-	{
-	case ITDB_SPLACTION_IS_INT:
-	    return (intcomp == splr->fromvalue);
-	case ITDB_SPLACTION_IS_NOT_INT:
-	    return (intcomp != splr->fromvalue);
-	case ITDB_SPLACTION_IS_GREATER_THAN:
-	    return (intcomp > splr->fromvalue);
-	case ITDB_SPLACTION_IS_LESS_THAN:
-	    return (intcomp < splr->fromvalue);
-	case ITDB_SPLACTION_IS_IN_THE_RANGE:
-	    return ((intcomp <= splr->fromvalue &&
-		     intcomp >= splr->tovalue) ||
-		    (intcomp >= splr->fromvalue &&
-		     intcomp <= splr->tovalue));
-	case ITDB_SPLACTION_IS_NOT_IN_THE_RANGE:
-	    return ((intcomp < splr->fromvalue &&
-		     intcomp < splr->tovalue) ||
-		    (intcomp > splr->fromvalue &&
-		     intcomp > splr->tovalue));
-	}
-	return FALSE;
     case ITDB_SPLFT_BINARY_AND:
-	switch(splr->action)
-	{
-	case ITDB_SPLACTION_BINARY_AND:
-	    return (intcomp & splr->fromvalue)? TRUE:FALSE;
-	}
-	return FALSE;
+	return splr_eval_int (splr, ft, intcomp);
     case ITDB_SPLFT_BOOLEAN:
-	switch (splr->action)
-	{
-	case ITDB_SPLACTION_IS_INT:	    /* aka "is set" */
-	    return (boolcomp != 0);
-	case ITDB_SPLACTION_IS_NOT_INT:  /* aka "is not set" */
-	    return (boolcomp == 0);
-	}
-	return FALSE;
+	return splr_eval_int (splr, ft, boolcomp);
     case ITDB_SPLFT_DATE:
-	switch (splr->action)
-	{
-	case ITDB_SPLACTION_IS_INT:
-	    return (datecomp == splr->fromvalue);
-	case ITDB_SPLACTION_IS_NOT_INT:
-	    return (datecomp != splr->fromvalue);
-	case ITDB_SPLACTION_IS_GREATER_THAN:
-	    return (datecomp > splr->fromvalue);
-	case ITDB_SPLACTION_IS_LESS_THAN:
-	    return (datecomp < splr->fromvalue);
-	case ITDB_SPLACTION_IS_NOT_GREATER_THAN:
-	    return (datecomp <= splr->fromvalue);
-	case ITDB_SPLACTION_IS_NOT_LESS_THAN:
-	    return (datecomp >= splr->fromvalue);
-	case ITDB_SPLACTION_IS_IN_THE_LAST:
-	    time (&t);
-	    t += (splr->fromdate * splr->fromunits);
-	    mactime = itdb_time_host_to_mac (t);
-	    return (datecomp > mactime);
-	case ITDB_SPLACTION_IS_NOT_IN_THE_LAST:
-	    time (&t);
-	    t += (splr->fromdate * splr->fromunits);
-	    mactime = itdb_time_host_to_mac (t);
-	    return (datecomp <= mactime);
-	case ITDB_SPLACTION_IS_IN_THE_RANGE:
-	    return ((datecomp <= splr->fromvalue &&
-		     datecomp >= splr->tovalue) ||
-		    (datecomp >= splr->fromvalue &&
-		     datecomp <= splr->tovalue));
-	case ITDB_SPLACTION_IS_NOT_IN_THE_RANGE:
-	    return ((datecomp < splr->fromvalue &&
-		     datecomp < splr->tovalue) ||
-		    (datecomp > splr->fromvalue &&
-		     datecomp > splr->tovalue));
-	}
-	return FALSE;
+	return splr_eval_int (splr, ft, datecomp);
     case ITDB_SPLFT_PLAYLIST:
 	/* if we didn't find the playlist, just exit instead of
 	   dealing with it */
@@ -630,38 +655,6 @@ static gint compGenre (Itdb_Track *a, Itdb_Track *b)
 {
     return strcmp (a->genre, b->genre);
 }
-static gint compMostRecentlyAdded (Itdb_Track *a, Itdb_Track *b)
-{
-    return b->time_added - a->time_added;
-}
-static gint compLeastRecentlyAdded (Itdb_Track *a, Itdb_Track *b)
-{
-    return a->time_added - b->time_added;
-}
-static gint compMostOftenPlayed (Itdb_Track *a, Itdb_Track *b)
-{
-    return b->playcount - a->playcount;
-}
-static gint compLeastOftenPlayed (Itdb_Track *a, Itdb_Track *b)
-{
-    return a->playcount - b->playcount;
-}
-static gint compMostRecentlyPlayed (Itdb_Track *a, Itdb_Track *b)
-{
-    return b->time_played - a->time_played;
-}
-static gint compLeastRecentlyPlayed (Itdb_Track *a, Itdb_Track *b)
-{
-    return a->time_played - b->time_played;
-}
-static gint compHighestRating (Itdb_Track *a, Itdb_Track *b)
-{
-    return b->rating - a->rating;
-}
-static gint compLowestRating (Itdb_Track *a, Itdb_Track *b)
-{
-    return a->rating - b->rating;
-}
 
 /* Randomize the order of the members of the GList @list */
 /* Returns a pointer to the new start of the list */
@@ -697,20 +690,196 @@ void itdb_playlist_randomize (Itdb_Playlist *pl)
 }
 
 
-/**
- * itdb_spl_update:
- * @spl: an #Itdb_Playlist
- *
- * Updates the content of the smart playlist @spl (meant to be called if the 
- * tracks stored in the #Itdb_iTunesDB associated with @spl have changed 
- * somehow and you want spl-&gt;members to be accurate with regards to those 
- * changes. Does nothing if @spl isn't a smart playlist.
- **/
-void itdb_spl_update (Itdb_Playlist *spl)
+/* Returns the column holding the value itdb_splr_eval() compares for
+   @field or -1 if @field isn't mirrored in an ItdbColumns. */
+static gint spl_field_column (guint32 field)
+{
+    switch (field)
+    {
+    case ITDB_SPLFIELD_BITRATE:       return ITDB_COLUMN_BITRATE;
+    case ITDB_SPLFIELD_SAMPLE_RATE:   return ITDB_COLUMN_SAMPLERATE;
+    case ITDB_SPLFIELD_YEAR:          return ITDB_COLUMN_YEAR;
+    case ITDB_SPLFIELD_TRACKNUMBER:   return ITDB_COLUMN_TRACK_NR;
+    case ITDB_SPLFIELD_SIZE:          return ITDB_COLUMN_SIZE;
+    case ITDB_SPLFIELD_PLAYCOUNT:     return ITDB_COLUMN_PLAYCOUNT;
+    case ITDB_SPLFIELD_DISC_NUMBER:   return ITDB_COLUMN_CD_NR;
+    case ITDB_SPLFIELD_BPM:           return ITDB_COLUMN_BPM;
+    case ITDB_SPLFIELD_RATING:        return ITDB_COLUMN_RATING;
+    case ITDB_SPLFIELD_TIME:          return ITDB_COLUMN_TRACKLEN;
+    case ITDB_SPLFIELD_COMPILATION:   return ITDB_COLUMN_COMPILATION;
+    case ITDB_SPLFIELD_DATE_MODIFIED: return ITDB_COLUMN_TIME_MODIFIED;
+    case ITDB_SPLFIELD_DATE_ADDED:    return ITDB_COLUMN_TIME_ADDED;
+    case ITDB_SPLFIELD_LAST_PLAYED:   return ITDB_COLUMN_TIME_PLAYED;
+    case ITDB_SPLFIELD_LAST_SKIPPED:  return ITDB_COLUMN_LAST_SKIPPED;
+    case ITDB_SPLFIELD_SEASON_NR:     return ITDB_COLUMN_SEASON_NR;
+    case ITDB_SPLFIELD_SKIPCOUNT:     return ITDB_COLUMN_SKIPCOUNT;
+    case ITDB_SPLFIELD_VIDEO_KIND:    return ITDB_COLUMN_MEDIATYPE;
+    }
+    return -1;
+}
+
+/* row states used by itdb_spl_update() */
+enum {
+    SPL_ROW_SKIPPED,    /* not checked although matchcheckedonly is set */
+    SPL_ROW_NO_MATCH,
+    SPL_ROW_MATCH
+};
+
+/* Evaluates @splr for every row of @cols in state @from and moves the
+ * rows for which the result equals @result to state @to. Integer,
+ * boolean and date rules are evaluated on the columns, playlist rules
+ * against a hash of the playlist's members, everything else through
+ * itdb_splr_eval(). */
+static void spl_eval_rule (Itdb_iTunesDB *itdb, Itdb_SPLRule *splr,
+			   ItdbColumns *cols, guint8 *state,
+			   guint8 from, gboolean result, guint8 to)
+{
+    ItdbSPLFieldType ft;
+    ItdbSPLActionType at;
+    gint col;
+    guint i;
+
+    ft = itdb_splr_get_field_type (splr);
+    at = itdb_splr_get_action_type (splr);
+    col = spl_field_column (splr->field);
+
+    if ((at != ITDB_SPLAT_INVALID) && (col != -1) &&
+	((ft == ITDB_SPLFT_INT) || (ft == ITDB_SPLFT_BINARY_AND) ||
+	 (ft == ITDB_SPLFT_BOOLEAN) || (ft == ITDB_SPLFT_DATE)))
+    {
+	for (i=0; i<cols->n_rows; ++i)
+	{
+	    gint64 intcomp;
+	    if (state[i] != from) continue;
+	    intcomp = itdb_columns_value (cols, col, i);
+	    if (splr->field == ITDB_SPLFIELD_TIME)
+		intcomp /= 1000;
+	    if (splr_eval_int (splr, ft, intcomp) == result)
+		state[i] = to;
+	}
+    }
+    else if ((at != ITDB_SPLAT_INVALID) &&
+	     (splr->field == ITDB_SPLFIELD_PLAYLIST))
+    {
+	Itdb_Playlist *playcomp = itdb_playlist_by_id (itdb,
+						       splr->fromvalue);
+	GHashTable *members = g_hash_table_new (NULL, NULL);
+	GList *gl;
+
+	if (playcomp)
+	    for (gl=playcomp->members; gl; gl=gl->next)
+		g_hash_table_insert (members, gl->data, gl->data);
+	for (i=0; i<cols->n_rows; ++i)
+	{
+	    gboolean truth = FALSE;
+	    if (state[i] != from) continue;
+	    if (playcomp)
+	    {
+		gboolean contained =
+		    (g_hash_table_lookup (members, cols->tracks[i]) != NULL);
+		if (splr->action == ITDB_SPLACTION_IS_INT)
+		    truth = contained;
+		else if (splr->action == ITDB_SPLACTION_IS_NOT_INT)
+		    truth = !contained;
+	    }
+	    if (truth == result)
+		state[i] = to;
+	}
+	g_hash_table_destroy (members);
+    }
+    else
+    {
+	for (i=0; i<cols->n_rows; ++i)
+	{
+	    if (state[i] != from) continue;
+	    if (itdb_splr_eval (splr, cols->tracks[i]) == result)
+		state[i] = to;
+	}
+    }
+}
+
+/* sort criterion for spl_limit_compare() */
+typedef struct
+{
+    ItdbColumns *cols;
+    guint32 limitsort;
+} SPLLimitSort;
+
+/* Compares two rows for the limit sorting of itdb_spl_update(). Ties
+ * are broken by the position in itdb->tracks so the result is the
+ * same as the stable g_list_sort() previously used. */
+static gint spl_limit_compare (gconstpointer a, gconstpointer b,
+			       gpointer data)
+{
+    SPLLimitSort *ls = data;
+    guint ra = *(const guint *)a;
+    guint rb = *(const guint *)b;
+    Itdb_Track *ta = ls->cols->tracks[ra];
+    Itdb_Track *tb = ls->cols->tracks[rb];
+    const guint32 *col;
+    gint result = 0;
+
+    switch (ls->limitsort)
+    {
+    case ITDB_LIMITSORT_SONG_NAME:
+	result = compTitle (ta, tb);
+	break;
+    case ITDB_LIMITSORT_ALBUM:
+	result = compAlbum (ta, tb);
+	break;
+    case ITDB_LIMITSORT_ARTIST:
+	result = compArtist (ta, tb);
+	break;
+    case ITDB_LIMITSORT_GENRE:
+	result = compGenre (ta, tb);
+	break;
+    case ITDB_LIMITSORT_MOST_RECENTLY_ADDED:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_TIME_ADDED);
+	result = col[rb] - col[ra];
+	break;
+    case ITDB_LIMITSORT_LEAST_RECENTLY_ADDED:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_TIME_ADDED);
+	result = col[ra] - col[rb];
+	break;
+    case ITDB_LIMITSORT_MOST_OFTEN_PLAYED:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_PLAYCOUNT);
+	result = col[rb] - col[ra];
+	break;
+    case ITDB_LIMITSORT_LEAST_OFTEN_PLAYED:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_PLAYCOUNT);
+	result = col[ra] - col[rb];
+	break;
+    case ITDB_LIMITSORT_MOST_RECENTLY_PLAYED:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_TIME_PLAYED);
+	result = col[rb] - col[ra];
+	break;
+    case ITDB_LIMITSORT_LEAST_RECENTLY_PLAYED:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_TIME_PLAYED);
+	result = col[ra] - col[rb];
+	break;
+    case ITDB_LIMITSORT_HIGHEST_RATING:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_RATING);
+	result = col[rb] - col[ra];
+	break;
+    case ITDB_LIMITSORT_LOWEST_RATING:
+	col = ITDB_COLUMN (ls->cols, ITDB_COLUMN_RATING);
+	result = col[ra] - col[rb];
+	break;
+    }
+    if (result == 0)
+	result = (ra < rb) ? -1 : (ra > rb);
+    return result;
+}
+
+/* itdb_spl_update() on columns freshly obtained from
+   itdb_columns_refresh() */
+static void spl_update (Itdb_Playlist *spl, ItdbColumns *cols)
 {
-    GList *gl;
     Itdb_iTunesDB *itdb;
-    GList *sel_tracks = NULL;
+    guint8 *state;
+    guint *rows;
+    guint i, n_sel;
+    GList *members = NULL;
 
     g_return_if_fail (spl);
     g_return_if_fail (spl->itdb);
@@ -725,63 +894,60 @@ void itdb_spl_update (Itdb_Playlist *spl)
     spl->members = NULL;
     spl->num = 0;
 
-    for (gl=itdb->tracks; gl ; gl=gl->next)
+    g_return_if_fail (cols);
+
+    state = g_new (guint8, cols->n_rows + 1);
+    for (i=0; i<cols->n_rows; ++i)
     {
-	Itdb_Track *t = gl->data;
-	g_return_if_fail (t);
 	/* skip non-checked songs if we have to do so (this takes care
 	   of *all* the match_checked functionality) */
-	if (spl->splpref.matchcheckedonly && (t->checked != 0))
-	    continue;
-	/* first, match the rules */
-	if (spl->splpref.checkrules)
-	{   /* if we are set to check the rules */
-	    /* start with true for "match all",
-	       start with false for "match any" */
-	    gboolean matchrules;
-	    GList *gl;
-
-	    if (spl->splrules.match_operator == ITDB_SPLMATCH_AND)
-		 matchrules = TRUE;
-	    else matchrules = FALSE;
-	    /* assume everything matches with no rules */
-	    if (spl->splrules.rules == NULL) matchrules = TRUE;
-	    /* match all rules */
+	if (spl->splpref.matchcheckedonly &&
+	    (ITDB_COLUMN (cols, ITDB_COLUMN_CHECKED)[i] != 0))
+	    state[i] = SPL_ROW_SKIPPED;
+	else
+	    state[i] = SPL_ROW_MATCH;
+    }
+
+    /* first, match the rules */
+    if (spl->splpref.checkrules && spl->splrules.rules)
+    {
+	GList *gl;
+
+	/* one rule after the other over all rows: "match all" starts
+	   with every row matching and drops the rows failing a rule,
+	   "match any" starts with no row matching and picks up the
+	   rows passing a rule */
+	if (spl->splrules.match_operator == ITDB_SPLMATCH_AND)
+	{
 	    for (gl=spl->splrules.rules; gl; gl=gl->next)
-	    {
-		Itdb_SPLRule* splr = gl->data;
-		gboolean ruletruth = itdb_splr_eval (splr, t);
-		if (spl->splrules.match_operator == ITDB_SPLMATCH_AND)
-		{
-		    if (!ruletruth)
-		    {   /* one rule did not match -- we can stop */
-			matchrules = FALSE;
-			break;
-		    }
-		}
-		else if (spl->splrules.match_operator == ITDB_SPLMATCH_OR)
-		{
-		    if (ruletruth)
-		    {   /* one rule matched -- we can stop */
-			matchrules = TRUE;
-			break;
-		    }
-		}
-	    }
-	    if (matchrules)
-	    {   /* we have a track that matches the ruleset, append to
-		 * playlist for now*/
-		sel_tracks = g_list_append (sel_tracks, t);
-	    }
+		spl_eval_rule (itdb, gl->data, cols, state,
+			       SPL_ROW_MATCH, FALSE, SPL_ROW_NO_MATCH);
 	}
 	else
-	{   /* we aren't checking the rules, so just append to
-	       playlist */
-		sel_tracks = g_list_append (sel_tracks, t);
+	{
+	    for (i=0; i<cols->n_rows; ++i)
+		if (state[i] == SPL_ROW_MATCH)
+		    state[i] = SPL_ROW_NO_MATCH;
+	    if (spl->splrules.match_operator == ITDB_SPLMATCH_OR)
+		for (gl=spl->splrules.rules; gl; gl=gl->next)
+		    spl_eval_rule (itdb, gl->data, cols, state,
+				   SPL_ROW_NO_MATCH, TRUE, SPL_ROW_MATCH);
 	}
     }
+
+    rows = g_new (guint, cols->n_rows + 1);
+    n_sel = 0;
+    for (i=0; i<cols->n_rows; ++i)
+	if (state[i] == SPL_ROW_MATCH)
+	    rows[n_sel++] = i;
+    g_free (state);
+
     /* no reason to go on if nothing matches so far */
-    if (g_list_length (sel_tracks) == 0) return;
+    if (n_sel == 0)
+    {
+	g_free (rows);
+	return;
+    }
 
     /* do the limits */
     if (spl->splpref.checklimits)
@@ -790,60 +956,37 @@ void itdb_spl_update (Itdb_Playlist *spl)
 	 * here */
 	gdouble runningtotal = 0;
 	guint32 trackcounter = 0;
-	guint32 tracknum = g_list_length (sel_tracks);
-
-/* 	printf("limitsort: %d\n", spl->splpref.limitsort); */
+	SPLLimitSort ls;
 
 	/* limit to (number) (type) selected by (sort) */
 	/* first, we sort the list */
 	switch(spl->splpref.limitsort)
 	{
 	case ITDB_LIMITSORT_RANDOM:
-	    sel_tracks = randomize_glist (sel_tracks);
+	    for (i=n_sel; i>1; --i)
+	    {
+		guint j = g_random_int_range (0, i);
+		guint tmp = rows[j];
+		rows[j] = rows[i-1];
+		rows[i-1] = tmp;
+	    }
 	    break;
 	case ITDB_LIMITSORT_SONG_NAME:
-	    sel_tracks = g_list_sort (sel_tracks, (GCompareFunc)compTitle);
-	    break;
 	case ITDB_LIMITSORT_ALBUM:
-	    sel_tracks = g_list_sort (sel_tracks, (GCompareFunc)compAlbum);
-		break;
 	case ITDB_LIMITSORT_ARTIST:
-	    sel_tracks = g_list_sort (sel_tracks, (GCompareFunc)compArtist);
-	    break;
 	case ITDB_LIMITSORT_GENRE:
-	    sel_tracks = g_list_sort (sel_tracks, (GCompareFunc)compGenre);
-	    break;
 	case ITDB_LIMITSORT_MOST_RECENTLY_ADDED:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compMostRecentlyAdded);
-	    break;
 	case ITDB_LIMITSORT_LEAST_RECENTLY_ADDED:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compLeastRecentlyAdded);
-	    break;
 	case ITDB_LIMITSORT_MOST_OFTEN_PLAYED:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compMostOftenPlayed);
-	    break;
 	case ITDB_LIMITSORT_LEAST_OFTEN_PLAYED:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compLeastOftenPlayed);
-	    break;
 	case ITDB_LIMITSORT_MOST_RECENTLY_PLAYED:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compMostRecentlyPlayed);
-	    break;
 	case ITDB_LIMITSORT_LEAST_RECENTLY_PLAYED:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compLeastRecentlyPlayed);
-	    break;
 	case ITDB_LIMITSORT_HIGHEST_RATING:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compHighestRating);
-	    break;
 	case ITDB_LIMITSORT_LOWEST_RATING:
-	    sel_tracks = g_list_sort (sel_tracks,
-			 (GCompareFunc)compLowestRating);
+	    ls.cols = cols;
+	    ls.limitsort = spl->splpref.limitsort;
+	    g_qsort_with_data (rows, n_sel, sizeof (guint),
+			       spl_limit_compare, &ls);
 	    break;
 	default:
 	    g_warning ("Programming error: should not reach this point (default of switch (spl->splpref.limitsort)\n");
@@ -854,28 +997,29 @@ void itdb_spl_update (Itdb_Playlist *spl)
 	   our playlist */
 
 	while ((runningtotal < spl->splpref.limitvalue) &&
-	       (trackcounter < tracknum))
+	       (trackcounter < n_sel))
 	{
 	    gdouble currentvalue=0;
-	    Itdb_Track *t = g_list_nth_data (sel_tracks, trackcounter);
-
-/* 	    printf ("track: %d runningtotal: %lf, limitvalue: %d\n", */
-/* 		    trackcounter, runningtotal, spl->splpref.limitvalue); */
+	    guint row = rows[trackcounter];
 
 	    /* get the next song's value to add to running total */
 	    switch (spl->splpref.limittype)
 	    {
 	    case ITDB_LIMITTYPE_MINUTES:
-		currentvalue = (double)(t->tracklen)/(60*1000);
+		currentvalue = (double)itdb_columns_value (
+		    cols, ITDB_COLUMN_TRACKLEN, row)/(60*1000);
 		break;
 	    case ITDB_LIMITTYPE_HOURS:
-		currentvalue = (double)(t->tracklen)/(60*60*1000);
+		currentvalue = (double)itdb_columns_value (
+		    cols, ITDB_COLUMN_TRACKLEN, row)/(60*60*1000);
 		break;
 	    case ITDB_LIMITTYPE_MB:
-		currentvalue = (double)(t->size)/(1024*1024);
+		currentvalue = (double)itdb_columns_value (
+		    cols, ITDB_COLUMN_SIZE, row)/(1024*1024);
 		break;
 	    case ITDB_LIMITTYPE_GB:
-		currentvalue = (double)(t->size)/(1024*1024*1024);
+		currentvalue = (double)itdb_columns_value (
+		    cols, ITDB_COLUMN_SIZE, row)/(1024*1024*1024);
 		break;
 	    case ITDB_LIMITTYPE_SONGS:
 		currentvalue = 1;
@@ -891,25 +1035,44 @@ void itdb_spl_update (Itdb_Playlist *spl)
 	    {
 		runningtotal += currentvalue;
 		/* Add the playlist entry */
-		itdb_playlist_add_track (spl, t, -1);
+		members = g_list_prepend (members, cols->tracks[row]);
 	    }
 	    /* increment the track counter so we can look at the next
 	       track */
 	    trackcounter++;
-/* 	    printf ("  track: %d runningtotal: %lf, limitvalue: %d\n", */
-/* 		    trackcounter, runningtotal, spl->splpref.limitvalue); */
 	}	/* end while */
-	/* no longer needed */
-	g_list_free (sel_tracks);
-	sel_tracks = NULL;
+	spl->members = g_list_reverse (members);
     } /* end if limits enabled */
     else
     {   /* no limits, so stick everything that matched the rules into
 	   the playlist */
-	spl->members = sel_tracks;
-	spl->num = g_list_length (sel_tracks);
-	sel_tracks = NULL;
+	for (i=n_sel; i>0; --i)
+	    members = g_list_prepend (members, cols->tracks[rows[i-1]]);
+	spl->members = members;
+	spl->num = n_sel;
     }
+    g_free (rows);
+}
+
+
+/**
+ * itdb_spl_update:
+ * @spl: an #Itdb_Playlist
+ *
+ * Updates the content of the smart playlist @spl (meant to be called if the 
+ * tracks stored in the #Itdb_iTunesDB associated with @spl have changed 
+ * somehow and you want spl-&gt;members to be accurate with regards to those 
+ * changes. Does nothing if @spl isn't a smart playlist.
+ **/
+void itdb_spl_update (Itdb_Playlist *spl)
+{
+    g_return_if_fail (spl);
+    g_return_if_fail (spl->itdb);
+
+    /* we only can populate smart playlists */
+    if (!spl->is_spl) return;
+
+    spl_update (spl, itdb_columns_refresh (spl->itdb));
 }
 
 
@@ -921,17 +1084,21 @@ void itdb_spl_update (Itdb_Playlist *spl)
  **/
 void itdb_spl_update_all (Itdb_iTunesDB *itdb)
 {
-    g_return_if_fail (itdb);
-
-    g_list_foreach (itdb->playlists, (GFunc)itdb_spl_update, NULL);
-}
+    Itdb_Stats *stats;
+    ItdbStatsTimer timer;
+    ItdbColumns *cols;
+    GList *gl;
 
+    g_return_if_fail (itdb);
 
-static void spl_update2 (Itdb_Playlist *playlist, gpointer data)
-{
-    g_return_if_fail (playlist);
-    if (playlist->is_spl && playlist->splpref.liveupdate)
-        itdb_spl_update (playlist);
+    stats = itdb_stats_get (itdb);
+    itdb_stats_begin (stats, &timer);
+    /* the tracks don't change while the playlists are updated: one
+       refresh of the columns serves all of them */
+    cols = itdb_columns_refresh (itdb);
+    for (gl=itdb->playlists; gl; gl=gl->next)
+	spl_update (gl->data, cols);
+    itdb_stats_end (stats, ITDB_STATS_SPL_UPDATE, &timer);
 }
 
 
@@ -944,9 +1111,19 @@ static void spl_update2 (Itdb_Playlist *playlist, gpointer data)
  **/
 void itdb_spl_update_live (Itdb_iTunesDB *itdb)
 {
+    ItdbColumns *cols;
+    GList *gl;
+
     g_return_if_fail (itdb);
 
-    g_list_foreach (itdb->playlists, (GFunc)spl_update2, NULL);
+    cols = itdb_columns_refresh (itdb);
+    for (gl=itdb->playlists; gl; gl=gl->next)
+    {
+	Itdb_Playlist *playlist = gl->data;
+	g_return_if_fail (playlist);
+	if (playlist->is_spl && playlist->splpref.liveupdate)
+	    spl_update (playlist, cols);
+    }
 }
 
 
@@ -61,6 +61,7 @@ typedef struct
        iTunesDBs for mobile phones */
     gboolean reversed;
     gsize length;
+    GMappedFile *mapped; /* set if contents is mapped rather than read */
     GError *error;
 } FContents;
 
@@ -73,12 +74,20 @@ typedef struct
     FContents *fcontents;
     GList *pos_glist;    /* temporary list to store position indicators */
     gint32 pos_len;      /* current length of above list */
-    GList *playcounts;   /* contents of Play Counts file */
+    struct playcount *playcounts; /* contents of Play Counts file,
+				    one entry per track */
+    guint32 playcounts_num;  /* number of entries in playcounts */
+    guint32 playcounts_next; /* entry of the next track parsed */
     GTree *idtree;       /* temporary tree with track id tree */
+    Itdb_Track **otg_tracks; /* track at each position of the
+				iTunesDB, used by OTG playlists (NULL
+				for tracks removed since)          */
+    guint32 otg_tracks_num;  /* number of entries in otg_tracks  */
+    Itdb_Stats *stats;   /* statistics to update or NULL */
     GError *error;       /* where to report errors to */
 } FImport;
 
-/* data of playcounts GList above */
+/* data of playcounts array above */
 struct playcount {
     guint32 playcount;
     guint32 skipped;     /* skipped (only for Shuffle's iTunesStats */
@@ -107,6 +116,7 @@ typedef struct
     gboolean reversed;
     gulong pos;          /* current write position ("end of file") */
     gulong total;        /* current total size of *contents array  */
+    gboolean backup;     /* keep the previous file as "*.bak"      */
     GError *error;       /* place to report errors to */
 } WContents;
 
@@ -121,6 +131,7 @@ typedef struct
     Itdb_iTunesDB *itdb;
     WContents *wcontents;
     guint32 next_id;     /* next free ID to use       */
+    Itdb_Stats *stats;   /* statistics to update or NULL */
     GError *error;       /* where to report errors to */
 } FExport;
 
@@ -142,6 +153,83 @@ struct _Itdb_DB{
 
 typedef struct _Itdb_DB Itdb_DB;
 
+/* scalar track fields mirrored in an ItdbColumns */
+typedef enum
+{
+    ITDB_COLUMN_RATING,
+    ITDB_COLUMN_PLAYCOUNT,
+    ITDB_COLUMN_SKIPCOUNT,
+    ITDB_COLUMN_TIME_ADDED,
+    ITDB_COLUMN_TIME_PLAYED,
+    ITDB_COLUMN_TIME_MODIFIED,
+    ITDB_COLUMN_LAST_SKIPPED,
+    ITDB_COLUMN_SIZE,
+    ITDB_COLUMN_TRACKLEN,
+    ITDB_COLUMN_MEDIATYPE,
+    ITDB_COLUMN_BITRATE,
+    ITDB_COLUMN_SAMPLERATE,
+    ITDB_COLUMN_YEAR,
+    ITDB_COLUMN_TRACK_NR,
+    ITDB_COLUMN_CD_NR,
+    ITDB_COLUMN_BPM,
+    ITDB_COLUMN_SEASON_NR,
+    ITDB_COLUMN_COMPILATION,
+    ITDB_COLUMN_CHECKED,
+    ITDB_COLUMN_N
+} ItdbColumnId;
+
+/* Column-wise copy of the scalar fields of itdb->tracks: row i
+   describes tracks[i], the i-th track of itdb->tracks. Every column
+   holds n_rows values in 32 bits (times are truncated the same way
+   the SPL code truncates them); use itdb_columns_value() to read
+   them with the sign of the original field. Applications change
+   tracks directly, so the columns are only valid until control
+   returns to the application and have to be refreshed with
+   itdb_columns_refresh() by every public function using them. */
+typedef struct
+{
+    guint n_rows;
+    guint n_alloc;
+    Itdb_Track **tracks;
+    guint32 *values;     /* ITDB_COLUMN_N columns of n_alloc values */
+} ItdbColumns;
+
+#define ITDB_COLUMN(cols, id) ((cols)->values + (gsize)(id) * (cols)->n_alloc)
+
+/* secondary indexes used by itdb_query_run(), see itdb_query.c */
+typedef struct _ItdbQueryIndexes ItdbQueryIndexes;
+
+/* encoded iTunesSD records kept between writes, see itdb_itunesdb.c */
+typedef struct _ItdbShuffleCache ItdbShuffleCache;
+
+/* On-The-Go playlist files read so far, see itdb_itunesdb.c */
+typedef struct _ItdbOtgState ItdbOtgState;
+
+/* private data of an Itdb_iTunesDB, kept in itdb->reserved1. Use
+   itdb_get_private() to access it. */
+typedef struct
+{
+    Itdb_Stats *stats;   /* NULL until statistics are collected */
+    ItdbColumns *columns;/* NULL until first used                */
+    ItdbQueryIndexes *indexes; /* NULL until the first query     */
+    GList *snapshots;    /* Itdb_Snapshot taken of this database */
+    Itdb_Snapshot *snapshot; /* set if this is a snapshot's database */
+    ItdbDurability durability;
+    gboolean backup;     /* see itdb_set_backup()              */
+    GHashTable *unflushed; /* paths written since the last itdb_flush() */
+    guint write_threads; /* see itdb_set_write_threads()       */
+    ItdbShuffleCache *shuffle; /* NULL until the first iTunesSD write */
+    gboolean shuffle_in_place; /* see itdb_set_shuffle_in_place()  */
+    ItdbOtgState *otg;   /* NULL until parsed or written         */
+} ItdbPrivate;
+
+/* start of a timed phase, see itdb_stats_begin() */
+typedef struct
+{
+    gdouble wall_time;
+    gdouble cpu_time;
+} ItdbStatsTimer;
+
 G_GNUC_INTERNAL gboolean itdb_spl_action_known (ItdbSPLAction action);
 G_GNUC_INTERNAL void itdb_splr_free (Itdb_SPLRule *splr);
 G_GNUC_INTERNAL const gchar *itdb_photodb_get_mountpoint (Itdb_PhotoDB *photodb);
@@ -157,4 +245,69 @@ G_GNUC_INTERNAL guint64 device_time_time_t_to_mac (Itdb_Device *device,
 						 time_t timet);
 G_GNUC_INTERNAL gint itdb_musicdirs_number_by_mountpoint (const gchar *mountpoint);
 G_GNUC_INTERNAL gboolean itdb_device_requires_checksum (Itdb_Device *device);
+G_GNUC_INTERNAL void itdb_resolve_path_forget_tree (const gchar *root);
+/* itdb_image.c */
+G_GNUC_INTERNAL void itdb_image_fit_size (gint src_width, gint src_height,
+					  gint width, gint height,
+					  gint *fit_width, gint *fit_height);
+G_GNUC_INTERNAL Itdb_Image *itdb_image_load_file_at_size (const gchar *filename,
+							  gint width,
+							  gint height);
+G_GNUC_INTERNAL Itdb_Image *itdb_image_load_data_at_size (const guchar *data,
+							  gsize len,
+							  gint width,
+							  gint height);
+G_GNUC_INTERNAL Itdb_Image *itdb_image_load_pixbuf_at_size (gpointer pixbuf,
+							    gint width,
+							    gint height);
+G_GNUC_INTERNAL Itdb_Image *itdb_image_rotate_with_backend (Itdb_Image *image,
+							    gint rotation);
+G_GNUC_INTERNAL Itdb_Image *itdb_image_new_questionmark (gint width,
+							 gint height);
+/* itdb_image_decode.c */
+G_GNUC_INTERNAL Itdb_Image *itdb_image_decode_jpeg (const guchar *data,
+						    gsize len,
+						    gint width, gint height);
+G_GNUC_INTERNAL Itdb_Image *itdb_image_decode_png (const guchar *data,
+						   gsize len);
+G_GNUC_INTERNAL ItdbPrivate *itdb_get_private (Itdb_iTunesDB *itdb);
+G_GNUC_INTERNAL void itdb_free_private (Itdb_iTunesDB *itdb);
+G_GNUC_INTERNAL Itdb_Stats *itdb_stats_get (Itdb_iTunesDB *itdb);
+G_GNUC_INTERNAL void itdb_stats_begin (Itdb_Stats *stats,
+				       ItdbStatsTimer *timer);
+G_GNUC_INTERNAL void itdb_stats_end (Itdb_Stats *stats,
+				     ItdbStatsPhase phase,
+				     const ItdbStatsTimer *timer);
+/* itdb_columns.c */
+G_GNUC_INTERNAL ItdbColumns *itdb_columns_refresh (Itdb_iTunesDB *itdb);
+G_GNUC_INTERNAL gint64 itdb_columns_value (const ItdbColumns *cols,
+					   ItdbColumnId id, guint row);
+G_GNUC_INTERNAL void itdb_columns_free (ItdbColumns *cols);
+/* itdb_query.c */
+G_GNUC_INTERNAL void itdb_query_track_added (Itdb_iTunesDB *itdb,
+					     Itdb_Track *track);
+G_GNUC_INTERNAL void itdb_query_track_removed (Itdb_iTunesDB *itdb,
+					       Itdb_Track *track);
+G_GNUC_INTERNAL void itdb_query_indexes_free (ItdbQueryIndexes *indexes);
+G_GNUC_INTERNAL void itdb_query_invalidate (Itdb_iTunesDB *itdb);
+/* itdb_track.c */
+G_GNUC_INTERNAL void itdb_track_set_defaults (Itdb_Track *tr);
+G_GNUC_INTERNAL void itdb_track_set_unique_dbid (Itdb_Track *tr,
+						 GHashTable *dbids);
+G_GNUC_INTERNAL guint itdb_dbid_hash (gconstpointer v);
+G_GNUC_INTERNAL gboolean itdb_dbid_equal (gconstpointer v1,
+					  gconstpointer v2);
+/* itdb_snapshot.c */
+G_GNUC_INTERNAL void itdb_snapshots_track_write (Itdb_Track *track);
+G_GNUC_INTERNAL gboolean itdb_snapshots_track_release (Itdb_Track *track);
+G_GNUC_INTERNAL void itdb_snapshots_detach (Itdb_iTunesDB *itdb);
+/* itdb_durability.c */
+G_GNUC_INTERNAL void itdb_durability_add_file (Itdb_iTunesDB *itdb,
+					       const gchar *path);
+G_GNUC_INTERNAL gboolean itdb_durability_flush (Itdb_iTunesDB *itdb,
+						GError **error);
+G_GNUC_INTERNAL gboolean itdb_file_replace (const gchar *filename,
+					    const gchar *contents, gsize len,
+					    int mode, gboolean backup,
+					    GError **error);
 #endif
@@ -0,0 +1,736 @@
+/*
+|  Track queries with lazily built secondary indexes.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include <string.h>
+
+/* String fields and the mediatype are indexed with a hash table
+   mapping each value to the tracks having it. The other numeric
+   fields are indexed with an array of (value, track) pairs sorted by
+   value for range lookups.
+
+   Hash indexes are updated when tracks are added, removed or
+   reported as changed with itdb_track_changed(). Sorted indexes are
+   dropped on any such change and rebuilt by the next query that
+   needs them. An index is only built once a query uses its field. */
+
+typedef struct
+{
+    GHashTable *by_value;  /* value -> GPtrArray of Itdb_Track      */
+    GHashTable *by_track;  /* Itdb_Track -> its key in by_value     */
+} HashIndex;
+
+typedef struct
+{
+    gint64 value;
+    guint pos;             /* position in itdb->tracks, for ties    */
+    Itdb_Track *track;
+} RangeEntry;
+
+struct _ItdbQueryIndexes
+{
+    HashIndex *hash[ITDB_QUERYFIELD_N];  /* NULL until built */
+    GArray *range[ITDB_QUERYFIELD_N];    /* NULL until built */
+};
+
+typedef enum
+{
+    PREDICATE_EQUAL,
+    PREDICATE_RANGE,
+    PREDICATE_MEDIATYPE
+} PredicateType;
+
+typedef struct
+{
+    PredicateType type;
+    ItdbQueryField field;
+    gchar *value;          /* PREDICATE_EQUAL     */
+    gint64 min, max;       /* PREDICATE_RANGE     */
+    guint32 mediatype;     /* PREDICATE_MEDIATYPE */
+} Predicate;
+
+struct _Itdb_Query
+{
+    GList *predicates;     /* (Predicate *), all must be true */
+};
+
+
+static gboolean field_is_string (ItdbQueryField field)
+{
+    return field < ITDB_QUERYFIELD_MEDIATYPE;
+}
+
+/* the fields with a hash index */
+static gboolean field_is_hashed (ItdbQueryField field)
+{
+    return field <= ITDB_QUERYFIELD_MEDIATYPE;
+}
+
+static const gchar *track_get_string (Itdb_Track *track,
+				      ItdbQueryField field)
+{
+    switch (field)
+    {
+    case ITDB_QUERYFIELD_ARTIST:
+	return track->artist;
+    case ITDB_QUERYFIELD_ALBUM:
+	return track->album;
+    case ITDB_QUERYFIELD_ALBUMARTIST:
+	return track->albumartist;
+    case ITDB_QUERYFIELD_GENRE:
+	return track->genre;
+    case ITDB_QUERYFIELD_COMPOSER:
+	return track->composer;
+    case ITDB_QUERYFIELD_FILETYPE:
+	return track->filetype;
+    default:
+	g_return_val_if_reached (NULL);
+    }
+}
+
+static gint64 track_get_number (Itdb_Track *track, ItdbQueryField field)
+{
+    switch (field)
+    {
+    case ITDB_QUERYFIELD_MEDIATYPE:
+	return track->mediatype;
+    case ITDB_QUERYFIELD_YEAR:
+	return track->year;
+    case ITDB_QUERYFIELD_RATING:
+	return track->rating;
+    case ITDB_QUERYFIELD_PLAYCOUNT:
+	return track->playcount;
+    case ITDB_QUERYFIELD_SKIPCOUNT:
+	return track->skipcount;
+    case ITDB_QUERYFIELD_SIZE:
+	/* files between 2 and 4 GB */
+	return (guint32)track->size;
+    case ITDB_QUERYFIELD_TRACKLEN:
+	return track->tracklen;
+    case ITDB_QUERYFIELD_TIME_ADDED:
+	return track->time_added;
+    case ITDB_QUERYFIELD_TIME_PLAYED:
+	return track->time_played;
+    case ITDB_QUERYFIELD_TIME_MODIFIED:
+	return track->time_modified;
+    default:
+	g_return_val_if_reached (0);
+    }
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Hash indexes
+ *
+\* ------------------------------------------------------------ */
+
+static void ptr_array_free (gpointer array)
+{
+    g_ptr_array_free (array, TRUE);
+}
+
+static void hash_index_insert (HashIndex *index, ItdbQueryField field,
+			       Itdb_Track *track)
+{
+    gpointer key, orig_key, tracks;
+
+    if (field_is_string (field))
+    {
+	const gchar *value = track_get_string (track, field);
+	if (!value)
+	    return;  /* tracks without the field are not indexed */
+	key = (gpointer)value;
+    }
+    else
+    {
+	key = GUINT_TO_POINTER (track->mediatype);
+    }
+
+    if (g_hash_table_lookup_extended (index->by_value, key,
+				      &orig_key, &tracks))
+    {   /* use the key stored in the table */
+	key = orig_key;
+    }
+    else
+    {
+	if (field_is_string (field))
+	    key = g_strdup (key);
+	tracks = g_ptr_array_new ();
+	g_hash_table_insert (index->by_value, key, tracks);
+    }
+    g_ptr_array_add (tracks, track);
+    g_hash_table_insert (index->by_track, track, key);
+}
+
+static void hash_index_remove (HashIndex *index, Itdb_Track *track)
+{
+    GPtrArray *tracks;
+    gpointer key;
+
+    if (!g_hash_table_lookup_extended (index->by_track, track, NULL, &key))
+	return;
+    g_hash_table_remove (index->by_track, track);
+
+    tracks = g_hash_table_lookup (index->by_value, key);
+    g_return_if_fail (tracks);
+    g_ptr_array_remove (tracks, track);
+    if (tracks->len == 0)
+	g_hash_table_remove (index->by_value, key);
+}
+
+static HashIndex *hash_index_new (Itdb_iTunesDB *itdb, ItdbQueryField field)
+{
+    HashIndex *index = g_new0 (HashIndex, 1);
+    GList *gl;
+
+    if (field_is_string (field))
+	index->by_value = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 g_free, ptr_array_free);
+    else
+	index->by_value = g_hash_table_new_full (g_direct_hash,
+						 g_direct_equal,
+						 NULL, ptr_array_free);
+    index->by_track = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (gl=itdb->tracks; gl; gl=gl->next)
+	hash_index_insert (index, field, gl->data);
+    return index;
+}
+
+static void hash_index_free (HashIndex *index)
+{
+    if (index)
+    {
+	g_hash_table_destroy (index->by_track);
+	g_hash_table_destroy (index->by_value);
+	g_free (index);
+    }
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Sorted indexes
+ *
+\* ------------------------------------------------------------ */
+
+static gint range_entry_compare (gconstpointer a, gconstpointer b)
+{
+    const RangeEntry *ea = a;
+    const RangeEntry *eb = b;
+
+    if (ea->value != eb->value)
+	return (ea->value < eb->value) ? -1 : 1;
+    return (ea->pos < eb->pos) ? -1 : (ea->pos > eb->pos);
+}
+
+static GArray *range_index_new (Itdb_iTunesDB *itdb, ItdbQueryField field)
+{
+    GArray *index;
+    GList *gl;
+    guint pos = 0;
+
+    index = g_array_sized_new (FALSE, FALSE, sizeof (RangeEntry),
+			       g_list_length (itdb->tracks));
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	RangeEntry entry;
+	entry.track = gl->data;
+	entry.value = track_get_number (entry.track, field);
+	entry.pos = pos++;
+	g_array_append_val (index, entry);
+    }
+    g_array_sort (index, range_entry_compare);
+    return index;
+}
+
+/* Returns the index of the first entry of @index with a value of at
+   least @value */
+static guint range_index_lower_bound (GArray *index, gint64 value)
+{
+    guint lo = 0, hi = index->len;
+
+    while (lo < hi)
+    {
+	guint mid = lo + (hi - lo) / 2;
+	if (g_array_index (index, RangeEntry, mid).value < value)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* Sets *@first and *@last so that the entries @first to @last-1 of
+   @index are those with a value between @min and @max */
+static void range_index_find (GArray *index, gint64 min, gint64 max,
+			      guint *first, guint *last)
+{
+    *first = range_index_lower_bound (index, min);
+    if (max == G_MAXINT64)
+	*last = index->len;
+    else
+	*last = range_index_lower_bound (index, max + 1);
+    if (*last < *first)
+	*last = *first;
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Index maintenance
+ *
+\* ------------------------------------------------------------ */
+
+static ItdbQueryIndexes *indexes_get (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv = itdb_get_private (itdb);
+
+    if (!priv->indexes)
+	priv->indexes = g_new0 (ItdbQueryIndexes, 1);
+    return priv->indexes;
+}
+
+/* Returns the existing indexes of @itdb without creating them */
+static ItdbQueryIndexes *indexes_lookup (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv = itdb->reserved1;
+
+    return priv ? priv->indexes : NULL;
+}
+
+static void indexes_drop_ranges (ItdbQueryIndexes *indexes)
+{
+    gint i;
+
+    for (i=0; i<ITDB_QUERYFIELD_N; ++i)
+    {
+	if (indexes->range[i])
+	{
+	    g_array_free (indexes->range[i], TRUE);
+	    indexes->range[i] = NULL;
+	}
+    }
+}
+
+static HashIndex *indexes_get_hash (Itdb_iTunesDB *itdb,
+				    ItdbQueryField field)
+{
+    ItdbQueryIndexes *indexes = indexes_get (itdb);
+
+    if (!indexes->hash[field])
+	indexes->hash[field] = hash_index_new (itdb, field);
+    return indexes->hash[field];
+}
+
+static GArray *indexes_get_range (Itdb_iTunesDB *itdb,
+				  ItdbQueryField field)
+{
+    ItdbQueryIndexes *indexes = indexes_get (itdb);
+
+    if (!indexes->range[field])
+	indexes->range[field] = range_index_new (itdb, field);
+    return indexes->range[field];
+}
+
+/* Called by itdb_track_add() and itdb_track_changed() after @track
+   was added to @itdb */
+void itdb_query_track_added (Itdb_iTunesDB *itdb, Itdb_Track *track)
+{
+    ItdbQueryIndexes *indexes;
+    gint i;
+
+    g_return_if_fail (itdb);
+    g_return_if_fail (track);
+
+    indexes = indexes_lookup (itdb);
+    if (!indexes)
+	return;
+
+    for (i=0; i<ITDB_QUERYFIELD_N; ++i)
+	if (indexes->hash[i])
+	    hash_index_insert (indexes->hash[i], i, track);
+    indexes_drop_ranges (indexes);
+}
+
+/* Called by itdb_track_remove(), itdb_track_unlink() and
+   itdb_track_changed() before @track is removed from @itdb */
+void itdb_query_track_removed (Itdb_iTunesDB *itdb, Itdb_Track *track)
+{
+    ItdbQueryIndexes *indexes;
+    gint i;
+
+    g_return_if_fail (itdb);
+    g_return_if_fail (track);
+
+    indexes = indexes_lookup (itdb);
+    if (!indexes)
+	return;
+
+    for (i=0; i<ITDB_QUERYFIELD_N; ++i)
+	if (indexes->hash[i])
+	    hash_index_remove (indexes->hash[i], track);
+    indexes_drop_ranges (indexes);
+}
+
+/* Drops all indexes of @itdb, e.g. after many changes at once. They
+   are rebuilt by the next query. */
+void itdb_query_invalidate (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+
+    g_return_if_fail (itdb);
+
+    priv = itdb->reserved1;
+    if (priv && priv->indexes)
+    {
+	itdb_query_indexes_free (priv->indexes);
+	priv->indexes = NULL;
+    }
+}
+
+void itdb_query_indexes_free (ItdbQueryIndexes *indexes)
+{
+    gint i;
+
+    if (!indexes)
+	return;
+
+    for (i=0; i<ITDB_QUERYFIELD_N; ++i)
+	hash_index_free (indexes->hash[i]);
+    indexes_drop_ranges (indexes);
+    g_free (indexes);
+}
+
+
+/* ------------------------------------------------------------ *\
+ *
+ * Queries
+ *
+\* ------------------------------------------------------------ */
+
+/**
+ * itdb_query_new:
+ *
+ * Creates an empty query. Add conditions with itdb_query_add_equal(),
+ * itdb_query_add_range() and itdb_query_add_mediatype(), then run it
+ * with itdb_query_run(). A query can be run any number of times and
+ * on different databases.
+ *
+ * Return value: a new #Itdb_Query to be freed with itdb_query_free()
+ **/
+Itdb_Query *itdb_query_new (void)
+{
+    return g_new0 (Itdb_Query, 1);
+}
+
+static void predicate_free (Predicate *pred)
+{
+    g_free (pred->value);
+    g_free (pred);
+}
+
+/**
+ * itdb_query_free:
+ * @query: an #Itdb_Query
+ *
+ * Frees @query.
+ **/
+void itdb_query_free (Itdb_Query *query)
+{
+    GList *gl;
+
+    if (query)
+    {
+	for (gl=query->predicates; gl; gl=gl->next)
+	    predicate_free (gl->data);
+	g_list_free (query->predicates);
+	g_free (query);
+    }
+}
+
+/**
+ * itdb_query_add_equal:
+ * @query: an #Itdb_Query
+ * @field: a string field (ITDB_QUERYFIELD_ARTIST to
+ * ITDB_QUERYFIELD_FILETYPE)
+ * @value: the value to match
+ *
+ * Restricts @query to tracks whose @field is exactly @value (case
+ * sensitive). Tracks without @field never match.
+ **/
+void itdb_query_add_equal (Itdb_Query *query, ItdbQueryField field,
+			   const gchar *value)
+{
+    Predicate *pred;
+
+    g_return_if_fail (query);
+    g_return_if_fail (field_is_string (field));
+    g_return_if_fail (value);
+
+    pred = g_new0 (Predicate, 1);
+    pred->type = PREDICATE_EQUAL;
+    pred->field = field;
+    pred->value = g_strdup (value);
+    query->predicates = g_list_prepend (query->predicates, pred);
+}
+
+/**
+ * itdb_query_add_range:
+ * @query: an #Itdb_Query
+ * @field: a numeric field (ITDB_QUERYFIELD_MEDIATYPE or later)
+ * @min: smallest value to match
+ * @max: largest value to match
+ *
+ * Restricts @query to tracks whose @field is between @min and @max
+ * (inclusive). Times are compared as time_t, the size as an unsigned
+ * number of bytes.
+ **/
+void itdb_query_add_range (Itdb_Query *query, ItdbQueryField field,
+			   gint64 min, gint64 max)
+{
+    Predicate *pred;
+
+    g_return_if_fail (query);
+    g_return_if_fail (field < ITDB_QUERYFIELD_N);
+    g_return_if_fail (!field_is_string (field));
+
+    pred = g_new0 (Predicate, 1);
+    pred->type = PREDICATE_RANGE;
+    pred->field = field;
+    pred->min = min;
+    pred->max = max;
+    query->predicates = g_list_prepend (query->predicates, pred);
+}
+
+/**
+ * itdb_query_add_mediatype:
+ * @query: an #Itdb_Query
+ * @mediatype: an or'ed combination of #ItdbMediatype
+ *
+ * Restricts @query to tracks whose mediatype has at least one of the
+ * bits of @mediatype set.
+ **/
+void itdb_query_add_mediatype (Itdb_Query *query, guint32 mediatype)
+{
+    Predicate *pred;
+
+    g_return_if_fail (query);
+
+    pred = g_new0 (Predicate, 1);
+    pred->type = PREDICATE_MEDIATYPE;
+    pred->field = ITDB_QUERYFIELD_MEDIATYPE;
+    pred->mediatype = mediatype;
+    query->predicates = g_list_prepend (query->predicates, pred);
+}
+
+static gboolean predicate_matches (const Predicate *pred, Itdb_Track *track)
+{
+    const gchar *str;
+    gint64 num;
+
+    switch (pred->type)
+    {
+    case PREDICATE_EQUAL:
+	str = track_get_string (track, pred->field);
+	return str && (strcmp (str, pred->value) == 0);
+    case PREDICATE_RANGE:
+	num = track_get_number (track, pred->field);
+	return (num >= pred->min) && (num <= pred->max);
+    case PREDICATE_MEDIATYPE:
+	return (track->mediatype & pred->mediatype) != 0;
+    }
+    return FALSE;
+}
+
+/* TRUE if the mediatype @key satisfies @pred */
+static gboolean predicate_matches_mediatype (const Predicate *pred,
+					     guint32 key)
+{
+    if (pred->type == PREDICATE_MEDIATYPE)
+	return (key & pred->mediatype) != 0;
+    return (key >= pred->min) && (key <= pred->max);
+}
+
+/* data for mediatype_scan() */
+typedef struct
+{
+    const Predicate *pred;
+    guint n;               /* number of tracks found              */
+    GPtrArray *result;     /* if not NULL, the tracks are added   */
+} MediatypeScan;
+
+/* g_hash_table_foreach() function over the mediatype index */
+static void mediatype_scan (gpointer key, gpointer tracks, gpointer data)
+{
+    MediatypeScan *scan = data;
+    GPtrArray *array = tracks;
+    guint i;
+
+    if (!predicate_matches_mediatype (scan->pred, GPOINTER_TO_UINT (key)))
+	return;
+    scan->n += array->len;
+    if (scan->result)
+	for (i=0; i<array->len; ++i)
+	    g_ptr_array_add (scan->result, g_ptr_array_index (array, i));
+}
+
+/* Returns the number of tracks of @itdb satisfying @pred according
+   to its index, building the index if needed */
+static guint predicate_estimate (Itdb_iTunesDB *itdb, const Predicate *pred)
+{
+    if (field_is_hashed (pred->field))
+    {
+	HashIndex *index = indexes_get_hash (itdb, pred->field);
+	MediatypeScan scan;
+
+	if (pred->type == PREDICATE_EQUAL)
+	{
+	    GPtrArray *array = g_hash_table_lookup (index->by_value,
+						    pred->value);
+	    return array ? array->len : 0;
+	}
+	scan.pred = pred;
+	scan.n = 0;
+	scan.result = NULL;
+	g_hash_table_foreach (index->by_value, mediatype_scan, &scan);
+	return scan.n;
+    }
+    else
+    {
+	GArray *index = indexes_get_range (itdb, pred->field);
+	guint first, last;
+
+	range_index_find (index, pred->min, pred->max, &first, &last);
+	return last - first;
+    }
+}
+
+/* Appends the tracks satisfying @pred to @result, using the index
+   built by predicate_estimate() */
+static void predicate_collect (Itdb_iTunesDB *itdb, const Predicate *pred,
+			       GPtrArray *result)
+{
+    guint i;
+
+    if (field_is_hashed (pred->field))
+    {
+	HashIndex *index = indexes_get_hash (itdb, pred->field);
+	MediatypeScan scan;
+
+	if (pred->type == PREDICATE_EQUAL)
+	{
+	    GPtrArray *array = g_hash_table_lookup (index->by_value,
+						    pred->value);
+	    if (array)
+		for (i=0; i<array->len; ++i)
+		    g_ptr_array_add (result, g_ptr_array_index (array, i));
+	    return;
+	}
+	scan.pred = pred;
+	scan.n = 0;
+	scan.result = result;
+	g_hash_table_foreach (index->by_value, mediatype_scan, &scan);
+    }
+    else
+    {
+	GArray *index = indexes_get_range (itdb, pred->field);
+	guint first, last;
+
+	range_index_find (index, pred->min, pred->max, &first, &last);
+	for (i=first; i<last; ++i)
+	    g_ptr_array_add (result,
+			     g_array_index (index, RangeEntry, i).track);
+    }
+}
+
+/**
+ * itdb_query_run:
+ * @itdb: an #Itdb_iTunesDB
+ * @query: an #Itdb_Query
+ *
+ * Finds the tracks of @itdb satisfying all conditions of @query. The
+ * indexes needed are built on first use and kept up to date by
+ * itdb_track_add(), itdb_track_remove() and itdb_track_unlink(). If
+ * you change a field of a track in @itdb directly, call
+ * itdb_track_changed() before running the next query.
+ *
+ * Return value: a newly allocated array of the matching tracks in no
+ * particular order, to be freed with g_ptr_array_free (array, TRUE)
+ **/
+GPtrArray *itdb_query_run (Itdb_iTunesDB *itdb, const Itdb_Query *query)
+{
+    const Predicate *best = NULL;
+    guint best_n = G_MAXUINT;
+    GPtrArray *result;
+    GList *gl;
+    guint i;
+
+    g_return_val_if_fail (itdb, NULL);
+    g_return_val_if_fail (query, NULL);
+
+    result = g_ptr_array_new ();
+
+    if (!query->predicates)
+    {
+	for (gl=itdb->tracks; gl; gl=gl->next)
+	    g_ptr_array_add (result, gl->data);
+	return result;
+    }
+
+    /* start with the condition matching the fewest tracks ... */
+    for (gl=query->predicates; gl; gl=gl->next)
+    {
+	guint n = predicate_estimate (itdb, gl->data);
+	if (n < best_n)
+	{
+	    best = gl->data;
+	    best_n = n;
+	}
+	if (n == 0)
+	    return result;
+    }
+    predicate_collect (itdb, best, result);
+
+    /* ... and check the others directly on the candidates */
+    for (gl=query->predicates; gl; gl=gl->next)
+    {
+	const Predicate *pred = gl->data;
+	guint n = 0;
+
+	if (pred == best)
+	    continue;
+	for (i=0; i<result->len; ++i)
+	{
+	    Itdb_Track *track = g_ptr_array_index (result, i);
+	    if (predicate_matches (pred, track))
+		g_ptr_array_index (result, n++) = track;
+	}
+	g_ptr_array_set_size (result, n);
+    }
+    return result;
+}
@@ -0,0 +1,296 @@
+/*
+|  Read-only snapshots of an iTunesDB sharing the track records with
+|  the live database until they are changed.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+
+/* A snapshot consists of its own Itdb_iTunesDB with copies of all
+   playlists (these are small) but with the Itdb_Track pointers of the
+   live database in its track list and playlist members. Before a
+   shared track is changed or freed, itdb_snapshots_track_write() or
+   itdb_snapshots_track_release() give each snapshot still sharing it
+   a private copy (or the track itself) and patch the links of the
+   snapshot pointing to it. */
+
+struct _Itdb_Snapshot
+{
+    Itdb_iTunesDB *live;   /* NULL once the live database is freed  */
+    Itdb_iTunesDB *itdb;   /* the frozen database handed out        */
+    GHashTable *shared;    /* Itdb_Track still owned by @live ->
+			      GSList of the GList links of @itdb
+			      pointing to it                        */
+};
+
+
+/* Returns the snapshots taken of @itdb without creating the private
+   data of @itdb */
+static GList *snapshots_of (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+
+    if (!itdb)
+	return NULL;
+    priv = itdb->reserved1;
+    return priv ? priv->snapshots : NULL;
+}
+
+static void snapshot_add_links (GHashTable *shared, GList *list,
+				gboolean create)
+{
+    GList *gl;
+
+    for (gl=list; gl; gl=gl->next)
+    {
+	GSList *links = g_hash_table_lookup (shared, gl->data);
+
+	/* extend the list in place: replacing the value would free it */
+	if (links)
+	    links->next = g_slist_prepend (links->next, gl);
+	else if (create)
+	    g_hash_table_insert (shared, gl->data,
+				 g_slist_prepend (NULL, gl));
+    }
+}
+
+/**
+ * itdb_snapshot_new:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Takes a snapshot of the tracks and playlists of @itdb, e.g. to keep
+ * the database "as parsed" while it's being edited. Only the
+ * playlists and the lists of tracks are copied: the tracks themselves
+ * are shared with @itdb until they're changed, removed or freed, so
+ * taking a snapshot is cheap even for large databases.
+ *
+ * While a snapshot exists, call itdb_track_prepare_change() before
+ * changing fields of a track of @itdb directly. The functions of
+ * libgpod changing or freeing tracks do this themselves.
+ *
+ * Return value: a new #Itdb_Snapshot to be freed with
+ * itdb_snapshot_free(). Freeing @itdb first is allowed.
+ **/
+Itdb_Snapshot *itdb_snapshot_new (Itdb_iTunesDB *itdb)
+{
+    Itdb_Snapshot *snapshot;
+    Itdb_iTunesDB *snap;
+    ItdbPrivate *priv;
+    GList *gl;
+
+    g_return_val_if_fail (itdb, NULL);
+    priv = itdb_get_private (itdb);
+    /* the tracks of a snapshot belong to another database */
+    g_return_val_if_fail (!priv->snapshot, NULL);
+
+    snap = g_new0 (Itdb_iTunesDB, 1);
+    snap->filename = g_strdup (itdb->filename);
+    snap->version = itdb->version;
+    snap->id = itdb->id;
+    snap->usertype = itdb->usertype;
+    snap->userdata_duplicate = itdb->userdata_duplicate;
+    snap->userdata_destroy = itdb->userdata_destroy;
+    if (itdb->userdata && itdb->userdata_duplicate)
+	snap->userdata = itdb->userdata_duplicate (itdb->userdata);
+    snap->tracks = g_list_copy (itdb->tracks);
+    for (gl=itdb->playlists; gl; gl=gl->next)
+    {
+	Itdb_Playlist *pl = gl->data;
+	Itdb_Playlist *pl_dup = itdb_playlist_duplicate (pl);
+
+	pl_dup->id = pl->id;
+	pl_dup->itdb = snap;
+	snap->playlists = g_list_prepend (snap->playlists, pl_dup);
+    }
+    snap->playlists = g_list_reverse (snap->playlists);
+
+    snapshot = g_new0 (Itdb_Snapshot, 1);
+    snapshot->live = itdb;
+    snapshot->itdb = snap;
+    snapshot->shared = g_hash_table_new_full (g_direct_hash,
+					      g_direct_equal,
+					      NULL,
+					      (GDestroyNotify)g_slist_free);
+    snapshot_add_links (snapshot->shared, snap->tracks, TRUE);
+    for (gl=snap->playlists; gl; gl=gl->next)
+    {
+	Itdb_Playlist *pl = gl->data;
+	/* members not in itdb->tracks are not shared */
+	snapshot_add_links (snapshot->shared, pl->members, FALSE);
+    }
+
+    itdb_get_private (snap)->snapshot = snapshot;
+    priv->snapshots = g_list_prepend (priv->snapshots, snapshot);
+    return snapshot;
+}
+
+/**
+ * itdb_snapshot_get_itdb:
+ * @snapshot: an #Itdb_Snapshot
+ *
+ * Retrieves the database of @snapshot. Its tracks and playlists can be
+ * read (also with itdb_query_run() or itdb_tracks_get_totals()) but
+ * must not be changed. The returned database has no device.
+ *
+ * Return value: the database of @snapshot (owned by @snapshot)
+ **/
+Itdb_iTunesDB *itdb_snapshot_get_itdb (Itdb_Snapshot *snapshot)
+{
+    g_return_val_if_fail (snapshot, NULL);
+
+    return snapshot->itdb;
+}
+
+/**
+ * itdb_snapshot_free:
+ * @snapshot: an #Itdb_Snapshot
+ *
+ * Frees @snapshot together with its copies of the tracks and
+ * playlists. Tracks still shared with the live database are left
+ * alone.
+ **/
+void itdb_snapshot_free (Itdb_Snapshot *snapshot)
+{
+    Itdb_iTunesDB *snap;
+    GList *gl;
+
+    g_return_if_fail (snapshot);
+
+    snap = snapshot->itdb;
+    if (snapshot->live)
+    {
+	ItdbPrivate *priv = itdb_get_private (snapshot->live);
+	priv->snapshots = g_list_remove (priv->snapshots, snapshot);
+    }
+
+    for (gl=snap->tracks; gl; gl=gl->next)
+    {
+	if (!g_hash_table_lookup (snapshot->shared, gl->data))
+	    itdb_track_free (gl->data);
+    }
+    g_list_free (snap->tracks);
+    snap->tracks = NULL;
+    g_hash_table_destroy (snapshot->shared);
+
+    /* frees the playlists and the private data */
+    itdb_free (snap);
+    g_free (snapshot);
+}
+
+/* Points all links of @snapshot to @track to @copy and stops sharing
+   @track */
+static void snapshot_replace (Itdb_Snapshot *snapshot, Itdb_Track *track,
+			      Itdb_Track *copy, GSList *links)
+{
+    GSList *gsl;
+
+    for (gsl=links; gsl; gsl=gsl->next)
+    {
+	GList *link = gsl->data;
+	link->data = copy;
+    }
+    g_hash_table_remove (snapshot->shared, track);
+    /* the query indexes of the snapshot refer to @track */
+    itdb_query_invalidate (snapshot->itdb);
+}
+
+/* Called before @track is changed: all snapshots sharing @track get a
+   copy of it. */
+void itdb_snapshots_track_write (Itdb_Track *track)
+{
+    GList *gl;
+
+    g_return_if_fail (track);
+
+    for (gl=snapshots_of (track->itdb); gl; gl=gl->next)
+    {
+	Itdb_Snapshot *snapshot = gl->data;
+	GSList *links = g_hash_table_lookup (snapshot->shared, track);
+
+	if (links)
+	{
+	    Itdb_Track *copy = itdb_track_duplicate (track);
+	    copy->itdb = snapshot->itdb;
+	    snapshot_replace (snapshot, track, copy, links);
+	}
+    }
+}
+
+/* Called instead of freeing @track when it leaves its database: the
+   first snapshot sharing @track takes it over, the others get a
+   copy.
+
+   Return value: TRUE if a snapshot took over @track, FALSE if it
+   must be freed by the caller. */
+gboolean itdb_snapshots_track_release (Itdb_Track *track)
+{
+    Itdb_Snapshot *owner = NULL;
+    GList *gl;
+
+    g_return_val_if_fail (track, FALSE);
+
+    for (gl=snapshots_of (track->itdb); gl; gl=gl->next)
+    {
+	Itdb_Snapshot *snapshot = gl->data;
+	GSList *links = g_hash_table_lookup (snapshot->shared, track);
+
+	if (!links)
+	    continue;
+	if (!owner)
+	{
+	    /* the links already point to @track */
+	    owner = snapshot;
+	    g_hash_table_remove (snapshot->shared, track);
+	}
+	else
+	{
+	    Itdb_Track *copy = itdb_track_duplicate (track);
+	    copy->itdb = snapshot->itdb;
+	    snapshot_replace (snapshot, track, copy, links);
+	}
+    }
+    if (owner)
+	track->itdb = owner->itdb;
+    return owner != NULL;
+}
+
+/* Called by itdb_free() after all tracks of @itdb were released */
+void itdb_snapshots_detach (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+    GList *gl;
+
+    g_return_if_fail (itdb);
+
+    priv = itdb->reserved1;
+    if (!priv)
+	return;
+    for (gl=priv->snapshots; gl; gl=gl->next)
+    {
+	Itdb_Snapshot *snapshot = gl->data;
+	snapshot->live = NULL;
+    }
+    g_list_free (priv->snapshots);
+    priv->snapshots = NULL;
+}
@@ -0,0 +1,242 @@
+/*
+|  Statistics about the time spent and the amount of data handled
+|  while parsing and writing an iTunesDB.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "itdb_private.h"
+#include <string.h>
+#include <time.h>
+
+/* Statistics are off by default. While off, itdb_stats_get() returns
+   NULL and the instrumented code skips all bookkeeping. Read by the
+   threads of itdb_async.c, hence accessed atomically. */
+static volatile gint stats_enabled = FALSE;
+
+static const gchar *phase_names[ITDB_STATS_N_PHASES] = {
+    "read file",
+    "play counts",
+    "parse tracks",
+    "parse playlists",
+    "read OTG playlists",
+    "parse artwork",
+    "update smart playlists",
+    "prepare write",
+    "write thumbnails",
+    "write artwork",
+    "write tracks",
+    "write playlists",
+    "collate",
+    "checksum",
+    "write file",
+    "sync"
+};
+
+
+/**
+ * itdb_stats_set_enabled:
+ * @enabled: TRUE to collect statistics
+ *
+ * Switches the collection of statistics on or off for all
+ * databases. Statistics are off by default; when on, itdb_parse(),
+ * itdb_write() and friends record the time spent in each
+ * #ItdbStatsPhase and the amount of data handled. Use
+ * itdb_get_stats() to retrieve them.
+ **/
+void itdb_stats_set_enabled (gboolean enabled)
+{
+    g_atomic_int_set (&stats_enabled, enabled);
+}
+
+/**
+ * itdb_stats_get_enabled:
+ *
+ * Return value: TRUE if statistics are being collected
+ **/
+gboolean itdb_stats_get_enabled (void)
+{
+    return g_atomic_int_get (&stats_enabled);
+}
+
+/**
+ * itdb_get_stats:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Retrieves the statistics collected for @itdb. Statistics
+ * accumulate over all operations on @itdb until itdb_stats_reset()
+ * is called.
+ *
+ * Return value: the statistics of @itdb (owned by @itdb) or NULL if
+ * none were collected.
+ **/
+const Itdb_Stats *itdb_get_stats (Itdb_iTunesDB *itdb)
+{
+    g_return_val_if_fail (itdb, NULL);
+
+    return itdb_get_private (itdb)->stats;
+}
+
+/**
+ * itdb_stats_reset:
+ * @itdb: an #Itdb_iTunesDB
+ *
+ * Sets all statistics of @itdb to zero, e.g. before timing a single
+ * itdb_write().
+ **/
+void itdb_stats_reset (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+
+    g_return_if_fail (itdb);
+
+    priv = itdb_get_private (itdb);
+    if (priv->stats)
+	memset (priv->stats, 0, sizeof (Itdb_Stats));
+}
+
+/**
+ * itdb_stats_phase_name:
+ * @phase: an #ItdbStatsPhase
+ *
+ * Return value: a short English description of @phase for logging
+ **/
+const gchar *itdb_stats_phase_name (ItdbStatsPhase phase)
+{
+    g_return_val_if_fail (phase < ITDB_STATS_N_PHASES, NULL);
+
+    return phase_names[phase];
+}
+
+/**
+ * itdb_stats_to_string:
+ * @stats: an #Itdb_Stats, e.g. from itdb_get_stats()
+ *
+ * Formats @stats for logging and regression tracking: one
+ * "key value" pair per line, e.g. "parse_tracks.wall_time 0.021403".
+ * Phases that were never entered are skipped. Keys are stable across
+ * releases; new keys may be added.
+ *
+ * Return value: a newly allocated string to be freed with g_free()
+ **/
+gchar *itdb_stats_to_string (const Itdb_Stats *stats)
+{
+    GString *str;
+    gint i;
+
+    g_return_val_if_fail (stats, NULL);
+
+    str = g_string_new (NULL);
+    for (i=0; i<ITDB_STATS_N_PHASES; ++i)
+    {
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar *key;
+
+	if (stats->phases[i].calls == 0)
+	    continue;
+	key = g_strdelimit (g_strdup (phase_names[i]), " ", '_');
+	g_string_append_printf (str, "%s.calls %u\n",
+				key, stats->phases[i].calls);
+	/* independent of the locale's decimal point */
+	g_ascii_formatd (buf, sizeof (buf), "%f",
+			 stats->phases[i].wall_time);
+	g_string_append_printf (str, "%s.wall_time %s\n", key, buf);
+	g_ascii_formatd (buf, sizeof (buf), "%f",
+			 stats->phases[i].cpu_time);
+	g_string_append_printf (str, "%s.cpu_time %s\n", key, buf);
+	g_free (key);
+    }
+    g_string_append_printf (str, "bytes_read %" G_GUINT64_FORMAT "\n",
+			    stats->bytes_read);
+    g_string_append_printf (str, "bytes_written %" G_GUINT64_FORMAT "\n",
+			    stats->bytes_written);
+    g_string_append_printf (str, "tracks %u\n", stats->tracks);
+    g_string_append_printf (str, "playlists %u\n", stats->playlists);
+    g_string_append_printf (str, "members %u\n", stats->members);
+    g_string_append_printf (str, "mhods %u\n", stats->mhods);
+    g_string_append_printf (str, "strings %u\n", stats->strings);
+    return g_string_free (str, FALSE);
+}
+
+/* Returns the statistics of @itdb to update, creating them if
+   needed, or NULL if statistics are switched off. */
+Itdb_Stats *itdb_stats_get (Itdb_iTunesDB *itdb)
+{
+    ItdbPrivate *priv;
+
+    if (!g_atomic_int_get (&stats_enabled) || !itdb)
+	return NULL;
+
+    priv = itdb_get_private (itdb);
+    if (!priv->stats)
+	priv->stats = g_new0 (Itdb_Stats, 1);
+    return priv->stats;
+}
+
+static void stats_now (ItdbStatsTimer *timer)
+{
+    GTimeVal tv;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+#endif
+
+    g_get_current_time (&tv);
+    timer->wall_time = tv.tv_sec + tv.tv_usec / 1e6;
+    /* phases of different databases run on different threads (see
+       itdb_async.c): charge each only with its own thread's time */
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    {
+	timer->cpu_time = ts.tv_sec + ts.tv_nsec / 1e9;
+	return;
+    }
+#endif
+    timer->cpu_time = (gdouble)clock () / CLOCKS_PER_SEC;
+}
+
+/* Start timing a phase. Does nothing if @stats is NULL. */
+void itdb_stats_begin (Itdb_Stats *stats, ItdbStatsTimer *timer)
+{
+    if (!stats)
+	return;
+
+    stats_now (timer);
+}
+
+/* Add the time passed since itdb_stats_begin() was called with
+   @timer to @phase. Does nothing if @stats is NULL. */
+void itdb_stats_end (Itdb_Stats *stats, ItdbStatsPhase phase,
+		     const ItdbStatsTimer *timer)
+{
+    ItdbStatsTimer now;
+
+    if (!stats)
+	return;
+
+    g_return_if_fail (phase < ITDB_STATS_N_PHASES);
+
+    stats_now (&now);
+    stats->phases[phase].wall_time += now.wall_time - timer->wall_time;
+    stats->phases[phase].cpu_time += now.cpu_time - timer->cpu_time;
+    ++stats->phases[phase].calls;
+}
@@ -68,8 +68,9 @@ Itdb_Track *itdb_track_new (void)
     return track;
 }
 
-/* Attempt to set some of the unknowns to reasonable defaults */
-static void itdb_track_set_defaults (Itdb_Track *tr)
+/* Attempt to set some of the unknowns to reasonable defaults. Also
+   used by itdb_batch_commit(). */
+void itdb_track_set_defaults (Itdb_Track *tr)
 {
     auto gboolean haystack (gchar *filetype, gchar **desclist);
     gboolean haystack (gchar *filetype, gchar **desclist)
@@ -209,6 +210,27 @@ static void itdb_track_set_defaults (Itdb_Track *tr)
     }
     if (tr->dbid2 == 0)  tr->dbid2 = tr->dbid;
 }
+
+/* Set a random ID for @tr that is not in @dbids (a set of dbid
+   pointers, see itdb_dbid_hash()) and add it to @dbids. Lets callers
+   adding many tracks check uniqueness against a hash table instead of
+   having itdb_track_set_defaults() walk all tracks for each of them. */
+void itdb_track_set_unique_dbid (Itdb_Track *tr, GHashTable *dbids)
+{
+    guint64 id;
+
+    g_return_if_fail (tr);
+    g_return_if_fail (dbids);
+
+    do
+    {
+	id = ((guint64)g_random_int () << 32) |
+	    ((guint64)g_random_int ());
+    } while ((id == 0) || g_hash_table_lookup (dbids, &id));
+    tr->dbid = id;
+    tr->dbid2 = id;
+    g_hash_table_insert (dbids, &tr->dbid, &tr->dbid);
+}
     
 
 
@@ -234,6 +256,7 @@ void itdb_track_add (Itdb_iTunesDB *itdb, Itdb_Track *track, gint32 pos)
     itdb_track_set_defaults (track);
 
     itdb->tracks = g_list_insert (itdb->tracks, track, pos);
+    itdb_query_track_added (itdb, track);
 }
 
 /**
@@ -298,8 +321,10 @@ void itdb_track_remove (Itdb_Track *track)
     itdb = track->itdb;
     g_return_if_fail (itdb);
 
+    itdb_query_track_removed (itdb, track);
     itdb->tracks = g_list_remove (itdb->tracks, track);
-    itdb_track_free (track);
+    if (!itdb_snapshots_track_release (track))
+	itdb_track_free (track);
 }
 
 /**
@@ -319,10 +344,49 @@ void itdb_track_unlink (Itdb_Track *track)
     itdb = track->itdb;
     g_return_if_fail (itdb);
 
+    /* the caller keeps @track and may change it */
+    itdb_snapshots_track_write (track);
+    itdb_query_track_removed (itdb, track);
     itdb->tracks = g_list_remove (itdb->tracks, track);
     track->itdb = NULL;
 }
 
+/**
+ * itdb_track_changed:
+ * @track: an #Itdb_Track
+ *
+ * Tells libgpod that fields of @track were changed directly. Call
+ * this after changing a field used by itdb_query_run() (artist,
+ * album, genre, rating, playcount, ...) so that the query indexes
+ * reflect the new values. Does nothing if @track isn't part of an
+ * #Itdb_iTunesDB.
+ **/
+void itdb_track_changed (Itdb_Track *track)
+{
+    g_return_if_fail (track);
+
+    if (!track->itdb)
+	return;
+    itdb_query_track_removed (track->itdb, track);
+    itdb_query_track_added (track->itdb, track);
+}
+
+/**
+ * itdb_track_prepare_change:
+ * @track: an #Itdb_Track
+ *
+ * Tells libgpod that fields of @track are about to be changed
+ * directly. If a snapshot taken with itdb_snapshot_new() still shares
+ * @track, the snapshot gets its own copy so that it keeps the old
+ * values. Does nothing if no snapshot of @track's database exists.
+ **/
+void itdb_track_prepare_change (Itdb_Track *track)
+{
+    g_return_if_fail (track);
+
+    itdb_snapshots_track_write (track);
+}
+
 /**
  * itdb_track_duplicate:
  * @tr: an #Itdb_Track
@@ -431,6 +495,7 @@ static gboolean itdb_track_set_thumbnails_internal (Itdb_Track *track,
 	formats = itdb_device_get_artwork_formats (track->itdb->device);
     }
 
+    itdb_snapshots_track_write (track);
     itdb_artwork_remove_thumbnails (track->artwork);
 
     for (thumbtype=thumbtypes; *thumbtype!=-1; ++thumbtype)
@@ -566,6 +631,7 @@ gboolean itdb_track_set_thumbnails_from_pixbuf (Itdb_Track *track,
 void itdb_track_remove_thumbnails (Itdb_Track *track)
 {
     g_return_if_fail (track);
+    itdb_snapshots_track_write (track);
     itdb_artwork_remove_thumbnails (track->artwork);
     track->artwork_size = 0;
     track->artwork_count = 0;
@@ -674,4 +740,17 @@ Itdb_Track *itdb_track_id_tree_by_id (GTree *idtree, guint32 id)
     return (Itdb_Track *)g_tree_lookup (idtree, &id);
 }
 
+/* GHashFunc and GEqualFunc for tables keyed by a pointer to a dbid
+   (or another guint64 like a playlist id) */
+guint itdb_dbid_hash (gconstpointer v)
+{
+    guint64 id = *(const guint64 *)v;
+    return (guint)(id ^ (id >> 32));
+}
+
+gboolean itdb_dbid_equal (gconstpointer v1, gconstpointer v2)
+{
+    return *(const guint64 *)v1 == *(const guint64 *)v2;
+}
+
 
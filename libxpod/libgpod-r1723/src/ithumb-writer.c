@@ -29,12 +29,8 @@
 #include <config.h>
 #include "itdb.h"
 #include "db-image-parser.h"
-
-#ifdef HAVE_GDKPIXBUF
-
 #include "itdb_private.h"
 #include "itdb_endianness.h"
-#include "pixmaps.h"
 
 #include <errno.h>
 #include <locale.h>
@@ -44,6 +40,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#if HAVE_GDKPIXBUF
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#endif
 
 
 /* Maximum size for .ithmb files. Reduced from 500 MB to 256 MB after
@@ -61,12 +60,14 @@ struct _iThumbWriter {
 	const Itdb_ArtworkFormat *img_info;
         DbType db_type;
         guint byte_order;
+	guint64 bytes_written;
+	GList *files;   /* files appended to or changed in place */
 };
 typedef struct _iThumbWriter iThumbWriter;
 
 
 static guint16 *
-pack_RGB_565 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
+pack_RGB_565 (const Itdb_Image *image, const Itdb_ArtworkFormat *img_info,
 	      gint horizontal_padding, gint vertical_padding)
 {
 	guchar *pixels;
@@ -79,10 +80,11 @@ pack_RGB_565 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
 	gint h;
 	gint byte_order;
 
-	g_object_get (G_OBJECT (pixbuf), 
-		      "rowstride", &row_stride, "n-channels", &channels,
-		      "height", &height, "width", &width,
-		      "pixels", &pixels, NULL);
+	row_stride = image->rowstride;
+	channels = image->n_channels;
+	height = image->height;
+	width = image->width;
+	pixels = image->pixels;
 	g_return_val_if_fail ((width <= img_info->width) && (height <= img_info->height), NULL);
 	/* dst_width and dst_height come from a width/height database 
 	 * hardcoded in libipoddevice code, so dst_width * dst_height * 2 can't
@@ -117,7 +119,7 @@ pack_RGB_565 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
 }
 
 static guint16 *
-pack_RGB_555 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
+pack_RGB_555 (const Itdb_Image *image, const Itdb_ArtworkFormat *img_info,
 	      gint horizontal_padding, gint vertical_padding)
 {
 	guchar *pixels;
@@ -130,10 +132,11 @@ pack_RGB_555 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
 	gint h;
 	gint byte_order;
 
-	g_object_get (G_OBJECT (pixbuf), 
-		      "rowstride", &row_stride, "n-channels", &channels,
-		      "height", &height, "width", &width,
-		      "pixels", &pixels, NULL);
+	row_stride = image->rowstride;
+	channels = image->n_channels;
+	height = image->height;
+	width = image->width;
+	pixels = image->pixels;
 	g_return_val_if_fail ((width <= img_info->width) && (height <= img_info->height), NULL);
 	/* dst_width and dst_height come from a width/height database 
 	 * hardcoded in libipoddevice code, so dst_width * dst_height * 2 can't
@@ -211,13 +214,13 @@ static guint16 *derange_pixels (guint16 *pixels_s, guint16 *pixels_d,
 }
 
 static guint16 *
-pack_rec_RGB_555 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
+pack_rec_RGB_555 (const Itdb_Image *image, const Itdb_ArtworkFormat *img_info,
 		  gint horizontal_padding, gint vertical_padding)
 {
     guint16 *pixels;
     guint16 *deranged_pixels = NULL;
 
-    pixels = pack_RGB_555 (pixbuf, img_info,
+    pixels = pack_RGB_555 (image, img_info,
 			   horizontal_padding, vertical_padding);
 
     if (pixels)
@@ -235,14 +238,13 @@ pack_rec_RGB_555 (GdkPixbuf *pixbuf, const Itdb_ArtworkFormat *img_info,
 /* pack_UYVY() is adapted from imgconvert.c from the GPixPod project
  * (www.gpixpod.org) */
 static guchar *
-pack_UYVY (GdkPixbuf *orig_pixbuf, const Itdb_ArtworkFormat *img_info,
+pack_UYVY (const Itdb_Image *orig_image, const Itdb_ArtworkFormat *img_info,
 	   gint horizontal_padding, gint vertical_padding)
 {
-    GdkPixbuf *pixbuf;
+    Itdb_Image *image;
     guchar *pixels, *yuvdata;
     gint width;
     gint height;
-    gint orig_height, orig_width;
     gint x = 0;
     gint z = 0;
     gint z2 = 0;
@@ -258,25 +260,27 @@ pack_UYVY (GdkPixbuf *orig_pixbuf, const Itdb_ArtworkFormat *img_info,
     width = img_info->width;
     height = img_info->height;
 
-    g_object_get (G_OBJECT (orig_pixbuf), 
-		  "height", &orig_height, "width", &orig_width, NULL);
+    g_return_val_if_fail ((orig_image->width + horizontal_padding <= width) &&
+			  (orig_image->height + vertical_padding <= height), NULL);
 
-    /* copy into new pixmap with padding applied */
-    pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
-			     gdk_pixbuf_get_has_alpha (orig_pixbuf),
-			     8,
-			     width, height);
-    gdk_pixbuf_copy_area (orig_pixbuf, 0, 0, orig_width, orig_height,
-			  pixbuf, horizontal_padding, vertical_padding);
+    /* copy into new image with padding applied */
+    image = itdb_image_new (width, height, orig_image->n_channels);
+    for (h = 0; h < orig_image->height; h++)
+    {
+	memcpy (image->pixels + (h+vertical_padding)*image->rowstride
+		              + horizontal_padding*image->n_channels,
+		orig_image->pixels + h*orig_image->rowstride,
+		orig_image->width*orig_image->n_channels);
+    }
+    h = 0;
 
-    g_object_get (G_OBJECT (pixbuf), 
-		  "rowstride", &rowstride,
-		  "pixels", &pixels, NULL);
+    rowstride = image->rowstride;
+    pixels = image->pixels;
 
     yuvsize = width*2*height;
     yuvdata = g_malloc (yuvsize);
     halfyuv = yuvsize/2;
-    if (gdk_pixbuf_get_has_alpha(pixbuf))
+    if (image->n_channels == 4)
     {
 	alphabit = 1;
 	rgbpx = 4;
@@ -332,7 +336,7 @@ pack_UYVY (GdkPixbuf *orig_pixbuf, const Itdb_ArtworkFormat *img_info,
 	x += exc;
 	h++;
     }
-    g_object_unref (pixbuf);
+    itdb_image_free (image);
     return yuvdata;
 }
 
@@ -358,6 +362,7 @@ ipod_image_get_ithmb_filename (const char *mount_point, gint correlation_id, gin
 			}
 			dir = g_build_filename (photos_dir, "Thumbs", NULL);
 			mkdir (dir, 0777);
+			itdb_resolve_path_invalidate (dir);
 			g_free (dir);
 			g_free (photos_dir);
 
@@ -382,6 +387,7 @@ ipod_image_get_ithmb_filename (const char *mount_point, gint correlation_id, gin
 		}
 		dir = g_build_filename (control_dir, "Artwork", NULL);
 		mkdir (dir, 0777);
+		itdb_resolve_path_invalidate (dir);
 		g_free (dir);
 		g_free (control_dir);
 
@@ -406,6 +412,7 @@ ipod_image_get_ithmb_filename (const char *mount_point, gint correlation_id, gin
 /*	printf ("%s %s\n", buf, filename);*/
 
 	g_free (buf);
+	g_free (artwork_dir);
 
 	return filename;
 }
@@ -416,9 +423,9 @@ static gboolean
 ithumb_writer_write_thumbnail (iThumbWriter *writer, 
 			       Itdb_Thumb *thumb)
 {
-    GdkPixbuf *pixbuf = NULL;
+    Itdb_Image *image = NULL;
     void *pixels = NULL;
-    gint width, height; /* must be gint -- see comment below */
+    gint width, height;
 
     g_return_val_if_fail (writer, FALSE);
     g_return_val_if_fail (writer->img_info, FALSE);
@@ -445,66 +452,39 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
 
     if (thumb->filename)
     {   /* read image from filename */
-	pixbuf = gdk_pixbuf_new_from_file_at_size (thumb->filename, 
-						   width, height,
-						   NULL);
+	image = itdb_image_load_file_at_size (thumb->filename,
+					      width, height);
 
 	g_free (thumb->filename);
 	thumb->filename = NULL;
     }
     else if (thumb->image_data)
     {   /* image data is stored in image_data and image_data_len */
-	GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
-	g_return_val_if_fail (loader, FALSE);
-	gdk_pixbuf_loader_set_size (loader,
-				    width, height);
-	gdk_pixbuf_loader_write (loader,
-				 thumb->image_data,
-				 thumb->image_data_len,
-				 NULL);
-	gdk_pixbuf_loader_close (loader, NULL);
-	pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
-	if (pixbuf)
-	    g_object_ref (pixbuf);
-	g_object_unref (loader);
+	image = itdb_image_load_data_at_size (thumb->image_data,
+					      thumb->image_data_len,
+					      width, height);
 
 	g_free (thumb->image_data);
 	thumb->image_data = NULL;
 	thumb->image_data_len = 0;
     }
+#ifdef HAVE_GDKPIXBUF
     else if (thumb->pixbuf)
     {
-        pixbuf = gdk_pixbuf_scale_simple (GDK_PIXBUF(thumb->pixbuf),
-                                          width, height,
-                                          GDK_INTERP_BILINEAR);
+        image = itdb_image_load_pixbuf_at_size (thumb->pixbuf,
+                                                width, height);
         g_object_unref (thumb->pixbuf);
         thumb->pixbuf = NULL;
     }
+#endif
 
-    if (pixbuf == NULL)
+    if (image == NULL)
     {
 	/* This is quite bad... if we just return FALSE the ArtworkDB
 	   gets messed up. */
-	pixbuf = gdk_pixbuf_from_pixdata (&questionmark_pixdata, FALSE, NULL);
-
-	if (pixbuf)
-	{
-	    GdkPixbuf *pixbuf2;
-	    pixbuf2 = gdk_pixbuf_scale_simple (pixbuf,
-					       writer->img_info->width,
-					       writer->img_info->height,
-					       GDK_INTERP_BILINEAR);
-	    g_object_unref (pixbuf);
-	    pixbuf = pixbuf2;
-	}
-	else
-	{
-	    /* Somethin went wrong. let's insert a red thumbnail */
-	    pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
-				     writer->img_info->width,
-				     writer->img_info->height);
-	    gdk_pixbuf_fill (pixbuf, 0xff000000);
-	}
+	image = itdb_image_new_questionmark (writer->img_info->width,
+					     writer->img_info->height);
+	g_return_val_if_fail (image, FALSE);
 	/* avoid rotation */
 	thumb->rotation = 0;
     }
@@ -512,20 +492,13 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
     /* Rotate if necessary */
     if (thumb->rotation != 0)
     {
-	GdkPixbuf *new_pixbuf = gdk_pixbuf_rotate_simple (pixbuf, thumb->rotation);
-	g_object_unref (pixbuf);
-	pixbuf = new_pixbuf;
+	image = itdb_image_rotate_with_backend (image, thumb->rotation);
 	/* Clean up */
 	thumb->rotation = 0;
     }
 
-    /* !! cannot write directly to &thumb->width/height because
-       g_object_get() returns a gint, but thumb->width/height are
-       gint16 !! */
-    g_object_get (G_OBJECT (pixbuf), 
-		  "width", &width,
-		  "height", &height,
-		  NULL);
+    width = image->width;
+    height = image->height;
 
     switch (thumb->type)
     {
@@ -583,7 +556,7 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
 	   screen photo thumbnail) */
     case THUMB_FORMAT_RGB565_LE:
     case THUMB_FORMAT_RGB565_BE:
-	pixels = pack_RGB_565 (pixbuf, writer->img_info,
+	pixels = pack_RGB_565 (image, writer->img_info,
 			       thumb->horizontal_padding,
 			       thumb->vertical_padding);
 	break;
@@ -594,7 +567,7 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
 	   screen photo thumbnail) */
     case THUMB_FORMAT_RGB555_LE:
     case THUMB_FORMAT_RGB555_BE:
-	pixels = pack_RGB_555 (pixbuf, writer->img_info,
+	pixels = pack_RGB_555 (image, writer->img_info,
 			       thumb->horizontal_padding,
 			       thumb->vertical_padding);
 	break;
@@ -605,7 +578,7 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
 	   screen photo thumbnail) */
     case THUMB_FORMAT_REC_RGB555_LE:
     case THUMB_FORMAT_REC_RGB555_BE:
-	pixels = pack_rec_RGB_555 (pixbuf, writer->img_info,
+	pixels = pack_rec_RGB_555 (image, writer->img_info,
 				   thumb->horizontal_padding,
 				   thumb->vertical_padding);
 	break;
@@ -614,14 +587,14 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
 	break;
     case THUMB_FORMAT_UYVY_BE:
     case THUMB_FORMAT_UYVY_LE:
-	pixels = pack_UYVY (pixbuf, writer->img_info,
+	pixels = pack_UYVY (image, writer->img_info,
 			    thumb->horizontal_padding,
 			    thumb->vertical_padding);
 	break;
     }
 
 
-    g_object_unref (G_OBJECT (pixbuf));
+    itdb_image_free (image);
 
     if (pixels == NULL)
     {
@@ -634,6 +607,7 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
     }
     g_free (pixels);
     writer->cur_offset += thumb->size;
+    writer->bytes_written += thumb->size;
 
     if (writer->img_info->padding != 0)
     {
@@ -650,6 +624,7 @@ ithumb_writer_write_thumbnail (iThumbWriter *writer,
 	    }
 	    g_free (pad_bytes);
 	    writer->cur_offset += padding;
+	    writer->bytes_written += padding;
 	}
     }
     return TRUE;
@@ -681,6 +656,7 @@ ithumb_writer_update (iThumbWriter *writer)
 	    return FALSE;
 	}
 	writer->f = fopen (writer->filename, "ab");
+	itdb_resolve_path_invalidate (writer->filename);
 	if (writer->f == NULL)
 	{
 	    g_print ("Error opening %s: %s\n", writer->filename, strerror (errno));
@@ -711,8 +687,14 @@ write_thumbnail (gpointer _writer, gpointer _artwork)
 	if (thumb && (thumb->size == 0))
 	{
 	    /* check if new thumbnail file has to be started */
-	    if (ithumb_writer_update (writer))
-		ithumb_writer_write_thumbnail (writer, thumb);
+	    if (ithumb_writer_update (writer) &&
+		ithumb_writer_write_thumbnail (writer, thumb))
+	    {   /* remember the file for itdb_flush() */
+		if (!writer->files ||
+		    (strcmp (writer->files->data, writer->filename) != 0))
+		    writer->files = g_list_prepend (writer->files,
+						    g_strdup (writer->filename));
+	    }
 	}
 }
 
@@ -720,6 +702,8 @@ write_thumbnail (gpointer _writer, gpointer _artwork)
 static void
 ithumb_writer_free (iThumbWriter *writer)
 {
+	GList *gl;
+
 	g_return_if_fail (writer != NULL);
 	if (writer->f)
 	{
@@ -727,8 +711,13 @@ ithumb_writer_free (iThumbWriter *writer)
 	    if (writer->filename && (writer->cur_offset == 0))
 	    {   /* Remove empty file */
 		unlink (writer->filename);
+		itdb_resolve_path_invalidate (writer->filename);
 	    }
 	}
+	for (gl = writer->files; gl != NULL; gl = gl->next) {
+		g_free (gl->data);
+	}
+	g_list_free (writer->files);
 	g_free (writer->filename);
 	g_free (writer->mountpoint);
 	g_free (writer);
@@ -761,24 +750,75 @@ ithumb_writer_new (const char *mount_point,
 	return writer;
 }
 
-gint offset_sort (gconstpointer a, gconstpointer b);
-gint offset_sort (gconstpointer a, gconstpointer b)
+/* Upper limit for the amount of data moved with a single read/write
+   pair when compacting .ithmb files */
+#define ITHUMB_COPY_CHUNK (1024L*1024L)
+
+static gint offset_sort (gconstpointer a, gconstpointer b)
+{
+    guint32 offset_a = ((Itdb_Thumb *)a)->offset;
+    guint32 offset_b = ((Itdb_Thumb *)b)->offset;
+
+    if (offset_a < offset_b) return -1;
+    if (offset_a > offset_b) return 1;
+    return 0;
+}
+
+/* Copy @len bytes inside the file @fd from offset @from to offset
+   @to, using @buf (at least @len bytes) as intermediate storage */
+static gboolean ithumb_copy_slots (gint fd, guint32 from, guint32 to,
+				   guint32 len, void *buf)
 {
-    return (-(((Itdb_Thumb *)a)->offset - ((Itdb_Thumb *)b)->offset));
+    guint32 done;
+
+    for (done=0; done<len; )
+    {
+	ssize_t result = pread (fd, (gchar *)buf+done, len-done, from+done);
+	if (result == -1)
+	{
+	    if (errno == EINTR) continue;
+	    return FALSE;
+	}
+	if (result == 0)
+	    return FALSE;
+	done += result;
+    }
+    for (done=0; done<len; )
+    {
+	ssize_t result = pwrite (fd, (gchar *)buf+done, len-done, to+done);
+	if (result == -1)
+	{
+	    if (errno == EINTR) continue;
+	    return FALSE;
+	}
+	done += result;
+    }
+    return TRUE;
 }
 
+/* user data of ithumb_rearrange_thumbnail_file() */
+typedef struct
+{
+    gboolean result;
+    GList *modified;   /* files changed in place */
+} RearrangeState;
+
 static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
 						 gpointer _thumbs,
 						 gpointer _user_data)
 {
     const gchar *filename = _key;
     GList *thumbs = _thumbs;
-    gboolean *result = _user_data;
+    RearrangeState *state = _user_data;
+    gboolean *result = &state->result;
     gint fd = -1;
     guint32 size = 0;
     GList *gl;
     struct stat statbuf;
-    guint32 offset;
+    guint32 offset, new_length, slots_used;
+    GArray *holes = NULL;
+    GPtrArray *sources = NULL;
+    guint i, run, max_run;
     void *buf = NULL;
 
 /*     printf ("%s: %d\n", filename, g_list_length (thumbs)); */
@@ -789,11 +829,12 @@ static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
 
     if (thumbs == NULL)
     {   /* no thumbnails for this file --> remove altogether */
+	itdb_resolve_path_invalidate (filename);
 	if (unlink (filename) == -1)
 	{
 	    *result = FALSE;
-	    goto out;
 	}
+	goto out;
     }
 
     /* check if all thumbnails have the same size */
@@ -830,6 +871,65 @@ static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
 	goto out;
     }
 
+    /* Sort the list of thumbs in order of img->offset. Several
+       thumbs may share the same slot. */
+    thumbs = g_list_sort (thumbs, offset_sort);
+
+    /* Count the slots still in use and make sure all of them lie
+       inside the file */
+    slots_used = 0;
+    for (gl=thumbs; gl; gl=gl->next)
+    {
+	Itdb_Thumb *thumb = gl->data;
+
+	if ((thumb->offset % size != 0) ||
+	    (thumb->offset + size > statbuf.st_size))
+	{
+	    *result = FALSE;
+	    goto out;
+	}
+	if (!gl->prev ||
+	    (((Itdb_Thumb *)gl->prev->data)->offset != thumb->offset))
+	    ++slots_used;
+    }
+    new_length = slots_used * size;
+
+    /* Plan the compaction: every unused slot below @new_length (a
+       hole) is filled with a slot in use above @new_length (a
+       source). Both lists are in ascending order so that runs of
+       adjacent slots can be moved with a single read/write. Slots
+       below @new_length that are in use are not touched at all. */
+    holes = g_array_new (FALSE, FALSE, sizeof (guint32));
+    sources = g_ptr_array_new ();
+    gl = thumbs;
+    for (offset=0; offset<new_length; offset+=size)
+    {
+	if (gl && (((Itdb_Thumb *)gl->data)->offset == offset))
+	{
+	    while (gl && (((Itdb_Thumb *)gl->data)->offset == offset))
+		gl = gl->next;
+	}
+	else
+	{
+	    g_array_append_val (holes, offset);
+	}
+    }
+    for (; gl; gl=gl->next)
+    {
+	if (!gl->prev ||
+	    (((Itdb_Thumb *)gl->prev->data)->offset !=
+	     ((Itdb_Thumb *)gl->data)->offset))
+	    g_ptr_array_add (sources, gl);
+    }
+    if (holes->len != sources->len)
+    {
+	*result = FALSE;
+	goto out;
+    }
+
+    if (holes->len == 0 && new_length == statbuf.st_size)
+	goto out;   /* nothing to do */
+
     fd = open (filename, O_RDWR, 0);
     if (fd == -1)
     {
@@ -841,100 +941,62 @@ static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
      * libipoddevice, or a guint32 read from an iPod file, so no overflow
      * can occur here
      */
-    buf = g_malloc (size);
-
-    /* Sort the list of thumbs in reverse order of img->offset */
-    thumbs = g_list_sort (thumbs, offset_sort);
-
-    gl = g_list_last (thumbs);
+    max_run = MAX (1, ITHUMB_COPY_CHUNK / size);
+    if (holes->len > 0)
+	buf = g_malloc (MIN (max_run, holes->len) * size);
 
-    /* check each thumbnail slot */
-    for (offset=0; gl && (offset<statbuf.st_size); offset+=size)
+    for (i=0; i<holes->len; i+=run)
     {
-	Itdb_Thumb *thumb = gl->data;
-	g_return_val_if_fail (thumb, FALSE);
-
-	/* Try to find a thumbnail that uses this slot */
-	while ((gl != NULL) && (thumb->offset < offset))
+	guint32 to = g_array_index (holes, guint32, i);
+	GList *src_gl = g_ptr_array_index (sources, i);
+	guint32 from = ((Itdb_Thumb *)src_gl->data)->offset;
+	guint j;
+
+	/* extend the run as long as both holes and sources are
+	   adjacent */
+	for (run=1; (i+run < holes->len) && (run < max_run); ++run)
 	{
-	    gl = gl->prev;
-	    if (gl)
-		thumb = gl->data;
-	    g_return_val_if_fail (thumb, FALSE);
+	    GList *next_gl = g_ptr_array_index (sources, i+run);
+	    if ((g_array_index (holes, guint32, i+run) != to + run*size) ||
+		(((Itdb_Thumb *)next_gl->data)->offset != from + run*size))
+		break;
 	}
 
-	if (!gl)
-	    break;  /* offset now indicates new length of file */
-
-	if (thumb->offset > offset)
+	if (!ithumb_copy_slots (fd, from, to, run*size, buf))
 	{
-	    /* did not find a thumbnail with matching offset -> copy
-	       data from last slot (== first element) */
-	    GList *first_gl = g_list_first (thumbs);
-	    Itdb_Thumb *first_thumb = first_gl->data;
-	    guint32 first_offset;
-
-	    g_return_val_if_fail (first_thumb, FALSE);
-	    first_offset = first_thumb->offset;
-
-	    /* actually copy the data */
-	    if (lseek (fd, first_offset, SEEK_SET) != first_offset)
-	    {
-		*result = FALSE;
-		goto out;
-	    }
-	    if (read (fd, buf, size) != size)
-	    {
-		*result = FALSE;
-		goto out;
-	    }
-	    if (lseek (fd, offset, SEEK_SET) != offset)
-	    {
-		*result = FALSE;
-		goto out;
-	    }
-	    if (write (fd, buf, size) != size)
-	    {
-		*result = FALSE;
-		goto out;
-	    }
+	    *result = FALSE;
+	    goto out;
+	}
 
-	    /* Adjust offset of all thumbnails whose offset is
-	       first_offset. Since the list is sorted, they are all at
-	       the beginning of the list. */
-	    while (first_thumb->offset == first_offset)
+	/* Adjust offset of all thumbnails in the moved slots */
+	for (j=0; j<run; ++j)
+	{
+	    guint32 old_offset = from + j*size;
+	    for (gl=g_ptr_array_index (sources, i+j);
+		 gl && (((Itdb_Thumb *)gl->data)->offset == old_offset);
+		 gl=gl->next)
 	    {
-		first_thumb->offset = offset;
-		/* There's a possibility that gl is the first
-		   element. In that case don't attempt to move it (it
-		   wouldn't work as intended because we access
-		   gl->next after removing it from the list) */
-		if (gl != first_gl)
-		{
-		    thumbs = g_list_delete_link (thumbs, first_gl);
-		    /* Insert /behind/ gl */
-		    thumbs = g_list_insert_before (thumbs,
-						   gl->next, first_thumb);
-		    first_gl = g_list_first (thumbs);
-		    first_thumb = first_gl->data;
-		    g_return_val_if_fail (first_thumb, FALSE);
-		}
+		((Itdb_Thumb *)gl->data)->offset = to + j*size;
 	    }
 	}
     }
-    /* offset corresponds to the new length of the file */
-    if (offset > 0)
+
+    /* new_length corresponds to the new length of the file */
+    if (new_length > 0)
     {   /* Truncate */
-	if (ftruncate (fd, offset) == -1)
+	if (ftruncate (fd, new_length) == -1)
 	{
 	    *result = FALSE;
 	    goto out;
 	}
+	state->modified = g_list_prepend (state->modified,
+					  g_strdup (filename));
     }
     else
     {   /* Remove file altogether */
 	close (fd);
 	fd = -1;
+	itdb_resolve_path_invalidate (filename);
 	if (unlink (filename) == -1)
 	{
 	    *result = FALSE;
@@ -945,6 +1007,8 @@ static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
   out:
     if (fd != -1) close (fd);
     g_free (buf);
+    if (holes) g_array_free (holes, TRUE);
+    if (sources) g_ptr_array_free (sources, TRUE);
     g_list_free (thumbs);
     return TRUE;
 }
@@ -962,18 +1026,24 @@ static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
    It is assumed that all thumbnails have the same data size. If not,
    FALSE is returned.
 
+   The names of the files changed in place are returned in @modified
+   (to be freed by the caller).
+
    If a thumbnail has been removed, a slot in the file is opened. This
    slot is filled by copying data from the end of the file and
-   adjusting the corresponding Itdb_Image offset pointer. When all
-   slots are filled, the file is truncated to the new length.
+   adjusting the corresponding Itdb_Image offset pointer. Only slots
+   beyond the new end of file are moved, so removing a few thumbnails
+   only copies as many slots as were removed. When all slots are
+   filled, the file is truncated to the new length.
 */
 static gboolean
 ithmb_rearrange_existing_thumbnails (Itdb_DB *db,
-				     const Itdb_ArtworkFormat *info)
+				     const Itdb_ArtworkFormat *info,
+				     GList **modified)
 {
     GList *gl;
     GHashTable *filenamehash;
-    gboolean result = TRUE;
+    RearrangeState state = { TRUE, NULL };
     GList *thumbs;
     gint i;
     gchar *filename;
@@ -1074,18 +1144,16 @@ ithmb_rearrange_existing_thumbnails (Itdb_DB *db,
        For the same reasons the thumb GList gets free'd in
        ithumb_rearrange_thumbnail_file() */
     g_hash_table_foreach_remove (filenamehash,
-				 ithumb_rearrange_thumbnail_file, &result);
+				 ithumb_rearrange_thumbnail_file, &state);
     g_hash_table_destroy (filenamehash);
 
-    return result;
+    *modified = state.modified;
+    return state.result;
 }
 
-#endif
-
 G_GNUC_INTERNAL int
 itdb_write_ithumb_files (Itdb_DB *db) 
 {
-#ifdef HAVE_GDKPIXBUF
 	GList *writers;
 	GList *it;
 	Itdb_Device *device;
@@ -1109,6 +1177,7 @@ itdb_write_ithumb_files (Itdb_DB *db)
 	writers = NULL;
 	while (format->type != -1) {
 		iThumbWriter *writer;
+		GList *modified = NULL;
 
 		switch (format->type) {
 		case ITDB_THUMB_COVER_XLARGE:
@@ -1121,13 +1190,21 @@ itdb_write_ithumb_files (Itdb_DB *db)
 		case ITDB_THUMB_PHOTO_LARGE:
 		case ITDB_THUMB_PHOTO_FULL_SCREEN:
 		case ITDB_THUMB_PHOTO_TV_SCREEN:
-		        ithmb_rearrange_existing_thumbnails (db, format );
+		        ithmb_rearrange_existing_thumbnails (db, format,
+							     &modified);
 			writer = ithumb_writer_new (mount_point, 
 						    format,
 						    db->db_type, 
 						    device->byte_order);
 			if (writer != NULL) {
+				writer->files = g_list_concat (writer->files,
+							       modified);
 				writers = g_list_prepend (writers, writer);
+			} else {
+				for (it = modified; it != NULL; it = it->next) {
+					g_free (it->data);
+				}
+				g_list_free (modified);
 			}
 			break;
 		}
@@ -1160,12 +1237,24 @@ itdb_write_ithumb_files (Itdb_DB *db)
 	default:
 	        g_return_val_if_reached (-1);
 	}
+
+	if (db->db_type == DB_TYPE_ITUNES) {
+		Itdb_iTunesDB *itdb = db_get_itunesdb (db);
+		Itdb_Stats *stats = itdb_stats_get (itdb);
+		for (it = writers; it != NULL; it = it->next) {
+			iThumbWriter *writer = it->data;
+			GList *gl;
+			if (stats) {
+				stats->bytes_written += writer->bytes_written;
+			}
+			for (gl = writer->files; gl != NULL; gl = gl->next) {
+				itdb_durability_add_file (itdb, gl->data);
+			}
+		}
+	}
 	
 	g_list_foreach (writers, (GFunc)ithumb_writer_free, NULL);
 	g_list_free (writers);
 
 	return 0;
-#else
-    return -1;
-#endif
 }
@@ -35,13 +35,11 @@
 
 #include "pixmaps.h"
 
-#ifdef HAVE_GDKPIXBUF
-
 
 /* Thanks to P.G. Richardson for the image */
 
 /* GdkPixbuf RGB C-Source image dump 1-byte-run-length-encoded */
-G_GNUC_INTERNAL const GdkPixdata questionmark_pixdata = {
+G_GNUC_INTERNAL const ItdbPixdata questionmark_pixdata = {
   0x47646b50, /* Pixbuf magic: 'GdkP' */
   24 + 153345, /* header length + pixel_data length */
   0x2010001, /* pixdata_type */
@@ -4093,6 +4091,3 @@ G_GNUC_INTERNAL const GdkPixdata questionmark_pixdata = {
   "\377\377\377\377\377\376\377\377\377\377\377\376\377\377\377\377\377"
   "\376\377\377\377\377\377\376\377\377\377\377",
 };
-
-
-#endif
@@ -38,13 +38,19 @@
 
 #include "itdb.h"
 
-#ifdef HAVE_GDKPIXBUF
+/* Same layout as GdkPixdata so the image can be used with or without
+   gdk-pixbuf. pixel_data is 1-byte-run-length-encoded RGB. */
+typedef struct
+{
+    guint32 magic;
+    gint32  length;
+    guint32 pixdata_type;
+    guint32 rowstride;
+    guint32 width;
+    guint32 height;
+    guint8 *pixel_data;
+} ItdbPixdata;
 
-#include <gdk-pixbuf/gdk-pixbuf.h>
-#include <gdk-pixbuf/gdk-pixdata.h>
-
-extern G_GNUC_INTERNAL const GdkPixdata questionmark_pixdata;
-
-#endif
+extern G_GNUC_INTERNAL const ItdbPixdata questionmark_pixdata;
 
 #endif
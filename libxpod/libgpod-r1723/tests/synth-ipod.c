@@ -0,0 +1,108 @@
+/*
+|  Creates a synthetic iPod directory tree, see synthdb.c.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include "synthdb.h"
+
+int
+main (int argc, char *argv[])
+{
+    SynthParams params;
+    gint tracks, playlists, playlist_size, smart_playlists;
+    gint string_min, string_max, seed;
+    gchar *model = NULL;
+    GOptionContext *context;
+    GError *error = NULL;
+
+    synth_params_init (&params);
+    tracks = params.tracks;
+    playlists = params.playlists;
+    playlist_size = params.playlist_size;
+    smart_playlists = params.smart_playlists;
+    string_min = params.string_min;
+    string_max = params.string_max;
+    seed = params.seed;
+    {
+	GOptionEntry entries[] = {
+	    { "tracks", 't', 0, G_OPTION_ARG_INT, &tracks,
+	      "Number of tracks", "N" },
+	    { "playlists", 'p', 0, G_OPTION_ARG_INT, &playlists,
+	      "Number of regular playlists", "N" },
+	    { "playlist-size", 's', 0, G_OPTION_ARG_INT, &playlist_size,
+	      "Tracks in each regular playlist", "N" },
+	    { "smart-playlists", 'S', 0, G_OPTION_ARG_INT, &smart_playlists,
+	      "Number of smart playlists", "N" },
+	    { "string-min", 0, 0, G_OPTION_ARG_INT, &string_min,
+	      "Minimum length of strings", "N" },
+	    { "string-max", 0, 0, G_OPTION_ARG_INT, &string_max,
+	      "Maximum length of strings", "N" },
+	    { "non-ascii", 'n', 0, G_OPTION_ARG_DOUBLE, &params.non_ascii,
+	      "Fraction of strings with non-ASCII characters", "F" },
+	    { "artwork", 'a', 0, G_OPTION_ARG_DOUBLE, &params.artwork,
+	      "Fraction of tracks with cover art", "F" },
+	    { "playcounts", 'c', 0, G_OPTION_ARG_NONE, &params.playcounts,
+	      "Write a Play Counts file", NULL },
+	    { "model", 'm', 0, G_OPTION_ARG_STRING, &model,
+	      "Model number, determines the artwork formats (MA450)", "MODEL" },
+	    { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+	      "Seed of the random numbers", "N" },
+	    { NULL }
+	};
+
+	context = g_option_context_new ("<mountpoint> - create a synthetic iPod");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error) ||
+	    (argc != 2))
+	{
+	    fprintf (stderr, "%s\nusage: %s [OPTION...] <mountpoint>\n",
+		     error ? error->message : "", argv[0]);
+	    return 1;
+	}
+	g_option_context_free (context);
+    }
+
+    if ((tracks < 0) || (playlists < 0) || (playlist_size < 0) ||
+	(smart_playlists < 0) || (string_min < 0) || (string_max < 0))
+    {
+	fprintf (stderr, "counts and lengths must not be negative\n");
+	return 1;
+    }
+    params.tracks = tracks;
+    params.playlists = playlists;
+    params.playlist_size = playlist_size;
+    params.smart_playlists = smart_playlists;
+    params.string_min = string_min;
+    params.string_max = string_max;
+    params.seed = seed;
+    if (model)
+	params.model = model;
+
+    if (!synth_ipod_create (argv[1], &params, &error))
+    {
+	fprintf (stderr, "cannot create %s: %s\n", argv[1],
+		 error ? error->message : "unknown error");
+	return 1;
+    }
+
+    g_free (model);
+    return 0;
+}
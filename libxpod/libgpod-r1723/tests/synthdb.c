@@ -0,0 +1,472 @@
+/*
+|  Generator for synthetic iPod directory trees (iTunesDB, ArtworkDB,
+|  Play Counts) used by the benchmark and test programs.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <string.h>
+#include <time.h>
+#include "synthdb.h"
+
+/* edge length of the cover art images handed to libgpod -- small, the
+   thumbnails are scaled up when they are written */
+#define SYNTH_ARTWORK_SIZE 32
+/* number of Fxx music directories the tracks are spread over */
+#define SYNTH_MUSIC_DIRS 20
+/* seconds between 1904-01-01 and 1970-01-01 */
+#define SYNTH_MAC_EPOCH 2082844800
+
+static const gchar *synth_letters = "abcdefghijklmnopqrstuvwxyz";
+static const gchar *synth_non_ascii[] = {
+    "\xc3\xa9", "\xc3\xbc", "\xc3\x9f", "\xc3\xb8", "\xc3\xa7",  /* é ü ß ø ç */
+    "\xd0\x96", "\xce\xbb",                                      /* Ж λ       */
+    "\xe6\x97\xa5", "\xe6\x9c\xac", "\xe8\xaa\x9e"               /* 日 本 語  */
+};
+static const gchar *synth_genres[] = {
+    "Rock", "Pop", "Jazz", "Classical", "Electronic", "Hip-Hop",
+    "Folk", "Blues", "Metal", "Soundtrack", "Podcast", "Audiobook"
+};
+
+/**
+ * synth_params_init:
+ * @params: parameters to initialize
+ *
+ * Sets @params to a database of 1000 tracks in 10 playlists of 100
+ * tracks and 5 smart playlists, strings of 4 to 32 characters of which
+ * 10% contain non-ASCII characters, no cover art, no Play Counts file,
+ * written for a 5th generation iPod (MA450).
+ **/
+void synth_params_init (SynthParams *params)
+{
+    g_return_if_fail (params);
+
+    memset (params, 0, sizeof (SynthParams));
+    params->tracks = 1000;
+    params->playlists = 10;
+    params->playlist_size = 100;
+    params->smart_playlists = 5;
+    params->string_min = 4;
+    params->string_max = 32;
+    params->non_ascii = 0.1;
+    params->artwork = 0.0;
+    params->playcounts = FALSE;
+    params->model = "MA450";
+    params->seed = 1;
+}
+
+/* A string of words made of random letters (and, with the probability
+   params->non_ascii, some non-ASCII characters) */
+static gchar *synth_string (GRand *rand, const SynthParams *params)
+{
+    GString *str;
+    guint32 len, i;
+    gboolean non_ascii;
+
+    len = g_rand_int_range (rand, params->string_min,
+			    MAX (params->string_min, params->string_max) + 1);
+    non_ascii = (g_rand_double (rand) < params->non_ascii);
+
+    str = g_string_sized_new (len * 2);
+    for (i=0; i<len; ++i)
+    {
+	if ((i > 0) && (i < len-1) && (str->str[str->len-1] != ' ') &&
+	    (g_rand_int_range (rand, 0, 6) == 0))
+	    g_string_append_c (str, ' ');
+	else if (non_ascii && (g_rand_int_range (rand, 0, 4) == 0))
+	    g_string_append (str, synth_non_ascii[
+		g_rand_int_range (rand, 0, G_N_ELEMENTS (synth_non_ascii))]);
+	else if (i == 0)
+	    g_string_append_c (str, g_ascii_toupper (
+		synth_letters[g_rand_int_range (rand, 0, 26)]));
+	else
+	    g_string_append_c (str,
+			       synth_letters[g_rand_int_range (rand, 0, 26)]);
+    }
+    return g_string_free (str, FALSE);
+}
+
+static void synth_put32be (guchar *p, guint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static guint32 synth_crc32 (const guchar *data, gsize len)
+{
+    static guint32 table[256];
+    static gboolean table_done = FALSE;
+    guint32 crc = 0xffffffff;
+    gsize i;
+
+    if (!table_done)
+    {
+	guint32 n, k, c;
+	for (n=0; n<256; ++n)
+	{
+	    c = n;
+	    for (k=0; k<8; ++k)
+		c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+	    table[n] = c;
+	}
+	table_done = TRUE;
+    }
+    for (i=0; i<len; ++i)
+	crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+static void synth_png_chunk (GByteArray *png, const gchar *type,
+			     const guchar *data, guint32 len)
+{
+    guchar buf[4];
+    guint start;
+
+    synth_put32be (buf, len);
+    g_byte_array_append (png, buf, 4);
+    start = png->len;
+    g_byte_array_append (png, (const guint8 *)type, 4);
+    g_byte_array_append (png, data, len);
+    synth_put32be (buf, synth_crc32 (png->data + start, len + 4));
+    g_byte_array_append (png, buf, 4);
+}
+
+/* A SYNTH_ARTWORK_SIZE x SYNTH_ARTWORK_SIZE RGB PNG showing a
+   gradient of @rgb. The image data is stored uncompressed. */
+static guchar *synth_png (guint32 rgb, gsize *len)
+{
+    static const guchar signature[8] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    const guint32 size = SYNTH_ARTWORK_SIZE;
+    const guint32 rowlen = 1 + size * 3;
+    guchar ihdr[13];
+    guchar *raw, *zlib, *p;
+    guint32 rawlen, zlen, a = 1, b = 0, x, y, i;
+    GByteArray *png;
+
+    rawlen = rowlen * size;
+    raw = g_malloc (rawlen);
+    for (y=0; y<size; ++y)
+    {
+	p = raw + y * rowlen;
+	*p++ = 0;   /* filter type none */
+	for (x=0; x<size; ++x)
+	{
+	    *p++ = ((rgb >> 16) & 0xff) * (x + size) / (2 * size);
+	    *p++ = ((rgb >> 8) & 0xff) * (y + size) / (2 * size);
+	    *p++ = (rgb & 0xff) * (x + y + size) / (3 * size);
+	}
+    }
+
+    /* zlib stream with a single stored block (rawlen < 65536) */
+    g_assert (rawlen < 0x10000);
+    zlen = 2 + 5 + rawlen + 4;
+    zlib = g_malloc (zlen);
+    p = zlib;
+    *p++ = 0x78;
+    *p++ = 0x01;
+    *p++ = 0x01;   /* final block, stored */
+    *p++ = rawlen & 0xff;
+    *p++ = rawlen >> 8;
+    *p++ = ~rawlen & 0xff;
+    *p++ = (~rawlen >> 8) & 0xff;
+    memcpy (p, raw, rawlen);
+    p += rawlen;
+    for (i=0; i<rawlen; ++i)
+    {
+	a = (a + raw[i]) % 65521;
+	b = (b + a) % 65521;
+    }
+    synth_put32be (p, (b << 16) | a);
+
+    synth_put32be (ihdr, size);
+    synth_put32be (ihdr+4, size);
+    ihdr[8] = 8;    /* bit depth  */
+    ihdr[9] = 2;    /* RGB        */
+    ihdr[10] = 0;   /* deflate    */
+    ihdr[11] = 0;   /* filtering  */
+    ihdr[12] = 0;   /* no interlacing */
+
+    png = g_byte_array_new ();
+    g_byte_array_append (png, signature, sizeof (signature));
+    synth_png_chunk (png, "IHDR", ihdr, sizeof (ihdr));
+    synth_png_chunk (png, "IDAT", zlib, zlen);
+    synth_png_chunk (png, "IEND", NULL, 0);
+
+    g_free (raw);
+    g_free (zlib);
+    *len = png->len;
+    return g_byte_array_free (png, FALSE);
+}
+
+static void synth_add_smart_playlist (Itdb_iTunesDB *itdb, GRand *rand,
+				      guint32 num)
+{
+    Itdb_Playlist *spl;
+    Itdb_SPLRule *splr;
+    gchar *name;
+
+    name = g_strdup_printf ("Smart Playlist %u", num+1);
+    spl = itdb_playlist_new (name, TRUE);
+    g_free (name);
+    itdb_playlist_add (itdb, spl, -1);
+
+    splr = itdb_splr_add_new (spl, -1);
+    switch (num % 4)
+    {
+    case 0: /* artist contains a letter */
+	splr->field = ITDB_SPLFIELD_ARTIST;
+	splr->action = ITDB_SPLACTION_CONTAINS;
+	g_free (splr->string);
+	splr->string = g_strndup (
+	    synth_letters + g_rand_int_range (rand, 0, 26), 1);
+	break;
+    case 1: /* rated three stars or more */
+	splr->field = ITDB_SPLFIELD_RATING;
+	splr->action = ITDB_SPLACTION_IS_GREATER_THAN;
+	splr->fromvalue = 40;
+	splr->fromunits = 1;
+	break;
+    case 2: /* played more than a few times, 25 random ones */
+	splr->field = ITDB_SPLFIELD_PLAYCOUNT;
+	splr->action = ITDB_SPLACTION_IS_GREATER_THAN;
+	splr->fromvalue = g_rand_int_range (rand, 1, 10);
+	splr->fromunits = 1;
+	spl->splpref.checklimits = TRUE;
+	spl->splpref.limittype = ITDB_LIMITTYPE_SONGS;
+	spl->splpref.limitsort = ITDB_LIMITSORT_RANDOM;
+	spl->splpref.limitvalue = 25;
+	break;
+    case 3: /* a genre, most recently added first */
+	splr->field = ITDB_SPLFIELD_GENRE;
+	splr->action = ITDB_SPLACTION_IS_STRING;
+	g_free (splr->string);
+	splr->string = g_strdup (synth_genres[
+	    g_rand_int_range (rand, 0, G_N_ELEMENTS (synth_genres))]);
+	spl->splpref.checklimits = TRUE;
+	spl->splpref.limittype = ITDB_LIMITTYPE_SONGS;
+	spl->splpref.limitsort = ITDB_LIMITSORT_MOST_RECENTLY_ADDED;
+	spl->splpref.limitvalue = 100;
+	break;
+    }
+}
+
+/**
+ * synth_itdb_new:
+ * @mountpoint: mount point to set, or NULL
+ * @params: what to generate
+ *
+ * Creates a database as described by @params in memory. Nothing is
+ * written to @mountpoint; the track files don't exist. Smart
+ * playlists are not evaluated yet.
+ *
+ * Return value: the new database
+ **/
+Itdb_iTunesDB *synth_itdb_new (const gchar *mountpoint,
+			       const SynthParams *params)
+{
+    Itdb_iTunesDB *itdb;
+    Itdb_Playlist *mpl;
+    Itdb_Track **tracks;
+    gchar **artists, **albums;
+    guint32 n_artists, n_albums, i, j;
+    time_t now = time (NULL);
+    GRand *rand;
+
+    g_return_val_if_fail (params, NULL);
+
+    rand = g_rand_new_with_seed (params->seed);
+
+    itdb = itdb_new ();
+    if (mountpoint)
+	itdb_set_mountpoint (itdb, mountpoint);
+    if (params->model)
+	itdb_device_set_sysinfo (itdb->device, "ModelNumStr", params->model);
+
+    mpl = itdb_playlist_new ("iPod", FALSE);
+    itdb_playlist_set_mpl (mpl);
+    itdb_playlist_add (itdb, mpl, -1);
+
+    /* roughly ten tracks per album and two albums per artist */
+    n_albums = MAX (1, params->tracks / 10);
+    n_artists = MAX (1, n_albums / 2);
+    artists = g_new (gchar *, n_artists);
+    for (i=0; i<n_artists; ++i)
+	artists[i] = synth_string (rand, params);
+    albums = g_new (gchar *, n_albums);
+    for (i=0; i<n_albums; ++i)
+	albums[i] = synth_string (rand, params);
+
+    tracks = g_new (Itdb_Track *, MAX (1, params->tracks));
+    for (i=0; i<params->tracks; ++i)
+    {
+	Itdb_Track *track = itdb_track_new ();
+	guint32 album = g_rand_int_range (rand, 0, n_albums);
+
+	track->title = synth_string (rand, params);
+	track->album = g_strdup (albums[album]);
+	track->artist = g_strdup (artists[album % n_artists]);
+	track->genre = g_strdup (synth_genres[album % G_N_ELEMENTS (synth_genres)]);
+	if (g_rand_int_range (rand, 0, 3) == 0)
+	    track->composer = synth_string (rand, params);
+	track->filetype = g_strdup ("MPEG audio file");
+	track->ipod_path = g_strdup_printf (
+	    ":iPod_Control:Music:F%02u:SYN%06u.mp3",
+	    i % SYNTH_MUSIC_DIRS, i);
+	track->size = g_rand_int_range (rand, 2000000, 9000000);
+	track->tracklen = g_rand_int_range (rand, 90000, 420000);
+	track->bitrate = 192;
+	track->samplerate = 44100;
+	track->track_nr = g_rand_int_range (rand, 1, 15);
+	track->tracks = 14;
+	track->year = g_rand_int_range (rand, 1960, 2008);
+	track->rating = 20 * g_rand_int_range (rand, 0, 6);
+	track->playcount = g_rand_int_range (rand, 0, 50);
+	track->time_added = now - g_rand_int_range (rand, 0, 3 * 365 * 86400);
+	if (track->playcount)
+	    track->time_played = track->time_added +
+		g_rand_int_range (rand, 0, now - track->time_added + 1);
+	track->transferred = TRUE;
+	/* unique by the low word; itdb_track_add() would otherwise
+	   compare a random dbid against every track added so far */
+	track->dbid = ((guint64)g_rand_int (rand) << 32) | (i + 1);
+	/* prepend: appending walks the whole list every time */
+	itdb_track_add (itdb, track, 0);
+	itdb_playlist_add_track (mpl, track, 0);
+	tracks[i] = track;
+
+	if ((params->artwork > 0) && (g_rand_double (rand) < params->artwork))
+	{   /* the same picture for all tracks of an album */
+	    gsize len;
+	    guchar *png = synth_png (g_str_hash (albums[album]) | 0x404040,
+				     &len);
+	    itdb_track_set_thumbnails_from_data (track, png, len);
+	    g_free (png);
+	}
+    }
+
+    for (i=0; (i<params->playlists) && (params->tracks > 0); ++i)
+    {
+	gchar *name = g_strdup_printf ("Playlist %u", i+1);
+	Itdb_Playlist *pl = itdb_playlist_new (name, FALSE);
+	g_free (name);
+	itdb_playlist_add (itdb, pl, -1);
+	for (j=0; j<params->playlist_size; ++j)
+	    itdb_playlist_add_track (
+		pl, tracks[g_rand_int_range (rand, 0, params->tracks)], -1);
+    }
+
+    for (i=0; i<params->smart_playlists; ++i)
+	synth_add_smart_playlist (itdb, rand, i);
+
+    for (i=0; i<n_artists; ++i)
+	g_free (artists[i]);
+    g_free (artists);
+    for (i=0; i<n_albums; ++i)
+	g_free (albums[i]);
+    g_free (albums);
+    g_free (tracks);
+    g_rand_free (rand);
+    return itdb;
+}
+
+/* Write a Play Counts file for the tracks of @itdb as written last,
+   with new play counts and ratings for some of them */
+static gboolean synth_write_playcounts (Itdb_iTunesDB *itdb,
+					const SynthParams *params,
+					GError **error)
+{
+    const guint32 header_len = 0x60, entry_len = 0x1c;
+    guint32 n = g_list_length (itdb->tracks);
+    guint32 *p;
+    guchar *data;
+    gchar *dir, *filename;
+    gboolean result;
+    GRand *rand;
+    GList *gl;
+
+    rand = g_rand_new_with_seed (params->seed + 1);
+    data = g_malloc0 (header_len + n * entry_len);
+    memcpy (data, "mhdp", 4);
+    p = (guint32 *)data;
+    p[1] = GUINT32_TO_LE (header_len);
+    p[2] = GUINT32_TO_LE (entry_len);
+    p[3] = GUINT32_TO_LE (n);
+
+    p = (guint32 *)(data + header_len);
+    for (gl=itdb->tracks; gl; gl=gl->next, p+=entry_len/4)
+    {
+	Itdb_Track *track = gl->data;
+	if (g_rand_int_range (rand, 0, 4) != 0)
+	    continue;
+	p[0] = GUINT32_TO_LE (g_rand_int_range (rand, 1, 5));  /* plays */
+	p[1] = GUINT32_TO_LE ((guint32)(time (NULL) + SYNTH_MAC_EPOCH));
+	p[3] = GUINT32_TO_LE ((track->rating + 20) % 120);
+	p[5] = GUINT32_TO_LE (g_rand_int_range (rand, 0, 3));  /* skips */
+    }
+
+    dir = itdb_get_itunes_dir (itdb_get_mountpoint (itdb));
+    filename = g_build_filename (dir, "Play Counts", NULL);
+    result = g_file_set_contents (filename, (const gchar *)data,
+				  header_len + n * entry_len, error);
+    g_free (filename);
+    g_free (dir);
+    g_free (data);
+    g_rand_free (rand);
+    return result;
+}
+
+/**
+ * synth_ipod_create:
+ * @mountpoint: directory to create the iPod in
+ * @params: what to generate
+ * @error: return location for a #GError or NULL
+ *
+ * Creates the iPod directory structure below @mountpoint (see
+ * itdb_init_ipod()) and writes the database described by @params to
+ * it, including the ArtworkDB and .ithmb files if there is cover art,
+ * and a Play Counts file if requested. Existing databases in
+ * @mountpoint are replaced.
+ *
+ * Return value: TRUE on success
+ **/
+gboolean synth_ipod_create (const gchar *mountpoint,
+			    const SynthParams *params,
+			    GError **error)
+{
+    Itdb_iTunesDB *itdb;
+    gboolean result;
+
+    g_return_val_if_fail (mountpoint, FALSE);
+    g_return_val_if_fail (params, FALSE);
+
+    if (!itdb_init_ipod (mountpoint, params->model, "iPod", error))
+	return FALSE;
+
+    itdb = synth_itdb_new (mountpoint, params);
+    itdb_set_durability (itdb, ITDB_DURABILITY_NONE);
+    itdb_spl_update_all (itdb);
+    result = itdb_write (itdb, error);
+    if (result && params->playcounts)
+	result = synth_write_playcounts (itdb, params, error);
+    itdb_free (itdb);
+    return result;
+}
@@ -0,0 +1,61 @@
+/*
+|  Generator for synthetic iPod directory trees (iTunesDB, ArtworkDB,
+|  Play Counts) used by the benchmark and test programs.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#ifndef __SYNTHDB_H__
+#define __SYNTHDB_H__
+
+#include "itdb.h"
+
+G_BEGIN_DECLS
+
+/* What to put into a synthetic iPod, see synth_params_init() for the
+   defaults. String lengths are in characters and uniformly
+   distributed between string_min and string_max. non_ascii is the
+   fraction of strings containing non-ASCII characters, artwork the
+   fraction of tracks with cover art. The artwork formats written are
+   the ones of model. The same seed gives the same database. */
+typedef struct
+{
+    guint32 tracks;
+    guint32 playlists;        /* regular playlists besides the MPL */
+    guint32 playlist_size;    /* members of each regular playlist  */
+    guint32 smart_playlists;
+    guint32 string_min;
+    guint32 string_max;
+    gdouble non_ascii;
+    gdouble artwork;
+    gboolean playcounts;      /* write a Play Counts file           */
+    const gchar *model;       /* model number, e.g. "MA450"         */
+    guint32 seed;
+} SynthParams;
+
+void synth_params_init (SynthParams *params);
+Itdb_iTunesDB *synth_itdb_new (const gchar *mountpoint,
+			       const SynthParams *params);
+gboolean synth_ipod_create (const gchar *mountpoint,
+			    const SynthParams *params,
+			    GError **error);
+
+G_END_DECLS
+
+#endif
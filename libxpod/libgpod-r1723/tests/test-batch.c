@@ -0,0 +1,161 @@
+/*
+|  Test for itdb_batch_commit(): adds batches of tracks without a dbid
+|  to a synthetic database and checks that every track ends up with a
+|  dbid of its own. Also prints the time each commit takes as
+|  "<tracks>.<measurement> <value>" lines (seconds), which should grow
+|  linearly with the number of tracks.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "synthdb.h"
+
+static guint dbid_hash (gconstpointer v)
+{
+    guint64 id = *(const guint64 *)v;
+    return (guint)(id ^ (id >> 32));
+}
+
+static gboolean dbid_equal (gconstpointer v1, gconstpointer v2)
+{
+    return *(const guint64 *)v1 == *(const guint64 *)v2;
+}
+
+/* TRUE if all tracks of @itdb have a dbid different from 0 and from
+   the dbids of all other tracks, and dbid2 equal to dbid */
+static gboolean check_dbids (Itdb_iTunesDB *itdb)
+{
+    GHashTable *dbids = g_hash_table_new (dbid_hash, dbid_equal);
+    gboolean result = TRUE;
+    GList *gl;
+
+    for (gl=itdb->tracks; gl && result; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+
+	if (track->dbid == 0)
+	{
+	    fprintf (stderr, "track '%s' has no dbid\n", track->title);
+	    result = FALSE;
+	}
+	else if (g_hash_table_lookup (dbids, &track->dbid))
+	{
+	    fprintf (stderr, "dbid %" G_GINT64_MODIFIER "x used twice\n",
+		     track->dbid);
+	    result = FALSE;
+	}
+	else if (track->dbid2 != track->dbid)
+	{
+	    fprintf (stderr, "track '%s': dbid2 differs from dbid\n",
+		     track->title);
+	    result = FALSE;
+	}
+	g_hash_table_insert (dbids, &track->dbid, track);
+    }
+    g_hash_table_destroy (dbids);
+    return result;
+}
+
+/* Adds @tracks tracks without dbid to a database of @tracks tracks in
+   two batches and checks the dbids after each commit */
+static gboolean test (guint32 tracks)
+{
+    SynthParams params;
+    Itdb_iTunesDB *itdb;
+    Itdb_Playlist *mpl;
+    GTimer *timer;
+    gboolean result = TRUE;
+    gint round;
+
+    synth_params_init (&params);
+    params.tracks = tracks;
+    params.playlists = 0;
+    params.seed = tracks;
+    itdb = synth_itdb_new (NULL, &params);
+    mpl = itdb_playlist_mpl (itdb);
+    timer = g_timer_new ();
+
+    for (round=0; (round<2) && result; ++round)
+    {
+	Itdb_Batch *batch = itdb_batch_begin (itdb);
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	guint32 i;
+
+	for (i=0; i<tracks/2; ++i)
+	{
+	    Itdb_Track *track = itdb_track_new ();
+	    track->title = g_strdup_printf ("batch %d/%u", round, i);
+	    track->filetype = g_strdup ("MPEG audio file");
+	    itdb_batch_track_add (batch, track);
+	    itdb_batch_playlist_add_track (batch, mpl, track);
+	}
+	g_timer_start (timer);
+	itdb_batch_commit (batch);
+	g_ascii_formatd (buf, sizeof (buf), "%f", g_timer_elapsed (timer, NULL));
+	printf ("%u.commit%d %s\n", tracks, round, buf);
+
+	if (g_list_length (itdb->tracks) != tracks + (round+1) * (tracks/2))
+	{
+	    fprintf (stderr, "%u tracks: wrong number of tracks after commit\n",
+		     tracks);
+	    result = FALSE;
+	}
+	else
+	{
+	    result = check_dbids (itdb);
+	}
+    }
+
+    g_timer_destroy (timer);
+    itdb_free (itdb);
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gchar **sizes;
+    gint i, result = 0;
+
+    if (argc > 2)
+    {
+	fprintf (stderr, "usage: %s [track counts (2000,20000)]\n", argv[0]);
+	return 1;
+    }
+
+    sizes = g_strsplit ((argc == 2) ? argv[1] : "2000,20000", ",", -1);
+    for (i=0; sizes[i] && (result == 0); ++i)
+    {
+	gint tracks = atoi (sizes[i]);
+	if (tracks <= 0)
+	{
+	    fprintf (stderr, "invalid track count '%s'\n", sizes[i]);
+	    result = 1;
+	}
+	else if (!test (tracks))
+	{
+	    result = 1;
+	}
+	fflush (stdout);
+    }
+    g_strfreev (sizes);
+    return result;
+}
@@ -0,0 +1,225 @@
+/*
+|  Benchmark of parsing, smart playlist evaluation, writing and freeing
+|  synthetic databases of different sizes (see synthdb.c).
+|
+|  Results are printed as "<tracks>.<measurement> <value>" lines, times
+|  in seconds, for collection by regression tracking scripts.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "synthdb.h"
+
+static void print_value (guint32 tracks, const gchar *name, gdouble value)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    /* independent of the locale's decimal point */
+    g_ascii_formatd (buf, sizeof (buf), "%f", value);
+    printf ("%u.%s %s\n", tracks, name, buf);
+}
+
+static void print_stats (guint32 tracks, const gchar *prefix,
+			 Itdb_iTunesDB *itdb)
+{
+    gchar *str, **lines;
+    gint i;
+
+    str = itdb_stats_to_string (itdb_get_stats (itdb));
+    lines = g_strsplit (str, "\n", -1);
+    for (i=0; lines[i]; ++i)
+    {
+	if (*lines[i])
+	    printf ("%u.%s.%s\n", tracks, prefix, lines[i]);
+    }
+    g_strfreev (lines);
+    g_free (str);
+}
+
+/* Decode all thumbnails of all tracks, returns the number decoded */
+static guint32 unpack_thumbnails (Itdb_iTunesDB *itdb)
+{
+    guint32 n = 0;
+    GList *gl, *thl;
+
+    for (gl=itdb->tracks; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	if (!track->artwork)
+	    continue;
+	for (thl=track->artwork->thumbnails; thl; thl=thl->next)
+	{
+	    Itdb_Image *image = itdb_thumb_get_image (itdb->device,
+						      thl->data);
+	    if (image)
+	    {
+		itdb_image_free (image);
+		++n;
+	    }
+	}
+    }
+    return n;
+}
+
+static gboolean bench (const gchar *workdir, guint32 tracks,
+		       const SynthParams *template, gboolean stats)
+{
+    SynthParams params = *template;
+    Itdb_iTunesDB *itdb;
+    GError *error = NULL;
+    GTimer *timer;
+    gchar *name, *mp;
+    guint32 thumbs;
+    gboolean result = FALSE;
+
+    name = g_strdup_printf ("ipod-%u", tracks);
+    mp = g_build_filename (workdir, name, NULL);
+    g_free (name);
+
+    params.tracks = tracks;
+    /* playlists grow with the database */
+    params.playlists = MAX (1, tracks / 1000);
+    params.playlist_size = MIN (tracks, 500);
+
+    timer = g_timer_new ();
+    if (!synth_ipod_create (mp, &params, &error))
+    {
+	fprintf (stderr, "cannot create %s: %s\n", mp,
+		 error ? error->message : "unknown error");
+	goto out;
+    }
+    print_value (tracks, "generate", g_timer_elapsed (timer, NULL));
+
+    itdb_stats_set_enabled (TRUE);
+
+    g_timer_start (timer);
+    itdb = itdb_parse (mp, &error);
+    if (!itdb)
+    {
+	fprintf (stderr, "cannot parse %s: %s\n", mp,
+		 error ? error->message : "unknown error");
+	goto out;
+    }
+    print_value (tracks, "parse", g_timer_elapsed (timer, NULL));
+    print_value (tracks, "parse_artwork",
+		 itdb_get_stats (itdb)->phases[ITDB_STATS_PARSE_ARTWORK].wall_time);
+    if (stats)
+	print_stats (tracks, "parse", itdb);
+    itdb_stats_reset (itdb);
+
+    g_timer_start (timer);
+    itdb_spl_update_all (itdb);
+    print_value (tracks, "spl_update_all", g_timer_elapsed (timer, NULL));
+
+    g_timer_start (timer);
+    thumbs = unpack_thumbnails (itdb);
+    print_value (tracks, "thumbnail_unpack", g_timer_elapsed (timer, NULL));
+    printf ("%u.thumbnails %u\n", tracks, thumbs);
+
+    itdb_stats_reset (itdb);
+    itdb_set_durability (itdb, ITDB_DURABILITY_NONE);
+    g_timer_start (timer);
+    if (!itdb_write (itdb, &error))
+    {
+	fprintf (stderr, "cannot write %s: %s\n", mp,
+		 error ? error->message : "unknown error");
+	itdb_free (itdb);
+	goto out;
+    }
+    print_value (tracks, "write", g_timer_elapsed (timer, NULL));
+    print_value (tracks, "write_artwork",
+		 itdb_get_stats (itdb)->phases[ITDB_STATS_WRITE_THUMBNAILS].wall_time +
+		 itdb_get_stats (itdb)->phases[ITDB_STATS_WRITE_ARTWORK].wall_time);
+    if (stats)
+	print_stats (tracks, "write", itdb);
+
+    g_timer_start (timer);
+    itdb_free (itdb);
+    print_value (tracks, "free", g_timer_elapsed (timer, NULL));
+    result = TRUE;
+
+  out:
+    g_clear_error (&error);
+    g_timer_destroy (timer);
+    g_free (mp);
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    SynthParams params;
+    gchar *scales = NULL, **sizes;
+    gboolean stats = FALSE;
+    GOptionContext *context;
+    GError *error = NULL;
+    gint i, result = 0;
+
+    synth_params_init (&params);
+    params.smart_playlists = 10;
+    params.artwork = 0.02;
+    params.playcounts = TRUE;
+    {
+	GOptionEntry entries[] = {
+	    { "scales", 's', 0, G_OPTION_ARG_STRING, &scales,
+	      "Comma separated track counts (1000,10000,50000)", "LIST" },
+	    { "artwork", 'a', 0, G_OPTION_ARG_DOUBLE, &params.artwork,
+	      "Fraction of tracks with cover art (0.02)", "F" },
+	    { "non-ascii", 'n', 0, G_OPTION_ARG_DOUBLE, &params.non_ascii,
+	      "Fraction of strings with non-ASCII characters (0.1)", "F" },
+	    { "model", 'm', 0, G_OPTION_ARG_STRING, &params.model,
+	      "Model number, determines the artwork formats (MA450)", "MODEL" },
+	    { "stats", 0, 0, G_OPTION_ARG_NONE, &stats,
+	      "Also print the phase statistics of parse and write", NULL },
+	    { NULL }
+	};
+
+	context = g_option_context_new ("<work directory> - benchmark libgpod");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error) ||
+	    (argc != 2))
+	{
+	    fprintf (stderr, "%s\nusage: %s [OPTION...] <work directory>\n",
+		     error ? error->message : "", argv[0]);
+	    return 1;
+	}
+	g_option_context_free (context);
+    }
+
+    sizes = g_strsplit (scales ? scales : "1000,10000,50000", ",", -1);
+    for (i=0; sizes[i] && (result == 0); ++i)
+    {
+	gint tracks = atoi (sizes[i]);
+	if (tracks <= 0)
+	{
+	    fprintf (stderr, "invalid track count '%s'\n", sizes[i]);
+	    result = 1;
+	}
+	else if (!bench (argv[1], tracks, &params, stats))
+	{
+	    result = 1;
+	}
+	fflush (stdout);
+    }
+    g_strfreev (sizes);
+    g_free (scales);
+    return result;
+}
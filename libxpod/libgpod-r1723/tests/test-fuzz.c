@@ -0,0 +1,196 @@
+/*
+|  Fuzz driver for the iTunesDB parser: random byte, bit and length
+|  field mutations and truncations of an iTunesDB are fed to
+|  itdb_parse_file(). Meant to be built with AddressSanitizer or
+|  valgrind at hand; a run is successful if it doesn't crash.
+|
+|  Every case is derived from --seed and its number only, so a failing
+|  case can be rerun alone with --case and inspected in the file left
+|  behind.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "synthdb.h"
+
+/* the parser warns about most mutations -- don't flood the terminal */
+static void quiet_log (const gchar *domain, GLogLevelFlags level,
+		       const gchar *message, gpointer user_data)
+{
+}
+
+/* Writes a synthetic iTunesDB with @tracks tracks to @filename */
+static gboolean create_seed (const gchar *filename, guint32 tracks,
+			     guint32 seed, GError **error)
+{
+    SynthParams params;
+    Itdb_iTunesDB *itdb;
+    gboolean result;
+
+    synth_params_init (&params);
+    params.tracks = tracks;
+    params.playlists = 2;
+    params.playlist_size = MIN (tracks, 10);
+    params.smart_playlists = 4;
+    params.non_ascii = 0.5;
+    params.seed = seed;
+
+    itdb = synth_itdb_new (NULL, &params);
+    itdb_spl_update_all (itdb);
+    result = itdb_write_file (itdb, filename, error);
+    itdb_free (itdb);
+    return result;
+}
+
+/* Applies one to eight mutations to @buf, returns the new length */
+static gsize mutate (GRand *rand, guchar *buf, gsize len)
+{
+    gint32 i, n = g_rand_int_range (rand, 1, 9);
+
+    for (i=0; (i<n) && (len > 0); ++i)
+    {
+	gsize offset = g_rand_int_range (rand, 0, len);
+	guint32 value;
+
+	switch (g_rand_int_range (rand, 0, 4))
+	{
+	case 0: /* random byte */
+	    buf[offset] = g_rand_int (rand);
+	    break;
+	case 1: /* flip one bit */
+	    buf[offset] ^= 1 << g_rand_int_range (rand, 0, 8);
+	    break;
+	case 2: /* implausible header, total or string length */
+	    if (g_rand_int_range (rand, 0, 3) == 0)
+		value = 0xffffffff;
+	    else
+		value = g_rand_int_range (rand, 0, 0x200);
+	    value = GUINT32_TO_LE (value);
+	    if (offset + 4 <= len)
+		memcpy (buf + offset, &value, 4);
+	    break;
+	case 3: /* truncate */
+	    len = offset + 1;
+	    break;
+	}
+    }
+    return len;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gint iterations = 10000, tracks = 50, seed = 1, single = -1;
+    gchar *input = NULL, *seedname, *casename, *contents;
+    gsize len;
+    guchar *buf;
+    gint i, parsed = 0;
+    GOptionContext *context;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+	{ "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+	  "Number of cases to run (10000)", "N" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &seed,
+	  "Seed of the mutations (1)", "N" },
+	{ "case", 'c', 0, G_OPTION_ARG_INT, &single,
+	  "Run only this case", "N" },
+	{ "tracks", 't', 0, G_OPTION_ARG_INT, &tracks,
+	  "Tracks in the generated iTunesDB (50)", "N" },
+	{ "input", 'f', 0, G_OPTION_ARG_FILENAME, &input,
+	  "Mutate this iTunesDB instead of a generated one", "FILE" },
+	{ NULL }
+    };
+
+    context = g_option_context_new ("<work directory> - fuzz itdb_parse_file()");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error) ||
+	(argc != 2) || (iterations < 0) || (tracks < 0))
+    {
+	fprintf (stderr, "%s\nusage: %s [OPTION...] <work directory>\n",
+		 error ? error->message : "", argv[0]);
+	return 1;
+    }
+    g_option_context_free (context);
+
+    seedname = g_build_filename (argv[1], "seed-iTunesDB", NULL);
+    casename = g_build_filename (argv[1], "case-iTunesDB", NULL);
+    if (!input)
+    {
+	if (!create_seed (seedname, tracks, seed, &error))
+	{
+	    fprintf (stderr, "cannot write %s: %s\n", seedname,
+		     error ? error->message : "unknown error");
+	    return 1;
+	}
+	input = g_strdup (seedname);
+    }
+    if (!g_file_get_contents (input, &contents, &len, &error))
+    {
+	fprintf (stderr, "cannot read %s: %s\n", input, error->message);
+	return 1;
+    }
+
+    g_log_set_default_handler (quiet_log, NULL);
+
+    buf = g_malloc (len);
+    for (i = (single >= 0) ? single : 0;
+	 (single >= 0) ? (i == single) : (i < iterations); ++i)
+    {
+	GRand *rand = g_rand_new_with_seed (seed ^ (i * 2654435761u));
+	Itdb_iTunesDB *itdb;
+	gsize caselen;
+
+	memcpy (buf, contents, len);
+	caselen = mutate (rand, buf, len);
+	g_rand_free (rand);
+
+	if (!g_file_set_contents (casename, (gchar *)buf, caselen, &error))
+	{
+	    fprintf (stderr, "cannot write %s: %s\n", casename,
+		     error->message);
+	    return 1;
+	}
+	/* progress: a crash happened in one of the cases after the
+	   last one printed */
+	if (single >= 0 || (i % 1000) == 0)
+	{
+	    printf ("case %d\n", i);
+	    fflush (stdout);
+	}
+
+	itdb = itdb_parse_file (casename, &error);
+	if (itdb)
+	{
+	    ++parsed;
+	    itdb_free (itdb);
+	}
+	g_clear_error (&error);
+    }
+
+    printf ("%d cases, %d parsed\n", (single >= 0) ? 1 : iterations, parsed);
+
+    g_free (buf);
+    g_free (contents);
+    g_free (input);
+    g_free (seedname);
+    g_free (casename);
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+|  Benchmark for the Photo Database writer: adds a large number of
+|  photos to a fresh photo database and times the first write and the
+|  rewrites that follow.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "itdb.h"
+
+#define DEFAULT_PHOTOS 20000
+#define ALBUMS 10
+#define REWRITES 5
+
+int
+main (int argc, char *argv[])
+{
+    Itdb_PhotoDB *db;
+    Itdb_PhotoAlbum *albums[ALBUMS];
+    GError *error = NULL;
+    GTimer *timer;
+    gdouble t_add, t_write, t_rewrite;
+    gint photos, i;
+
+    if ((argc < 3) || (argc > 4))
+    {
+	fprintf (stderr, "usage: %s <empty directory> <image file> [number of photos]\n", argv[0]);
+	return 1;
+    }
+    photos = (argc == 4) ? atoi (argv[3]) : DEFAULT_PHOTOS;
+
+    /* MA450: 5th generation iPod, which supports photos */
+    if (!itdb_init_ipod (argv[1], "MA450", "bench", &error))
+    {
+	fprintf (stderr, "cannot initialize %s: %s\n", argv[1],
+		 error ? error->message : "unknown error");
+	return 1;
+    }
+
+    db = itdb_photodb_create (argv[1]);
+    for (i=0; i<ALBUMS; ++i)
+    {
+	gchar *name = g_strdup_printf ("Album %d", i);
+	albums[i] = itdb_photodb_photoalbum_create (db, name, -1);
+	g_free (name);
+    }
+
+    timer = g_timer_new ();
+    for (i=0; i<photos; ++i)
+    {
+	Itdb_Artwork *artwork;
+	artwork = itdb_photodb_add_photo (db, argv[2], -1, 0, &error);
+	if (!artwork)
+	{
+	    fprintf (stderr, "cannot add %s: %s\n", argv[2],
+		     error ? error->message : "unknown error");
+	    return 1;
+	}
+	itdb_photodb_photoalbum_add_photo (db, albums[i%ALBUMS], artwork, -1);
+    }
+    t_add = g_timer_elapsed (timer, NULL);
+
+    g_timer_start (timer);
+    if (!itdb_photodb_write (db, &error))
+    {
+	fprintf (stderr, "write failed: %s\n",
+		 error ? error->message : "unknown error");
+	return 1;
+    }
+    t_write = g_timer_elapsed (timer, NULL);
+
+    g_timer_start (timer);
+    for (i=0; i<REWRITES; ++i)
+    {
+	if (!itdb_photodb_write (db, &error))
+	{
+	    fprintf (stderr, "rewrite failed: %s\n",
+		     error ? error->message : "unknown error");
+	    return 1;
+	}
+    }
+    t_rewrite = g_timer_elapsed (timer, NULL) / REWRITES;
+
+    printf ("photos=%d add=%.3f write=%.3f rewrite=%.4f\n",
+	    photos, t_add, t_write, t_rewrite);
+
+    g_timer_destroy (timer);
+    itdb_photodb_free (db);
+    return 0;
+}
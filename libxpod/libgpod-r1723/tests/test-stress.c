@@ -0,0 +1,217 @@
+/*
+|  Stress test for parsing and writing several iPods at the same time
+|  with itdb_parse_async() and itdb_write_async(). Every round parses
+|  all synthetic iPods (see synthdb.c), adds a track to each and writes
+|  it back; a truncated iTunesDB makes one parse fail in every round.
+|  Best run under valgrind --tool=helgrind or a thread sanitizer.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "synthdb.h"
+
+static gint parsed, written, failed, expected_failures;
+static const gchar *broken_mountpoint;
+
+static void stress_written (Itdb_iTunesDB *itdb, GError *error,
+			    gpointer user_data)
+{
+    if (error)
+    {
+	fprintf (stderr, "cannot write %s: %s\n",
+		 (const gchar *)user_data, error->message);
+	g_atomic_int_inc (&failed);
+    }
+    else
+    {
+	g_atomic_int_inc (&written);
+    }
+    itdb_free (itdb);
+}
+
+static void stress_parsed (Itdb_iTunesDB *itdb, GError *error,
+			   gpointer user_data)
+{
+    const gchar *mountpoint = user_data;
+    Itdb_Track *track;
+
+    if (!itdb)
+    {
+	if (mountpoint == broken_mountpoint &&
+	    error && (error->domain == ITDB_FILE_ERROR))
+	{
+	    g_atomic_int_inc (&expected_failures);
+	}
+	else
+	{
+	    fprintf (stderr, "cannot parse %s: %s\n", mountpoint,
+		     error ? error->message : "unknown error");
+	    g_atomic_int_inc (&failed);
+	}
+	return;
+    }
+    g_atomic_int_inc (&parsed);
+
+    track = itdb_track_new ();
+    track->title = g_strdup ("stress");
+    track->ipod_path = g_strdup (":iPod_Control:Music:F00:STRESS.mp3");
+    track->filetype = g_strdup ("MPEG audio file");
+    itdb_track_add (itdb, track, -1);
+    itdb_playlist_add_track (itdb_playlist_mpl (itdb), track, -1);
+    itdb_spl_update_all (itdb);
+    itdb_set_durability (itdb, ITDB_DURABILITY_NONE);
+    itdb_write_async (itdb, stress_written, user_data);
+}
+
+/* Creates an iPod whose iTunesDB is cut off in the middle */
+static gboolean create_broken (const gchar *mountpoint, GError **error)
+{
+    SynthParams params;
+    gchar *filename, *contents;
+    gsize len;
+    gboolean result;
+
+    synth_params_init (&params);
+    params.tracks = 100;
+    if (!synth_ipod_create (mountpoint, &params, error))
+	return FALSE;
+    filename = itdb_get_itunesdb_path (mountpoint);
+    result = filename && g_file_get_contents (filename, &contents, &len, error);
+    if (result)
+    {
+	result = g_file_set_contents (filename, contents, len/2, error);
+	g_free (contents);
+    }
+    g_free (filename);
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gint ipods = 16, tracks = 2000, rounds = 3, threads = 4, i, j;
+    gdouble artwork = 0.05;
+    gchar **mountpoints;
+    GOptionContext *context;
+    GError *error = NULL;
+    GOptionEntry entries[] = {
+	{ "ipods", 'i', 0, G_OPTION_ARG_INT, &ipods,
+	  "Number of iPods (16)", "N" },
+	{ "tracks", 't', 0, G_OPTION_ARG_INT, &tracks,
+	  "Tracks on each iPod (2000)", "N" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds,
+	  "Number of parse/write rounds (3)", "N" },
+	{ "threads", 'j', 0, G_OPTION_ARG_INT, &threads,
+	  "Maximum number of worker threads (4)", "N" },
+	{ "artwork", 'a', 0, G_OPTION_ARG_DOUBLE, &artwork,
+	  "Fraction of tracks with cover art (0.05)", "F" },
+	{ NULL }
+    };
+
+    context = g_option_context_new ("<work directory> - parse and write iPods concurrently");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error) ||
+	(argc != 2) || (ipods < 1) || (tracks < 0) || (rounds < 0))
+    {
+	fprintf (stderr, "%s\nusage: %s [OPTION...] <work directory>\n",
+		 error ? error->message : "", argv[0]);
+	return 1;
+    }
+    g_option_context_free (context);
+
+    g_thread_init (NULL);
+
+    /* the last one is the broken iPod */
+    mountpoints = g_new0 (gchar *, ipods + 2);
+    for (i=0; i<=ipods; ++i)
+    {
+	gchar *name = g_strdup_printf ("stress-%02d", i);
+	mountpoints[i] = g_build_filename (argv[1], name, NULL);
+	g_free (name);
+    }
+    broken_mountpoint = mountpoints[ipods];
+
+    for (i=0; i<ipods; ++i)
+    {
+	SynthParams params;
+
+	synth_params_init (&params);
+	params.tracks = tracks;
+	params.playlists = 2;
+	params.playlist_size = MIN (tracks, 100);
+	params.smart_playlists = 2;
+	params.artwork = artwork;
+	params.playcounts = TRUE;
+	params.seed = i;
+	/* cover art in different formats */
+	params.model = (i % 2) ? "MA450" : "MA477";
+	if (!synth_ipod_create (mountpoints[i], &params, &error))
+	{
+	    fprintf (stderr, "cannot create %s: %s\n", mountpoints[i],
+		     error ? error->message : "unknown error");
+	    return 1;
+	}
+    }
+    if (!create_broken (broken_mountpoint, &error))
+    {
+	fprintf (stderr, "cannot create %s: %s\n", broken_mountpoint,
+		 error ? error->message : "unknown error");
+	return 1;
+    }
+
+    /* start with the caches as cold as after connecting the iPods */
+    itdb_resolve_path_invalidate (NULL);
+    itdb_device_profiles_clear ();
+
+    itdb_async_set_max_threads (threads);
+    for (j=0; j<rounds; ++j)
+    {
+	for (i=0; i<=ipods; ++i)
+	    itdb_parse_async (mountpoints[i], stress_parsed, mountpoints[i]);
+	itdb_async_wait ();
+    }
+
+    for (i=0; i<ipods; ++i)
+    {
+	Itdb_iTunesDB *itdb = itdb_parse (mountpoints[i], &error);
+	if (!itdb)
+	{
+	    fprintf (stderr, "cannot parse %s: %s\n", mountpoints[i],
+		     error ? error->message : "unknown error");
+	    g_clear_error (&error);
+	    ++failed;
+	    continue;
+	}
+	if (g_list_length (itdb->tracks) != (guint)(tracks + rounds))
+	{
+	    fprintf (stderr, "%s: %u tracks instead of %d\n", mountpoints[i],
+		     g_list_length (itdb->tracks), tracks + rounds);
+	    ++failed;
+	}
+	itdb_free (itdb);
+    }
+
+    printf ("parsed=%d written=%d failed=%d expected_failures=%d\n",
+	    parsed, written, failed, expected_failures);
+
+    g_strfreev (mountpoints);
+    return ((failed == 0) && (expected_failures == rounds)) ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+/*
+|  Regression benchmark for reordering the track list before writing
+|  (prepare_itdb_for_write()): itdb_write_file() of synthetic databases
+|  whose master playlist holds 90% of the tracks in a different order
+|  than itdb->tracks.
+|
+|  Results are printed as "<tracks>.<measurement> <value>" lines, times
+|  in seconds. The program fails if the tracks aren't in master
+|  playlist order afterwards.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "synthdb.h"
+
+static void print_value (guint32 tracks, const gchar *name, gdouble value)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_ascii_formatd (buf, sizeof (buf), "%f", value);
+    printf ("%u.%s %s\n", tracks, name, buf);
+}
+
+/* Shuffles the master playlist and drops every tenth member from it */
+static void shuffle_mpl (Itdb_iTunesDB *itdb, GRand *rand)
+{
+    Itdb_Playlist *mpl = itdb_playlist_mpl (itdb);
+    GPtrArray *members = g_ptr_array_new ();
+    GList *gl;
+    guint i;
+
+    for (gl=mpl->members; gl; gl=gl->next)
+	g_ptr_array_add (members, gl->data);
+    for (i=members->len; i>1; --i)
+    {
+	guint j = g_rand_int_range (rand, 0, i);
+	gpointer tmp = g_ptr_array_index (members, i-1);
+	g_ptr_array_index (members, i-1) = g_ptr_array_index (members, j);
+	g_ptr_array_index (members, j) = tmp;
+    }
+
+    g_list_free (mpl->members);
+    mpl->members = NULL;
+    for (i=0; i<members->len; ++i)
+    {
+	if ((i % 10) != 9)
+	    mpl->members = g_list_prepend (mpl->members,
+					   g_ptr_array_index (members, i));
+    }
+    mpl->members = g_list_reverse (mpl->members);
+    g_ptr_array_free (members, TRUE);
+}
+
+/* TRUE if itdb->tracks starts with the members of the MPL in order */
+static gboolean check_order (Itdb_iTunesDB *itdb)
+{
+    GList *gl, *ml;
+
+    gl = itdb->tracks;
+    for (ml=itdb_playlist_mpl (itdb)->members; ml; ml=ml->next)
+    {
+	if (!gl || (gl->data != ml->data))
+	    return FALSE;
+	gl = gl->next;
+    }
+    return TRUE;
+}
+
+static gboolean bench (const gchar *workdir, guint32 tracks)
+{
+    SynthParams params;
+    Itdb_iTunesDB *itdb;
+    GRand *rand;
+    GError *error = NULL;
+    GTimer *timer;
+    gchar *filename;
+    gboolean result = FALSE;
+
+    synth_params_init (&params);
+    params.tracks = tracks;
+    params.playlists = 0;
+    params.seed = tracks;
+    itdb = synth_itdb_new (NULL, &params);
+    rand = g_rand_new_with_seed (tracks);
+    shuffle_mpl (itdb, rand);
+    g_rand_free (rand);
+
+    filename = g_build_filename (workdir, "iTunesDB", NULL);
+    itdb_stats_set_enabled (TRUE);
+    itdb_stats_reset (itdb);
+    itdb_set_durability (itdb, ITDB_DURABILITY_NONE);
+
+    timer = g_timer_new ();
+    if (!itdb_write_file (itdb, filename, &error))
+    {
+	fprintf (stderr, "cannot write %s: %s\n", filename,
+		 error ? error->message : "unknown error");
+	goto out;
+    }
+    print_value (tracks, "write", g_timer_elapsed (timer, NULL));
+    print_value (tracks, "prepare_write",
+		 itdb_get_stats (itdb)->phases[ITDB_STATS_PREPARE_WRITE].wall_time);
+
+    if (!check_order (itdb))
+    {
+	fprintf (stderr, "%u tracks: track list not in MPL order\n", tracks);
+	goto out;
+    }
+    result = TRUE;
+
+  out:
+    g_clear_error (&error);
+    g_timer_destroy (timer);
+    g_free (filename);
+    itdb_free (itdb);
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gchar **sizes;
+    gint i, result = 0;
+
+    if ((argc < 2) || (argc > 3))
+    {
+	fprintf (stderr, "usage: %s <work directory> [track counts (10000,50000)]\n",
+		 argv[0]);
+	return 1;
+    }
+
+    sizes = g_strsplit ((argc == 3) ? argv[2] : "10000,50000", ",", -1);
+    for (i=0; sizes[i] && (result == 0); ++i)
+    {
+	gint tracks = atoi (sizes[i]);
+	if (tracks <= 0)
+	{
+	    fprintf (stderr, "invalid track count '%s'\n", sizes[i]);
+	    result = 1;
+	}
+	else if (!bench (argv[1], tracks))
+	{
+	    result = 1;
+	}
+	fflush (stdout);
+    }
+    g_strfreev (sizes);
+    return result;
+}
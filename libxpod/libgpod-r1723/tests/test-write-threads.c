@@ -0,0 +1,136 @@
+/*
+|  Test for itdb_set_write_threads(): writes the same synthetic
+|  database with 1, 4 and 7 threads and checks that the iTunesDBs
+|  written are identical byte for byte.
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "synthdb.h"
+
+static const guint write_threads[] = { 1, 4, 7 };
+
+/* Writes @itdb to @filename with @n_threads threads and returns the
+   contents of the file written, or NULL on error */
+static gchar *write_contents (Itdb_iTunesDB *itdb, const gchar *filename,
+			      guint n_threads, gsize *length)
+{
+    GError *error = NULL;
+    gchar *contents = NULL;
+
+    itdb_set_write_threads (itdb, n_threads);
+    if (!itdb_write_file (itdb, filename, &error) ||
+	!g_file_get_contents (filename, &contents, length, &error))
+    {
+	fprintf (stderr, "cannot write %s with %u threads: %s\n", filename,
+		 n_threads, error ? error->message : "unknown error");
+	g_clear_error (&error);
+    }
+    return contents;
+}
+
+static gboolean test (const gchar *workdir, guint32 tracks)
+{
+    SynthParams params;
+    Itdb_iTunesDB *itdb;
+    gchar *filename;
+    gchar *serial;
+    gsize serial_length;
+    gboolean result = FALSE;
+    guint i;
+
+    synth_params_init (&params);
+    params.tracks = tracks;
+    params.seed = tracks;
+    itdb = synth_itdb_new (NULL, &params);
+    itdb_set_durability (itdb, ITDB_DURABILITY_NONE);
+    filename = g_build_filename (workdir, "iTunesDB", NULL);
+
+    serial = write_contents (itdb, filename, write_threads[0],
+			     &serial_length);
+    if (!serial)
+	goto out;
+
+    for (i=1; i<G_N_ELEMENTS (write_threads); ++i)
+    {
+	gchar *contents;
+	gsize length;
+
+	contents = write_contents (itdb, filename, write_threads[i], &length);
+	if (!contents)
+	    goto out;
+	if ((length != serial_length) ||
+	    (memcmp (contents, serial, length) != 0))
+	{
+	    fprintf (stderr, "%u tracks: iTunesDB written with %u threads "
+		     "differs from the one written with %u\n",
+		     tracks, write_threads[i], write_threads[0]);
+	    g_free (contents);
+	    goto out;
+	}
+	g_free (contents);
+	printf ("%u tracks, %u threads: %" G_GSIZE_FORMAT " bytes identical\n",
+		tracks, write_threads[i], length);
+    }
+    result = TRUE;
+
+  out:
+    g_free (serial);
+    g_free (filename);
+    itdb_free (itdb);
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gchar **sizes;
+    gint i, result = 0;
+
+    if ((argc < 2) || (argc > 3))
+    {
+	fprintf (stderr, "usage: %s <work directory> [track counts (20000,50001)]\n",
+		 argv[0]);
+	return 1;
+    }
+
+    /* without threads, everything is written by the calling thread */
+    g_thread_init (NULL);
+
+    sizes = g_strsplit ((argc == 3) ? argv[2] : "20000,50001", ",", -1);
+    for (i=0; sizes[i] && (result == 0); ++i)
+    {
+	gint tracks = atoi (sizes[i]);
+	if (tracks <= 0)
+	{
+	    fprintf (stderr, "invalid track count '%s'\n", sizes[i]);
+	    result = 1;
+	}
+	else if (!test (argv[1], tracks))
+	{
+	    result = 1;
+	}
+	fflush (stdout);
+    }
+    g_strfreev (sizes);
+    return result;
+}